@@ -0,0 +1,743 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * smbfsの1リクエストごとに動くCPU処理のマイクロベンチマーク
+ *
+ * サーバとの通信を含まない変換処理 (conv.c, sjispath.c, iconv_mini.c) と
+ * ページキャッシュの圧縮・展開 (lz.c)、接続時の認証で使うlibsmb2のハッシュ計算だけを
+ * ホスト上の合成データで繰り返し呼び出して、1回あたりの時間(ns)を表示する。
+ * qemu-m68kで実行すると68000系CPUでの相対的な重さを見積もれる。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <humandefs.h>
+
+#include "fileop.h"
+#include "conv.h"
+#include "cache.h"
+#include "lz.h"
+#include "sjispath.h"
+#include "profile.h"
+
+#include "sha.h"                    // libsmb2/lib
+#include "hmac-md5.h"
+
+//****************************************************************************
+// Macros and definitions
+//****************************************************************************
+
+#define NAME_MAX_SJIS   23      // dos_filesinfo.nameのサイズ
+#define NAME_MAX_UTF8   64
+
+#define NSETS           2       // ASCII, SJIS
+#define DIRSIZE_MAX     10000
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static long target_ms = 200;        // 1つの計測にかける時間
+static volatile uint32_t sink;      // 最適化で呼び出しが消えないようにする
+
+static const int dirsizes[] = { 10, 100, 1000, 10000 };
+
+static const char *setname[NSETS] = { "ascii", "sjis" };
+
+// 合成したディレクトリエントリ
+struct entry {
+  char utf8[NAME_MAX_UTF8];         // サーバから返るファイル名 (UTF-8)
+  char sjis[NAME_MAX_SJIS];         // Human68kでのファイル名 (SJIS)
+  struct dos_namestbuf ns;          // Human68kから渡されるnamests
+  TYPE_STAT st;
+};
+static struct entry *entries[NSETS];
+
+// ページキャッシュの1ページ分のデータ (ファイル一覧のテキスト) と、それを圧縮したもの
+static uint8_t pagedata[NSETS][PCACHE_PAGESIZE];
+static uint8_t zpagedata[NSETS][PCACHE_PAGESIZE];
+static size_t zpagelen[NSETS];
+
+//****************************************************************************
+// Input data
+//****************************************************************************
+
+// ファイル名の素になる文字列 (SJIS)
+static const char *stem_ascii[] = {
+  "file", "README", "Makefile", "program", "DATA", "sound", "image", "x",
+};
+static const char *stem_sjis[] = {
+  "\x83\x65\x83\x58\x83\x67",           // テスト
+  "\x93\xfa\x96\x7b\x8c\xea",           // 日本語
+  "\x83\x66\x81\x5b\x83\x5e",           // データ
+  "\x89\xb9\x8a\x79",                   // 音楽
+  "\x89\xe6\x91\x9c" "file",            // 画像file
+  "\x83\x5c\x81\x5b\x83\x58",           // ソース (2バイト目が0x5c)
+  "\xb1\xb2\xb3",                       // 半角カナ
+  "\x95\xb6\x8f\x91",                   // 文書
+};
+static const char *exts[] = { "txt", "x", "c", "doc", "", "bin", "s", "r" };
+
+// Human68kのディレクトリ (区切りは0x09)
+static const char *dir_sjis[NSETS] = {
+  "\x09" "usr" "\x09" "local" "\x09" "src",
+  "\x09" "\x83\x65\x83\x58\x83\x67" "\x09" "\x93\xfa\x96\x7b\x8c\xea",
+};
+
+// 検索パターン (namestsの主ファイル名1/拡張子)
+static const struct {
+  const char *name1;
+  const char *ext;
+} patterns[] = {
+  { "????????", "???" },    // *.*
+  { "????????", "TXT" },    // *.txt
+  { "FILE0???", "???" },    // file0*.*
+  { "README  ", "   " },    // README
+};
+#define NPATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+// smbclientのワイルドカードと正規化するパス
+static const char *wildcards[] = { "*", "*.txt", "file0*", "*\x83\x67*", "?????.c" };
+#define NWILDCARDS (sizeof(wildcards) / sizeof(wildcards[0]))
+
+static const char *paths[] = {
+  "/",
+  "/usr/local/src",
+  "/usr/./local/../src//file.txt",
+  "/a/b/c/d/e/f/../../../g/./h/",
+  "/\x83\x65\x83\x58\x83\x67/../\x93\xfa\x96\x7b\x8c\xea/./x.c",
+};
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+// 接続時にpre-auth integrityのハッシュ対象となるメッセージの大きさ
+// (negotiate要求/応答, NTLMのsession setup要求/応答x2)
+static const int preauth_msgs[] = { 240, 320, 180, 360, 540 };
+#define NPREAUTH_MSGS (sizeof(preauth_msgs) / sizeof(preauth_msgs[0]))
+
+static const int errnos[] = {
+  0, ENOENT, ENOTDIR, EMFILE, EISDIR, EBADF, ENOMEM, EFAULT, ENOEXEC,
+  ENAMETOOLONG, EINVAL, EXDEV, EACCES, EPERM, EROFS, ENOTEMPTY, ENOSPC,
+  EOVERFLOW, EEXIST, EIO,
+};
+#define NERRNOS (sizeof(errnos) / sizeof(errnos[0]))
+
+// namestsを作る
+static void make_namests(struct dos_namestbuf *ns, const char *dir, const char *name)
+{
+  memset(ns, 0, sizeof(*ns));
+  ns->flag = 0;
+  ns->drive = 0;
+  strncpy(ns->path, dir, sizeof(ns->path) - 1);
+  ns->path[strlen(ns->path)] = 0x09;
+
+  const char *dot = strrchr(name, '.');
+  size_t len = dot ? dot - name : strlen(name);
+  memset(ns->name1, ' ', sizeof(ns->name1));
+  memset(ns->ext, ' ', sizeof(ns->ext));
+  memcpy(ns->name1, name, len < 8 ? len : 8);
+  if (len > 8)
+    memcpy(ns->name2, name + 8, len - 8 < 10 ? len - 8 : 10);
+  if (dot)
+    memcpy(ns->ext, dot + 1, strlen(dot + 1) < 3 ? strlen(dot + 1) : 3);
+}
+
+// n番目のファイル名 (SJIS) を作る
+static void make_name(int set, int n, char *buf)
+{
+  const char *stem = (set == 0 ? stem_ascii : stem_sjis)[n % 8];
+  const char *ext = exts[(n / 8) % 8];
+  snprintf(buf, NAME_MAX_SJIS, "%s%04d%s%s", stem, n, *ext ? "." : "", ext);
+}
+
+static void make_entries(void)
+{
+  for (int set = 0; set < NSETS; set++) {
+    entries[set] = calloc(DIRSIZE_MAX, sizeof(struct entry));
+    if (entries[set] == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    for (int i = 0; i < DIRSIZE_MAX; i++) {
+      struct entry *e = &entries[set][i];
+      make_name(set, i, e->sjis);
+
+      char *src_buf = e->sjis;
+      size_t src_len = strlen(e->sjis);
+      char *dst_buf = e->utf8;
+      size_t dst_len = sizeof(e->utf8) - 1;
+      if (FUNC_ICONV_S2U(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
+        fprintf(stderr, "iconv_s2u failed: entry %d\n", i);
+        exit(1);
+      }
+      *dst_buf = '\0';
+
+      make_namests(&e->ns, dir_sjis[set], e->sjis);
+
+      e->st.smb2_type = (i % 16) ? SMB2_TYPE_FILE : SMB2_TYPE_DIRECTORY;
+      e->st.smb2_size = i * 1031;
+      e->st.smb2_mtime = 1700000000 + i * 3607;
+    }
+  }
+}
+
+// ページキャッシュに入るテキストのページを作って圧縮しておく
+static void make_pages(void)
+{
+  for (int set = 0; set < NSETS; set++) {
+    char *p = (char *)pagedata[set];
+    char *end = p + PCACHE_PAGESIZE;
+    for (int i = 0; p < end; i++) {
+      struct entry *e = &entries[set][i];
+      char line[80];
+      int n = snprintf(line, sizeof(line), "%-22s %10u  %s\r\n", e->sjis,
+                       (unsigned int)e->st.smb2_size,
+                       e->st.smb2_type == SMB2_TYPE_DIRECTORY ? "<DIR>" : "");
+      if (n > end - p)
+        n = end - p;
+      memcpy(p, line, n);
+      p += n;
+    }
+    zpagelen[set] = lz_compress(pagedata[set], PCACHE_PAGESIZE,
+                                zpagedata[set], PCACHE_PAGESIZE);
+  }
+}
+
+//****************************************************************************
+// Timer
+//****************************************************************************
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// fnを繰り返し呼び出して1回あたりの時間を求める
+// fnは1回の呼び出しで処理した単位数(ファイル名数など)を返す
+static double measure(uint32_t (*fn)(int set, int n), int set, int n, uint64_t *units)
+{
+  uint64_t total = 0;
+  uint64_t count = 0;
+  uint64_t limit = target_ms * 1000000;
+  uint64_t start = now_ns();
+  uint64_t elapsed;
+  do {
+    for (int i = 0; i < 16; i++) {
+      total += fn(set, n);
+    }
+    count += 16;
+    elapsed = now_ns() - start;
+  } while (elapsed < limit);
+  *units = total / count;
+  return (double)elapsed / total;
+}
+
+//****************************************************************************
+// Kernels
+//****************************************************************************
+
+// conv_namebuf: namestsからホストのパスを作る
+static uint32_t k_namebuf(int set, int n)
+{
+  char path[256];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    r += conv_namebuf_root("/share", &entries[set][i].ns, true, path, sizeof(path));
+    r += (uint8_t)path[7];
+  }
+  sink += r;
+  return n;
+}
+
+// dl_opendir: 検索パターンの準備
+static uint32_t k_pattern(int set, int n)
+{
+  struct dos_namestbuf ns;
+  uint8_t fname[21];
+  uint32_t r = 0;
+  for (int i = 0; i < NPATTERNS; i++) {
+    make_namests(&ns, dir_sjis[set], "");
+    memcpy(ns.name1, patterns[i].name1, 8);
+    memcpy(ns.ext, patterns[i].ext, 3);
+    conv_pattern(&ns, fname);
+    r += fname[0] + fname[18];
+  }
+  sink += r;
+  return NPATTERNS;
+}
+
+// dl_readdir: ファイル名の検査
+static uint32_t k_validname(int set, int n)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    r += conv_validname(entries[set][i].sjis);
+  }
+  sink += r;
+  return n;
+}
+
+// dl_readdir: ファイル名の分解
+static uint32_t k_splitname(int set, int n)
+{
+  uint8_t w2[21];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    r += conv_splitname(entries[set][i].sjis, w2);
+    r += w2[0];
+  }
+  sink += r;
+  return n;
+}
+
+// dl_readdir: ファイル名の比較 (*.txt)
+static uint32_t k_matchname(int set, int n)
+{
+  static uint8_t w2[NSETS][DIRSIZE_MAX][21];
+  static bool ready[NSETS];
+  uint8_t fname[21];
+  struct dos_namestbuf ns;
+
+  if (!ready[set]) {
+    for (int i = 0; i < DIRSIZE_MAX; i++)
+      conv_splitname(entries[set][i].sjis, w2[set][i]);
+    ready[set] = true;
+  }
+  make_namests(&ns, dir_sjis[set], "");
+  memcpy(ns.name1, patterns[1].name1, 8);
+  memcpy(ns.ext, patterns[1].ext, 3);
+  conv_pattern(&ns, fname);
+
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    r += conv_matchname(fname, w2[set][i]);
+  }
+  sink += r;
+  return n;
+}
+
+// dl_readdir: サーバから返ったエントリ1つあたりの処理全体
+// (UTF-8->SJIS変換、検査、分解、ファイル情報の変換、比較)
+static uint32_t k_readdir(int set, int n)
+{
+  struct dos_namestbuf ns;
+  struct dos_filesinfo fi;
+  uint8_t fname[21];
+  uint8_t w2[21];
+
+  make_namests(&ns, dir_sjis[set], "");
+  memcpy(ns.name1, patterns[0].name1, 8);
+  memcpy(ns.ext, patterns[0].ext, 3);
+  conv_pattern(&ns, fname);
+
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    struct entry *e = &entries[set][i];
+    char *dst_buf = fi.name;
+    size_t dst_len = sizeof(fi.name) - 1;
+    char *src_buf = e->utf8;
+    size_t src_len = strlen(e->utf8);
+    if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0)
+      continue;
+    *dst_buf = '\0';
+    if (!conv_validname(fi.name))
+      continue;
+    if (conv_splitname(fi.name, w2) < 0)
+      continue;
+    conv_statinfo(&e->st, &fi);
+    r += conv_matchname(fname, w2) + fi.atr;
+  }
+  sink += r;
+  return n;
+}
+
+// conv_statinfo: ファイル情報の変換
+static uint32_t k_statinfo(int set, int n)
+{
+  struct dos_filesinfo fi;
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    conv_statinfo(&entries[set][i].st, &fi);
+    r += fi.date + fi.time;
+  }
+  sink += r;
+  return n;
+}
+
+// conv_errno: エラーコードの変換
+static uint32_t k_errno(int set, int n)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < NERRNOS; i++) {
+    r += conv_errno(errnos[i]);
+  }
+  sink += r;
+  return NERRNOS;
+}
+
+// iconv_s2u: SJIS -> UTF-8 (ASCII区間を飛ばすドライバのラッパ経由)
+static uint32_t k_s2u(int set, int n)
+{
+  char buf[NAME_MAX_UTF8];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    char *src_buf = entries[set][i].sjis;
+    size_t src_len = strlen(src_buf);
+    char *dst_buf = buf;
+    size_t dst_len = sizeof(buf) - 1;
+    r += FUNC_ICONV_S2U(&src_buf, &src_len, &dst_buf, &dst_len);
+    r += dst_len;
+  }
+  sink += r;
+  return n;
+}
+
+// iconv_u2s: UTF-8 -> SJIS (ASCII区間を飛ばすドライバのラッパ経由)
+static uint32_t k_u2s(int set, int n)
+{
+  char buf[NAME_MAX_SJIS];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    char *src_buf = entries[set][i].utf8;
+    size_t src_len = strlen(src_buf);
+    char *dst_buf = buf;
+    size_t dst_len = sizeof(buf) - 1;
+    r += FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len);
+    r += dst_len;
+  }
+  sink += r;
+  return n;
+}
+
+// iconv_s2u: SJIS -> UTF-8 (iconv_miniを直接呼ぶ)
+static uint32_t k_s2u_raw(int set, int n)
+{
+  char buf[NAME_MAX_UTF8];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    char *src_buf = entries[set][i].sjis;
+    size_t src_len = strlen(src_buf);
+    char *dst_buf = buf;
+    size_t dst_len = sizeof(buf) - 1;
+    r += iconv_s2u(&src_buf, &src_len, &dst_buf, &dst_len);
+    r += dst_len;
+  }
+  sink += r;
+  return n;
+}
+
+// iconv_u2s: UTF-8 -> SJIS (iconv_miniを直接呼ぶ)
+static uint32_t k_u2s_raw(int set, int n)
+{
+  char buf[NAME_MAX_SJIS];
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    char *src_buf = entries[set][i].utf8;
+    size_t src_len = strlen(src_buf);
+    char *dst_buf = buf;
+    size_t dst_len = sizeof(buf) - 1;
+    r += iconv_u2s(&src_buf, &src_len, &dst_buf, &dst_len);
+    r += dst_len;
+  }
+  sink += r;
+  return n;
+}
+
+// smbclient: match_wildcard
+static uint32_t k_wildcard(int set, int n)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++) {
+    r += match_wildcard(wildcards[i % NWILDCARDS], entries[set][i].sjis);
+  }
+  sink += r;
+  return n;
+}
+
+// smbclient: normalize_path
+static uint32_t k_normalize(int set, int n)
+{
+  char buf[256];
+  uint32_t r = 0;
+  for (int i = 0; i < NPATHS; i++) {
+    strcpy(buf, paths[i]);
+    normalize_path(buf);
+    r += (uint8_t)buf[1];
+  }
+  sink += r;
+  return NPATHS;
+}
+
+// SMB 3.1.1のpre-auth integrity: 接続1回分のSHA-512計算
+static uint32_t k_preauth(int set, int n)
+{
+  static uint8_t msg[1024];
+  uint8_t hash[SHA512HashSize];
+  USHAContext ctx;
+  memset(hash, 0, sizeof(hash));
+  for (int i = 0; i < NPREAUTH_MSGS; i++) {
+    USHAReset(&ctx, SHA512);
+    USHAInput(&ctx, hash, sizeof(hash));
+    USHAInput(&ctx, msg, preauth_msgs[i]);
+    USHAResult(&ctx, hash);
+  }
+  sink += hash[0];
+  return 1;
+}
+
+// NTLMv2: 接続1回分のHMAC-MD5計算 (NTOWFv2, NTProofStr, セッション鍵)
+static uint32_t k_ntlmv2(int set, int n)
+{
+  static uint8_t blob[8 + 200];   // サーバチャレンジ + クライアントのblob
+  uint8_t nthash[16] = { 0 };
+  uint8_t userdom[2 * 16] = { 'U', 0, 'S', 0, 'E', 0, 'R', 0 };
+  uint8_t ntowf[16];
+  uint8_t proof[16];
+  uint8_t key[16];
+  smb2_hmac_md5(userdom, sizeof(userdom), nthash, sizeof(nthash), ntowf);
+  smb2_hmac_md5(blob, sizeof(blob), ntowf, sizeof(ntowf), proof);
+  smb2_hmac_md5(proof, sizeof(proof), ntowf, sizeof(ntowf), key);
+  sink += key[0];
+  return 1;
+}
+
+// SMB 2.xの署名: 4KBのパケット1つ分のHMAC-SHA256計算
+static uint32_t k_sign2(int set, int n)
+{
+  static uint8_t pkt[64 + 4096];
+  uint8_t key[16] = { 0 };
+  uint8_t digest[USHAMaxHashSize];
+  hmac(SHA256, pkt, sizeof(pkt), key, sizeof(key), digest);
+  sink += digest[0];
+  return 1;
+}
+
+// キャッシュのページからの読み出し: 展開されているページのコピー
+static uint32_t k_pagehit(int set, int n)
+{
+  static uint8_t buf[PCACHE_PAGESIZE];
+  memcpy(buf, pagedata[set], PCACHE_PAGESIZE);
+  sink += buf[0];
+  return 1;
+}
+
+// 追い出すページの圧縮
+static uint32_t k_lzpack(int set, int n)
+{
+  static uint8_t buf[PCACHE_PAGESIZE];
+  sink += lz_compress(pagedata[set], PCACHE_PAGESIZE, buf, PCACHE_PAGESIZE * 3 / 4);
+  return 1;
+}
+
+// 圧縮されたページの展開 (圧縮キャッシュにヒットしたときの読み出し)
+static uint32_t k_lzunpack(int set, int n)
+{
+  static uint8_t buf[PCACHE_PAGESIZE];
+  sink += lz_decompress(zpagedata[set], zpagelen[set], buf, PCACHE_PAGESIZE);
+  return 1;
+}
+
+static const struct kernel {
+  const char *name;
+  uint32_t (*fn)(int set, int n);
+  bool perdir;          // ディレクトリの大きさを変えて計測する
+  const char *desc;
+} kernels[] = {
+  { "namebuf",   k_namebuf,   true,  "conv_namebuf (namests -> host path)" },
+  { "pattern",   k_pattern,   false, "dl_opendir pattern preparation" },
+  { "validname", k_validname, true,  "dl_readdir name validation" },
+  { "splitname", k_splitname, true,  "dl_readdir name splitting" },
+  { "matchname", k_matchname, true,  "dl_readdir name matching" },
+  { "readdir",   k_readdir,   true,  "dl_readdir per-entry total" },
+  { "statinfo",  k_statinfo,  true,  "conv_statinfo" },
+  { "errno",     k_errno,     false, "conv_errno" },
+  { "s2u",       k_s2u,       true,  "SJIS -> UTF-8 (FUNC_ICONV_S2U)" },
+  { "u2s",       k_u2s,       true,  "UTF-8 -> SJIS (FUNC_ICONV_U2S)" },
+  { "s2u_raw",   k_s2u_raw,   true,  "SJIS -> UTF-8 (iconv_s2u)" },
+  { "u2s_raw",   k_u2s_raw,   true,  "UTF-8 -> SJIS (iconv_u2s)" },
+  { "wildcard",  k_wildcard,  true,  "smbclient match_wildcard" },
+  { "normalize", k_normalize, false, "smbclient normalize_path" },
+  { "preauth",   k_preauth,   false, "SMB 3.1.1 pre-auth SHA-512 per connect" },
+  { "ntlmv2",    k_ntlmv2,    false, "NTLMv2 HMAC-MD5 per connect" },
+  { "sign2",     k_sign2,     false, "SMB 2.x HMAC-SHA256 signing per 4KB packet" },
+  { "pagehit",   k_pagehit,   false, "page cache hit (copy one page)" },
+  { "lzpack",    k_lzpack,    false, "compress one page on eviction (lz_compress)" },
+  { "lzunpack",  k_lzunpack,  false, "compressed page cache hit (lz_decompress)" },
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+//****************************************************************************
+// Main
+//****************************************************************************
+
+static void usage(void)
+{
+  printf("Usage: bench [-t <ms>] [-s ascii|sjis] [-n <entries>] [-k <kernel>]... [-l] [-p <file>]\n"
+         "  -t <ms>       time per measurement (default %ld)\n"
+         "  -s <set>      run only ascii or sjis name set\n"
+         "  -n <entries>  run only one directory size (1-%d)\n"
+         "  -k <kernel>   run only the specified kernel (may be repeated)\n"
+         "  -l            list kernels\n"
+         "  -p <file>     save a sampling profile (needs make PROFILE=1)\n",
+         target_ms, DIRSIZE_MAX);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  bool selected[NKERNELS] = { false };
+  bool anysel = false;
+  int onlyset = -1;
+  int onlysize = 0;
+  char *proffile = NULL;
+  bool lzran = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "t:s:n:k:lp:")) != -1) {
+    switch (c) {
+    case 't':
+      target_ms = strtol(optarg, NULL, 0);
+      if (target_ms <= 0)
+        usage();
+      break;
+    case 's':
+      for (onlyset = 0; onlyset < NSETS; onlyset++) {
+        if (strcmp(optarg, setname[onlyset]) == 0)
+          break;
+      }
+      if (onlyset >= NSETS)
+        usage();
+      break;
+    case 'n':
+      onlysize = strtol(optarg, NULL, 0);
+      if (onlysize <= 0 || onlysize > DIRSIZE_MAX)
+        usage();
+      break;
+    case 'k':
+      {
+        int i;
+        for (i = 0; i < NKERNELS; i++) {
+          if (strcmp(optarg, kernels[i].name) == 0)
+            break;
+        }
+        if (i >= NKERNELS) {
+          fprintf(stderr, "unknown kernel: %s\n", optarg);
+          usage();
+        }
+        selected[i] = anysel = true;
+      }
+      break;
+    case 'l':
+      for (int i = 0; i < NKERNELS; i++)
+        printf("%-10s %s\n", kernels[i].name, kernels[i].desc);
+      return 0;
+    case 'p':
+#ifdef PROFILE
+      proffile = optarg;
+      break;
+#else
+      fprintf(stderr, "bench is built without PROFILE=1\n");
+      return 1;
+#endif
+    default:
+      usage();
+    }
+  }
+
+  make_entries();
+  make_pages();
+
+#ifdef PROFILE
+  if (proffile) {
+    prof_start();
+  }
+#endif
+
+  printf("%-10s %-6s %8s %12s %14s\n", "kernel", "set", "entries", "ns/call", "ns/op");
+  for (int k = 0; k < NKERNELS; k++) {
+    const struct kernel *kn = &kernels[k];
+    if (anysel && !selected[k])
+      continue;
+    for (int set = 0; set < NSETS; set++) {
+      if (onlyset >= 0 && set != onlyset)
+        continue;
+      int nsizes = kn->perdir ? (onlysize ? 1 : sizeof(dirsizes) / sizeof(dirsizes[0])) : 1;
+      for (int s = 0; s < nsizes; s++) {
+        int n = kn->perdir ? (onlysize ? onlysize : dirsizes[s]) : 1;
+        uint64_t units;
+        PROF_ENTER(PROF_DOSCALL);
+        double ns = measure(kn->fn, set, n, &units);
+        PROF_LEAVE(PROF_DOSCALL);
+        lzran |= (kn->fn == k_lzpack || kn->fn == k_lzunpack);
+        // ns/callは1単位(ファイル名1つ、パターン1つなど)あたり、ns/opはfnの1回の呼び出しあたり
+        char entries[16] = "-";
+        if (kn->perdir)
+          snprintf(entries, sizeof(entries), "%d", n);
+        printf("%-10s %-6s %8s %12.1f %14.1f\n",
+               kn->name, setname[set], entries, ns, ns * units);
+      }
+    }
+  }
+
+  // 圧縮キャッシュの容量: 同じメモリに残せるページ数の比
+  if (lzran) {
+    printf("\n%-10s %-6s %8s %12s %14s\n", "page", "set", "bytes", "compressed", "pages/64KB");
+    for (int set = 0; set < NSETS; set++) {
+      if (onlyset >= 0 && set != onlyset)
+        continue;
+      size_t hdr = offsetof(cpage_t, data);
+      printf("%-10s %-6s %8u %12u %7u -> %4u\n", "lz", setname[set],
+             PCACHE_PAGESIZE, (unsigned int)zpagelen[set],
+             (unsigned int)(65536 / (hdr + PCACHE_PAGESIZE)),
+             (unsigned int)(65536 / (hdr + zpagelen[set])));
+    }
+  }
+
+#ifdef PROFILE
+  if (proffile) {
+    prof_stop();
+    size_t len = prof_save(NULL, 0);
+    void *buf = malloc(len);
+    FILE *fp;
+    if (buf == NULL || prof_save(buf, len) != len ||
+        (fp = fopen(proffile, "wb")) == NULL) {
+      fprintf(stderr, "cannot save profile to %s\n", proffile);
+      return 1;
+    }
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+    free(buf);
+  }
+#endif
+  return 0;
+}
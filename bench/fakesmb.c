@@ -0,0 +1,1956 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ホスト上で動かす最小限のSMB2サーバ
+ *
+ * 1つの接続を1つのスレッドで処理する。受信した要求はすぐに処理して、
+ * 応答は「受信時刻+遅延」の時刻になるまで送信待ちのキューに置く。
+ * 応答を待たずに次の要求を送るクライアント(パイプライン)では遅延が重なって見えるので、
+ * 通信の往復回数と処理の重なり具合を実際のネットワークに近い形で確認できる。
+ */
+
+#define _GNU_SOURCE                 // memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fakesmb.h"
+
+//****************************************************************************
+// Macros and definitions
+//****************************************************************************
+
+#define MAXHANDLES      256         // サーバ全体で同時にオープンできるファイル数
+#define MAXMSG          (16 * 1024 * 1024)
+
+// SMB2 commands
+#define SMB2_NEGOTIATE          0x00
+#define SMB2_SESSION_SETUP      0x01
+#define SMB2_LOGOFF             0x02
+#define SMB2_TREE_CONNECT       0x03
+#define SMB2_TREE_DISCONNECT    0x04
+#define SMB2_CREATE             0x05
+#define SMB2_CLOSE              0x06
+#define SMB2_FLUSH              0x07
+#define SMB2_READ               0x08
+#define SMB2_WRITE              0x09
+#define SMB2_LOCK               0x0a
+#define SMB2_IOCTL              0x0b
+#define SMB2_CANCEL             0x0c
+#define SMB2_ECHO               0x0d
+#define SMB2_QUERY_DIRECTORY    0x0e
+#define SMB2_CHANGE_NOTIFY      0x0f
+#define SMB2_QUERY_INFO         0x10
+#define SMB2_SET_INFO           0x11
+#define SMB2_OPLOCK_BREAK       0x12
+
+#define SMB2_FLAGS_SERVER_TO_REDIR    0x00000001
+#define SMB2_FLAGS_RELATED_OPERATIONS 0x00000004
+
+// NT status codes
+#define STATUS_SUCCESS                  0x00000000
+#define STATUS_NO_MORE_FILES            0x80000006
+#define STATUS_BUFFER_OVERFLOW          0x80000005
+#define STATUS_UNSUCCESSFUL             0xc0000001
+#define STATUS_NOT_IMPLEMENTED          0xc0000002
+#define STATUS_INFO_LENGTH_MISMATCH     0xc0000004
+#define STATUS_INVALID_HANDLE           0xc0000008
+#define STATUS_INVALID_PARAMETER        0xc000000d
+#define STATUS_NO_SUCH_FILE             0xc000000f
+#define STATUS_END_OF_FILE              0xc0000011
+#define STATUS_MORE_PROCESSING_REQUIRED 0xc0000016
+#define STATUS_ACCESS_DENIED            0xc0000022
+#define STATUS_OBJECT_NAME_INVALID      0xc0000033
+#define STATUS_OBJECT_NAME_NOT_FOUND    0xc0000034
+#define STATUS_OBJECT_NAME_COLLISION    0xc0000035
+#define STATUS_OBJECT_PATH_NOT_FOUND    0xc000003a
+#define STATUS_SHARING_VIOLATION        0xc0000043
+#define STATUS_LOGON_FAILURE            0xc000006d
+#define STATUS_DISK_FULL                0xc000007f
+#define STATUS_INSUFFICIENT_RESOURCES   0xc000009a
+#define STATUS_MEDIA_WRITE_PROTECTED    0xc00000a2
+#define STATUS_FILE_IS_A_DIRECTORY      0xc00000ba
+#define STATUS_NOT_SUPPORTED            0xc00000bb
+#define STATUS_NETWORK_NAME_DELETED     0xc00000c9
+#define STATUS_DIRECTORY_NOT_EMPTY      0xc0000101
+#define STATUS_NOT_A_DIRECTORY          0xc0000103
+#define STATUS_FILE_CLOSED              0xc0000128
+#define STATUS_USER_SESSION_DELETED     0xc0000203
+
+// CREATE
+#define FILE_SUPERSEDE          0
+#define FILE_OPEN               1
+#define FILE_CREATE             2
+#define FILE_OPEN_IF            3
+#define FILE_OVERWRITE          4
+#define FILE_OVERWRITE_IF       5
+
+#define FILE_DIRECTORY_FILE     0x00000001
+#define FILE_NON_DIRECTORY_FILE 0x00000040
+#define FILE_DELETE_ON_CLOSE    0x00001000
+
+#define FILE_SHARE_READ         0x00000001
+#define FILE_SHARE_WRITE        0x00000002
+#define FILE_SHARE_DELETE       0x00000004
+
+#define FILE_READ_DATA          0x00000001
+#define FILE_WRITE_DATA         0x00000002
+#define FILE_APPEND_DATA        0x00000004
+#define FILE_EXECUTE            0x00000020
+#define DELETE                  0x00010000
+#define MAXIMUM_ALLOWED         0x02000000
+#define GENERIC_ALL             0x10000000
+#define GENERIC_EXECUTE         0x20000000
+#define GENERIC_WRITE           0x40000000
+#define GENERIC_READ            0x80000000
+
+#define FILE_ATTRIBUTE_READONLY   0x00000001
+#define FILE_ATTRIBUTE_DIRECTORY  0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE    0x00000020
+
+// QUERY_DIRECTORY
+#define SMB2_RESTART_SCANS        0x01
+#define SMB2_RETURN_SINGLE_ENTRY  0x02
+#define SMB2_REOPEN               0x10
+
+// QUERY_INFO/SET_INFO
+#define SMB2_0_INFO_FILE        1
+#define SMB2_0_INFO_FILESYSTEM  2
+
+#define NT_EPOCH_DIFF           11644473600ULL
+
+// 最初に受け付けるメッセージの大きさ
+#define NETBIOS_HDR             4
+#define SMB2_HDR                64
+
+//****************************************************************************
+// Type definitions
+//****************************************************************************
+
+typedef struct conn conn_t;
+
+// オープンしたファイル (サーバ全体で共有して、共有モードの競合を調べる)
+typedef struct {
+  conn_t *owner;                // NULLなら未使用
+  uint64_t volatile_id;
+  char *path;                   // ホスト側のパス名
+  bool isdir;
+  int fd;
+  uint32_t access;              // FILE_READ_DATA/FILE_WRITE_DATA/DELETEに丸めたアクセス
+  uint32_t share;               // FILE_SHARE_*
+  bool delete_pending;
+  char **names;                 // ディレクトリの一覧 (QUERY_DIRECTORYの最初に作る)
+  int nnames;
+  int dirpos;
+  bool dirstarted;
+} handle_t;
+
+// 送信待ちの応答
+typedef struct outmsg {
+  struct outmsg *next;
+  uint64_t due;                 // 送信する時刻 (ns)
+  size_t len;
+  uint8_t data[];
+} outmsg_t;
+
+typedef struct {
+  uint8_t *p;
+  size_t len;
+  size_t cap;
+} buf_t;
+
+struct conn {
+  struct conn *next;
+  fakesmb_t *srv;
+  int fd;
+  int id;
+  uint16_t dialect;
+  uint64_t sessid;
+  bool authed;
+  uint32_t treeid;
+  outmsg_t *outq;
+  int inflight;
+  bool drop;
+};
+
+struct fakesmb {
+  fakesmb_config_t cfg;
+  int lfd;
+  int port;
+  pthread_t thread;
+  bool listening;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  conn_t *conns;
+  int nconns;
+  int nextid;
+  uint64_t nextvol;
+  uint64_t nextsess;
+  handle_t h[MAXHANDLES];
+  fakesmb_stats_t st;
+  uint32_t count[FAKESMB_NCMDS];  // 障害を起こす条件の判定に使う要求数
+  uint32_t countall;
+};
+
+static const char *cmdname[FAKESMB_NCMDS] = {
+  "negotiate", "sessionsetup", "logoff", "treeconnect", "treedisconnect",
+  "create", "close", "flush", "read", "write", "lock", "ioctl", "cancel",
+  "echo", "querydirectory", "changenotify", "queryinfo", "setinfo", "oplockbreak",
+};
+
+//****************************************************************************
+// Utility functions
+//****************************************************************************
+
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static uint64_t get64(const uint8_t *p) { return get32(p) | ((uint64_t)get32(p + 4) << 32); }
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+static void put64(uint8_t *p, uint64_t v) { put32(p, v); put32(p + 4, v >> 32); }
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t nt_time(const struct timespec *ts)
+{
+  return (ts->tv_sec + NT_EPOCH_DIFF) * 10000000ULL + ts->tv_nsec / 100;
+}
+
+static uint64_t nt_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return nt_time(&ts);
+}
+
+// 応答の領域を確保する (確保した領域は0で埋める)
+static uint8_t *buf_reserve(buf_t *b, size_t n)
+{
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + n) {
+      cap *= 2;
+    }
+    uint8_t *p = realloc(b->p, cap);
+    if (p == NULL) {
+      abort();
+    }
+    b->p = p;
+    b->cap = cap;
+  }
+  uint8_t *p = b->p + b->len;
+  memset(p, 0, n);
+  b->len += n;
+  return p;
+}
+
+static uint32_t errno_status(int err)
+{
+  switch (err) {
+  case ENOENT:
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+  case ENOTDIR:
+    return STATUS_OBJECT_PATH_NOT_FOUND;
+  case EEXIST:
+    return STATUS_OBJECT_NAME_COLLISION;
+  case EACCES:
+  case EPERM:
+    return STATUS_ACCESS_DENIED;
+  case EISDIR:
+    return STATUS_FILE_IS_A_DIRECTORY;
+  case ENOTEMPTY:
+    return STATUS_DIRECTORY_NOT_EMPTY;
+  case ENOSPC:
+    return STATUS_DISK_FULL;
+  case ENAMETOOLONG:
+    return STATUS_OBJECT_NAME_INVALID;
+  case EROFS:
+    return STATUS_MEDIA_WRITE_PROTECTED;
+  default:
+    return STATUS_UNSUCCESSFUL;
+  }
+}
+
+// UTF-16LEをUTF-8に変換する
+static char *utf16_to_utf8(const uint8_t *s, int bytes)
+{
+  char *d = malloc(bytes * 3 / 2 + 1);
+  char *p = d;
+  for (int i = 0; i + 1 < bytes; i += 2) {
+    uint32_t c = get16(s + i);
+    if (c >= 0xd800 && c < 0xdc00 && i + 3 < bytes) {
+      uint32_t c2 = get16(s + i + 2);
+      if (c2 >= 0xdc00 && c2 < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+        i += 2;
+      }
+    }
+    if (c < 0x80) {
+      *p++ = c;
+    } else if (c < 0x800) {
+      *p++ = 0xc0 | (c >> 6);
+      *p++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      *p++ = 0xe0 | (c >> 12);
+      *p++ = 0x80 | ((c >> 6) & 0x3f);
+      *p++ = 0x80 | (c & 0x3f);
+    } else {
+      *p++ = 0xf0 | (c >> 18);
+      *p++ = 0x80 | ((c >> 12) & 0x3f);
+      *p++ = 0x80 | ((c >> 6) & 0x3f);
+      *p++ = 0x80 | (c & 0x3f);
+    }
+  }
+  *p = '\0';
+  return d;
+}
+
+// UTF-8をUTF-16LEに変換してバイト数を返す (dがNULLならバイト数だけを返す)
+static int utf8_to_utf16(const char *s, uint8_t *d)
+{
+  const uint8_t *p = (const uint8_t *)s;
+  int n = 0;
+  while (*p) {
+    uint32_t c = *p++;
+    if (c >= 0xf0 && p[0] && p[1] && p[2]) {
+      c = ((c & 0x07) << 18) | ((p[0] & 0x3f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+      p += 3;
+    } else if (c >= 0xe0 && p[0] && p[1]) {
+      c = ((c & 0x0f) << 12) | ((p[0] & 0x3f) << 6) | (p[1] & 0x3f);
+      p += 2;
+    } else if (c >= 0xc0 && p[0]) {
+      c = ((c & 0x1f) << 6) | (p[0] & 0x3f);
+      p += 1;
+    }
+    if (c >= 0x10000) {
+      if (d) {
+        put16(d + n, 0xd800 + ((c - 0x10000) >> 10));
+        put16(d + n + 2, 0xdc00 + ((c - 0x10000) & 0x3ff));
+      }
+      n += 4;
+    } else {
+      if (d) {
+        put16(d + n, c);
+      }
+      n += 2;
+    }
+  }
+  return n;
+}
+
+// ワイルドカード('*', '?')を含むファイル名を大文字小文字を区別せずに比較する
+static bool match_pattern(const char *pat, const char *name)
+{
+  while (*pat) {
+    if (*pat == '*') {
+      while (*pat == '*') {
+        pat++;
+      }
+      if (*pat == '\0') {
+        return true;
+      }
+      for (; *name; name++) {
+        if (match_pattern(pat, name)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    if (*name == '\0' ||
+        (*pat != '?' && tolower((unsigned char)*pat) != tolower((unsigned char)*name))) {
+      return false;
+    }
+    pat++;
+    name++;
+  }
+  return *name == '\0';
+}
+
+// 共有内のパス名(UTF-16LE, '\'区切り)からホスト側のパス名を作る
+static char *host_path(fakesmb_t *srv, const uint8_t *name, int bytes)
+{
+  char *rel = utf16_to_utf8(name, bytes);
+  char *r = rel;
+  while (*r == '\\' || *r == '/') {
+    r++;
+  }
+  for (char *p = r; *p; p++) {
+    if (*p == '\\') {
+      *p = '/';
+    }
+  }
+  // 共有の外を指すパス名は受け付けない
+  for (char *p = r; *p; ) {
+    char *e = strchr(p, '/');
+    int len = e ? e - p : strlen(p);
+    if (len == 2 && p[0] == '.' && p[1] == '.') {
+      free(rel);
+      return NULL;
+    }
+    p += len + (e ? 1 : 0);
+  }
+  char *path = malloc(strlen(srv->cfg.root) + strlen(r) + 2);
+  if (*r) {
+    sprintf(path, "%s/%s", srv->cfg.root, r);
+  } else {
+    strcpy(path, srv->cfg.root);
+  }
+  free(rel);
+  return path;
+}
+
+static uint32_t file_attributes(const struct stat *st)
+{
+  uint32_t attr = S_ISDIR(st->st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+  if (!(st->st_mode & S_IWUSR)) {
+    attr |= FILE_ATTRIBUTE_READONLY;
+  }
+  return attr;
+}
+
+// CreationTime, LastAccessTime, LastWriteTime, ChangeTime
+static void put_times(uint8_t *p, const struct stat *st)
+{
+  put64(p + 0, nt_time(&st->st_mtim));
+  put64(p + 8, nt_time(&st->st_atim));
+  put64(p + 16, nt_time(&st->st_mtim));
+  put64(p + 24, nt_time(&st->st_ctim));
+}
+
+static uint64_t alloc_size(const struct stat *st)
+{
+  return S_ISDIR(st->st_mode) ? 0 : (uint64_t)st->st_blocks * 512;
+}
+
+//****************************************************************************
+// File handles
+//****************************************************************************
+
+// 要求されたアクセスを読み出し/書き込み/削除に丸める
+static uint32_t access_mask(uint32_t desired)
+{
+  uint32_t a = 0;
+  if (desired & (FILE_READ_DATA | FILE_EXECUTE | GENERIC_READ | GENERIC_EXECUTE | GENERIC_ALL | MAXIMUM_ALLOWED)) {
+    a |= FILE_READ_DATA;
+  }
+  if (desired & (FILE_WRITE_DATA | FILE_APPEND_DATA | GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED)) {
+    a |= FILE_WRITE_DATA;
+  }
+  if (desired & (DELETE | GENERIC_ALL)) {
+    a |= DELETE;
+  }
+  return a;
+}
+
+// 既にオープンされているファイルと共有モードが競合するか
+static bool share_conflict(fakesmb_t *srv, const char *path, uint32_t access, uint32_t share)
+{
+  static const struct { uint32_t access, share; } bits[] = {
+    { FILE_READ_DATA, FILE_SHARE_READ },
+    { FILE_WRITE_DATA, FILE_SHARE_WRITE },
+    { DELETE, FILE_SHARE_DELETE },
+  };
+  for (int i = 0; i < MAXHANDLES; i++) {
+    handle_t *h = &srv->h[i];
+    if (h->owner == NULL || h->isdir || strcmp(h->path, path) != 0) {
+      continue;
+    }
+    for (int j = 0; j < 3; j++) {
+      if (((access & bits[j].access) && !(h->share & bits[j].share)) ||
+          ((h->access & bits[j].access) && !(share & bits[j].share))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static handle_t *handle_find(conn_t *c, const uint8_t *fileid)
+{
+  uint64_t pid = get64(fileid);
+  uint64_t vid = get64(fileid + 8);
+  if (pid == 0 || pid > MAXHANDLES) {
+    return NULL;
+  }
+  handle_t *h = &c->srv->h[pid - 1];
+  return (h->owner == c && h->volatile_id == vid) ? h : NULL;
+}
+
+static void handle_dirfree(handle_t *h)
+{
+  for (int i = 0; i < h->nnames; i++) {
+    free(h->names[i]);
+  }
+  free(h->names);
+  h->names = NULL;
+  h->nnames = 0;
+}
+
+static void handle_free(handle_t *h)
+{
+  if (h->fd >= 0) {
+    close(h->fd);
+  }
+  if (h->delete_pending) {
+    if (h->isdir) {
+      rmdir(h->path);
+    } else {
+      unlink(h->path);
+    }
+  }
+  handle_dirfree(h);
+  free(h->path);
+  h->path = NULL;
+  h->fd = -1;
+  h->owner = NULL;
+}
+
+//****************************************************************************
+// SPNEGO / NTLMSSP
+//****************************************************************************
+
+static const uint8_t oid_ntlmssp[] = {
+  0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a
+};
+
+// negotiate応答に入れるNegTokenInit (NTLMSSPだけを示す)
+static const uint8_t spnego_init[] = {
+  0x60, 0x1c, 0x06, 0x06, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02,
+  0xa0, 0x12, 0x30, 0x10, 0xa0, 0x0e, 0x30, 0x0c,
+  0x06, 0x0a, 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a
+};
+
+static int der_hdr(uint8_t *p, uint8_t tag, int len)
+{
+  p[0] = tag;
+  if (len < 0x80) {
+    p[1] = len;
+    return 2;
+  } else if (len < 0x100) {
+    p[1] = 0x81;
+    p[2] = len;
+    return 3;
+  }
+  p[1] = 0x82;
+  p[2] = len >> 8;
+  p[3] = len;
+  return 4;
+}
+
+static int der_hdrlen(int len)
+{
+  return len < 0x80 ? 2 : len < 0x100 ? 3 : 4;
+}
+
+// NTLMSSPのトークンをNegTokenRespに包む (tokがNULLなら状態だけを返す)
+static int spnego_resp(uint8_t *out, int state, const uint8_t *tok, int toklen)
+{
+  int l_state = 5;
+  int l_mech = tok ? 2 + sizeof(oid_ntlmssp) : 0;
+  int l_oct = tok ? der_hdrlen(toklen) + toklen : 0;
+  int l_tok = tok ? der_hdrlen(l_oct) + l_oct : 0;
+  int l_seq = l_state + l_mech + l_tok;
+  uint8_t *p = out;
+  p += der_hdr(p, 0xa1, der_hdrlen(l_seq) + l_seq);
+  p += der_hdr(p, 0x30, l_seq);
+  *p++ = 0xa0; *p++ = 0x03; *p++ = 0x0a; *p++ = 0x01; *p++ = state;
+  if (tok) {
+    p += der_hdr(p, 0xa1, sizeof(oid_ntlmssp));
+    memcpy(p, oid_ntlmssp, sizeof(oid_ntlmssp));
+    p += sizeof(oid_ntlmssp);
+    p += der_hdr(p, 0xa2, l_oct);
+    p += der_hdr(p, 0x04, toklen);
+    memcpy(p, tok, toklen);
+    p += toklen;
+  }
+  return p - out;
+}
+
+// NTLMSSPのCHALLENGE_MESSAGEを作る
+static int ntlm_challenge(uint8_t *out)
+{
+  static const char target[] = "FAKESMB";
+  int tlen = 2 * (sizeof(target) - 1);
+  uint8_t *p = out;
+  memset(p, 0, 56);
+  memcpy(p, "NTLMSSP", 8);
+  put32(p + 8, 2);
+  put16(p + 12, tlen);
+  put16(p + 14, tlen);
+  put32(p + 16, 56);
+  put32(p + 20, 0xe2898215);
+  for (int i = 0; i < 8; i++) {
+    p[24 + i] = rand();
+  }
+  p += 56;
+  for (int i = 0; i < sizeof(target) - 1; i++) {
+    put16(p + 2 * i, target[i]);
+  }
+  p += tlen;
+
+  // TargetInfo: NbDomainName, NbComputerName, Timestamp, EOL
+  uint8_t *info = p;
+  static const int avid[] = { 2, 1 };
+  for (int i = 0; i < 2; i++) {
+    put16(p, avid[i]);
+    put16(p + 2, tlen);
+    memcpy(p + 4, out + 56, tlen);
+    p += 4 + tlen;
+  }
+  put16(p, 7);
+  put16(p + 2, 8);
+  put64(p + 4, nt_now());
+  p += 12;
+  put32(p, 0);
+  p += 4;
+
+  put16(out + 40, p - info);
+  put16(out + 42, p - info);
+  put32(out + 44, info - out);
+  return p - out;
+}
+
+//****************************************************************************
+// Command handlers
+//****************************************************************************
+
+// 各ハンドラはbの末尾に応答の本体を追加してNTステータスを返す
+// (エラーの場合は本体を追加しなくてよい)
+
+static uint32_t cmd_negotiate(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  fakesmb_t *srv = c->srv;
+  if (blen < 36) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  int count = get16(body + 2);
+  uint16_t dialect = 0;
+  for (int i = 0; i < count && 36 + 2 * i + 2 <= blen; i++) {
+    uint16_t d = get16(body + 36 + 2 * i);
+    if (srv->cfg.dialect ? d == srv->cfg.dialect : (d == 0x0202 || d == 0x0210) && d > dialect) {
+      dialect = d;
+    }
+  }
+  if (dialect == 0) {
+    return STATUS_NOT_SUPPORTED;
+  }
+  c->dialect = dialect;
+
+  uint32_t maxsize = srv->cfg.max_size ? srv->cfg.max_size : 65536;
+  uint8_t *r = buf_reserve(b, 64 + sizeof(spnego_init));
+  put16(r + 0, 65);
+  put16(r + 2, 0x0001);                 // 署名は可能だが要求しない
+  put16(r + 4, dialect);
+  memcpy(r + 8, "FAKESMB-SERVER!!", 16);
+  put32(r + 24, dialect >= 0x0210 ? 0x00000004 : 0);  // SMB2_GLOBAL_CAP_LARGE_MTU
+  put32(r + 28, maxsize);
+  put32(r + 32, maxsize);
+  put32(r + 36, maxsize);
+  put64(r + 40, nt_now());
+  put16(r + 56, SMB2_HDR + 64);
+  put16(r + 58, sizeof(spnego_init));
+  memcpy(r + 64, spnego_init, sizeof(spnego_init));
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_session_setup(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 24) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  size_t off = get16(body + 12);
+  size_t len = get16(body + 14);
+  if (off < SMB2_HDR || off - SMB2_HDR + len > blen) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  const uint8_t *sec = body + off - SMB2_HDR;
+  const uint8_t *tok = memmem(sec, len, "NTLMSSP", 8);
+  if (tok == NULL || tok + 12 > sec + len) {
+    return STATUS_LOGON_FAILURE;          // NTLMSSP以外の認証には対応しない
+  }
+  bool spnego = tok != sec;
+
+  uint8_t tmp[512];
+  uint8_t out[600];
+  int outlen = 0;
+  uint32_t status;
+  switch (get32(tok + 8)) {
+  case 1:                                 // NEGOTIATE_MESSAGE
+    pthread_mutex_lock(&c->srv->lock);
+    c->sessid = c->srv->nextsess++;
+    pthread_mutex_unlock(&c->srv->lock);
+    c->authed = false;
+    if (spnego) {
+      outlen = spnego_resp(out, 1, tmp, ntlm_challenge(tmp));   // accept-incomplete
+    } else {
+      outlen = ntlm_challenge(out);
+    }
+    status = STATUS_MORE_PROCESSING_REQUIRED;
+    break;
+  case 3:                                 // AUTHENTICATE_MESSAGE (内容は確認しない)
+    if (c->sessid == 0) {
+      return STATUS_LOGON_FAILURE;
+    }
+    c->authed = true;
+    if (spnego) {
+      outlen = spnego_resp(out, 0, NULL, 0);                    // accept-completed
+    }
+    status = STATUS_SUCCESS;
+    break;
+  default:
+    return STATUS_LOGON_FAILURE;
+  }
+
+  uint8_t *r = buf_reserve(b, 8 + outlen);
+  put16(r + 0, 9);
+  put16(r + 2, 0);
+  put16(r + 4, SMB2_HDR + 8);
+  put16(r + 6, outlen);
+  memcpy(r + 8, out, outlen);
+  return status;
+}
+
+static uint32_t cmd_tree_connect(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  c->treeid++;
+  uint8_t *r = buf_reserve(b, 16);
+  put16(r + 0, 16);
+  r[2] = 0x01;                            // SMB2_SHARE_TYPE_DISK
+  put32(r + 4, 0);
+  put32(r + 8, 0);
+  put32(r + 12, 0x001f01ff);
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_simple(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  put16(buf_reserve(b, 4), 4);
+  return STATUS_SUCCESS;
+}
+
+static void put_create_info(uint8_t *r, const struct stat *st)
+{
+  put_times(r, st);
+  put64(r + 32, alloc_size(st));
+  put64(r + 40, S_ISDIR(st->st_mode) ? 0 : st->st_size);
+  put32(r + 48, file_attributes(st));
+}
+
+static uint32_t cmd_create(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  fakesmb_t *srv = c->srv;
+  if (blen < 56) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  uint32_t desired = get32(body + 24);
+  uint32_t share = get32(body + 32);
+  uint32_t disp = get32(body + 36);
+  uint32_t opts = get32(body + 40);
+  size_t noff = get16(body + 44);
+  size_t nlen = get16(body + 46);
+  if (nlen > 0 && (noff < SMB2_HDR || noff - SMB2_HDR + nlen > blen)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  char *path = host_path(srv, body + noff - SMB2_HDR, nlen);
+  if (path == NULL) {
+    return STATUS_OBJECT_NAME_INVALID;
+  }
+
+  struct stat st;
+  bool exists = stat(path, &st) == 0;
+  uint32_t action = 1;
+  uint32_t status = STATUS_SUCCESS;
+  if (!exists && errno != ENOENT) {
+    status = errno_status(errno);
+  } else if (exists) {
+    if (disp == FILE_CREATE) {
+      status = STATUS_OBJECT_NAME_COLLISION;
+    } else if ((opts & FILE_DIRECTORY_FILE) && !S_ISDIR(st.st_mode)) {
+      status = STATUS_NOT_A_DIRECTORY;
+    } else if ((opts & FILE_NON_DIRECTORY_FILE) && S_ISDIR(st.st_mode)) {
+      status = STATUS_FILE_IS_A_DIRECTORY;
+    }
+    action = (disp == FILE_SUPERSEDE) ? 0 :
+             (disp == FILE_OVERWRITE || disp == FILE_OVERWRITE_IF) ? 3 : 1;
+  } else {
+    if (disp == FILE_OPEN || disp == FILE_OVERWRITE) {
+      status = STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    action = 2;
+  }
+
+  uint32_t access = access_mask(desired);
+  if ((opts & FILE_DELETE_ON_CLOSE) || action != 1) {
+    access |= FILE_WRITE_DATA;
+  }
+  handle_t *h = NULL;
+  pthread_mutex_lock(&srv->lock);
+  if (status == STATUS_SUCCESS) {
+    if (exists && !S_ISDIR(st.st_mode) && share_conflict(srv, path, access, share)) {
+      status = STATUS_SHARING_VIOLATION;
+    } else {
+      for (int i = 0; i < MAXHANDLES; i++) {
+        if (srv->h[i].owner == NULL) {
+          h = &srv->h[i];
+          break;
+        }
+      }
+      if (h == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+      }
+    }
+  }
+  if (status == STATUS_SUCCESS) {
+    // ファイルを作成/オープンする
+    int fd = -1;
+    bool isdir = exists ? S_ISDIR(st.st_mode) : (opts & FILE_DIRECTORY_FILE) != 0;
+    if (isdir) {
+      if (!exists && mkdir(path, 0777) < 0) {
+        status = errno_status(errno);
+      }
+    } else {
+      int flags = (action == 2 ? O_CREAT | O_EXCL : 0) | (action == 0 || action == 3 ? O_TRUNC : 0);
+      if ((fd = open(path, O_RDWR | flags, 0666)) < 0 &&
+          (errno != EACCES || (access & FILE_WRITE_DATA) || (fd = open(path, O_RDONLY)) < 0)) {
+        status = (errno == ENOENT) ? STATUS_OBJECT_PATH_NOT_FOUND : errno_status(errno);
+      }
+    }
+    if (status == STATUS_SUCCESS && (fd >= 0 ? fstat(fd, &st) : stat(path, &st)) < 0) {
+      status = errno_status(errno);
+    }
+    if (status == STATUS_SUCCESS) {
+      h->owner = c;
+      h->volatile_id = srv->nextvol++;
+      h->path = path;
+      h->isdir = isdir;
+      h->fd = fd;
+      h->access = access;
+      h->share = share;
+      h->delete_pending = (opts & FILE_DELETE_ON_CLOSE) != 0;
+      h->dirstarted = false;
+      path = NULL;
+    } else if (fd >= 0) {
+      close(fd);
+    }
+  }
+  pthread_mutex_unlock(&srv->lock);
+  free(path);
+  if (status != STATUS_SUCCESS) {
+    return status;
+  }
+
+  uint8_t *r = buf_reserve(b, 89);
+  put16(r + 0, 89);
+  r[2] = 0;                               // オプロックは与えない
+  put32(r + 4, action);
+  put_create_info(r + 8, &st);
+  put64(r + 64, h - srv->h + 1);
+  put64(r + 72, h->volatile_id);
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_close(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 24) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  pthread_mutex_lock(&c->srv->lock);
+  handle_t *h = handle_find(c, body + 8);
+  if (h == NULL) {
+    pthread_mutex_unlock(&c->srv->lock);
+    return STATUS_FILE_CLOSED;
+  }
+  uint8_t *r = buf_reserve(b, 60);
+  put16(r + 0, 60);
+  struct stat st;
+  if ((get16(body + 2) & 0x0001) &&       // SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB
+      (h->fd >= 0 ? fstat(h->fd, &st) : stat(h->path, &st)) == 0) {
+    put16(r + 2, 0x0001);
+    put_create_info(r + 8, &st);
+  }
+  handle_free(h);
+  pthread_mutex_unlock(&c->srv->lock);
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_flush(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 24) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  handle_t *h = handle_find(c, body + 8);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+  return cmd_simple(c, req, body, blen, b);
+}
+
+static uint32_t cmd_read(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 48) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  uint32_t len = get32(body + 4);
+  uint64_t offset = get64(body + 8);
+  uint32_t mincount = get32(body + 32);
+  handle_t *h = handle_find(c, body + 16);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+  if (h->isdir) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  uint32_t maxsize = c->srv->cfg.max_size ? c->srv->cfg.max_size : 65536;
+  if (len > maxsize) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  size_t base = b->len;
+  buf_reserve(b, 16 + len);
+  ssize_t n = pread(h->fd, b->p + base + 16, len, offset);
+  if (n < 0) {
+    b->len = base;
+    return errno_status(errno);
+  }
+  if ((n == 0 && len > 0) || n < mincount) {
+    b->len = base;
+    return STATUS_END_OF_FILE;
+  }
+  b->len = base + 16 + n;
+  uint8_t *r = b->p + base;
+  put16(r + 0, 17);
+  r[2] = SMB2_HDR + 16;
+  put32(r + 4, n);
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_write(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 48) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  size_t doff = get16(body + 2);
+  uint32_t len = get32(body + 4);
+  uint64_t offset = get64(body + 8);
+  if (len > 0 && (doff < SMB2_HDR || doff - SMB2_HDR + len > blen)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  handle_t *h = handle_find(c, body + 16);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+  if (h->isdir) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!(h->access & FILE_WRITE_DATA)) {
+    return STATUS_ACCESS_DENIED;
+  }
+  ssize_t n = len ? pwrite(h->fd, body + doff - SMB2_HDR, len, offset) : 0;
+  if (n < 0) {
+    return errno_status(errno);
+  }
+  uint8_t *r = buf_reserve(b, 17);
+  put16(r + 0, 17);
+  put32(r + 4, n);
+  return STATUS_SUCCESS;
+}
+
+// ディレクトリエントリを1つ作る (入り切らなければ-1を返す)
+static int put_dirent(uint8_t *p, int space, int cls, const char *name, const struct stat *st, int index)
+{
+  int nlen = utf8_to_utf16(name, NULL);
+  int fixed;
+  switch (cls) {
+  case 1:  fixed = 64;  break;          // FileDirectoryInformation
+  case 2:  fixed = 68;  break;          // FileFullDirectoryInformation
+  case 3:  fixed = 94;  break;          // FileBothDirectoryInformation
+  case 12: fixed = 12;  break;          // FileNamesInformation
+  case 37: fixed = 104; break;          // FileIdBothDirectoryInformation
+  case 38: fixed = 80;  break;          // FileIdFullDirectoryInformation
+  default:
+    return -2;
+  }
+  if (fixed + nlen > space) {
+    return -1;
+  }
+  memset(p, 0, fixed);
+  put32(p + 4, index);
+  if (cls == 12) {
+    put32(p + 8, nlen);
+  } else {
+    put_times(p + 8, st);
+    put64(p + 40, S_ISDIR(st->st_mode) ? 0 : st->st_size);
+    put64(p + 48, alloc_size(st));
+    put32(p + 56, file_attributes(st));
+    put32(p + 60, nlen);
+    if (cls == 37) {
+      put64(p + 96, st->st_ino);
+    } else if (cls == 38) {
+      put64(p + 72, st->st_ino);
+    }
+  }
+  utf8_to_utf16(name, p + fixed);
+  return fixed + nlen;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static uint32_t cmd_query_directory(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 32) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  int cls = body[2];
+  int flags = body[3];
+  size_t noff = get16(body + 24);
+  size_t nlen = get16(body + 26);
+  uint32_t outlen = get32(body + 28);
+  if (nlen > 0 && (noff < SMB2_HDR || noff - SMB2_HDR + nlen > blen)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  handle_t *h = handle_find(c, body + 8);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+  if (!h->isdir) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  uint32_t maxsize = c->srv->cfg.max_size ? c->srv->cfg.max_size : 65536;
+  if (outlen > maxsize) {
+    outlen = maxsize;
+  }
+
+  bool first = false;
+  if (!h->dirstarted || (flags & (SMB2_RESTART_SCANS | SMB2_REOPEN))) {
+    // 検索パターンに合うエントリの一覧を作る
+    char *pat = nlen ? utf16_to_utf8(body + noff - SMB2_HDR, nlen) : strdup("*");
+    DIR *dir = opendir(h->path);
+    if (dir == NULL) {
+      free(pat);
+      return errno_status(errno);
+    }
+    handle_dirfree(h);
+    int cap = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+      if (!match_pattern(pat, d->d_name)) {
+        continue;
+      }
+      if (h->nnames >= cap) {
+        cap = cap ? cap * 2 : 64;
+        h->names = realloc(h->names, cap * sizeof(char *));
+      }
+      h->names[h->nnames++] = strdup(d->d_name);
+    }
+    closedir(dir);
+    free(pat);
+    if (h->nnames > 0) {
+      qsort(h->names, h->nnames, sizeof(char *), name_cmp);
+    }
+    h->dirpos = 0;
+    h->dirstarted = true;
+    first = true;
+  }
+
+  size_t base = b->len;
+  buf_reserve(b, 8 + outlen);
+  uint8_t *out = b->p + base + 8;
+  int used = 0;
+  int last = -1;
+  while (h->dirpos < h->nnames) {
+    char *path = malloc(strlen(h->path) + strlen(h->names[h->dirpos]) + 2);
+    sprintf(path, "%s/%s", h->path, h->names[h->dirpos]);
+    struct stat st;
+    int r = lstat(path, &st);
+    free(path);
+    if (r < 0) {
+      h->dirpos++;                        // 一覧を作った後に消えたファイル
+      continue;
+    }
+    int pos = (used + 7) & ~7;
+    int n = pos <= outlen ? put_dirent(out + pos, outlen - pos, cls, h->names[h->dirpos], &st, h->dirpos) : -1;
+    if (n == -2) {
+      b->len = base;
+      return STATUS_NOT_SUPPORTED;
+    }
+    if (n < 0) {
+      break;
+    }
+    if (last >= 0) {
+      put32(out + last, pos - last);
+    }
+    last = pos;
+    used = pos + n;
+    h->dirpos++;
+    if (flags & SMB2_RETURN_SINGLE_ENTRY) {
+      break;
+    }
+  }
+  if (last < 0) {
+    b->len = base;
+    if (h->dirpos < h->nnames) {
+      return STATUS_INFO_LENGTH_MISMATCH;
+    }
+    return (first && h->nnames == 0) ? STATUS_NO_SUCH_FILE : STATUS_NO_MORE_FILES;
+  }
+  b->len = base + 8 + used;
+  uint8_t *r = b->p + base;
+  put16(r + 0, 9);
+  put16(r + 2, SMB2_HDR + 8);
+  put32(r + 4, used);
+  return STATUS_SUCCESS;
+}
+
+// ファイル情報を作ってバイト数を返す (対応していなければ-1)
+static int file_info(handle_t *h, int cls, const struct stat *st, uint8_t *p)
+{
+  const char *name = strrchr(h->path, '/');
+  name = name ? name + 1 : h->path;
+  switch (cls) {
+  case 4:                                 // FileBasicInformation
+    put_times(p, st);
+    put32(p + 32, file_attributes(st));
+    return 40;
+  case 5:                                 // FileStandardInformation
+    put64(p + 0, alloc_size(st));
+    put64(p + 8, S_ISDIR(st->st_mode) ? 0 : st->st_size);
+    put32(p + 16, st->st_nlink);
+    p[20] = h->delete_pending;
+    p[21] = S_ISDIR(st->st_mode);
+    return 24;
+  case 6:                                 // FileInternalInformation
+    put64(p, st->st_ino);
+    return 8;
+  case 7:                                 // FileEaInformation
+    return 4;
+  case 8:                                 // FileAccessInformation
+    put32(p, 0x001f01ff);
+    return 4;
+  case 14:                                // FilePositionInformation
+    return 8;
+  case 16:                                // FileModeInformation
+  case 17:                                // FileAlignmentInformation
+    return 4;
+  case 18:                                // FileAllInformation
+    {
+      int n = 0;
+      static const int parts[] = { 4, 5, 6, 7, 8, 14, 16, 17 };
+      for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        n += file_info(h, parts[i], st, p + n);
+      }
+      int nlen = utf8_to_utf16(name, p + n + 4);
+      put32(p + n, nlen);
+      return n + 4 + nlen;
+    }
+  case 34:                                // FileNetworkOpenInformation
+    put_times(p, st);
+    put64(p + 32, alloc_size(st));
+    put64(p + 40, S_ISDIR(st->st_mode) ? 0 : st->st_size);
+    put32(p + 48, file_attributes(st));
+    return 56;
+  case 35:                                // FileAttributeTagInformation
+    put32(p, file_attributes(st));
+    return 8;
+  default:
+    return -1;
+  }
+}
+
+// ファイルシステム情報を作ってバイト数を返す (対応していなければ-1)
+static int fs_info(fakesmb_t *srv, int cls, uint8_t *p)
+{
+  struct statvfs vfs;
+  if (statvfs(srv->cfg.root, &vfs) < 0) {
+    memset(&vfs, 0, sizeof(vfs));
+    vfs.f_frsize = 4096;
+  }
+  // 1アロケーション単位を1セクタとして返す
+  uint32_t bsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+  switch (cls) {
+  case 1:                                 // FileFsVolumeInformation
+    put64(p, nt_now());
+    put32(p + 8, 0x12345678);
+    return 18;
+  case 3:                                 // FileFsSizeInformation
+    put64(p + 0, vfs.f_blocks);
+    put64(p + 8, vfs.f_bavail);
+    put32(p + 16, 1);
+    put32(p + 20, bsize);
+    return 24;
+  case 4:                                 // FileFsDeviceInformation
+    put32(p, 7);                          // FILE_DEVICE_DISK
+    return 8;
+  case 5:                                 // FileFsAttributeInformation
+    put32(p + 0, 0x00000003);             // CASE_SENSITIVE_SEARCH | CASE_PRESERVED_NAMES
+    put32(p + 4, 255);
+    put32(p + 8, utf8_to_utf16("NTFS", p + 12));
+    return 12 + 8;
+  case 7:                                 // FileFsFullSizeInformation
+    put64(p + 0, vfs.f_blocks);
+    put64(p + 8, vfs.f_bavail);
+    put64(p + 16, vfs.f_bfree);
+    put32(p + 24, 1);
+    put32(p + 28, bsize);
+    return 32;
+  default:
+    return -1;
+  }
+}
+
+static uint32_t cmd_query_info(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  if (blen < 40) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  int type = body[2];
+  int cls = body[3];
+  uint32_t outlen = get32(body + 4);
+  handle_t *h = handle_find(c, body + 24);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+
+  uint8_t tmp[1024 + 4 * 256];
+  int n;
+  if (type == SMB2_0_INFO_FILE) {
+    struct stat st;
+    if ((h->fd >= 0 ? fstat(h->fd, &st) : stat(h->path, &st)) < 0) {
+      return errno_status(errno);
+    }
+    n = file_info(h, cls, &st, memset(tmp, 0, sizeof(tmp)));
+  } else if (type == SMB2_0_INFO_FILESYSTEM) {
+    n = fs_info(c->srv, cls, memset(tmp, 0, sizeof(tmp)));
+  } else {
+    return STATUS_NOT_SUPPORTED;
+  }
+  if (n < 0) {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  uint32_t status = STATUS_SUCCESS;
+  if (n > outlen) {
+    // 可変長の情報は切り詰めて返すが、固定長の情報はエラーにする
+    if (type != SMB2_0_INFO_FILE || cls != 18) {
+      return STATUS_INFO_LENGTH_MISMATCH;
+    }
+    n = outlen;
+    status = STATUS_BUFFER_OVERFLOW;
+  }
+  uint8_t *r = buf_reserve(b, 8 + n);
+  put16(r + 0, 9);
+  put16(r + 2, SMB2_HDR + 8);
+  put32(r + 4, n);
+  memcpy(r + 8, tmp, n);
+  return status;
+}
+
+static uint32_t cmd_set_info(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  fakesmb_t *srv = c->srv;
+  if (blen < 32) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  int type = body[2];
+  int cls = body[3];
+  size_t len = get32(body + 4);
+  size_t off = get16(body + 8);
+  if (off < SMB2_HDR || off - SMB2_HDR + len > blen) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  const uint8_t *p = body + off - SMB2_HDR;
+  handle_t *h = handle_find(c, body + 16);
+  if (h == NULL) {
+    return STATUS_FILE_CLOSED;
+  }
+  if (type != SMB2_0_INFO_FILE) {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  switch (cls) {
+  case 4:                                 // FileBasicInformation
+    {
+      if (len < 36) {
+        return STATUS_INFO_LENGTH_MISMATCH;
+      }
+      uint64_t mtime = get64(p + 16);
+      if (mtime != 0 && mtime != (uint64_t)-1) {
+        struct timespec ts[2];
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec = mtime / 10000000ULL - NT_EPOCH_DIFF;
+        ts[1].tv_nsec = (mtime % 10000000ULL) * 100;
+        if (utimensat(AT_FDCWD, h->path, ts, 0) < 0) {
+          return errno_status(errno);
+        }
+      }
+      uint32_t attr = get32(p + 32);
+      struct stat st;
+      if (attr != 0 && stat(h->path, &st) == 0) {
+        mode_t mode = (attr & FILE_ATTRIBUTE_READONLY) ? st.st_mode & ~0222 : st.st_mode | S_IWUSR;
+        if (chmod(h->path, mode & 07777) < 0) {
+          return errno_status(errno);
+        }
+      }
+    }
+    break;
+  case 10:                                // FileRenameInformation
+    {
+      if (len < 20 || 20 + get32(p + 16) > len) {
+        return STATUS_INFO_LENGTH_MISMATCH;
+      }
+      char *newpath = host_path(srv, p + 20, get32(p + 16));
+      if (newpath == NULL) {
+        return STATUS_OBJECT_NAME_INVALID;
+      }
+      struct stat st;
+      if (!p[0] && stat(newpath, &st) == 0) {
+        free(newpath);
+        return STATUS_OBJECT_NAME_COLLISION;
+      }
+      if (rename(h->path, newpath) < 0) {
+        int err = errno;
+        free(newpath);
+        return errno_status(err);
+      }
+      pthread_mutex_lock(&srv->lock);
+      free(h->path);
+      h->path = newpath;
+      pthread_mutex_unlock(&srv->lock);
+    }
+    break;
+  case 13:                                // FileDispositionInformation
+    if (len < 1) {
+      return STATUS_INFO_LENGTH_MISMATCH;
+    }
+    if (p[0] && h->isdir) {
+      DIR *dir = opendir(h->path);
+      struct dirent *d;
+      while (dir && (d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0) {
+          closedir(dir);
+          return STATUS_DIRECTORY_NOT_EMPTY;
+        }
+      }
+      if (dir) {
+        closedir(dir);
+      }
+    }
+    h->delete_pending = p[0] != 0;
+    break;
+  case 19:                                // FileAllocationInformation
+    break;
+  case 20:                                // FileEndOfFileInformation
+    if (len < 8) {
+      return STATUS_INFO_LENGTH_MISMATCH;
+    }
+    if (h->fd < 0 || ftruncate(h->fd, get64(p)) < 0) {
+      return h->fd < 0 ? STATUS_INVALID_PARAMETER : errno_status(errno);
+    }
+    break;
+  default:
+    return STATUS_NOT_SUPPORTED;
+  }
+  put16(buf_reserve(b, 2), 2);
+  return STATUS_SUCCESS;
+}
+
+static uint32_t cmd_notsupp(conn_t *c, const uint8_t *req, const uint8_t *body, size_t blen, buf_t *b)
+{
+  return STATUS_NOT_SUPPORTED;
+}
+
+typedef uint32_t (*cmd_handler_t)(conn_t *, const uint8_t *, const uint8_t *, size_t, buf_t *);
+
+static const cmd_handler_t handlers[FAKESMB_NCMDS] = {
+  [SMB2_NEGOTIATE]        = cmd_negotiate,
+  [SMB2_SESSION_SETUP]    = cmd_session_setup,
+  [SMB2_LOGOFF]           = cmd_simple,
+  [SMB2_TREE_CONNECT]     = cmd_tree_connect,
+  [SMB2_TREE_DISCONNECT]  = cmd_simple,
+  [SMB2_CREATE]           = cmd_create,
+  [SMB2_CLOSE]            = cmd_close,
+  [SMB2_FLUSH]            = cmd_flush,
+  [SMB2_READ]             = cmd_read,
+  [SMB2_WRITE]            = cmd_write,
+  [SMB2_LOCK]             = cmd_simple,
+  [SMB2_IOCTL]            = cmd_notsupp,
+  [SMB2_CANCEL]           = NULL,
+  [SMB2_ECHO]             = cmd_simple,
+  [SMB2_QUERY_DIRECTORY]  = cmd_query_directory,
+  [SMB2_CHANGE_NOTIFY]    = cmd_notsupp,
+  [SMB2_QUERY_INFO]       = cmd_query_info,
+  [SMB2_SET_INFO]         = cmd_set_info,
+  [SMB2_OPLOCK_BREAK]     = cmd_notsupp,
+};
+
+//****************************************************************************
+// Message processing
+//****************************************************************************
+
+// 障害の設定に該当するか調べる
+static const fakesmb_fault_t *fault_check(fakesmb_t *srv, int cmd)
+{
+  const fakesmb_fault_t *hit = NULL;
+  pthread_mutex_lock(&srv->lock);
+  srv->count[cmd]++;
+  srv->countall++;
+  srv->st.reqs[cmd]++;
+  for (int i = 0; i < srv->cfg.nfaults; i++) {
+    const fakesmb_fault_t *f = &srv->cfg.faults[i];
+    uint32_t n = (f->cmd < 0) ? srv->countall : srv->count[cmd];
+    if ((f->cmd < 0 || f->cmd == cmd) && (f->nth == 0 || f->nth == n)) {
+      hit = f;
+      srv->st.faults++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&srv->lock);
+  return hit;
+}
+
+// 応答を送信待ちのキューに送信時刻順に入れる
+static void enqueue(conn_t *c, const uint8_t *msg, size_t len, uint64_t due)
+{
+  outmsg_t *m = malloc(sizeof(outmsg_t) + NETBIOS_HDR + len);
+  m->due = due;
+  m->len = NETBIOS_HDR + len;
+  m->data[0] = 0;
+  m->data[1] = len >> 16;
+  m->data[2] = len >> 8;
+  m->data[3] = len;
+  memcpy(m->data + NETBIOS_HDR, msg, len);
+  outmsg_t **pp = &c->outq;
+  while (*pp && (*pp)->due <= due) {
+    pp = &(*pp)->next;
+  }
+  m->next = *pp;
+  *pp = m;
+  c->inflight++;
+  pthread_mutex_lock(&c->srv->lock);
+  if (c->inflight > c->srv->st.maxinflight) {
+    c->srv->st.maxinflight = c->inflight;
+  }
+  pthread_mutex_unlock(&c->srv->lock);
+}
+
+// 受信した1つのメッセージ(compound要求なら複数の要求)を処理する
+static void process_message(conn_t *c, const uint8_t *msg, size_t len, uint64_t recvtime)
+{
+  fakesmb_t *srv = c->srv;
+  buf_t out = { 0 };
+  uint64_t delay_ms = srv->cfg.latency_ms;
+  size_t off = 0;
+  uint32_t prevstatus = STATUS_SUCCESS;
+  uint8_t prevfid[16];
+  memset(prevfid, 0xff, sizeof(prevfid));
+  size_t prevhdr = 0;
+  bool anyreply = false;
+
+  pthread_mutex_lock(&srv->lock);
+  srv->st.msgs++;
+  if (len >= SMB2_HDR && get32(msg + 20) != 0) {
+    srv->st.compounds++;
+  }
+  pthread_mutex_unlock(&srv->lock);
+
+  while (off + SMB2_HDR <= len) {
+    const uint8_t *req = msg + off;
+    if (memcmp(req, "\xfeSMB", 4) != 0) {
+      c->drop = true;
+      break;
+    }
+    uint32_t next = get32(req + 20);
+    size_t reqlen = next ? next : len - off;
+    if (reqlen < SMB2_HDR || off + reqlen > len) {
+      c->drop = true;
+      break;
+    }
+    int cmd = get16(req + 12);
+    uint32_t flags = get32(req + 16);
+    bool related = (flags & SMB2_FLAGS_RELATED_OPERATIONS) != 0;
+
+    if (cmd >= FAKESMB_NCMDS) {
+      cmd = SMB2_OPLOCK_BREAK;
+    }
+    const fakesmb_fault_t *f = fault_check(srv, cmd);
+    if (f && f->action == FAULT_DROP) {
+      c->drop = true;
+      break;
+    }
+    if (cmd == SMB2_CANCEL || (f && f->action == FAULT_NOREPLY)) {
+      off += reqlen;
+      if (!next) {
+        break;
+      }
+      continue;
+    }
+
+    // 関連する要求では直前のCREATEのファイルIDを使う
+    size_t blen = reqlen - SMB2_HDR;
+    uint8_t *body = malloc(blen + 16);
+    memcpy(body, req + SMB2_HDR, blen);
+    static const int fidpos[FAKESMB_NCMDS] = {
+      [SMB2_CLOSE] = 8, [SMB2_FLUSH] = 8, [SMB2_READ] = 16, [SMB2_WRITE] = 16,
+      [SMB2_QUERY_DIRECTORY] = 8, [SMB2_QUERY_INFO] = 24, [SMB2_SET_INFO] = 16,
+    };
+    if (related && fidpos[cmd] && fidpos[cmd] + 16 <= blen &&
+        get64(body + fidpos[cmd]) == (uint64_t)-1 && get64(body + fidpos[cmd] + 8) == (uint64_t)-1) {
+      memcpy(body + fidpos[cmd], prevfid, 16);
+    }
+
+    // 応答ヘッダを作る
+    size_t hdr = out.len;
+    if (hdr > 0 && !srv->cfg.split_compound) {
+      hdr = (out.len + 7) & ~7;
+      buf_reserve(&out, hdr - out.len);
+      put32(out.p + prevhdr + 20, hdr - prevhdr);
+    } else if (hdr > 0) {
+      hdr = 0;
+      out.len = 0;
+    }
+    prevhdr = hdr;
+    uint8_t *h = buf_reserve(&out, SMB2_HDR);
+    memcpy(h, req, SMB2_HDR);
+    put32(h + 16, SMB2_FLAGS_SERVER_TO_REDIR | (flags & SMB2_FLAGS_RELATED_OPERATIONS));
+    put32(h + 20, 0);
+    memset(h + 48, 0, 16);
+
+    uint32_t status;
+    if (f && f->action == FAULT_STATUS) {
+      status = f->status;
+    } else if (related && prevstatus != STATUS_SUCCESS) {
+      status = prevstatus;                // 関連する要求は直前のエラーを引き継ぐ
+    } else if (cmd > SMB2_SESSION_SETUP && cmd != SMB2_ECHO &&
+               (!c->authed || (!related && get64(req + 40) != c->sessid))) {
+      status = STATUS_USER_SESSION_DELETED;
+    } else if (cmd > SMB2_TREE_CONNECT && cmd != SMB2_ECHO && cmd != SMB2_LOGOFF && c->treeid == 0) {
+      status = STATUS_NETWORK_NAME_DELETED;
+    } else {
+      status = handlers[cmd](c, req, body, blen, &out);
+    }
+    free(body);
+    h = out.p + hdr;
+    if (status != STATUS_SUCCESS && status != STATUS_MORE_PROCESSING_REQUIRED &&
+        status != STATUS_BUFFER_OVERFLOW) {
+      // エラー応答
+      out.len = hdr + SMB2_HDR;
+      put16(buf_reserve(&out, 9), 9);
+      h = out.p + hdr;
+    }
+    if (cmd == SMB2_CREATE) {
+      if (status == STATUS_SUCCESS) {
+        memcpy(prevfid, out.p + hdr + SMB2_HDR + 64, 16);
+      }
+    }
+    prevstatus = status;
+    put32(h + 8, status);
+    uint16_t credits = get16(req + 14);
+    int maxcredits = srv->cfg.credits ? srv->cfg.credits : 64;
+    put16(h + 14, credits < 1 ? 1 : credits > maxcredits ? maxcredits : credits);
+    if (cmd == SMB2_SESSION_SETUP || c->sessid) {
+      put64(h + 40, c->sessid);
+    }
+    if (cmd == SMB2_TREE_CONNECT && status == STATUS_SUCCESS) {
+      put32(h + 36, c->treeid);
+    }
+    delay_ms += srv->cfg.cmd_latency_ms[cmd];
+    if (f && f->action == FAULT_DELAY) {
+      delay_ms += f->delay_ms;
+    }
+    if (srv->cfg.verbose) {
+      printf("[%d] %-14s mid=%-6llu%s -> 0x%08x\n", c->id, cmdname[cmd],
+             (unsigned long long)get64(req + 24), related ? " (related)" : "", status);
+    }
+    anyreply = true;
+    if (srv->cfg.split_compound) {
+      enqueue(c, out.p, out.len, recvtime + delay_ms * 1000000ULL);
+      anyreply = false;
+    }
+
+    off += reqlen;
+    if (!next) {
+      break;
+    }
+  }
+  if (anyreply && !c->drop) {
+    enqueue(c, out.p, out.len, recvtime + delay_ms * 1000000ULL);
+  }
+  free(out.p);
+}
+
+static bool send_all(int fd, const uint8_t *p, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 1つの接続を処理するスレッド
+static void *conn_thread(void *arg)
+{
+  conn_t *c = arg;
+  fakesmb_t *srv = c->srv;
+  uint8_t *rbuf = NULL;
+  size_t rlen = 0;
+  size_t rcap = 0;
+
+  while (!c->drop) {
+    // 送信時刻になった応答を送る
+    uint64_t now = now_ns();
+    while (c->outq && c->outq->due <= now) {
+      outmsg_t *m = c->outq;
+      c->outq = m->next;
+      c->inflight--;
+      bool ok = send_all(c->fd, m->data, m->len);
+      free(m);
+      if (!ok) {
+        c->drop = true;
+        break;
+      }
+    }
+    if (c->drop) {
+      break;
+    }
+
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int timeout = c->outq ? (int)((c->outq->due - now + 999999) / 1000000) : -1;
+    int r = poll(&pfd, 1, timeout);
+    if (r < 0 && errno != EINTR) {
+      break;
+    }
+    if (r <= 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+
+    if (rcap - rlen < 65536) {
+      rcap = rcap ? rcap * 2 : 131072;
+      rbuf = realloc(rbuf, rcap);
+    }
+    ssize_t n = recv(c->fd, rbuf + rlen, rcap - rlen, 0);
+    if (n <= 0) {
+      break;
+    }
+    rlen += n;
+    uint64_t recvtime = now_ns();
+
+    // 受信したメッセージを1つずつ処理する
+    size_t pos = 0;
+    while (rlen - pos >= NETBIOS_HDR && !c->drop) {
+      size_t mlen = (rbuf[pos + 1] << 16) | (rbuf[pos + 2] << 8) | rbuf[pos + 3];
+      if (rbuf[pos] != 0 || mlen > MAXMSG) {
+        c->drop = true;
+        break;
+      }
+      if (rlen - pos < NETBIOS_HDR + mlen) {
+        break;
+      }
+      process_message(c, rbuf + pos + NETBIOS_HDR, mlen, recvtime);
+      pos += NETBIOS_HDR + mlen;
+    }
+    memmove(rbuf, rbuf + pos, rlen - pos);
+    rlen -= pos;
+  }
+
+  // 接続を閉じてこの接続でオープンしていたファイルを閉じる
+  while (c->outq) {
+    outmsg_t *m = c->outq;
+    c->outq = m->next;
+    free(m);
+  }
+  free(rbuf);
+  close(c->fd);
+  if (srv->cfg.verbose) {
+    printf("[%d] disconnected\n", c->id);
+  }
+  pthread_mutex_lock(&srv->lock);
+  for (int i = 0; i < MAXHANDLES; i++) {
+    if (srv->h[i].owner == c) {
+      handle_free(&srv->h[i]);
+    }
+  }
+  for (conn_t **pp = &srv->conns; *pp; pp = &(*pp)->next) {
+    if (*pp == c) {
+      *pp = c->next;
+      break;
+    }
+  }
+  srv->nconns--;
+  pthread_cond_broadcast(&srv->cond);
+  pthread_mutex_unlock(&srv->lock);     // この後はsrvが解放されている可能性がある
+  free(c);
+  return NULL;
+}
+
+static int conn_start(fakesmb_t *srv, int fd)
+{
+  conn_t *c = calloc(1, sizeof(conn_t));
+  if (c == NULL) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  c->srv = srv;
+  c->fd = fd;
+  pthread_mutex_lock(&srv->lock);
+  c->id = srv->nextid++;
+  c->next = srv->conns;
+  srv->conns = c;
+  srv->nconns++;
+  srv->st.conns++;
+  pthread_mutex_unlock(&srv->lock);
+
+  pthread_t th;
+  if (pthread_create(&th, NULL, conn_thread, c) != 0) {
+    pthread_mutex_lock(&srv->lock);
+    srv->conns = c->next;
+    srv->nconns--;
+    pthread_mutex_unlock(&srv->lock);
+    close(fd);
+    free(c);
+    return -1;
+  }
+  pthread_detach(th);
+  if (srv->cfg.verbose) {
+    printf("[%d] connected\n", c->id);
+  }
+  return 0;
+}
+
+static void *accept_thread(void *arg)
+{
+  fakesmb_t *srv = arg;
+  while (1) {
+    int fd = accept(srv->lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;                              // fakesmb_stop()で待ち受けを止めた
+    }
+    conn_start(srv, fd);
+  }
+  return NULL;
+}
+
+//****************************************************************************
+// Global functions
+//****************************************************************************
+
+// サーバを起動する
+// portが0でなければループバックのTCPポートで待ち受ける(-1なら空いているポートを使う)
+fakesmb_t *fakesmb_start(const fakesmb_config_t *cfg, int port)
+{
+  fakesmb_t *srv = calloc(1, sizeof(fakesmb_t));
+  if (srv == NULL) {
+    return NULL;
+  }
+  srv->cfg = *cfg;
+  srv->lfd = -1;
+  srv->nextvol = 1;
+  srv->nextsess = 0x0000040000000001ULL;
+  for (int i = 0; i < MAXHANDLES; i++) {
+    srv->h[i].fd = -1;
+  }
+  pthread_mutex_init(&srv->lock, NULL);
+  pthread_cond_init(&srv->cond, NULL);
+  if (port == 0) {
+    return srv;
+  }
+
+  struct sockaddr_in sin = { 0 };
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port < 0 ? 0 : port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int one = 1;
+  socklen_t slen = sizeof(sin);
+  if ((srv->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+      setsockopt(srv->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      bind(srv->lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+      listen(srv->lfd, 8) < 0 ||
+      getsockname(srv->lfd, (struct sockaddr *)&sin, &slen) < 0) {
+    if (srv->lfd >= 0) {
+      close(srv->lfd);
+    }
+    free(srv);
+    return NULL;
+  }
+  srv->port = ntohs(sin.sin_port);
+  if (pthread_create(&srv->thread, NULL, accept_thread, srv) != 0) {
+    close(srv->lfd);
+    free(srv);
+    return NULL;
+  }
+  srv->listening = true;
+  return srv;
+}
+
+int fakesmb_port(fakesmb_t *srv)
+{
+  return srv->port;
+}
+
+// プロセス内でクライアントとつなぐソケットを作る (クライアント側のfdを返す)
+int fakesmb_socketpair(fakesmb_t *srv)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -1;
+  }
+  if (conn_start(srv, sv[1]) < 0) {
+    close(sv[0]);
+    return -1;
+  }
+  return sv[0];
+}
+
+// コマンド名からコマンド番号を得る
+int fakesmb_cmd(const char *name)
+{
+  for (int i = 0; i < FAKESMB_NCMDS; i++) {
+    if (strcasecmp(name, cmdname[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *fakesmb_cmdname(int cmd)
+{
+  return (cmd >= 0 && cmd < FAKESMB_NCMDS) ? cmdname[cmd] : "?";
+}
+
+// 障害の指定 "<command>[:<nth>]:<action>" を解釈する
+// <command>はコマンド名か'*'、<action>は drop, noreply, delay=<ms>, NTステータス(0xc0000022など)
+int fakesmb_parse_fault(const char *spec, fakesmb_fault_t *f)
+{
+  char buf[64];
+  if (strlen(spec) >= sizeof(buf)) {
+    return -1;
+  }
+  strcpy(buf, spec);
+  char *fields[3];
+  int n = 0;
+  for (char *p = strtok(buf, ":"); p && n < 3; p = strtok(NULL, ":")) {
+    fields[n++] = p;
+  }
+  if (n < 2) {
+    return -1;
+  }
+  memset(f, 0, sizeof(*f));
+  if (strcmp(fields[0], "*") == 0) {
+    f->cmd = -1;
+  } else if ((f->cmd = fakesmb_cmd(fields[0])) < 0) {
+    return -1;
+  }
+  const char *action = fields[n - 1];
+  if (n == 3) {
+    f->nth = strtoul(fields[1], NULL, 0);
+  }
+  if (strcmp(action, "drop") == 0) {
+    f->action = FAULT_DROP;
+  } else if (strcmp(action, "noreply") == 0) {
+    f->action = FAULT_NOREPLY;
+  } else if (strncmp(action, "delay=", 6) == 0) {
+    f->action = FAULT_DELAY;
+    f->delay_ms = atoi(action + 6);
+  } else if (strncmp(action, "0x", 2) == 0) {
+    f->action = FAULT_STATUS;
+    f->status = strtoul(action, NULL, 16);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+void fakesmb_getstats(fakesmb_t *srv, fakesmb_stats_t *st)
+{
+  pthread_mutex_lock(&srv->lock);
+  *st = srv->st;
+  pthread_mutex_unlock(&srv->lock);
+}
+
+void fakesmb_resetstats(fakesmb_t *srv)
+{
+  pthread_mutex_lock(&srv->lock);
+  memset(&srv->st, 0, sizeof(srv->st));
+  memset(srv->count, 0, sizeof(srv->count));
+  srv->countall = 0;
+  pthread_mutex_unlock(&srv->lock);
+}
+
+// サーバを止めてすべての接続を閉じる
+void fakesmb_stop(fakesmb_t *srv)
+{
+  if (srv->listening) {
+    shutdown(srv->lfd, SHUT_RDWR);
+    close(srv->lfd);
+    pthread_join(srv->thread, NULL);
+  }
+  pthread_mutex_lock(&srv->lock);
+  for (conn_t *c = srv->conns; c; c = c->next) {
+    shutdown(c->fd, SHUT_RDWR);
+  }
+  while (srv->nconns > 0) {
+    pthread_cond_wait(&srv->cond, &srv->lock);
+  }
+  pthread_mutex_unlock(&srv->lock);
+  pthread_mutex_destroy(&srv->lock);
+  pthread_cond_destroy(&srv->cond);
+  free(srv);
+}
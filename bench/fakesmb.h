@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ホスト上で動かす最小限のSMB2サーバ
+ *
+ * ローカルのディレクトリをSMB 2.02/2.1の共有として見せる。
+ * 認証は行わず(NTLMSSPのやり取りの形だけを合わせる)、署名と暗号化にも対応しない。
+ * 応答の遅延、クレジットの数、compound要求の応答の返し方、エラーや切断の注入を設定できるので、
+ * Sambaを使わずにlibsmb2を通した通信回数やパイプライン、再接続の動作を再現性よく確認できる。
+ */
+
+#ifndef _FAKESMB_H_
+#define _FAKESMB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define FAKESMB_NCMDS       19          // SMB2のコマンド数 (NEGOTIATE - OPLOCK_BREAK)
+#define FAKESMB_MAXFAULTS   16          // 設定できる障害の数
+
+// 注入する障害の種類
+#define FAULT_STATUS        0           // 指定したステータスでエラー応答を返す
+#define FAULT_DROP          1           // 応答を返さずに接続を切る
+#define FAULT_DELAY         2           // 応答を指定した時間だけ遅らせる
+#define FAULT_NOREPLY       3           // 応答を返さない (タイムアウトの確認用)
+
+// 障害を起こす条件と内容
+typedef struct {
+  int cmd;                      // 対象のコマンド (-1=すべて)
+  uint32_t nth;                 // 何回目の要求で起こすか (1から数える。0=毎回)
+  int action;                   // FAULT_*
+  uint32_t status;              // FAULT_STATUSで返すNTステータス
+  int delay_ms;                 // FAULT_DELAYで追加する遅延
+} fakesmb_fault_t;
+
+// サーバの設定
+typedef struct {
+  const char *root;             // 共有として見せるディレクトリ
+  int latency_ms;               // すべての応答に加える遅延 (往復時間を模擬する)
+  int cmd_latency_ms[FAKESMB_NCMDS];  // コマンドごとに追加する遅延 (サーバの処理時間を模擬する)
+  int credits;                  // 1つの応答で与えるクレジットの上限 (0=64)
+  uint16_t dialect;             // 使用するダイアレクト (0=クライアントが示す2.xの最大)
+  uint32_t max_size;            // 最大読み書きサイズ (0=65536)
+  bool split_compound;          // compound要求の応答をまとめずに1つずつ返す
+  bool verbose;                 // 要求と応答を表示する
+  int nfaults;
+  fakesmb_fault_t faults[FAKESMB_MAXFAULTS];
+} fakesmb_config_t;
+
+// 受け付けた要求の統計情報
+typedef struct {
+  uint32_t conns;               // 接続数
+  uint32_t msgs;                // 受信したメッセージ数 (compound要求は1つと数える)
+  uint32_t compounds;           // 受信したcompound要求の数
+  uint32_t reqs[FAKESMB_NCMDS]; // コマンドごとの要求数
+  uint32_t faults;              // 起こした障害の数
+  uint32_t maxinflight;         // 同時に処理待ちだった要求の最大数 (パイプラインの深さ)
+} fakesmb_stats_t;
+
+typedef struct fakesmb fakesmb_t;
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+fakesmb_t *fakesmb_start(const fakesmb_config_t *cfg, int port);
+int fakesmb_port(fakesmb_t *srv);
+int fakesmb_socketpair(fakesmb_t *srv);
+int fakesmb_cmd(const char *name);
+const char *fakesmb_cmdname(int cmd);
+int fakesmb_parse_fault(const char *spec, fakesmb_fault_t *f);
+void fakesmb_getstats(fakesmb_t *srv, fakesmb_stats_t *st);
+void fakesmb_resetstats(fakesmb_t *srv);
+void fakesmb_stop(fakesmb_t *srv);
+
+#endif /* _FAKESMB_H_ */
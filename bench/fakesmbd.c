@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * fakesmb.cのサーバを単独で動かす
+ *
+ * ループバックのTCPポートで待ち受けるので、ホスト上のクライアントやエミュレータ上の
+ * smbclient/smbfsからSambaの代わりに接続できる。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "fakesmb.h"
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static volatile sig_atomic_t done;
+
+//****************************************************************************
+// Main
+//****************************************************************************
+
+static void usage(void)
+{
+  printf("Usage: fakesmbd [-p <port>] [-l <ms>] [-L <cmd>=<ms>]... [-c <credits>] [-d <dialect>]\n"
+         "                [-m <size>] [-s] [-f <fault>]... [-v] <directory>\n"
+         "  -p <port>       TCP port on 127.0.0.1 (default 4450, 0=any)\n"
+         "  -l <ms>         latency added to every response\n"
+         "  -L <cmd>=<ms>   additional latency for one command (e.g. read=5)\n"
+         "  -c <credits>    maximum credits granted per response (default 64)\n"
+         "  -d <dialect>    dialect to use (0x0202 or 0x0210)\n"
+         "  -m <size>       maximum read/write/transact size (default 65536)\n"
+         "  -s              reply to compound requests one by one\n"
+         "  -f <fault>      inject a fault: <cmd>[:<nth>]:drop|noreply|delay=<ms>|<ntstatus>\n"
+         "                  (<cmd> is a command name or '*', <nth> counts from 1, 0=every time)\n"
+         "  -v              print each request\n");
+  exit(1);
+}
+
+static void on_signal(int sig)
+{
+  done = 1;
+}
+
+int main(int argc, char **argv)
+{
+  fakesmb_config_t cfg = { 0 };
+  fakesmb_fault_t f;
+  int port = 4450;
+  int c;
+
+  while ((c = getopt(argc, argv, "p:l:L:c:d:m:sf:v")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      if (port == 0) {
+        port = -1;
+      }
+      break;
+    case 'l':
+      cfg.latency_ms = atoi(optarg);
+      break;
+    case 'L':
+      {
+        char *eq = strchr(optarg, '=');
+        int cmd;
+        if (eq == NULL) {
+          usage();
+        }
+        *eq = '\0';
+        if ((cmd = fakesmb_cmd(optarg)) < 0) {
+          usage();
+        }
+        cfg.cmd_latency_ms[cmd] = atoi(eq + 1);
+      }
+      break;
+    case 'c':
+      cfg.credits = atoi(optarg);
+      break;
+    case 'd':
+      cfg.dialect = strtoul(optarg, NULL, 0);
+      break;
+    case 'm':
+      cfg.max_size = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      cfg.split_compound = true;
+      break;
+    case 'f':
+      if (cfg.nfaults >= FAKESMB_MAXFAULTS || fakesmb_parse_fault(optarg, &f) < 0) {
+        usage();
+      }
+      cfg.faults[cfg.nfaults++] = f;
+      break;
+    case 'v':
+      cfg.verbose = true;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+  }
+  cfg.root = argv[optind];
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  fakesmb_t *srv = fakesmb_start(&cfg, port);
+  if (srv == NULL) {
+    perror("fakesmbd");
+    return 1;
+  }
+  printf("serving %s on 127.0.0.1:%d\n", cfg.root, fakesmb_port(srv));
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  while (!done) {
+    pause();
+  }
+
+  fakesmb_stats_t st;
+  fakesmb_getstats(srv, &st);
+  fakesmb_stop(srv);
+  printf("\nconnections %u, messages %u (compound %u), faults %u, max in flight %u\n",
+         st.conns, st.msgs, st.compounds, st.faults, st.maxinflight);
+  for (int i = 0; i < FAKESMB_NCMDS; i++) {
+    if (st.reqs[i]) {
+      printf("  %-14s %u\n", fakesmb_cmdname(i), st.reqs[i]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// ホスト上でベンチマークをビルドするための<x68k/dos.h>の代替
+// (smbfsのconv.cが使う定義だけを用意する)
+
+#ifndef _BENCH_X68K_DOS_H_
+#define _BENCH_X68K_DOS_H_
+
+#include <stdint.h>
+
+struct dos_namestbuf {
+  uint8_t flag;
+  uint8_t drive;
+  char path[65];
+  char name1[8];
+  char ext[3];
+  char name2[10];
+};
+
+#define _DOSE_NOENT     -2
+#define _DOSE_NODIR     -3
+#define _DOSE_MFILE     -4
+#define _DOSE_ISDIR     -5
+#define _DOSE_BADF      -6
+#define _DOSE_NOMEM     -8
+#define _DOSE_ILGMPTR   -9
+#define _DOSE_ILGFMT    -11
+#define _DOSE_ILGARG    -12
+#define _DOSE_ILGFNAME  -13
+#define _DOSE_ILGPARM   -14
+#define _DOSE_ILGDRV    -15
+#define _DOSE_ISCURDIR  -16
+#define _DOSE_NOMORE    -18
+#define _DOSE_RDONLY    -19
+#define _DOSE_EXISTDIR  -20
+#define _DOSE_NOTEMPTY  -21
+#define _DOSE_CANTREN   -22
+#define _DOSE_DISKFULL  -23
+#define _DOSE_DIRFULL   -24
+#define _DOSE_CANTSEEK  -25
+#define _DOSE_EXISTFILE -80
+
+#endif /* _BENCH_X68K_DOS_H_ */
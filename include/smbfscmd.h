@@ -37,6 +37,15 @@
 #define SMBCMD_UNMOUNTALL   3
 #define SMBCMD_GETMOUNT     4
 #define SMBCMD_GETMEMINFO   5
+#define SMBCMD_GETSTATS     6
+#define SMBCMD_GETHISTORY   7
+#define SMBCMD_SETHISTORY   8
+#define SMBCMD_QUERYCACHE   9
+#define SMBCMD_PROFILE      10
+#define SMBCMD_GETPROCSTATS 11
+#define SMBCMD_GETCONNTIME  12
+#define SMBCMD_TRACE        13
+#define SMBCMD_WAITCHANGE   14
 
 struct smbcmd_mount {
     size_t username_len;
@@ -62,4 +71,157 @@ struct smbcmd_getmeminfo {
     size_t used_heap_size;
 };
 
+// 統計情報 (項目は末尾に追加する)
+// 呼び出し側はsizeに構造体のサイズを設定する。ドライバはsizeまでの項目を格納し、
+// sizeに格納したバイト数を返す (それより後ろの項目は古いドライバでは返らない)
+struct smbcmd_getstats {
+    uint32_t size;              // 構造体のサイズ
+    uint32_t read_hits;         // ファイルキャッシュから読めたreadの数
+    uint32_t read_misses;       // サーバから読んだreadの数
+    uint32_t hit_bytes;         // ファイルキャッシュから読んだバイト数
+    uint32_t prefetch_issued;   // 先読みしたページ数
+    uint32_t prefetch_used;     // 先読みしたページのうち読まれたページ数
+    uint32_t evicted;           // キャッシュから追い出されたページ数
+    uint32_t cache_pages;       // 現在のキャッシュページ数
+    uint32_t cache_budget;      // キャッシュページ数の上限
+    uint32_t page_size;         // キャッシュページのサイズ
+    uint32_t fast_hits;         // mutexを確保せずに処理できたDOSコールの数
+    uint32_t fast_retries;      // 処理中にキャッシュが変更されてやり直した数
+    uint32_t zcache_pages;      // 圧縮して保持しているページ数
+    uint32_t zcache_bytes;      // 圧縮したページが使っているバイト数
+    uint32_t zcache_budget;     // 圧縮したページに使うバイト数の上限 (0=圧縮しない)
+    uint32_t zstored;           // 追い出す代わりに圧縮したページ数
+    uint32_t zhits;             // 圧縮したページを展開して読んだ数
+    uint32_t zskipped;          // 圧縮できなかったページ数
+    uint32_t wb_absorbed;       // サーバに書かずに保持したwriteの数
+    uint32_t wb_flushed;        // 保持していた書き込みをサーバに書いた回数
+    uint32_t wb_pages;          // 現在書き込みを保持しているページ数
+    uint32_t stride_records;    // 一定間隔のreadを検出して先読みしたレコード数
+    uint32_t stride_backoffs;   // 間隔が変わって先読みするレコード数を減らした回数
+    uint32_t stale_hits;        // 期限切れの一覧やファイル情報をそのまま返した数
+    uint32_t revalidated;       // バックグラウンドで読み直してキャッシュに反映した数
+};
+
+struct smbcmd_history {
+    size_t buf_len;             // バッファサイズ (GETHISTORYでは必要なサイズが返る)
+    void *buf;                  // 起動履歴の保存形式データ
+};
+
+// QUERYCACHEの結果 (flags)
+#define QC_STAT             0x0001  // ファイル情報がキャッシュされている
+#define QC_NEGATIVE         0x0002  // 存在しないことがキャッシュされている
+#define QC_STAT_FRESH       0x0004  // ファイル情報のキャッシュが有効期間内
+#define QC_LISTED           0x0010  // 親ディレクトリの一覧キャッシュに含まれている
+#define QC_DIRLIST          0x0020  // ディレクトリ自身の一覧がキャッシュされている
+#define QC_DIRLIST_COMPLETE 0x0040  // ディレクトリ自身の一覧を最後まで記録済み
+#define QC_FILE             0x0100  // ページキャッシュにファイルがある
+#define QC_FILE_FRESH       0x0200  // ファイルサイズの確認が有効期間内
+#define QC_PINNED           0x0400  // 開いているFCBがあるため追い出されてもファイルは残る
+
+// QUERYCACHEで返すページの情報 (flags)
+#define QCP_REF             0x01    // 最近読まれた
+#define QCP_PREFETCHED      0x02    // 先読みされてまだ読まれていない
+#define QCP_COMPRESSED      0x04    // 圧縮して保持されている
+
+struct smbcmd_qcpage {
+    uint32_t pageno;            // ページ番号 (オフセット/page_size)
+    uint32_t age;               // ページを読み込んでからの経過時間 (1/100秒)
+    uint16_t len;               // 有効なデータ長
+    uint8_t flags;              // QCP_*
+    uint8_t reserved;
+};
+
+struct smbcmd_querycache {
+    char *path;                 // 調べるパス名 (ドライブ名を除くSJISのフルパス)
+    uint32_t flags;             // QC_*
+    uint32_t ttl;               // キャッシュの有効期間 (1/100秒)
+    uint32_t page_size;         // キャッシュページのサイズ
+    uint8_t stat_atr;           // キャッシュされているファイル属性
+    uint32_t stat_age;          // ファイル情報を記録してからの経過時間 (1/100秒)
+    uint32_t dir_age;           // ディレクトリ一覧を記録してからの経過時間 (1/100秒)
+    uint32_t dir_nent;          // ディレクトリ一覧のエントリ数
+    uint32_t file_age;          // ファイルサイズを確認してからの経過時間 (1/100秒)
+    uint32_t file_size;         // ファイルサイズ
+    uint32_t file_refs;         // ファイルを開いているFCBの数
+    uint32_t npages;            // キャッシュされているページ数
+    size_t pages_len;           // pagesの要素数 (先頭からnpages個までを格納する)
+    struct smbcmd_qcpage *pages;
+};
+
+// PROFILEのサブコマンド
+#define PROFCMD_START       1       // 計測を開始する (記録済みのサンプルは消去する)
+#define PROFCMD_STOP        2       // 計測を終了する
+#define PROFCMD_GET         3       // 記録したサンプルを保存形式で得る
+
+struct smbcmd_profile {
+    int cmd;                    // PROFCMD_*
+    size_t buf_len;             // バッファサイズ (PROFCMD_GETでは必要なサイズが返る)
+    void *buf;                  // サンプルの保存形式データ
+};
+
+// プロセスごとの統計情報
+struct smbcmd_procstat {
+    uint32_t psp;               // プロセスのメモリ管理ポインタ
+    char name[24];              // 実行ファイル名
+    uint32_t requests;          // DOSコールの数
+    uint32_t bytes;             // read/writeしたバイト数
+    uint32_t time;              // ドライバ内で処理にかかった時間 (1/100秒)
+    uint32_t age;               // 最後のDOSコールからの経過時間 (1/100秒)
+};
+
+struct smbcmd_getprocstats {
+    size_t procs_len;           // procsの要素数
+    uint32_t nprocs;            // 記録しているプロセス数 (先頭からprocs_len個までを格納する)
+    struct smbcmd_procstat *procs;
+};
+
+// TRACEのサブコマンド
+#define TRACECMD_START      1       // 記録を開始する (記録済みのトレースは消去する)
+#define TRACECMD_STOP       2       // 記録を終了する
+#define TRACECMD_GET        3       // 記録したトレースを保存形式で得る
+#define TRACECMD_CLEAR      4       // 記録したトレースを消去してメモリを解放する
+
+struct smbcmd_trace {
+    int cmd;                    // TRACECMD_*
+    uint32_t nrec;              // 記録するDOSコール数 (TRACECMD_START)
+    size_t buf_len;             // バッファサイズ (TRACECMD_GETでは必要なサイズが返る)
+    void *buf;                  // トレースの保存形式データ
+};
+
+// WAITCHANGEのサブコマンド
+#define WCCMD_REGISTER      1       // ディレクトリの監視を登録する
+#define WCCMD_WAIT          2       // 変更が通知されるまで待つ
+#define WCCMD_CANCEL        3       // 監視を解除する
+
+// WAITCHANGEで監視する変更 (SMB2 CHANGE_NOTIFYのCompletionFilterと同じ値)
+#define WCF_FILE_NAME       0x0001  // ファイルの作成、削除、名前の変更
+#define WCF_DIR_NAME        0x0002  // ディレクトリの作成、削除、名前の変更
+#define WCF_ATTRIBUTES      0x0004  // 属性の変更
+#define WCF_SIZE            0x0008  // ファイルサイズの変更
+#define WCF_LAST_WRITE      0x0010  // 更新日時の変更
+#define WCF_DEFAULT         (WCF_FILE_NAME|WCF_DIR_NAME|WCF_SIZE|WCF_LAST_WRITE)
+
+struct smbcmd_waitchange {
+    int cmd;                    // WCCMD_*
+    int id;                     // 監視ID (WCCMD_REGISTERで返る)
+    char *path;                 // 監視するディレクトリ (WCCMD_REGISTER)
+    uint32_t filter;            // 監視する変更 WCF_* (0ならWCF_DEFAULT)
+    uint32_t subtree;           // 0以外ならサブディレクトリ以下も監視する
+    uint32_t timeout;           // 待つ時間 (1/100秒, 0なら待たずに調べる, 最大60秒)
+    uint32_t changes;           // 前回のWCCMD_WAITから通知された変更の数
+};
+
+// 接続処理の段階
+#define CONNPHASE_TCP       0       // TCP接続
+#define CONNPHASE_NEGOTIATE 1       // negotiate
+#define CONNPHASE_SESSION   2       // session setup (認証) と tree connect
+#define CONNPHASE_TOTAL     3       // 接続処理全体
+
+struct smbcmd_conntime {
+    uint16_t dialect;           // 使用しているSMBのバージョン (0x0202, 0x0210, 0x0300, 0x0302, 0x0311)
+    uint16_t reserved;
+    uint32_t time[4];           // 各段階の所要時間 (1/100秒, CONNPHASE_*)
+    uint32_t cpu[4];            // 各段階でlibsmb2の処理にかかった時間 (1/100秒, CONNPHASE_*)
+};
+
 #endif /* _SMBFSCMD_H_ */
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sjispath.h"
+
+//****************************************************************************
+// SJIS path utilities
+//****************************************************************************
+
+// Get the byte length of the first SJIS character at the given position
+int sjis_char_len(const char *s)
+{
+  unsigned char c = (unsigned char)*s;
+  
+  if (c == 0) return 0;  // End of string
+  
+  // SJIS first byte ranges:
+  // 0x81-0x9F, 0xE0-0xFC are double-byte characters
+  if ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC)) {
+    return 2;  // Double-byte character
+  }
+  
+  return 1;  // Single-byte character (ASCII or half-width katakana)
+}
+
+// Compare SJIS characters (returns the length if equal, 0 if not equal)
+int sjis_chars_equal(const char *s1, const char *s2)
+{
+  int len1 = sjis_char_len(s1);
+  int len2 = sjis_char_len(s2);
+  
+  if (len1 != len2) return 0;
+  
+  if (len1 == 1 && tolower(*s1) == tolower(*s2)) {
+    return 1; // case insensitive match for single-byte characters
+  }
+
+  for (int i = 0; i < len1; i++) {
+    if (s1[i] != s2[i]) return 0;
+  }
+  
+  return len1;
+}
+
+// SJIS aware wildcard matching function
+int match_wildcard(const char *pattern, const char *string)
+{
+  const char *p = pattern;
+  const char *s = string;
+  const char *star = NULL;
+  const char *ss = s;
+  int len;
+
+  if (strlen(pattern) == 0) {
+    return 1;
+  }
+
+  while (*s) {
+    if (*p == '?') {
+      // '?' matches any single SJIS character
+      p++;
+      s += sjis_char_len(s);
+    } else if (*p == '*') {
+      // '*' matches any sequence of characters
+      star = p++;
+      ss = s;
+    } else if ((len = sjis_chars_equal(p, s))) {
+      // SJIS characters match
+      p += len;
+      s += len;
+    } else if (star) {
+      // No match, but we have a '*' to backtrack to
+      p = star + 1;
+      ss += sjis_char_len(ss);
+      s = ss;
+    } else {
+      // No match and no '*' to backtrack to
+      return 0;
+    }
+  }
+
+  // Skip any trailing '*' in pattern
+  while (*p == '*') {
+    p++;
+  }
+
+  // If we've consumed all of pattern, it's a match
+  return *p == '\0';
+}
+
+//----------------------------------------------------------------------------
+
+// Convert backslashes to forward slashes in SJIS path
+void convert_path_separator(char *sjis_path)
+{
+  char *p = sjis_path;
+
+  if (sjis_path == NULL) return;
+
+  while (*p) {
+    int char_len = sjis_char_len(p);
+    if (char_len == 1 && *p == '\\') {
+      // Convert backslash to forward slash
+      *p = '/';
+      p++;
+    } else {
+      // Skip SJIS character
+      p += char_len;
+    }
+  }
+}
+
+// Path normalization
+void normalize_path(char *path)
+{
+  char *p = path;
+  if (*p == '/') {
+    p++; // Skip leading slash for processing
+  }
+  char *q = p;
+  char *r = q;
+  while (*p != '\0') {
+    while (*p == '/') {
+      p++;  // Skip multiple slashes
+    }
+    if (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) {
+      // Current directory - skip
+      p += 1 + (p[1] == '/' ? 1 : 0);
+    } else if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+      // Parent directory - remove last segment if exists
+      while (q > r && --q > r && *(q - 1) != '/') {
+        // Move q back to previous slash
+      }
+      p += 2 + (p[2] == '/' ? 1 : 0);
+    } else {
+      // Regular segment
+      char *next_slash = strchr(p, '/');
+      if (next_slash) {
+        memcpy(q, p, next_slash - p + 1);
+        q += next_slash - p + 1;
+        p = next_slash + 1;
+      } else {
+        strcpy(q, p);
+        return;
+      }
+    }
+  }
+  *q = '\0';  // Null terminate the result
+}
@@ -39,7 +39,7 @@
 #include <setjmp.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
-#include <pthread.h>
+#include <sys/select.h>
 #include <x68k/dos.h>
 #include <x68k/iocs.h>
 
@@ -49,6 +49,8 @@
 #include <libsmb2-private.h>
 #include <iconv_mini.h>
 
+#include "sjispath.h"
+
 //****************************************************************************
 // Macros and definitions
 //****************************************************************************
@@ -61,6 +63,19 @@
 #define CMD_ERROR   -1
 #define CMD_HELP    -2
 
+/* event loop */
+#define POLLIN      0x0001
+#define POLLOUT     0x0004
+
+#define EVL_MAXCONN     2       // イベントループで扱う接続数
+#define EVL_MAXTIMER    4       // イベントループで扱うタイマー数
+#define KEEPALIVE_INTERVAL  30000   // keepalive送信間隔 (ms)
+#define KEEPALIVE_TIMEOUT   10000   // keepaliveの応答を待つ時間 (ms)
+
+/* server-to-server transfer */
+#define XFER_SLOTS      4       // xferで同時に読み書きするブロック数
+#define XFER_BLOCK      16384   // xferで1回に読み書きする最大サイズ
+
 //****************************************************************************
 // Global variables
 //****************************************************************************
@@ -74,8 +89,19 @@ static jmp_buf jmp_env;
 static char current_dir[PATH_LEN] = "/";
 static int is_finished = false;
 
-static pthread_t keepalive_thread;
-static pthread_mutex_t keepalive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct smb2_context *smb2_2nd;                 // open2で接続した転送先
+static char url_2nd[PATH_LEN];                        // 転送先のURL
+static char dir_2nd[PATH_LEN] = "/";                  // 転送先の基準ディレクトリ
+
+static struct smb2_context *evl_conn[EVL_MAXCONN];   // イベントループで待つ接続
+static bool conn_lost;                                // keepaliveの応答がなく接続が切れたとみなした
+
+static struct evl_timer {
+  uint32_t interval;                    // 呼び出し間隔 (ms) 0=未使用
+  uint32_t expire;                      // 次回の呼び出し時刻 (ms)
+  void (*func)(void *arg);
+  void *arg;
+} evl_timer[EVL_MAXTIMER];
 
 static const struct cmd_table {
   const char *name;
@@ -85,6 +111,12 @@ static const struct cmd_table {
   const char *usage;
 } cmd_table[];
 
+static uint32_t evl_now(void);
+static void evl_add_conn(struct smb2_context *smb2);
+static void evl_remove_conn(struct smb2_context *smb2);
+static int evl_run(int *done, uint32_t timeout);
+static char* normalize_smb_url(const char *input_url);
+
 //****************************************************************************
 // Utility routine
 //****************************************************************************
@@ -172,89 +204,6 @@ static struct cmd_table *find_command(const char *name)
 
 //----------------------------------------------------------------------------
 
-// Get the byte length of the first SJIS character at the given position
-static int sjis_char_len(const char *s)
-{
-  unsigned char c = (unsigned char)*s;
-  
-  if (c == 0) return 0;  // End of string
-  
-  // SJIS first byte ranges:
-  // 0x81-0x9F, 0xE0-0xFC are double-byte characters
-  if ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC)) {
-    return 2;  // Double-byte character
-  }
-  
-  return 1;  // Single-byte character (ASCII or half-width katakana)
-}
-
-// Compare SJIS characters (returns the length if equal, 0 if not equal)
-static int sjis_chars_equal(const char *s1, const char *s2)
-{
-  int len1 = sjis_char_len(s1);
-  int len2 = sjis_char_len(s2);
-  
-  if (len1 != len2) return 0;
-  
-  if (len1 == 1 && tolower(*s1) == tolower(*s2)) {
-    return 1; // case insensitive match for single-byte characters
-  }
-
-  for (int i = 0; i < len1; i++) {
-    if (s1[i] != s2[i]) return 0;
-  }
-  
-  return len1;
-}
-
-// SJIS aware wildcard matching function
-static int match_wildcard(const char *pattern, const char *string)
-{
-  const char *p = pattern;
-  const char *s = string;
-  const char *star = NULL;
-  const char *ss = s;
-  int len;
-
-  if (strlen(pattern) == 0) {
-    return 1;
-  }
-
-  while (*s) {
-    if (*p == '?') {
-      // '?' matches any single SJIS character
-      p++;
-      s += sjis_char_len(s);
-    } else if (*p == '*') {
-      // '*' matches any sequence of characters
-      star = p++;
-      ss = s;
-    } else if ((len = sjis_chars_equal(p, s))) {
-      // SJIS characters match
-      p += len;
-      s += len;
-    } else if (star) {
-      // No match, but we have a '*' to backtrack to
-      p = star + 1;
-      ss += sjis_char_len(ss);
-      s = ss;
-    } else {
-      // No match and no '*' to backtrack to
-      return 0;
-    }
-  }
-
-  // Skip any trailing '*' in pattern
-  while (*p == '*') {
-    p++;
-  }
-
-  // If we've consumed all of pattern, it's a match
-  return *p == '\0';
-}
-
-//----------------------------------------------------------------------------
-
 // SJIS -> UTF-8 conversion
 static char* sjis_to_utf8(const char *sjis_str)
 {
@@ -301,79 +250,33 @@ static char* utf8_to_sjis(const char *utf8_str)
 
 //----------------------------------------------------------------------------
 
-// Convert backslashes to forward slashes in SJIS path
-static void convert_path_separator(char *sjis_path)
-{
-  char *p = sjis_path;
-
-  if (sjis_path == NULL) return;
-
-  while (*p) {
-    int char_len = sjis_char_len(p);
-    if (char_len == 1 && *p == '\\') {
-      // Convert backslash to forward slash
-      *p = '/';
-      p++;
-    } else {
-      // Skip SJIS character
-      p += char_len;
-    }
-  }
-}
-
-// Path normalization
-static void normalize_path(char *path)
-{
-  char *p = path;
-  if (*p == '/') {
-    p++; // Skip leading slash for processing
-  }
-  char *q = p;
-  char *r = q;
-  while (*p != '\0') {
-    while (*p == '/') {
-      p++;  // Skip multiple slashes
-    }
-    if (p[0] == '.' && (p[1] == '/' || p[1] == '\0')) {
-      // Current directory - skip
-      p += 1 + (p[1] == '/' ? 1 : 0);
-    } else if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
-      // Parent directory - remove last segment if exists
-      while (q > r && --q > r && *(q - 1) != '/') {
-        // Move q back to previous slash
-      }
-      p += 2 + (p[2] == '/' ? 1 : 0);
-    } else {
-      // Regular segment
-      char *next_slash = strchr(p, '/');
-      if (next_slash) {
-        memcpy(q, p, next_slash - p + 1);
-        q += next_slash - p + 1;
-        p = next_slash + 1;
-      } else {
-        strcpy(q, p);
-        return;
-      }
-    }
-  }
-  *q = '\0';  // Null terminate the result
-}
-
-static char* resolve_path(const char *path)
+static void join_path(char *resolved, const char *dir, const char *path)
 {
-  static char resolved[PATH_LEN];
-  
   if (path[0] == '/') {
     // Absolute path
     strcpy(resolved, path);
   } else {
-    // Relative path - append to current directory
-    strcpy(resolved, current_dir);
+    // Relative path - append to the base directory
+    strcpy(resolved, dir);
     strncat(resolved, "/", PATH_LEN - strlen(resolved) - 1);
     strncat(resolved, path, PATH_LEN - strlen(resolved) - 1);
   }
   
   normalize_path(resolved);
+}
+
+static char* resolve_path(const char *path)
+{
+  static char resolved[PATH_LEN];
+  join_path(resolved, current_dir, path);
+  return resolved;
+}
+
+// Resolve a path on the second connection (relative to the path in its URL)
+static char* resolve_path_2nd(const char *path)
+{
+  static char resolved[PATH_LEN];
+  join_path(resolved, dir_2nd, path);
   return resolved;
 }
 
@@ -1233,6 +1136,334 @@ static int cmd_mput(struct smb2_context *smb2, const char *local_path, const cha
 
 //----------------------------------------------------------------------------
 
+static void close_2nd(void)
+{
+  if (smb2_2nd) {
+    evl_remove_conn(smb2_2nd);
+    smb2_disconnect_share(smb2_2nd);
+    smb2_destroy_context(smb2_2nd);
+    smb2_2nd = NULL;
+  }
+}
+
+static int cmd_open2(struct smb2_context *smb2, const char *url_str)
+{
+  struct smb2_context *smb2b;
+  struct smb2_url *url;
+
+  if (url_str == NULL || strlen(url_str) == 0) {
+    if (smb2_2nd) {
+      printf("転送先: %s\n", url_2nd);
+    } else {
+      printf("転送先に接続していません\n");
+    }
+    return CMD_DONE;
+  }
+
+  close_2nd();
+
+  smb2b = smb2_init_context();
+  if (smb2b == NULL) {
+    printf("Failed to init context\n");
+    return CMD_ERROR;
+  }
+  char *normalized_url = normalize_smb_url(url_str);
+  url = smb2_parse_url(smb2b, sjis_to_utf8(normalized_url));
+  if (url == NULL) {
+    printf("URL 指定に誤りがあります: %s\n", smb2_get_error(smb2b));
+    smb2_destroy_context(smb2b);
+    return CMD_ERROR;
+  }
+
+  // URLにユーザ名がなければ最初の接続と同じユーザ名とパスワードを使う
+  smb2_set_user(smb2b, url->user ? url->user : smb2->user);
+  if (smb2->password) {
+    smb2_set_password(smb2b, smb2->password);
+  }
+  smb2_set_security_mode(smb2b, SMB2_NEGOTIATE_SIGNING_ENABLED);
+  if (smb2_connect_share(smb2b, url->server, url->share, NULL) != 0) {
+    printf("転送先のファイル共有サーバへの接続に失敗しました: %s\n", smb2_get_error(smb2b));
+    smb2_destroy_url(url);
+    smb2_destroy_context(smb2b);
+    return CMD_ERROR;
+  }
+
+  strcpy(dir_2nd, "/");
+  if (url->path && strlen(url->path) > 0) {
+    strncat(dir_2nd, utf8_to_sjis(url->path), sizeof(dir_2nd) - 2);
+    normalize_path(dir_2nd);
+  }
+  smb2_destroy_url(url);
+  strcpy(url_2nd, normalized_url);
+
+  smb2_2nd = smb2b;
+  evl_add_conn(smb2_2nd);
+  printf("転送先 %s に接続しました\n", url_2nd);
+  return CMD_DONE;
+}
+
+static int cmd_close2(struct smb2_context *smb2, const char *arg)
+{
+  if (smb2_2nd == NULL) {
+    printf("転送先に接続していません\n");
+    return CMD_ERROR;
+  }
+  close_2nd();
+  printf("転送先との接続を切断しました\n");
+  return CMD_DONE;
+}
+
+//----------------------------------------------------------------------------
+
+// サーバ間の転送
+// 転送元からの読み出しと転送先への書き込みをブロック単位で並行して発行し、
+// 読み出したブロックはそのまま書き込んで、書き終えたバッファで次のブロックを読む
+struct xfer {
+  struct smb2_context *src, *dst;
+  struct smb2fh *sfh, *dfh;
+  uint64_t size;                        // 転送するサイズ
+  uint64_t next;                        // 次に読み出すオフセット
+  uint64_t written;                     // 書き込みを終えたバイト数
+  uint32_t block;                       // 1回に読み書きするサイズ
+  int inflight;                         // 応答待ちの要求数
+  int error;                            // 最初に発生したエラー (0=なし)
+  struct smb2_context *errconn;         // エラーが発生した接続
+  int done;
+  struct xfer_slot {
+    struct xfer *x;
+    uint8_t *buf;
+    uint64_t offset;                    // ブロックのオフセット
+    uint32_t len;                       // 読み出したバイト数
+    uint32_t pos;                       // 書き込みを終えたバイト数
+  } slot[XFER_SLOTS];
+};
+
+static void xfer_read_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *private_data);
+static void xfer_write_cb(struct smb2_context *smb2, int status,
+                          void *command_data, void *private_data);
+
+static void xfer_fail(struct xfer *x, struct smb2_context *smb2, int status)
+{
+  if (x->error == 0) {
+    x->error = status;
+    x->errconn = smb2;
+  }
+}
+
+// 応答待ちの要求がなくなったら転送を終える
+static void xfer_check_done(struct xfer *x)
+{
+  if (x->inflight == 0) {
+    x->done = true;
+  }
+}
+
+static void xfer_read(struct xfer_slot *sl)
+{
+  struct xfer *x = sl->x;
+  if (x->error || x->next >= x->size) {
+    return;
+  }
+  sl->offset = x->next;
+  sl->len = x->size - x->next < x->block ? x->size - x->next : x->block;
+  sl->pos = 0;
+  x->next += sl->len;
+  if (smb2_pread_async(x->src, x->sfh, sl->buf, sl->len, sl->offset, xfer_read_cb, sl) < 0) {
+    xfer_fail(x, x->src, -EIO);
+    return;
+  }
+  x->inflight++;
+}
+
+static void xfer_write(struct xfer_slot *sl)
+{
+  struct xfer *x = sl->x;
+  if (smb2_pwrite_async(x->dst, x->dfh, sl->buf + sl->pos, sl->len - sl->pos,
+                        sl->offset + sl->pos, xfer_write_cb, sl) < 0) {
+    xfer_fail(x, x->dst, -EIO);
+    return;
+  }
+  x->inflight++;
+}
+
+static void xfer_read_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *private_data)
+{
+  struct xfer_slot *sl = private_data;
+  struct xfer *x = sl->x;
+
+  x->inflight--;
+  if (status < 0) {
+    xfer_fail(x, smb2, status);
+  } else if (!x->error && status > 0) {
+    if (status < sl->len) {
+      // 転送中にファイルが短くなった場合はそこまでを転送する
+      sl->len = status;
+      if (x->size > sl->offset + status) {
+        x->size = sl->offset + status;
+      }
+    }
+    xfer_write(sl);
+  }
+  xfer_check_done(x);
+}
+
+static void xfer_write_cb(struct smb2_context *smb2, int status,
+                          void *command_data, void *private_data)
+{
+  struct xfer_slot *sl = private_data;
+  struct xfer *x = sl->x;
+
+  x->inflight--;
+  if (status < 0) {
+    xfer_fail(x, smb2, status);
+  } else if (status == 0) {
+    xfer_fail(x, smb2, -ENOSPC);
+  } else if (!x->error) {
+    sl->pos += status;
+    x->written += status;
+    if (sl->pos < sl->len) {
+      xfer_write(sl);           // 書き込めなかった残りを書き込む
+    } else {
+      xfer_read(sl);
+    }
+  }
+  xfer_check_done(x);
+}
+
+static int xfer_one_file(struct smb2_context *smb2, const char *target_src, const char *target_dst)
+{
+  struct xfer *x;
+  struct smb2_stat_64 st;
+  char dst_utf8[PATH_LEN];
+  int res = CMD_DONE;
+
+  if ((x = calloc(1, sizeof(*x))) == NULL) {
+    printf("メモリが不足しています\n");
+    return CMD_ERROR;
+  }
+  x->src = smb2;
+  x->dst = smb2_2nd;
+
+  x->sfh = smb2_open(x->src, sjis_to_utf8(target_src + 1), O_RDONLY);
+  if (x->sfh == NULL) {
+    printf("リモートファイル '%s' を開けません: %s\n", target_src, smb2_get_error(x->src));
+    free(x);
+    return CMD_ERROR;
+  }
+  if (smb2_fstat(x->src, x->sfh, &st) < 0) {
+    printf("リモートファイル '%s' の情報を取得できません: %s\n", target_src, smb2_get_error(x->src));
+    smb2_close(x->src, x->sfh);
+    free(x);
+    return CMD_ERROR;
+  }
+  strncpy(dst_utf8, sjis_to_utf8(target_dst + 1), sizeof(dst_utf8) - 1);
+  dst_utf8[sizeof(dst_utf8) - 1] = '\0';
+  x->dfh = smb2_open(x->dst, dst_utf8, O_WRONLY | O_CREAT | O_TRUNC);
+  if (x->dfh == NULL) {
+    printf("転送先のファイル '%s' を作成できません: %s\n", target_dst, smb2_get_error(x->dst));
+    smb2_close(x->src, x->sfh);
+    free(x);
+    return CMD_ERROR;
+  }
+
+  // ブロックの大きさは両方のサーバが1回で扱えるサイズに合わせる
+  x->size = st.smb2_size;
+  x->block = XFER_BLOCK;
+  if (smb2_get_max_read_size(x->src) < x->block) {
+    x->block = smb2_get_max_read_size(x->src);
+  }
+  if (smb2_get_max_write_size(x->dst) < x->block) {
+    x->block = smb2_get_max_write_size(x->dst);
+  }
+  uint8_t *ring = malloc(x->block * XFER_SLOTS);
+  if (ring == NULL) {
+    printf("メモリが不足しています\n");
+    smb2_close(x->dst, x->dfh);
+    smb2_close(x->src, x->sfh);
+    free(x);
+    return CMD_ERROR;
+  }
+
+  printf("ファイル '%s' を転送先の '%s' に転送します\n", target_src, target_dst);
+
+  uint32_t start = evl_now();
+  for (int i = 0; i < XFER_SLOTS; i++) {
+    x->slot[i].x = x;
+    x->slot[i].buf = ring + i * x->block;
+    xfer_read(&x->slot[i]);
+  }
+  xfer_check_done(x);
+  if (evl_run(&x->done, 0) < 0) {
+    xfer_fail(x, NULL, -EIO);
+  }
+  uint32_t elapsed = evl_now() - start;
+
+  if (x->error || x->written < x->size) {
+    printf("ファイルを転送できません: %s\n",
+           x->errconn ? smb2_get_error(x->errconn) : strerror(-x->error));
+    res = CMD_ERROR;
+  } else {
+    struct smb2_timeval tv[2];
+    tv[0].tv_sec = st.smb2_atime;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = st.smb2_mtime;
+    tv[1].tv_usec = 0;
+    smb2_futimes(x->dst, x->dfh, tv);
+    printf("%u バイトを %u.%02u 秒で転送しました (%u KB/s)\n",
+           (unsigned int)x->written, elapsed / 1000, (elapsed % 1000) / 10,
+           elapsed ? (unsigned int)(x->written * 1000 / 1024 / elapsed) : 0);
+  }
+
+  // 読み書きが途中で止まった場合は応答を待っている要求がバッファを参照しているので解放しない
+  bool drained = (x->inflight == 0);
+  smb2_close(x->dst, x->dfh);
+  smb2_close(x->src, x->sfh);
+  if (drained) {
+    free(ring);
+    free(x);
+  }
+  return res;
+}
+
+static int cmd_xfer(struct smb2_context *smb2, const char *src_path, const char *dst_path)
+{
+  char target_src[PATH_LEN];
+  char target_dst[PATH_LEN];
+  struct smb2_stat_64 st;
+
+  if (src_path == NULL || strlen(src_path) == 0) {
+    return CMD_HELP;
+  }
+  if (smb2_2nd == NULL) {
+    printf("転送先に接続していません (open2 で接続してください)\n");
+    return CMD_ERROR;
+  }
+
+  strcpy(target_src, resolve_path(src_path));
+  const char *filename = strrchr(target_src, '/') + 1;
+  if (smb2_stat(smb2, sjis_to_utf8(target_src + 1), &st) == 0 &&
+      st.smb2_type == SMB2_TYPE_DIRECTORY) {
+    printf("'%s' はディレクトリです\n", target_src);
+    return CMD_ERROR;
+  }
+
+  // 転送先がディレクトリならその下に同じファイル名で転送する
+  strcpy(target_dst, resolve_path_2nd(dst_path && strlen(dst_path) > 0 ? dst_path : filename));
+  if (smb2_stat(smb2_2nd, sjis_to_utf8(target_dst + 1), &st) == 0 &&
+      st.smb2_type == SMB2_TYPE_DIRECTORY) {
+    if (strcmp(target_dst, "/") != 0) {
+      strncat(target_dst, "/", sizeof(target_dst) - strlen(target_dst) - 1);
+    }
+    strncat(target_dst, filename, sizeof(target_dst) - strlen(target_dst) - 1);
+  }
+
+  return xfer_one_file(smb2, target_src, target_dst);
+}
+
+//----------------------------------------------------------------------------
+
 static int cmd_help(struct smb2_context *smb2, const char *command)
 {
   struct cmd_table *cmd;
@@ -1270,6 +1501,9 @@ static const struct cmd_table cmd_table[] = {
   {"mget",        cmd_mget,    2, "<remote_path> [local_path]", "複数リモートファイルのダウンロード"},
   {"put",         cmd_put,     2, "<local_path> [remote_path]", "ローカルファイルのアップロード"},
   {"mput",        cmd_mput,    2, "<local_path> [remote_path]", "複数ローカルファイルのアップロード"},
+  {"open2",       cmd_open2,   1, "[smb2-url]",                 "転送先のファイル共有への接続/表示"},
+  {"close2",      cmd_close2,  0, "",                           "転送先のファイル共有との接続の切断"},
+  {"xfer",        cmd_xfer,    2, "<remote_path> [dest_path]",  "転送先のファイル共有へのファイル転送"},
   {"quit|exit",   NULL,        0, "",                           "プログラムの終了"},
   {"help",        cmd_help,    0, "[command]",                  "ヘルプの表示"},
   {NULL,          NULL,        0, NULL,                         NULL}
@@ -1362,6 +1596,162 @@ static int execute_command_string(struct smb2_context *smb2, const char *command
   return result;
 }
 
+//****************************************************************************
+// Event loop
+//****************************************************************************
+
+// 単調増加する時刻 (ms) を得る
+// (clock()はCPU時間なので、select()で待っている間は進まない。IOCS _ONTIMEの起動からの経過時間を使う)
+static uint32_t evl_now(void)
+{
+  static uint32_t last;
+  static uint32_t base;
+  uint32_t now = _iocs_ontime();        // 1/100秒単位で、日付が変わると0に戻る
+  if (now < last) {
+    base += 24 * 60 * 60 * 100;
+  }
+  last = now;
+  return (base + now) * 10;
+}
+
+static void evl_add_conn(struct smb2_context *smb2)
+{
+  for (int i = 0; i < EVL_MAXCONN; i++) {
+    if (evl_conn[i] == NULL) {
+      evl_conn[i] = smb2;
+      return;
+    }
+  }
+}
+
+static void evl_remove_conn(struct smb2_context *smb2)
+{
+  for (int i = 0; i < EVL_MAXCONN; i++) {
+    if (evl_conn[i] == smb2) {
+      evl_conn[i] = NULL;
+    }
+  }
+}
+
+static int evl_add_timer(uint32_t interval, void (*func)(void *), void *arg)
+{
+  for (int i = 0; i < EVL_MAXTIMER; i++) {
+    if (evl_timer[i].interval == 0) {
+      evl_timer[i].interval = interval;
+      evl_timer[i].expire = evl_now() + interval;
+      evl_timer[i].func = func;
+      evl_timer[i].arg = arg;
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void evl_remove_timer(int id)
+{
+  if (id >= 0 && id < EVL_MAXTIMER) {
+    evl_timer[id].interval = 0;
+  }
+}
+
+// Wait for network events or timers for at most timeout ms and dispatch them
+static int evl_wait(uint32_t timeout)
+{
+  uint32_t now = evl_now();
+  fd_set rfds, wfds;
+  int maxfd = -1;
+
+  // 次のタイマー満了までの時間を待ち時間の上限にする
+  for (int i = 0; i < EVL_MAXTIMER; i++) {
+    if (evl_timer[i].interval != 0) {
+      int32_t t = (int32_t)(evl_timer[i].expire - now);
+      if (t < 0) {
+        t = 0;
+      }
+      if ((uint32_t)t < timeout) {
+        timeout = t;
+      }
+    }
+  }
+
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  for (int i = 0; i < EVL_MAXCONN; i++) {
+    if (evl_conn[i] == NULL) {
+      continue;
+    }
+    int fd = smb2_get_fd(evl_conn[i]);
+    if (fd < 0) {
+      continue;
+    }
+    int events = smb2_which_events(evl_conn[i]);
+    if (events & POLLIN) {
+      FD_SET(fd, &rfds);
+    }
+    if (events & POLLOUT) {
+      FD_SET(fd, &wfds);
+    }
+    if (fd > maxfd) {
+      maxfd = fd;
+    }
+  }
+
+  struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+  int n = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+  if (n < 0 && errno != EINTR) {
+    return -EIO;
+  }
+
+  // 応答待ちの処理のタイムアウトもsmb2_service()で処理されるため、イベントがなくても呼ぶ
+  for (int i = 0; i < EVL_MAXCONN; i++) {
+    if (evl_conn[i] == NULL) {
+      continue;
+    }
+    int fd = smb2_get_fd(evl_conn[i]);
+    int revents = 0;
+    if (n > 0 && fd >= 0) {
+      revents |= FD_ISSET(fd, &rfds) ? POLLIN : 0;
+      revents |= FD_ISSET(fd, &wfds) ? POLLOUT : 0;
+    }
+    if (smb2_service(evl_conn[i], revents) < 0) {
+      return -EIO;
+    }
+  }
+
+  now = evl_now();
+  for (int i = 0; i < EVL_MAXTIMER; i++) {
+    if (evl_timer[i].interval != 0 && (int32_t)(evl_timer[i].expire - now) <= 0) {
+      evl_timer[i].expire = now + evl_timer[i].interval;
+      evl_timer[i].func(evl_timer[i].arg);
+    }
+  }
+  return 0;
+}
+
+// Run the event loop until *done becomes true or timeout ms elapse (0=no timeout)
+static int evl_run(int *done, uint32_t timeout)
+{
+  uint32_t start = evl_now();
+
+  while (!*done) {
+    uint32_t wait = 1000;
+    if (timeout != 0) {
+      uint32_t elapsed = evl_now() - start;
+      if (elapsed >= timeout) {
+        return -ETIMEDOUT;
+      }
+      if (timeout - elapsed < wait) {
+        wait = timeout - elapsed;
+      }
+    }
+    int res = evl_wait(wait);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
 //****************************************************************************
 // Share enumeration
 //****************************************************************************
@@ -1416,9 +1806,6 @@ static void share_enum_cb(struct smb2_context *smb2, int status,
   is_finished = true;
 }
 
-#define POLLIN      0x0001
-#define POLLOUT     0x0004
-
 static int list_shares(struct smb2_context *smb2, const char *server, const char *user)
 {
   int ret = 0;
@@ -1439,37 +1826,80 @@ static int list_shares(struct smb2_context *smb2, const char *server, const char
     return 1;
   }
 
-  // Simple event loop
-  while (!is_finished) {
-    int revents = smb2_which_events(smb2) == POLLIN ? POLLIN : POLLOUT;
-    // Simple polling mechanism - just service the connection
-    if (smb2_service(smb2, revents) < 0) {
-      printf("smb2_service failed: %s\n", smb2_get_error(smb2));
-      ret = 1;
-      break;
-    }
+  // Wait for the reply without spinning on the connection
+  evl_add_conn(smb2);
+  int res = evl_run(&is_finished, 30000);
+  if (res == -ETIMEDOUT) {
+    printf("ファイル共有一覧の取得がタイムアウトしました\n");
+    ret = 1;
+  } else if (res < 0) {
+    printf("smb2_service failed: %s\n", smb2_get_error(smb2));
+    ret = 1;
   }
+  evl_remove_conn(smb2);
 
   smb2_disconnect_share(smb2);
   return ret;
 }
 
 //****************************************************************************
-// Keepalive thread
+// Keepalive timer
 //****************************************************************************
 
-__attribute__((noreturn))
-static void* keepalive_thread_func(void *arg)
+static int keepalive_pending = 0;        // 応答を待っているechoの数
+static uint32_t keepalive_sent;         // echoを送った時刻 (ms)
+
+static void keepalive_cb(struct smb2_context *smb2, int status,
+                         void *command_data, void *private_data)
+{
+  keepalive_pending--;
+  if (status != SMB2_STATUS_SUCCESS) {
+    conn_lost = true;
+  }
+}
+
+static void keepalive_timer_func(void *arg)
 {
   struct smb2_context *smb2 = (struct smb2_context *)arg;
 
-  pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-  while (1) {
-    sleep(30);
-    pthread_mutex_lock(&keepalive_mutex);
-    smb2_echo(smb2);
-    pthread_mutex_unlock(&keepalive_mutex);
+  // 前回のechoの応答が返ってきていなければ重ねて送らない
+  if (keepalive_pending == 0) {
+    if (smb2_echo_async(smb2, keepalive_cb, NULL) == 0) {
+      keepalive_pending++;
+      keepalive_sent = evl_now();
+    } else {
+      conn_lost = true;
+    }
+  }
+}
+
+// 期限までにechoの応答が返ってこなければ接続が切れたとみなす
+static void keepalive_check(void)
+{
+  if (keepalive_pending > 0 && evl_now() - keepalive_sent >= KEEPALIVE_TIMEOUT) {
+    conn_lost = true;
+  }
+}
+
+//----------------------------------------------------------------------------
+
+// Read a command line while keeping the connection alive
+// (接続が切れたらfalseを返す)
+static bool read_command_line(struct dos_inpptr *cmdline)
+{
+  // キー入力があるまではイベントループでkeepaliveタイマーと受信を処理する
+  while (_dos_keysns() == 0) {
+    if (evl_wait(100) < 0) {
+      conn_lost = true;
+    }
+    keepalive_check();
+    if (conn_lost) {
+      return false;
+    }
   }
+  cmdline->max = 255;
+  _dos_gets(cmdline);
+  return true;
 }
 
 //****************************************************************************
@@ -1729,20 +2159,14 @@ int main(int argc, char *argv[])
   int result = 0;
   if (command_mode) {
     // Execute the specified command(s) and exit
+    evl_add_conn(smb2);
     result = execute_command_string(smb2, command_string);
+    evl_remove_conn(smb2);
     free(command_string);
   } else {
     // Interactive mode
-    pthread_mutex_lock(&keepalive_mutex);
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setname_np(&attr, "smbclient_keep");
-    if (pthread_create(&keepalive_thread, &attr, keepalive_thread_func, smb2) != 0) {
-      printf("Failed to create keepalive thread\n");
-      smb2_disconnect_share(smb2);
-      smb2_destroy_context(smb2);
-      exit(1);
-    }
+    evl_add_conn(smb2);
+    int keepalive_timer = evl_add_timer(KEEPALIVE_INTERVAL, keepalive_timer_func, smb2);
 
     printf("SMB Client - Type 'help' for commands, 'quit' to exit\n");
 
@@ -1758,10 +2182,11 @@ int main(int argc, char *argv[])
       fflush(stdout);
 
       struct dos_inpptr cmdline;
-      pthread_mutex_unlock(&keepalive_mutex);
-      cmdline.max = 255;
-      _dos_gets(&cmdline);
-      pthread_mutex_lock(&keepalive_mutex);
+      if (!read_command_line(&cmdline)) {
+        printf("\nサーバからの応答がないため接続を終了します\n");
+        result = 1;
+        break;
+      }
       printf("smb:%s> %s\n", current_dir, cmdline.buffer);  // Echo command
 
       trim_newline(cmdline.buffer);
@@ -1775,11 +2200,14 @@ int main(int argc, char *argv[])
     }
 
     _dos_intvcs(0xfff1, old_ctrlc);
+    evl_remove_timer(keepalive_timer);
+    evl_remove_conn(smb2);
   }
 
-  pthread_cancel(keepalive_thread);
-  pthread_join(keepalive_thread, NULL);
-  smb2_disconnect_share(smb2);
+  close_2nd();
+  if (!conn_lost) {
+    smb2_disconnect_share(smb2);      // 切れた接続では応答を待たずに破棄する
+  }
   smb2_destroy_context(smb2);
   return result ? 1 : 0;
 }
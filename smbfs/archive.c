@@ -0,0 +1,1339 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <humandefs.h>
+
+#include "smbfs.h"
+#include "fileop.h"
+#include "cache.h"
+#include "archive.h"
+
+// ZIPやLZHのアーカイブファイルをディレクトリとして読み出す
+// 最初に使われたときに索引だけを読み込んでキャッシュし、
+// ファイルの読み出しではそのファイルの圧縮データの範囲だけをサーバから読んで展開する
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define ZIP_EOCD_SIG      0x06054b50    // End of central directory
+#define ZIP_CDIR_SIG      0x02014b50    // Central directory file header
+#define ZIP_LOCAL_SIG     0x04034b50    // Local file header
+
+#define LZH_NC            510           // 文字と一致長の符号の数
+#define LZH_NT            19            // 符号長の符号の数
+#define LZH_CBIT          9
+#define LZH_TBIT          5
+
+#define HUFF_MAXBITS      16
+
+#define SYM_MATCH         256           // 一致長と距離を得た
+#define SYM_AGAIN         257           // ブロックの先頭を処理した (出力なし)
+#define SYM_EOF           -2
+#define SYM_ERROR         -1
+
+//****************************************************************************
+// Data types
+//****************************************************************************
+
+// サーバ上のファイルの一定範囲を先頭から順に読み込むバッファ
+typedef struct {
+  int unit;
+  TYPE_FD fd;
+  uint32_t pos;                 // 次にバッファに読み込む位置
+  uint32_t end;                 // 読み込む範囲の末尾
+  uint32_t fpos;                // サーバ側のファイル位置 (不明なら0xffffffff)
+  int rpos;                     // バッファ内の読み出し位置
+  int rlen;                     // バッファ内の有効なデータ長
+  bool err;                     // 範囲外を読んだか読み込みに失敗した
+  uint8_t buf[ARC_BUFSIZE];
+} arcin_t;
+
+// 正規ハフマン符号の復号表
+typedef struct {
+  int single;                   // 0以上なら符号を読まずに常にこのシンボルを返す
+  uint16_t count[HUFF_MAXBITS + 1]; // 符号長ごとの符号の数
+  uint16_t *sym;                // 符号順に並べたシンボル
+} huff_t;
+
+// 展開中のファイル
+// シンボル単位で展開を中断、再開できるように状態を保持する
+struct arcfile {
+  arc_t *arc;
+  arcent_t *ent;
+  uint32_t data;                // 圧縮データの位置
+  uint32_t out;                 // 展開済みのバイト数
+  int state;                    // deflate: 0=ブロックの先頭 1=無圧縮ブロック 2=圧縮ブロック
+  bool last;                    // deflate: 最後のブロック
+  uint32_t left;                // 無圧縮ブロック(deflate)/ブロック(LZH)の残り
+  uint32_t copylen;             // 辞書からコピーする残りのバイト数
+  uint32_t copydist;            // 辞書からコピーする距離
+  uint32_t bitbuf;
+  int bitcnt;
+  bool msb;                     // ビット列を上位ビットから読む (LZH)
+  int np;                       // LZH: 距離の符号の数
+  int pbit;                     // LZH: 距離の符号の数を表すビット数
+  uint8_t *window;              // 展開済みのデータを保持する辞書 (リングバッファ)
+  uint32_t wmask;
+  huff_t lit;                   // 文字と一致長 (LZHではc)
+  huff_t dist;                  // 距離 (LZHでは符号長とp)
+  uint16_t litsym[LZH_NC];
+  uint16_t distsym[32];
+  arcin_t in;
+};
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static arc_t *arc_list;                 // 索引をキャッシュしているアーカイブ (新しい順)
+static const char *arc_sortnames;       // qsort()で比較するパス名の格納領域
+
+//****************************************************************************
+// Input buffer
+//****************************************************************************
+
+static void in_init(arcin_t *in, int unit, TYPE_FD fd, uint32_t pos, uint32_t end)
+{
+  in->unit = unit;
+  in->fd = fd;
+  in->pos = pos;
+  in->end = end;
+  in->fpos = 0xffffffff;
+  in->rpos = in->rlen = 0;
+  in->err = false;
+}
+
+static bool in_fill(arcin_t *in)
+{
+  if (in->pos >= in->end) {
+    in->err = true;
+    return false;
+  }
+  uint32_t n = in->end - in->pos;
+  if (n > ARC_BUFSIZE) {
+    n = ARC_BUFSIZE;
+  }
+  if (in->fpos != in->pos &&
+      FUNC_LSEEK(in->unit, NULL, in->fd, in->pos, SEEK_SET) < 0) {
+    in->err = true;
+    return false;
+  }
+  ssize_t r = FUNC_READ(in->unit, NULL, in->fd, in->buf, n);
+  if (r <= 0) {
+    in->fpos = 0xffffffff;
+    in->err = true;
+    return false;
+  }
+  in->pos += r;
+  in->fpos = in->pos;
+  in->rpos = 0;
+  in->rlen = r;
+  return true;
+}
+
+static inline int in_byte(arcin_t *in)
+{
+  if (in->rpos >= in->rlen && !in_fill(in)) {
+    return 0;
+  }
+  return in->buf[in->rpos++];
+}
+
+// リトルエンディアンの数値を読む
+static uint32_t in_le(arcin_t *in, int n)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < n; i++) {
+    v |= in_byte(in) << (i * 8);
+  }
+  return v;
+}
+
+static void in_read(arcin_t *in, void *buf, size_t n)
+{
+  uint8_t *p = buf;
+  while (n-- > 0) {
+    *p++ = in_byte(in);
+  }
+}
+
+// 現在の読み出し位置
+static uint32_t in_tell(arcin_t *in)
+{
+  return in->pos - (in->rlen - in->rpos);
+}
+
+// 読み飛ばす (バッファ内に収まらなければ次に読むときにseekする)
+static void in_skip(arcin_t *in, uint32_t n)
+{
+  if (n <= in->rlen - in->rpos) {
+    in->rpos += n;
+    return;
+  }
+  in->pos = in_tell(in) + n;
+  in->rpos = in->rlen = 0;
+}
+
+static inline uint16_t le16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//****************************************************************************
+// Path names
+//****************************************************************************
+
+static inline bool iskanji(int c)
+{
+  return (0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xfc);
+}
+
+// ファイル名の拡張子がアーカイブのものか
+bool arc_isarchive(const char *name, int len)
+{
+  if (len < 0) {
+    len = strlen(name);
+  }
+  if (len < 5) {
+    return false;
+  }
+  const char *e = &name[len - 4];
+  return e[0] == '.' && (strncasecmp(&e[1], "zip", 3) == 0 || strncasecmp(&e[1], "lzh", 3) == 0);
+}
+
+// SJISのパス名を大文字小文字を区別せずに比較する (n<0なら末尾まで比較する)
+static int arc_namecmp(const char *a, const char *b, int n)
+{
+  bool kanji = false;
+  for (int i = 0; n < 0 || i < n; i++) {
+    int c = (uint8_t)a[i];
+    int d = (uint8_t)b[i];
+    if (!kanji) {
+      c = tolower(c);
+      d = tolower(d);
+    }
+    if (c != d) {
+      return c - d;
+    }
+    if (c == 0) {
+      break;
+    }
+    kanji = !kanji && iskanji(c);
+  }
+  return 0;
+}
+
+static int arc_sortcmp(const void *a, const void *b)
+{
+  return arc_namecmp(&arc_sortnames[((arcent_t *)a)->name],
+                     &arc_sortnames[((arcent_t *)b)->name], -1);
+}
+
+// 索引からパス名を探す (見つからなければ挿入する位置を負の値で返す)
+static int arc_search(arc_t *arc, const char *name, int nent)
+{
+  int lo = 0;
+  int hi = nent;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = arc_namecmp(ARC_NAME(arc, &arc->ent[mid]), name, -1);
+    if (c == 0) {
+      return mid;
+    } else if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1 - lo;
+}
+
+//****************************************************************************
+// Index
+//****************************************************************************
+
+static void arc_free(arc_t *arc)
+{
+  free(arc->ent);
+  free(arc->names);
+  free(arc->path);
+  free(arc);
+}
+
+// 索引にエントリを追加する
+// (パス名の区切りを'/'に揃え、末尾の'/'はディレクトリとして取り除く)
+static arcent_t *arc_add(arc_t *arc, const char *name)
+{
+  if (arc->nent >= ARC_MAXENT) {
+    return NULL;
+  }
+  if (arc->ent == NULL &&
+      (arc->ent = malloc(sizeof(arcent_t) * ARC_MAXENT)) == NULL) {
+    return NULL;
+  }
+  size_t len = strlen(name);
+  if (arc->nameslen + len + 1 > arc->namescap) {
+    size_t cap = (arc->nameslen + len + 1) * 2;
+    char *p = realloc(arc->names, cap);
+    if (p == NULL) {
+      return NULL;
+    }
+    arc->names = p;
+    arc->namescap = cap;
+  }
+
+  char *top = &arc->names[arc->nameslen];
+  char *dst = top;
+  bool isdir = false;
+  for (int i = 0; i < len; i++) {
+    int c = (uint8_t)name[i];
+    if (iskanji(c) && i + 1 < len) {
+      *dst++ = c;
+      *dst++ = name[++i];
+      continue;
+    }
+    if (c == '\\' || c == 0xff) {
+      c = '/';
+    }
+    if (c == '/' && (dst == top || dst[-1] == '/')) {
+      continue;                 // 先頭や連続した'/'は除く
+    }
+    *dst++ = c;
+  }
+  if (dst > top && dst[-1] == '/') {
+    dst--;
+    isdir = true;
+  }
+  if (dst == top) {
+    return NULL;
+  }
+  *dst++ = '\0';
+
+  arcent_t *e = &arc->ent[arc->nent++];
+  memset(e, 0, sizeof(*e));
+  e->name = arc->nameslen;
+  e->atr = isdir ? 0x10 : 0x20;
+  arc->nameslen = dst - arc->names;
+  return e;
+}
+
+// ZIPのセントラルディレクトリを読み込む
+static int arc_load_zip(arc_t *arc, arcin_t *in)
+{
+  // ファイル末尾のEnd of central directoryを探す (コメントが長いものは扱わない)
+  uint32_t len = arc->size < ARC_BUFSIZE ? arc->size : ARC_BUFSIZE;
+  in->pos = arc->size - len;
+  in->end = arc->size;
+  if (!in_fill(in) || in->rlen != len) {
+    return -1;
+  }
+  int i;
+  for (i = (int)len - 22; i >= 0; i--) {
+    if (le32(&in->buf[i]) == ZIP_EOCD_SIG) {
+      break;
+    }
+  }
+  if (i < 0) {
+    return -1;
+  }
+  uint8_t *eocd = &in->buf[i];
+  uint32_t n = le16(&eocd[10]);
+  uint32_t cdsize = le32(&eocd[12]);
+  uint32_t cdoff = le32(&eocd[16]);
+  if (cdoff > arc->size || cdsize > arc->size - cdoff) {
+    return -1;
+  }
+
+  // セントラルディレクトリのエントリを順に読む
+  in->pos = cdoff;
+  in->end = cdoff + cdsize;
+  in->rpos = in->rlen = 0;
+  for (uint32_t k = 0; k < n && arc->nent < ARC_MAXENT; k++) {
+    uint8_t h[42];
+    if (in_le(in, 4) != ZIP_CDIR_SIG) {
+      break;
+    }
+    in_read(in, h, sizeof(h));
+    uint16_t flags = le16(&h[4]);
+    uint16_t method = le16(&h[6]);
+    uint16_t nlen = le16(&h[24]);
+    uint16_t xlen = le16(&h[26]) + le16(&h[28]);
+    char name[ARC_PATHLEN];
+    if (in->err || nlen >= sizeof(name)) {
+      break;
+    }
+    in_read(in, name, nlen);
+    name[nlen] = '\0';
+    in_skip(in, xlen);
+
+    if (flags & 0x0800) {       // ファイル名がUTF-8ならSJISに変換する
+      char sjis[ARC_PATHLEN];
+      char *src_buf = name;
+      size_t src_len = nlen;
+      char *dst_buf = sjis;
+      size_t dst_len = sizeof(sjis) - 1;
+      if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
+        continue;
+      }
+      *dst_buf = '\0';
+      strcpy(name, sjis);
+    }
+    arcent_t *e = arc_add(arc, name);
+    if (e == NULL) {
+      continue;
+    }
+    e->time = le16(&h[8]);
+    e->date = le16(&h[10]);
+    e->csize = le32(&h[16]);
+    e->usize = le32(&h[20]);
+    e->offset = le32(&h[38]);
+    if ((flags & 0x0001) || e->csize == 0xffffffff || e->usize == 0xffffffff) {
+      e->method = ARC_UNKNOWN;  // 暗号化やZIP64には対応しない
+    } else if (method == 0) {
+      e->method = ARC_STORED;
+    } else if (method == 8) {
+      e->method = ARC_DEFLATE;
+    } else {
+      e->method = ARC_UNKNOWN;
+    }
+  }
+  return in->err ? -1 : 0;
+}
+
+// LZHの拡張ヘッダを読む (次の拡張ヘッダのサイズから始めて、読んだ拡張ヘッダの合計サイズを返す)
+static uint32_t arc_lzh_ext(arcin_t *in, uint32_t size, char *name, char *dir)
+{
+  uint32_t total = 0;
+  while (size >= 3 && !in->err) {
+    total += size;
+    int type = in_byte(in);
+    uint32_t len = size - 3;
+    char *dst = type == 0x01 ? name : type == 0x02 ? dir : NULL;
+    if (dst != NULL && len < ARC_PATHLEN - 1) {
+      in_read(in, dst, len);
+      dst[len] = '\0';
+      if (type == 0x02 && len > 0 && (uint8_t)dst[len - 1] != 0xff) {
+        strcat(dst, "/");
+      }
+    } else {
+      in_skip(in, len);
+    }
+    size = in_le(in, 2);
+  }
+  return total;
+}
+
+// LZHのヘッダを先頭から順に読む (圧縮データは読み飛ばす)
+static int arc_load_lzh(arc_t *arc, arcin_t *in)
+{
+  uint32_t pos = 0;
+  in->pos = 0;
+  in->end = arc->size;
+  while (pos + 22 <= arc->size && arc->nent < ARC_MAXENT) {
+    uint8_t h[21];
+    in_skip(in, pos - in_tell(in));
+    if ((h[0] = in_byte(in)) == 0) {
+      break;                    // アーカイブの終端
+    }
+    in_read(in, &h[1], sizeof(h) - 1);
+    if (in->err || h[2] != '-' || h[3] != 'l' || h[6] != '-') {
+      break;
+    }
+
+    char name[ARC_PATHLEN];
+    char dir[ARC_PATHLEN];
+    name[0] = dir[0] = '\0';
+    uint32_t packed = le32(&h[7]);
+    uint32_t datapos;
+    uint16_t time = le16(&h[15]);
+    uint16_t date = le16(&h[17]);
+    int level = h[20];
+    if (level == 0 || level == 1) {
+      uint32_t hdrsize = h[0] + 2;
+      int nlen = in_byte(in);
+      in_read(in, name, nlen);
+      name[nlen] = '\0';
+      datapos = pos + hdrsize;
+      if (level == 1) {         // 基本ヘッダの末尾に次の拡張ヘッダのサイズがある
+        in_skip(in, hdrsize - 2 - (22 + nlen));
+        uint32_t ext = arc_lzh_ext(in, in_le(in, 2), name, dir);
+        datapos += ext;
+        packed -= ext;          // レベル1の圧縮サイズは拡張ヘッダを含む
+      }
+    } else if (level == 2) {
+      in_skip(in, 3);           // CRC, OS ID
+      arc_lzh_ext(in, in_le(in, 2), name, dir);
+      datapos = pos + le16(&h[0]);
+      time_t mtime = le32(&h[15]);  // レベル2の更新時刻はUNIX時間
+      struct tm *tm = localtime(&mtime);
+      time = tm->tm_hour << 11 | tm->tm_min << 5 | tm->tm_sec >> 1;
+      date = (tm->tm_year - 80) << 9 | (tm->tm_mon + 1) << 5 | tm->tm_mday;
+    } else {
+      break;
+    }
+    if (in->err) {
+      break;
+    }
+
+    char path[ARC_PATHLEN * 2];
+    strcpy(path, dir);
+    strcat(path, name);
+    arcent_t *e;
+    if (strlen(path) < ARC_PATHLEN && (e = arc_add(arc, path)) != NULL) {
+      e->time = time;
+      e->date = date;
+      e->offset = datapos;
+      e->csize = packed;
+      e->usize = le32(&h[11]);
+      if (memcmp(&h[2], "-lhd-", 5) == 0) {
+        e->atr = 0x10;
+      } else if (memcmp(&h[2], "-lh0-", 5) == 0 || memcmp(&h[2], "-lz4-", 5) == 0) {
+        e->method = ARC_STORED;
+      } else if (memcmp(&h[2], "-lh5-", 5) == 0) {
+        e->method = ARC_LH5;
+      } else if (memcmp(&h[2], "-lh6-", 5) == 0) {
+        e->method = ARC_LH6;
+      } else if (memcmp(&h[2], "-lh7-", 5) == 0) {
+        e->method = ARC_LH7;
+      } else {
+        e->method = ARC_UNKNOWN;
+      }
+    }
+    pos = datapos + packed;
+  }
+  return arc->nent > 0 ? 0 : -1;
+}
+
+// 索引をパス名順に並べ、記録されていない中間のディレクトリを補う
+static void arc_sort(arc_t *arc)
+{
+  arc_sortnames = arc->names;
+  qsort(arc->ent, arc->nent, sizeof(arcent_t), arc_sortcmp);
+
+  int n = arc->nent;
+  for (int i = 0; i < n; i++) {
+    char path[ARC_PATHLEN];
+    strcpy(path, ARC_NAME(arc, &arc->ent[i]));
+    bool kanji = false;
+    for (char *p = path; *p; p++) {
+      if (kanji) {
+        kanji = false;
+        continue;
+      }
+      kanji = iskanji((uint8_t)*p);
+      if (*p != '/') {
+        continue;
+      }
+      *p = '\0';
+      if (arc_search(arc, path, n) < 0) {
+        int j;
+        for (j = n; j < arc->nent; j++) {
+          if (arc_namecmp(ARC_NAME(arc, &arc->ent[j]), path, -1) == 0) {
+            break;
+          }
+        }
+        arcent_t *e;
+        if (j == arc->nent && (e = arc_add(arc, path)) != NULL) {
+          e->atr = 0x10;
+          e->time = arc->ent[i].time;
+          e->date = arc->ent[i].date;
+        }
+      }
+      *p = '/';
+    }
+  }
+  if (arc->nent > n) {
+    arc_sortnames = arc->names;
+    qsort(arc->ent, arc->nent, sizeof(arcent_t), arc_sortcmp);
+  }
+}
+
+// アーカイブの索引を読み込む
+static int arc_load(arc_t *arc)
+{
+  int err;
+  TYPE_FD fd = FUNC_OPEN(arc->unit, &err, arc->path, O_RDONLY|O_BINARY);
+  if (fd == FD_BADFD) {
+    return -1;
+  }
+  arcin_t *in = malloc(sizeof(arcin_t));
+  if (in == NULL) {
+    FUNC_CLOSE(arc->unit, NULL, fd);
+    return -1;
+  }
+  in_init(in, arc->unit, fd, 0, 0);
+  int res = arc->zip ? arc_load_zip(arc, in) : arc_load_lzh(arc, in);
+  free(in);
+  FUNC_CLOSE(arc->unit, NULL, fd);
+  if (res < 0) {
+    return -1;
+  }
+  arc_sort(arc);
+  DPRINTF1("arc_load: %s %d entries\r\n", arc->path, arc->nent);
+  return 0;
+}
+
+// アーカイブの索引を得る (キャッシュになければ読み込む)
+// (有効期間を過ぎていたら、サイズと更新時刻が変わっていないかを確認する)
+static arc_t *arc_get(int unit, const char *path, int len)
+{
+  uint32_t hash = cache_hash(unit, path, len);
+  uint32_t now = cache_clock();
+  char apath[ARC_PATHLEN];
+  memcpy(apath, path, len);
+  apath[len] = '\0';
+
+  int n = 0;
+  arc_t **pa, **pvictim = NULL;
+  for (pa = &arc_list; *pa != NULL; pa = &(*pa)->next) {
+    arc_t *arc = *pa;
+    if (arc->unit == unit && arc->hash == hash && strcasecmp(arc->path, apath) == 0) {
+      *pa = arc->next;          // リストの先頭に移動する
+      arc->next = arc_list;
+      arc_list = arc;
+      if (now - arc->time <= PCACHE_TTL) {
+        return arc;
+      }
+      TYPE_STAT st;
+      if (FUNC_STAT(unit, NULL, apath, &st) == 0 &&
+          STAT_SIZE(&st) == arc->size && STAT_MTIME(&st) == arc->mtime) {
+        arc->time = now;
+        return arc;
+      }
+      arc_invalidate(unit, apath);
+      break;
+    }
+  }
+  for (pa = &arc_list; *pa != NULL; pa = &(*pa)->next) {
+    n++;
+    if ((*pa)->refs == 0) {
+      pvictim = pa;
+    }
+  }
+  // キャッシュ数が上限に達していたら使われていない最も古い索引を解放する
+  if (n >= ARC_MAXARCS && pvictim != NULL) {
+    arc_t *victim = *pvictim;
+    *pvictim = victim->next;
+    arc_free(victim);
+  }
+
+  arc_t *arc = calloc(1, sizeof(arc_t));
+  if (arc == NULL || (arc->path = strdup(apath)) == NULL) {
+    free(arc);
+    return NULL;
+  }
+  arc->unit = unit;
+  arc->hash = hash;
+  arc->time = now;
+  arc->zip = strncasecmp(&apath[len - 3], "zip", 3) == 0;
+  TYPE_STAT st;
+  if (FUNC_STAT(unit, NULL, apath, &st) == 0 && !STAT_ISDIR(&st)) {
+    arc->size = STAT_SIZE(&st);
+    arc->mtime = STAT_MTIME(&st);
+  }
+  if (arc->size == 0 || arc_load(arc) < 0) {
+    // アーカイブとして読めなかったことも記録して、有効期間内は読み直さない
+    free(arc->ent);
+    free(arc->names);
+    arc->ent = NULL;
+    arc->names = NULL;
+    arc->nameslen = arc->namescap = 0;
+    arc->nent = -1;
+  }
+  arc->next = arc_list;
+  arc_list = arc;
+  return arc;
+}
+
+// パス名がアーカイブかアーカイブ内のものなら索引を得て、アーカイブ内のパス名をSJISでmemberに返す
+arc_t *arc_lookup(int unit, const char *path, char *member, size_t size)
+{
+  // パス名の要素のうち最初にアーカイブの拡張子を持つものを探す
+  const char *p = path;
+  int len = -1;
+  for (const char *s = path; ; s++) {
+    if (*s == '/' || *s == '\0') {
+      if (arc_isarchive(p, s - p)) {
+        len = s - path;
+        break;
+      }
+      if (*s == '\0') {
+        break;
+      }
+      p = s + 1;
+    }
+  }
+  if (len < 0 || len >= ARC_PATHLEN) {
+    return NULL;
+  }
+  arc_t *arc = arc_get(unit, path, len);
+  if (arc == NULL || arc->nent < 0) {
+    return NULL;
+  }
+
+  char *src_buf = (char *)&path[len];
+  while (*src_buf == '/') {
+    src_buf++;
+  }
+  size_t src_len = strlen(src_buf);
+  char *dst_buf = member;
+  size_t dst_len = size - 1;
+  if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
+    return NULL;
+  }
+  while (dst_buf > member && dst_buf[-1] == '/') {
+    dst_buf--;
+  }
+  *dst_buf = '\0';
+  return arc;
+}
+
+void arc_ref(arc_t *arc)
+{
+  arc->refs++;
+}
+
+void arc_release(arc_t *arc)
+{
+  if (arc == NULL) {
+    return;
+  }
+  if (--arc->refs <= 0 && arc->stale) {
+    arc_free(arc);
+  }
+}
+
+// アーカイブ内のパス名のエントリを探す
+arcent_t *arc_find(arc_t *arc, const char *member)
+{
+  int i = arc_search(arc, member, arc->nent);
+  return i < 0 ? NULL : &arc->ent[i];
+}
+
+// アーカイブ内のパス名のファイル属性を得る (アーカイブ自身はディレクトリとする)
+int arc_stat(arc_t *arc, const char *member)
+{
+  if (member[0] == '\0') {
+    return 0x10;
+  }
+  arcent_t *e = arc_find(arc, member);
+  return e ? e->atr : -1;
+}
+
+// ディレクトリ内のエントリを列挙する最初の位置を得る
+int arc_first(arc_t *arc, const char *dir)
+{
+  if (dir[0] == '\0') {
+    return 0;
+  }
+  char prefix[ARC_PATHLEN + 1];
+  strcpy(prefix, dir);
+  strcat(prefix, "/");
+  int i = arc_search(arc, prefix, arc->nent);
+  return i < 0 ? -1 - i : i;
+}
+
+// ディレクトリ直下の次のエントリを得る (nameにはディレクトリ内でのファイル名を返す)
+arcent_t *arc_next(arc_t *arc, const char *dir, int *pos, const char **name)
+{
+  int dlen = strlen(dir);
+  while (*pos < arc->nent) {
+    arcent_t *e = &arc->ent[(*pos)++];
+    const char *p = ARC_NAME(arc, e);
+    if (dlen > 0) {
+      if (arc_namecmp(p, dir, dlen) != 0 || p[dlen] != '/') {
+        break;                  // パス名順に並んでいるので、ディレクトリの範囲を過ぎた
+      }
+      p += dlen + 1;
+    }
+    bool kanji = false;
+    const char *s;
+    for (s = p; *s; s++) {
+      if (!kanji && *s == '/') {
+        break;
+      }
+      kanji = !kanji && iskanji((uint8_t)*s);
+    }
+    if (*s == '\0') {
+      *name = p;
+      return e;
+    }
+  }
+  *pos = arc->nent;
+  return NULL;
+}
+
+// アーカイブの索引を捨てる (使用中なら使われなくなってから解放する)
+void arc_invalidate(int unit, const char *path)
+{
+  uint32_t hash = cache_hash(unit, path, -1);
+  for (arc_t **pa = &arc_list; *pa != NULL; pa = &(*pa)->next) {
+    arc_t *arc = *pa;
+    if (arc->unit == unit && arc->hash == hash && strcasecmp(arc->path, path) == 0) {
+      *pa = arc->next;
+      if (arc->refs > 0) {
+        arc->stale = true;
+      } else {
+        arc_free(arc);
+      }
+      return;
+    }
+  }
+}
+
+void arc_invalidate_unit(int unit)
+{
+  arc_t **pa = &arc_list;
+  while (*pa != NULL) {
+    arc_t *arc = *pa;
+    if (arc->unit == unit) {
+      *pa = arc->next;
+      if (arc->refs > 0) {
+        arc->stale = true;
+      } else {
+        arc_free(arc);
+      }
+    } else {
+      pa = &arc->next;
+    }
+  }
+}
+
+//****************************************************************************
+// Decompression
+//****************************************************************************
+
+static inline uint32_t getbits(arcfile_t *af, int n)
+{
+  if (af->msb) {
+    while (af->bitcnt < n) {
+      af->bitbuf = (af->bitbuf << 8) | in_byte(&af->in);
+      af->bitcnt += 8;
+    }
+    af->bitcnt -= n;
+    return (af->bitbuf >> af->bitcnt) & ((1 << n) - 1);
+  } else {
+    while (af->bitcnt < n) {
+      af->bitbuf |= in_byte(&af->in) << af->bitcnt;
+      af->bitcnt += 8;
+    }
+    uint32_t v = af->bitbuf & ((1 << n) - 1);
+    af->bitbuf >>= n;
+    af->bitcnt -= n;
+    return v;
+  }
+}
+
+// 符号長の表から復号表を作る
+static void huff_build(huff_t *h, const uint8_t *len, int n)
+{
+  uint16_t offs[HUFF_MAXBITS + 1];
+  h->single = -1;
+  memset(h->count, 0, sizeof(h->count));
+  for (int i = 0; i < n; i++) {
+    h->count[len[i]]++;
+  }
+  h->count[0] = 0;
+  offs[1] = 0;
+  for (int i = 1; i < HUFF_MAXBITS; i++) {
+    offs[i + 1] = offs[i] + h->count[i];
+  }
+  for (int i = 0; i < n; i++) {
+    if (len[i] != 0) {
+      h->sym[offs[len[i]]++] = i;
+    }
+  }
+}
+
+static int huff_decode(arcfile_t *af, huff_t *h)
+{
+  if (h->single >= 0) {
+    return h->single;
+  }
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (int len = 1; len <= HUFF_MAXBITS; len++) {
+    code |= getbits(af, 1);
+    int count = h->count[len];
+    if (code - count < first) {
+      return h->sym[index + (code - first)];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return SYM_ERROR;
+}
+
+//----------------------------------------------------------------------------
+
+// deflate (RFC 1951)
+
+static const uint16_t lbase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lext[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dbase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dext[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void inflate_fixed(arcfile_t *af)
+{
+  uint8_t len[288];
+  memset(&len[0], 8, 144);
+  memset(&len[144], 9, 112);
+  memset(&len[256], 7, 24);
+  memset(&len[280], 8, 8);
+  huff_build(&af->lit, len, 288);
+  memset(len, 5, 30);
+  huff_build(&af->dist, len, 30);
+}
+
+static int inflate_dynamic(arcfile_t *af)
+{
+  static const uint8_t order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  uint8_t len[288 + 32];
+  int nlen = getbits(af, 5) + 257;
+  int ndist = getbits(af, 5) + 1;
+  int ncode = getbits(af, 4) + 4;
+  if (nlen > 286 || ndist > 30) {
+    return -1;
+  }
+  memset(len, 0, 19);
+  for (int i = 0; i < ncode; i++) {
+    len[order[i]] = getbits(af, 3);
+  }
+  huff_build(&af->dist, len, 19);   // 符号長の符号は一時的に距離の復号表を使う
+
+  for (int i = 0; i < nlen + ndist; ) {
+    int sym = huff_decode(af, &af->dist);
+    if (sym < 0) {
+      return -1;
+    }
+    if (sym < 16) {
+      len[i++] = sym;
+      continue;
+    }
+    int val = 0;
+    int rep;
+    if (sym == 16) {
+      if (i == 0) {
+        return -1;
+      }
+      val = len[i - 1];
+      rep = 3 + getbits(af, 2);
+    } else if (sym == 17) {
+      rep = 3 + getbits(af, 3);
+    } else {
+      rep = 11 + getbits(af, 7);
+    }
+    if (i + rep > nlen + ndist) {
+      return -1;
+    }
+    while (rep-- > 0) {
+      len[i++] = val;
+    }
+  }
+  huff_build(&af->lit, len, nlen);
+  huff_build(&af->dist, &len[nlen], ndist);
+  return 0;
+}
+
+static int inflate_symbol(arcfile_t *af)
+{
+  switch (af->state) {
+  case 0:                       // ブロックの先頭
+    if (af->last) {
+      return SYM_EOF;
+    }
+    af->last = getbits(af, 1);
+    switch (getbits(af, 2)) {
+    case 0:
+      af->bitbuf >>= af->bitcnt & 7;  // バイト境界に揃える
+      af->bitcnt &= ~7;
+      af->left = getbits(af, 16);
+      getbits(af, 16);
+      af->state = 1;
+      return SYM_AGAIN;
+    case 1:
+      inflate_fixed(af);
+      af->state = 2;
+      return SYM_AGAIN;
+    case 2:
+      if (inflate_dynamic(af) < 0) {
+        return SYM_ERROR;
+      }
+      af->state = 2;
+      return SYM_AGAIN;
+    default:
+      return SYM_ERROR;
+    }
+  case 1:                       // 無圧縮ブロック
+    if (af->left == 0) {
+      af->state = 0;
+      return SYM_AGAIN;
+    }
+    af->left--;
+    return getbits(af, 8);
+  default: {                    // 圧縮ブロック
+    int sym = huff_decode(af, &af->lit);
+    if (sym < 256) {
+      return sym;
+    }
+    if (sym == 256) {
+      af->state = 0;
+      return SYM_AGAIN;
+    }
+    sym -= 257;
+    if (sym >= 29) {
+      return SYM_ERROR;
+    }
+    af->copylen = lbase[sym] + getbits(af, lext[sym]);
+    int d = huff_decode(af, &af->dist);
+    if (d < 0 || d >= 30) {
+      return SYM_ERROR;
+    }
+    af->copydist = dbase[d] + getbits(af, dext[d]);
+    return SYM_MATCH;
+  }
+  }
+}
+
+//----------------------------------------------------------------------------
+
+// LZH -lh5-, -lh6-, -lh7- (ブロックごとの静的ハフマン符号 + LZSS)
+
+// 符号長の符号、または距離の符号の符号長を読む
+static int lzh_read_pt(arcfile_t *af, int nn, int nbit, int special)
+{
+  uint8_t len[32];
+  int n = getbits(af, nbit);
+  if (n == 0) {
+    af->dist.single = getbits(af, nbit);
+    return af->dist.single < nn ? 0 : -1;
+  }
+  if (n > nn) {
+    return -1;
+  }
+  int i = 0;
+  while (i < n) {
+    int c = getbits(af, 3);
+    if (c == 7) {
+      while (getbits(af, 1)) {
+        if (++c > HUFF_MAXBITS) {
+          return -1;
+        }
+      }
+    }
+    len[i++] = c;
+    if (i == special) {
+      int z = getbits(af, 2);
+      while (z-- > 0 && i < nn) {
+        len[i++] = 0;
+      }
+    }
+  }
+  while (i < nn) {
+    len[i++] = 0;
+  }
+  huff_build(&af->dist, len, nn);
+  return 0;
+}
+
+// 文字と一致長の符号の符号長を読む
+static int lzh_read_c(arcfile_t *af)
+{
+  uint8_t len[LZH_NC];
+  int n = getbits(af, LZH_CBIT);
+  if (n == 0) {
+    af->lit.single = getbits(af, LZH_CBIT);
+    return af->lit.single < LZH_NC ? 0 : -1;
+  }
+  if (n > LZH_NC) {
+    return -1;
+  }
+  int i = 0;
+  while (i < n) {
+    int c = huff_decode(af, &af->dist);
+    if (c < 0) {
+      return -1;
+    }
+    if (c <= 2) {
+      int z = c == 0 ? 1 : c == 1 ? getbits(af, 4) + 3 : getbits(af, LZH_CBIT) + 20;
+      while (z-- > 0 && i < LZH_NC) {
+        len[i++] = 0;
+      }
+    } else if (c - 2 > HUFF_MAXBITS) {
+      return -1;                // 符号長の表が壊れている
+    } else {
+      len[i++] = c - 2;
+    }
+  }
+  while (i < LZH_NC) {
+    len[i++] = 0;
+  }
+  huff_build(&af->lit, len, LZH_NC);
+  return 0;
+}
+
+static int lzh_symbol(arcfile_t *af)
+{
+  if (af->out >= af->ent->usize) {
+    return SYM_EOF;
+  }
+  if (af->left == 0) {          // ブロックの先頭で符号表を読む
+    if ((af->left = getbits(af, 16)) == 0 ||
+        lzh_read_pt(af, LZH_NT, LZH_TBIT, 3) < 0 ||
+        lzh_read_c(af) < 0 ||
+        lzh_read_pt(af, af->np, af->pbit, -1) < 0) {
+      return SYM_ERROR;
+    }
+  }
+  af->left--;
+  int c = huff_decode(af, &af->lit);
+  if (c < 256) {
+    return c;
+  }
+  af->copylen = c - 256 + 3;
+  int p = huff_decode(af, &af->dist);
+  if (p < 0) {
+    return SYM_ERROR;
+  }
+  if (p > 1) {
+    p = (1 << (p - 1)) + getbits(af, p - 1);
+  }
+  af->copydist = p + 1;
+  return SYM_MATCH;
+}
+
+//----------------------------------------------------------------------------
+
+// 展開を圧縮データの先頭からやり直す
+static void af_reset(arcfile_t *af)
+{
+  in_init(&af->in, af->in.unit, af->in.fd, af->data, af->data + af->ent->csize);
+  af->out = 0;
+  af->state = 0;
+  af->last = false;
+  af->left = 0;
+  af->copylen = 0;
+  af->bitbuf = 0;
+  af->bitcnt = 0;
+}
+
+// n バイトを展開する (bufがNULLなら読み捨てる)
+static ssize_t af_inflate(arcfile_t *af, uint8_t *buf, size_t n)
+{
+  size_t done = 0;
+  while (done < n) {
+    if (af->copylen > 0) {      // 辞書からコピーする
+      while (af->copylen > 0 && done < n) {
+        uint8_t c = af->window[(af->out - af->copydist) & af->wmask];
+        af->window[af->out++ & af->wmask] = c;
+        if (buf) {
+          *buf++ = c;
+        }
+        af->copylen--;
+        done++;
+      }
+      continue;
+    }
+    int sym = af->ent->method == ARC_DEFLATE ? inflate_symbol(af) : lzh_symbol(af);
+    if (af->in.err || sym == SYM_ERROR) {
+      return -1;
+    }
+    if (sym == SYM_EOF) {
+      break;
+    }
+    if (sym == SYM_MATCH) {
+      if (af->copydist > af->out || af->copydist > af->wmask + 1) {
+        return -1;
+      }
+    } else if (sym < 256) {
+      af->window[af->out++ & af->wmask] = sym;
+      if (buf) {
+        *buf++ = sym;
+      }
+      done++;
+    }
+  }
+  return done;
+}
+
+// アーカイブ内のファイルを開く
+arcfile_t *arc_fopen(int unit, arc_t *arc, arcent_t *ent, int *err)
+{
+  static const uint8_t dicbit[] = {
+    [ARC_DEFLATE] = 15, [ARC_LH5] = 13, [ARC_LH6] = 15, [ARC_LH7] = 16
+  };
+  if (ent->method == ARC_UNKNOWN) {
+    *err = ENOEXEC;
+    return NULL;
+  }
+  arcfile_t *af = calloc(1, sizeof(arcfile_t));
+  if (af == NULL) {
+    *err = ENOMEM;
+    return NULL;
+  }
+  if (ent->method != ARC_STORED) {
+    af->wmask = (1 << dicbit[ent->method]) - 1;
+    if ((af->window = malloc(af->wmask + 1)) == NULL) {
+      free(af);
+      *err = ENOMEM;
+      return NULL;
+    }
+  }
+  af->lit.sym = af->litsym;
+  af->dist.sym = af->distsym;
+  af->msb = ent->method != ARC_DEFLATE;
+  af->np = dicbit[ent->method] + 1;
+  af->pbit = ent->method == ARC_LH5 ? 4 : 5;
+
+  TYPE_FD fd = FUNC_OPEN(unit, err, arc->path, O_RDONLY|O_BINARY);
+  if (fd == FD_BADFD) {
+    free(af->window);
+    free(af);
+    return NULL;
+  }
+  af->arc = arc;
+  af->ent = ent;
+  af->data = ent->offset;
+  if (arc->zip) {
+    // ローカルヘッダは圧縮データの先頭と一緒に読み込んで、そのまま展開に使う
+    uint8_t h[30];
+    in_init(&af->in, unit, fd, ent->offset, ent->offset + sizeof(h) + 2 * 0xffff + ent->csize);
+    in_read(&af->in, h, sizeof(h));
+    if (af->in.err || le32(h) != ZIP_LOCAL_SIG) {
+      FUNC_CLOSE(unit, NULL, fd);
+      free(af->window);
+      free(af);
+      *err = ENOEXEC;
+      return NULL;
+    }
+    in_skip(&af->in, le16(&h[26]) + le16(&h[28]));
+    af->data = in_tell(&af->in);
+    af->in.end = af->data + ent->csize;
+  } else {
+    in_init(&af->in, unit, fd, af->data, af->data + ent->csize);
+  }
+  arc_ref(arc);
+  return af;
+}
+
+// アーカイブ内のファイルのposの位置からlenバイトを読む
+ssize_t arc_fread(arcfile_t *af, uint32_t pos, void *buf, size_t len, int *err)
+{
+  arcent_t *e = af->ent;
+  *err = 0;
+  if (pos >= e->usize) {
+    return 0;
+  }
+  if (len > e->usize - pos) {
+    len = e->usize - pos;
+  }
+
+  if (e->method == ARC_STORED) {
+    // 無圧縮ならサーバから必要な範囲だけを直接読む
+    af->in.fpos = 0xffffffff;
+    if (FUNC_LSEEK(af->in.unit, err, af->in.fd, af->data + pos, SEEK_SET) < 0) {
+      return -1;
+    }
+    return FUNC_READ(af->in.unit, err, af->in.fd, buf, len);
+  }
+
+  uint8_t *p = buf;
+  size_t done = 0;
+  if (pos < af->out) {
+    if (af->out - pos <= af->wmask + 1) {
+      // 直前に展開した範囲は辞書に残っている
+      for (; done < len && pos + done < af->out; done++) {
+        p[done] = af->window[(pos + done) & af->wmask];
+      }
+    } else {
+      af_reset(af);             // 先頭から展開し直す
+    }
+  }
+  if (done < len) {
+    if (pos + done > af->out && af_inflate(af, NULL, pos + done - af->out) < 0) {
+      *err = EIO;
+      return -1;
+    }
+    ssize_t r = af_inflate(af, &p[done], len - done);
+    if (r < 0) {
+      *err = EIO;
+      return -1;
+    }
+    done += r;
+  }
+  return done;
+}
+
+// オープンしたファイルの索引のエントリを得る
+arcent_t *arc_fentry(arcfile_t *af)
+{
+  return af->ent;
+}
+
+// (closeがfalseならサーバ側のファイルは閉じずに捨てる)
+void arc_fclose(arcfile_t *af, bool close)
+{
+  if (af == NULL) {
+    return;
+  }
+  if (close) {
+    FUNC_CLOSE(af->in.unit, NULL, af->in.fd);
+  }
+  arc_release(af->arc);
+  free(af->window);
+  free(af);
+}
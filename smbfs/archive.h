@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fileop.h"
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define ARC_MAXARCS       2             // 索引をキャッシュするアーカイブ数
+#define ARC_MAXENT        1024          // 1アーカイブあたりの索引のエントリ数の上限
+#define ARC_BUFSIZE       2048          // サーバから一度に読み込むサイズ
+#define ARC_PATHLEN       256           // アーカイブ内のパス名の長さの上限
+
+// 圧縮方式
+#define ARC_STORED        0             // 無圧縮 (ZIP stored, LZH -lh0-)
+#define ARC_DEFLATE       1             // ZIP deflate
+#define ARC_LH5           2             // LZH -lh5- (8KB辞書)
+#define ARC_LH6           3             // LZH -lh6- (32KB辞書)
+#define ARC_LH7           4             // LZH -lh7- (64KB辞書)
+#define ARC_UNKNOWN       0xff          // 展開できない方式
+
+//****************************************************************************
+// Data types
+//****************************************************************************
+
+// アーカイブ内のファイル
+typedef struct {
+  uint32_t name;                // アーカイブ内のパス名 (namesでの位置, SJIS, '/'区切り)
+  uint32_t offset;              // ローカルヘッダ(ZIP)または圧縮データ(LZH)の位置
+  uint32_t csize;               // 圧縮後のサイズ
+  uint32_t usize;               // 展開後のサイズ
+  uint16_t time;                // 更新時刻 (Human68k形式)
+  uint16_t date;                // 更新日付 (Human68k形式)
+  uint8_t method;               // ARC_*
+  uint8_t atr;                  // ファイル属性
+} arcent_t;
+
+// アーカイブの索引
+// ZIPのセントラルディレクトリやLZHのヘッダを読み込んでパス名順に並べたもの
+// (中間のディレクトリが記録されていなければ補う)
+typedef struct arc {
+  struct arc *next;
+  int unit;
+  uint32_t hash;
+  uint32_t time;                // アーカイブのサイズと更新時刻を確認した時刻
+  uint32_t size;                // アーカイブのサイズ
+  uint64_t mtime;               // アーカイブの更新時刻
+  bool zip;                     // ZIP形式 (falseならLZH形式)
+  bool stale;                   // 内容が変わったので使用中でなくなったら解放する
+  int refs;                     // 使用中のFILBUF/FCBの数
+  int nent;                     // 索引のエントリ数 (-1=アーカイブとして読めなかった)
+  arcent_t *ent;
+  char *names;                  // パス名の格納領域
+  size_t nameslen;              // 格納済みのパス名の長さの合計
+  size_t namescap;              // パス名の格納領域のサイズ
+  char *path;                   // アーカイブのホストパス名
+} arc_t;
+
+typedef struct arcfile arcfile_t;
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+#define ARC_NAME(arc, e)  (&(arc)->names[(e)->name])
+
+bool arc_isarchive(const char *name, int len);
+arc_t *arc_lookup(int unit, const char *path, char *member, size_t size);
+void arc_ref(arc_t *arc);
+void arc_release(arc_t *arc);
+arcent_t *arc_find(arc_t *arc, const char *member);
+int arc_stat(arc_t *arc, const char *member);
+int arc_first(arc_t *arc, const char *dir);
+arcent_t *arc_next(arc_t *arc, const char *dir, int *pos, const char **name);
+void arc_invalidate(int unit, const char *path);
+void arc_invalidate_unit(int unit);
+
+arcfile_t *arc_fopen(int unit, arc_t *arc, arcent_t *ent, int *err);
+ssize_t arc_fread(arcfile_t *af, uint32_t pos, void *buf, size_t len, int *err);
+arcent_t *arc_fentry(arcfile_t *af);
+void arc_fclose(arcfile_t *af, bool close);
+
+#endif /* _ARCHIVE_H_ */
@@ -0,0 +1,1031 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <x68k/iocs.h>
+
+#include "smbfs.h"
+#include "cache.h"
+#include "lz.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+struct cache_stats cache_stats;
+
+// ページキャッシュの変更カウンタ (変更中は奇数になる)
+// ページキャッシュはDOSコールの処理とバックグラウンドスレッドの両方から変更されるため、
+// mutexを確保せずに読み出す場合は読み出しの前後でこの値が変わっていないことを確認する
+// (ディレクトリ一覧とファイル情報のキャッシュはDOSコールの処理からしか変更されない)
+volatile uint32_t pcache_seq;
+
+// ディレクトリ一覧とファイル情報のキャッシュを無効にした回数
+// (バックグラウンドで読み直した結果が、読み直した後の変更より古くないかを確かめるのに使う)
+volatile uint32_t dcache_gen;
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static dcache_t *dc_list;               // ディレクトリ一覧キャッシュ (新しい順)
+
+static cfile_t *cf_list;                // ページキャッシュのファイル
+static struct lru {
+  cpage_t *head;                        // 最近使われたページ
+  cpage_t *tail;                        // 最も使われていないページ
+} lru, zlru;                            // 展開されているページと圧縮されているページ
+static uint8_t zbuf[PCACHE_PAGESIZE];   // ページの圧縮用バッファ
+
+static volatile bool pcache_reading;    // mutexを確保せずに読み出し中
+static cpage_t *pcache_limbo;           // 読み出し中に解放されたため解放を遅らせているページ
+
+static scache_t sc_ent[SCACHE_MAXENT];  // ファイル情報キャッシュ
+static int sc_next;                     // 次に置き換えるエントリ
+
+//****************************************************************************
+// Utility routine
+//****************************************************************************
+
+// 単調増加する時刻 (1/100秒単位) を得る
+uint32_t cache_clock(void)
+{
+  static uint32_t last;
+  static uint32_t base;
+  uint32_t now = _iocs_ontime();
+  // 複数のスレッドから呼ばれて前後することがあるので、大きく戻った場合だけ日付の変化とみなす
+  if (now + 12 * 60 * 60 * 100 < last) {
+    base += 24 * 60 * 60 * 100;   // 日付が変わった
+  } else if (now < last) {
+    return base + last;
+  }
+  last = now;
+  return base + now;
+}
+
+// パス名の末尾の'/'を除いた長さを得る
+static int cache_pathlen(const char *path, int len)
+{
+  if (len < 0) {
+    len = strlen(path);
+  }
+  while (len > 0 && path[len - 1] == '/') {
+    len--;
+  }
+  return len;
+}
+
+// パス名のハッシュ値を得る (SMBのパス名は大文字小文字を区別しないので小文字化して計算する)
+uint32_t cache_hash(int unit, const char *path, int len)
+{
+  uint32_t h = 2166136261u ^ unit;
+  len = cache_pathlen(path, len);
+  for (int i = 0; i < len; i++) {
+    h = (h ^ tolower((uint8_t)path[i])) * 16777619u;
+  }
+  return h;
+}
+
+// パス名を比較する (p1は長さlen, p2は'\0'終端)
+bool cache_pathmatch(const char *p1, int len, const char *p2)
+{
+  len = cache_pathlen(p1, len);
+  if (cache_pathlen(p2, -1) != len) {
+    return false;
+  }
+  for (int i = 0; i < len; i++) {
+    if (tolower((uint8_t)p1[i]) != tolower((uint8_t)p2[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// パス名のディレクトリ部分の長さを得る
+int cache_dirlen(const char *path)
+{
+  char *p = strrchr(path, '/');
+  return p ? p - path : 0;
+}
+
+void cache_init(size_t budget, size_t zbudget)
+{
+  cache_stats.budget = budget / sizeof(cpage_t);
+  cache_stats.zbudget = cache_stats.budget > 0 ? zbudget : 0;
+  for (int i = 0; i < SCACHE_MAXENT; i++) {
+    sc_ent[i].unit = -1;
+  }
+}
+
+//****************************************************************************
+// Directory list cache
+//****************************************************************************
+
+static void dcache_free(dcache_t *dc)
+{
+  free(dc->ent);
+  free(dc->path);
+  free(dc);
+}
+
+dcache_t *dcache_lookup(int unit, const char *path, int len)
+{
+  if (cache_stats.budget == 0) {
+    return NULL;
+  }
+  uint32_t hash = cache_hash(unit, path, len);
+  dcache_t **pdc;
+  for (pdc = &dc_list; *pdc != NULL; pdc = &(*pdc)->next) {
+    dcache_t *dc = *pdc;
+    if (dc->unit == unit && dc->hash == hash && cache_pathmatch(path, len, dc->path)) {
+      *pdc = dc->next;          // リストの先頭に移動する
+      dc->next = dc_list;
+      dc_list = dc;
+      return dc;
+    }
+  }
+  return NULL;
+}
+
+// ディレクトリ一覧の記録を開始する
+dcache_t *dcache_begin(int unit, const char *path)
+{
+  dcache_t *dc = dcache_lookup(unit, path, -1);
+
+  if (dc == NULL) {
+    if (cache_stats.budget == 0) {
+      return NULL;
+    }
+    // キャッシュ数が上限に達していたら使われていない最も古い一覧を解放する
+    int n = 0;
+    dcache_t **pdc, **pvictim = NULL;
+    for (pdc = &dc_list; *pdc != NULL; pdc = &(*pdc)->next) {
+      n++;
+      if ((*pdc)->busy == 0) {
+        pvictim = pdc;
+      }
+    }
+    if (n >= DCACHE_MAXDIRS) {
+      if (pvictim == NULL) {
+        return NULL;
+      }
+      dcache_t *victim = *pvictim;
+      *pvictim = victim->next;
+      dcache_free(victim);
+    }
+
+    if ((dc = calloc(1, sizeof(dcache_t))) == NULL) {
+      return NULL;
+    }
+    dc->ent = malloc(sizeof(struct dos_filesinfo) * DCACHE_MAXENT);
+    dc->path = malloc(strlen(path) + 1);
+    if (dc->ent == NULL || dc->path == NULL) {
+      dcache_free(dc);
+      return NULL;
+    }
+    strcpy(dc->path, path);
+    dc->unit = unit;
+    dc->hash = cache_hash(unit, path, -1);
+    dc->lastopen = -1;
+    dc->next = dc_list;
+    dc_list = dc;
+  }
+  dc->busy++;
+  return dc;
+}
+
+void dcache_end(dcache_t *dc)
+{
+  if (dc != NULL && dc->busy > 0) {
+    dc->busy--;
+  }
+}
+
+// index番目のディレクトリエントリを記録する
+void dcache_record(dcache_t *dc, int index, struct dos_filesinfo *fi)
+{
+  if (dc == NULL || index >= DCACHE_MAXENT) {
+    return;
+  }
+  if (index < dc->nent) {
+    if (memcmp(&dc->ent[index], fi, sizeof(*fi)) == 0) {
+      return;                   // 前回の一覧と同じ
+    }
+    // 一覧が変化したので以降のエントリと先読みの状態を捨てる
+    dc->nent = index;
+    dc->complete = false;
+    dc->lastopen = -1;
+    if (dc->prefetched > index) {
+      dc->prefetched = index;
+    }
+  }
+  memcpy(&dc->ent[index], fi, sizeof(*fi));
+  dc->nent = index + 1;
+}
+
+// ディレクトリ一覧を最後まで記録した
+void dcache_finish(dcache_t *dc, int nent)
+{
+  if (dc == NULL) {
+    return;
+  }
+  if (nent <= DCACHE_MAXENT) {
+    dc->nent = nent;
+    dc->complete = true;
+  }
+  dc->time = cache_clock();
+}
+
+// 最後まで記録済みで有効期間内の一覧か
+bool dcache_fresh(dcache_t *dc)
+{
+  return dcache_valid(dc, PCACHE_TTL);
+}
+
+// 最後まで記録済みで記録してからmaxage以内の一覧か
+bool dcache_valid(dcache_t *dc, uint32_t maxage)
+{
+  return dc->complete && cache_clock() - dc->time <= maxage;
+}
+
+// ファイル名(SJIS)に一致するエントリを探す
+int dcache_find(dcache_t *dc, const char *name)
+{
+  for (int i = 0; i < dc->nent; i++) {
+    const char *p = dc->ent[i].name;
+    const char *q = name;
+    while (*p && tolower((uint8_t)*p) == tolower((uint8_t)*q)) {
+      p++;
+      q++;
+    }
+    if (*p == '\0' && *q == '\0') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void scache_invalidate(int unit, const char *path);
+
+// pathを含むディレクトリとpath自身の一覧、pathのファイル情報を無効にする
+void dcache_invalidate(int unit, const char *path)
+{
+  dcache_gen++;
+  scache_invalidate(unit, path);
+
+  int dirlen = cache_dirlen(path);
+  dcache_t **pdc = &dc_list;
+  while (*pdc != NULL) {
+    dcache_t *dc = *pdc;
+    if (dc->unit == unit &&
+        (cache_pathmatch(path, dirlen, dc->path) || cache_pathmatch(path, -1, dc->path))) {
+      if (dc->busy) {
+        dc->nent = 0;
+        dc->complete = false;
+        dc->lastopen = -1;
+        dc->prefetched = 0;
+      } else {
+        *pdc = dc->next;
+        dcache_free(dc);
+        continue;
+      }
+    }
+    pdc = &dc->next;
+  }
+}
+
+void dcache_invalidate_unit(int unit)
+{
+  dcache_gen++;
+  for (int i = 0; i < SCACHE_MAXENT; i++) {
+    if (sc_ent[i].unit == unit) {
+      sc_ent[i].unit = -1;
+    }
+  }
+
+  dcache_t **pdc = &dc_list;
+  while (*pdc != NULL) {
+    dcache_t *dc = *pdc;
+    if (dc->unit == unit) {
+      *pdc = dc->next;
+      dcache_free(dc);
+    } else {
+      pdc = &dc->next;
+    }
+  }
+}
+
+//****************************************************************************
+// File information cache
+//****************************************************************************
+
+static scache_t *scache_find(int unit, const char *path)
+{
+  uint32_t hash = cache_hash(unit, path, -1);
+  for (int i = 0; i < SCACHE_MAXENT; i++) {
+    scache_t *sc = &sc_ent[i];
+    if (sc->unit == unit && sc->hash == hash && cache_pathmatch(path, -1, sc->path)) {
+      return sc;
+    }
+  }
+  return NULL;
+}
+
+static void scache_invalidate(int unit, const char *path)
+{
+  scache_t *sc = scache_find(unit, path);
+  if (sc) {
+    sc->unit = -1;
+  }
+}
+
+// キャッシュからファイル情報を得る
+// nameはpathの最後の要素のSJIS表記 (NULLならpathのディレクトリ一覧も参照する)
+// 戻り値: 1=存在する 0=存在しない -1=不明
+int scache_lookup(int unit, const char *path, const char *name, uint8_t *atr)
+{
+  return scache_lookup_age(unit, path, name, atr, PCACHE_TTL);
+}
+
+// 記録してからmaxage以内のキャッシュからファイル情報を得る
+int scache_lookup_age(int unit, const char *path, const char *name, uint8_t *atr, uint32_t maxage)
+{
+  if (cache_stats.budget == 0) {
+    return -1;
+  }
+  scache_t *sc = scache_find(unit, path);
+  if (sc && cache_clock() - sc->time <= maxage) {
+    if (atr) {
+      *atr = sc->atr;
+    }
+    return sc->exists;
+  }
+
+  dcache_t *dc;
+  if (name) {
+    // 親ディレクトリの一覧があれば、そこに含まれているかで判断する
+    if ((dc = dcache_lookup(unit, path, cache_dirlen(path))) != NULL && dcache_valid(dc, maxage)) {
+      int i = dcache_find(dc, name);
+      if (i >= 0 && atr) {
+        *atr = dc->ent[i].atr;
+      }
+      return i >= 0;
+    }
+  } else {
+    // ディレクトリ自身の一覧があればディレクトリは存在する
+    if ((dc = dcache_lookup(unit, path, -1)) != NULL && dcache_valid(dc, maxage)) {
+      if (atr) {
+        *atr = 0x10;
+      }
+      return 1;
+    }
+  }
+  return -1;
+}
+
+// ファイル情報をキャッシュに記録する
+void scache_enter(int unit, const char *path, bool exists, uint8_t atr)
+{
+  if (cache_stats.budget == 0 || strlen(path) >= SCACHE_PATHLEN) {
+    return;
+  }
+  scache_t *sc = scache_find(unit, path);
+  if (sc == NULL) {
+    sc = &sc_ent[sc_next];
+    sc_next = (sc_next + 1) % SCACHE_MAXENT;
+    strcpy(sc->path, path);
+    sc->unit = unit;
+    sc->hash = cache_hash(unit, path, -1);
+  }
+  sc->time = cache_clock();
+  sc->exists = exists;
+  sc->atr = atr;
+}
+
+//****************************************************************************
+// Page cache
+//****************************************************************************
+
+// ページキャッシュの変更を開始する
+// mutexを確保せずに読み出し中でなければ、解放を遅らせていたページを解放する
+static void pcache_write_begin(void)
+{
+  pcache_seq++;
+  if (!pcache_reading) {
+    while (pcache_limbo) {
+      cpage_t *pg = pcache_limbo;
+      pcache_limbo = pg->lru_next;
+      free(pg);
+    }
+  }
+}
+
+static void pcache_write_end(void)
+{
+  pcache_seq++;
+}
+
+static void lru_unlink(struct lru *l, cpage_t *pg)
+{
+  if (pg->lru_prev) {
+    pg->lru_prev->lru_next = pg->lru_next;
+  } else {
+    l->head = pg->lru_next;
+  }
+  if (pg->lru_next) {
+    pg->lru_next->lru_prev = pg->lru_prev;
+  } else {
+    l->tail = pg->lru_prev;
+  }
+}
+
+static void lru_push(struct lru *l, cpage_t *pg)
+{
+  pg->lru_prev = NULL;
+  pg->lru_next = l->head;
+  if (l->head) {
+    l->head->lru_prev = pg;
+  } else {
+    l->tail = pg;
+  }
+  l->head = pg;
+}
+
+static void lru_touch(struct lru *l, cpage_t *pg)
+{
+  if (l->head == pg) {
+    return;
+  }
+  lru_unlink(l, pg);
+  lru_push(l, pg);
+}
+
+static void cfile_free_if_unused(cfile_t *cf)
+{
+  if (cf->refs > 0 || cf->pages != NULL) {
+    return;
+  }
+  for (cfile_t **pcf = &cf_list; *pcf != NULL; pcf = &(*pcf)->next) {
+    if (*pcf == cf) {
+      *pcf = cf->next;
+      free(cf->path);
+      free(cf);
+      return;
+    }
+  }
+}
+
+// ページのメモリを解放する
+static void page_release(cpage_t *pg)
+{
+  if (pcache_reading) {
+    // mutexを確保せずに読み出し中のページかもしれないので、解放を遅らせる
+    // (pg->nextは読み出し中の処理が辿れるように解放後もしばらく有効に保つ)
+    pg->cf = NULL;
+    pg->lru_next = (cpage_t *)pcache_limbo;
+    pcache_limbo = pg;
+  } else {
+    free(pg);
+  }
+}
+
+// ページを解放する (pcache_write_begin()とpcache_write_end()の間で呼ぶ)
+static void page_free(cpage_t *pg)
+{
+  cfile_t *cf = pg->cf;
+  for (cpage_t **ppg = &cf->pages; *ppg != NULL; ppg = &(*ppg)->next) {
+    if (*ppg == pg) {
+      *ppg = pg->next;
+      break;
+    }
+  }
+  if (pg->zlen) {
+    lru_unlink(&zlru, pg);
+    cache_stats.zpages--;
+    cache_stats.zbytes -= offsetof(cpage_t, data) + pg->zlen;
+  } else {
+    lru_unlink(&lru, pg);
+    cache_stats.pages--;
+  }
+  page_release(pg);
+}
+
+// 追い出すページを圧縮して残す (残せなければfalseを返す)
+// 先読みされたまま読まれなかったページや、圧縮できないページが続いたファイルのページは残さない
+// (pcache_write_begin()とpcache_write_end()の間で呼ぶ)
+static bool page_compress(cpage_t *pg)
+{
+  cfile_t *cf = pg->cf;
+  if (cache_stats.zbudget == 0 || pg->len == 0 || pg->prefetched) {
+    return false;
+  }
+  if (cf->zfail >= PCACHE_ZFAILMAX && (pg->pageno % PCACHE_ZRETRY) != 0) {
+    cache_stats.zskipped++;
+    return false;
+  }
+
+  // 圧縮しても3/4以下にならないページは展開の手間に見合わないので残さない
+  size_t zlen = lz_compress(pg->data, pg->len, zbuf, pg->len * 3 / 4);
+  if (zlen == 0) {
+    if (cf->zfail < PCACHE_ZFAILMAX) {
+      cf->zfail++;
+    }
+    cache_stats.zskipped++;
+    return false;
+  }
+  cf->zfail = 0;
+
+  size_t size = offsetof(cpage_t, data) + zlen;
+  if (size > cache_stats.zbudget) {
+    return false;
+  }
+  while (cache_stats.zbytes + size > cache_stats.zbudget) {
+    cpage_t *victim = zlru.tail;
+    cfile_t *vcf = victim->cf;
+    page_free(victim);
+    cache_stats.evicted++;
+    if (vcf != cf) {
+      cfile_free_if_unused(vcf);
+    }
+  }
+  cpage_t *zp = malloc(size);
+  if (zp == NULL) {
+    return false;
+  }
+  zp->cf = cf;
+  zp->pageno = pg->pageno;
+  zp->len = pg->len;
+  zp->zlen = zlen;
+  zp->ref = 0;
+  zp->prefetched = 0;
+  zp->time = pg->time;
+  memcpy(zp->data, zbuf, zlen);
+
+  // ファイルのページリスト上で置き換える
+  zp->next = pg->next;
+  for (cpage_t **ppg = &cf->pages; *ppg != NULL; ppg = &(*ppg)->next) {
+    if (*ppg == pg) {
+      *ppg = zp;
+      break;
+    }
+  }
+  lru_unlink(&lru, pg);
+  lru_push(&zlru, zp);
+  page_release(pg);
+  cache_stats.pages--;
+  cache_stats.zpages++;
+  cache_stats.zbytes += size;
+  cache_stats.zstored++;
+  return true;
+}
+
+static cpage_t *page_find(cfile_t *cf, uint32_t pageno)
+{
+  for (cpage_t *pg = cf->pages; pg != NULL && pg->pageno <= pageno; pg = pg->next) {
+    if (pg->pageno == pageno) {
+      return pg;
+    }
+  }
+  return NULL;
+}
+
+cfile_t *pcache_file(int unit, const char *path, bool create)
+{
+  if (cache_stats.budget == 0) {
+    return NULL;
+  }
+  uint32_t hash = cache_hash(unit, path, -1);
+  cfile_t *cf;
+  for (cf = cf_list; cf != NULL; cf = cf->next) {
+    if (cf->unit == unit && cf->hash == hash && cache_pathmatch(path, -1, cf->path)) {
+      if (cache_clock() - cf->time > PCACHE_TTL) {
+        pcache_invalidate(cf);  // 有効期間を過ぎたキャッシュは使わない
+      }
+      return cf;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  if ((cf = calloc(1, sizeof(cfile_t))) == NULL) {
+    return NULL;
+  }
+  if ((cf->path = malloc(strlen(path) + 1)) == NULL) {
+    free(cf);
+    return NULL;
+  }
+  strcpy(cf->path, path);
+  cf->unit = unit;
+  cf->hash = hash;
+  cf->time = cache_clock();
+  cf->next = cf_list;
+  cf_list = cf;
+  return cf;
+}
+
+void pcache_ref(cfile_t *cf)
+{
+  if (cf) {
+    cf->refs++;
+  }
+}
+
+void pcache_release(cfile_t *cf)
+{
+  if (cf) {
+    cf->refs--;
+    cfile_free_if_unused(cf);
+  }
+}
+
+bool pcache_has_page(cfile_t *cf, uint32_t pageno)
+{
+  return page_find(cf, pageno) != NULL;
+}
+
+// 新しいページを確保する (上限に達していたら最も使われていないページを追い出す)
+static cpage_t *page_alloc(cfile_t *cf, uint32_t pageno)
+{
+  cpage_t *pg;
+
+  pcache_write_begin();
+  if (cache_stats.pages >= cache_stats.budget && lru.tail != NULL) {
+    // 最近読まれたページは一度だけ見逃す
+    for (int i = cache_stats.pages; i > 0 && lru.tail->ref; i--) {
+      lru.tail->ref = 0;
+      lru_touch(&lru, lru.tail);
+    }
+    pg = lru.tail;
+    if (!page_compress(pg)) {
+      cfile_t *victim = pg->cf;
+      page_free(pg);
+      cache_stats.evicted++;
+      if (victim != cf) {
+        cfile_free_if_unused(victim);
+      }
+    }
+  }
+  if ((pg = malloc(sizeof(cpage_t))) == NULL) {
+    pcache_write_end();
+    return NULL;
+  }
+  pg->cf = cf;
+  pg->pageno = pageno;
+  pg->len = 0;
+  pg->zlen = 0;
+  pg->ref = 0;
+  pg->prefetched = 0;
+  pg->time = cache_clock();
+
+  // ファイルのページリストにオフセット順で繋ぐ
+  cpage_t **ppg;
+  for (ppg = &cf->pages; *ppg != NULL && (*ppg)->pageno < pageno; ppg = &(*ppg)->next)
+    ;
+  pg->next = *ppg;
+  *ppg = pg;
+
+  lru_push(&lru, pg);
+  cache_stats.pages++;
+  pcache_write_end();
+  return pg;
+}
+
+// 圧縮されているページを展開したページに置き換える
+static cpage_t *page_expand(cpage_t *zp)
+{
+  cfile_t *cf = zp->cf;
+
+  // 新しいページを確保する間に追い出されないように、先にリストから外しておく
+  pcache_write_begin();
+  for (cpage_t **ppg = &cf->pages; *ppg != NULL; ppg = &(*ppg)->next) {
+    if (*ppg == zp) {
+      *ppg = zp->next;
+      break;
+    }
+  }
+  lru_unlink(&zlru, zp);
+  cache_stats.zpages--;
+  cache_stats.zbytes -= offsetof(cpage_t, data) + zp->zlen;
+  pcache_write_end();
+
+  cpage_t *pg = page_alloc(cf, zp->pageno);
+  pcache_write_begin();
+  if (pg != NULL) {
+    if (lz_decompress(zp->data, zp->zlen, pg->data, zp->len) == zp->len) {
+      pg->len = zp->len;
+      pg->time = zp->time;
+      cache_stats.zhits++;
+    }
+  }
+  page_release(zp);
+  pcache_write_end();
+  return pg;
+}
+
+// ページを確保する (キャッシュ済みのページがあればそれを返す)
+cpage_t *pcache_alloc_page(cfile_t *cf, uint32_t pageno)
+{
+  cpage_t *pg = page_find(cf, pageno);
+  if (pg == NULL) {
+    return page_alloc(cf, pageno);
+  }
+  if (pg->zlen) {
+    return page_expand(pg);
+  }
+  lru_touch(&lru, pg);
+  return pg;
+}
+
+// offsetから連続してキャッシュされている範囲を読み出す (読み出せたバイト数を返す)
+size_t pcache_read(cfile_t *cf, uint32_t offset, void *buf, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    uint32_t pageno = offset / PCACHE_PAGESIZE;
+    uint32_t pageoff = offset % PCACHE_PAGESIZE;
+    cpage_t *pg = page_find(cf, pageno);
+    if (pg != NULL && pg->zlen) {
+      pg = page_expand(pg);
+    }
+    if (pg == NULL || pageoff >= pg->len) {
+      break;
+    }
+    size_t n = pg->len - pageoff;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy((uint8_t *)buf + done, &pg->data[pageoff], n);
+    if (pg->prefetched) {
+      pg->prefetched = 0;
+      cache_stats.prefetch_used++;
+    }
+    lru_touch(&lru, pg);
+    done += n;
+    offset += n;
+    if (pg->len < PCACHE_PAGESIZE) {
+      break;                    // ファイル末尾のページ
+    }
+  }
+  cache_stats.hit_bytes += done;
+  return done;
+}
+
+// mutexを確保せずにoffsetから連続してキャッシュされている範囲を読み出す
+// 読み出し中にページキャッシュが変更された場合は-1を返すので、mutexを確保して読み直す
+// (LRUリストは変更せず、読まれたページに印を付けるだけにする)
+ssize_t pcache_read_nolock(cfile_t *cf, uint32_t offset, void *buf, size_t len)
+{
+  pcache_reading = true;
+  uint32_t seq = pcache_seq;
+  if (seq & 1) {                // バックグラウンドスレッドが変更中
+    pcache_reading = false;
+    cache_stats.fast_retries++;
+    return -1;
+  }
+
+  size_t done = 0;
+  int used = 0;
+  while (done < len) {
+    uint32_t pageno = offset / PCACHE_PAGESIZE;
+    uint32_t pageoff = offset % PCACHE_PAGESIZE;
+    cpage_t *pg = page_find(cf, pageno);
+    if (pg == NULL || pg->zlen || pageoff >= pg->len) {
+      break;                    // 圧縮されているページはmutexを確保して展開する
+    }
+    size_t n = pg->len - pageoff;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy((uint8_t *)buf + done, &pg->data[pageoff], n);
+    pg->ref = 1;
+    if (pg->prefetched) {
+      pg->prefetched = 0;
+      used++;
+    }
+    done += n;
+    offset += n;
+    if (pg->len < PCACHE_PAGESIZE) {
+      break;                    // ファイル末尾のページ
+    }
+  }
+
+  bool changed = (pcache_seq != seq);
+  pcache_reading = false;
+  if (changed) {
+    cache_stats.fast_retries++;
+    return -1;
+  }
+  cache_stats.prefetch_used += used;
+  cache_stats.hit_bytes += done;
+  return done;
+}
+
+// サーバから読んだデータをキャッシュに格納する
+// (ページ全体が含まれているか、ファイル末尾までを含むページだけを格納する)
+void pcache_fill(cfile_t *cf, uint32_t offset, const void *buf, size_t len)
+{
+  uint32_t end = offset + len;
+  uint32_t pageno = (offset + PCACHE_PAGESIZE - 1) / PCACHE_PAGESIZE;
+  for (; pageno * PCACHE_PAGESIZE < end; pageno++) {
+    uint32_t pstart = pageno * PCACHE_PAGESIZE;
+    uint32_t plen = end - pstart;
+    if (plen > PCACHE_PAGESIZE) {
+      plen = PCACHE_PAGESIZE;
+    } else if (plen < PCACHE_PAGESIZE && end != cf->size) {
+      break;
+    }
+    cpage_t *pg = pcache_alloc_page(cf, pageno);
+    if (pg == NULL) {
+      break;
+    }
+    pcache_write_begin();
+    memcpy(pg->data, (const uint8_t *)buf + (pstart - offset), plen);
+    pg->len = plen;
+    pcache_write_end();
+  }
+}
+
+// サーバから読んだ1ページ分のデータをキャッシュに格納する
+cpage_t *pcache_store_page(cfile_t *cf, uint32_t pageno, const void *buf, size_t len)
+{
+  cpage_t *pg = pcache_alloc_page(cf, pageno);
+  if (pg == NULL) {
+    return NULL;
+  }
+  pcache_write_begin();
+  memcpy(pg->data, buf, len);
+  pg->len = len;
+  pcache_write_end();
+  return pg;
+}
+
+// 書き込んだデータでキャッシュされているページを書き換える (sizeは書き込み後のファイルサイズ)
+// ページの有効なデータ長を越える書き込みのページや圧縮されているページは捨てる
+void pcache_write(cfile_t *cf, uint32_t offset, const void *buf, size_t len, uint32_t size)
+{
+  uint32_t end = offset + len;
+  cpage_t *pg;
+  pcache_write_begin();
+  if (cf->size != size) {
+    // ファイル末尾だったページは長さが変わるので捨てる
+    if ((pg = page_find(cf, cf->size / PCACHE_PAGESIZE)) != NULL) {
+      page_free(pg);
+    }
+    cf->size = size;
+  }
+  for (uint32_t pageno = offset / PCACHE_PAGESIZE; pageno * PCACHE_PAGESIZE < end; pageno++) {
+    if ((pg = page_find(cf, pageno)) == NULL) {
+      continue;
+    }
+    uint32_t pstart = pageno * PCACHE_PAGESIZE;
+    uint32_t lo = offset > pstart ? offset - pstart : 0;
+    uint32_t hi = end - pstart < PCACHE_PAGESIZE ? end - pstart : PCACHE_PAGESIZE;
+    if (pg->zlen || hi > pg->len) {
+      page_free(pg);
+      continue;
+    }
+    memcpy(&pg->data[lo], (const uint8_t *)buf + (pstart + lo - offset), hi - lo);
+  }
+  pcache_write_end();
+}
+
+// ファイルサイズが変わっていたらキャッシュを捨てる
+void pcache_validate(cfile_t *cf, uint32_t size)
+{
+  if (cf->size != size) {
+    pcache_invalidate(cf);
+    cf->size = size;
+  }
+  cf->time = cache_clock();
+}
+
+void pcache_invalidate(cfile_t *cf)
+{
+  if (cf->pages == NULL) {
+    return;
+  }
+  pcache_write_begin();
+  while (cf->pages != NULL) {
+    page_free(cf->pages);
+  }
+  pcache_write_end();
+}
+
+void pcache_invalidate_path(int unit, const char *path)
+{
+  cfile_t *cf = pcache_file(unit, path, false);
+  if (cf) {
+    pcache_invalidate(cf);
+    cfile_free_if_unused(cf);
+  }
+}
+
+void pcache_invalidate_unit(int unit)
+{
+  cfile_t *cf = cf_list;
+  while (cf != NULL) {
+    cfile_t *next = cf->next;
+    if (cf->unit == unit) {
+      pcache_invalidate(cf);
+      cfile_free_if_unused(cf);
+    }
+    cf = next;
+  }
+}
+
+//****************************************************************************
+// Cache introspection
+//****************************************************************************
+
+// pathについてキャッシュされている情報を調べる (キャッシュの状態は変更しない)
+// nameはpathの最後の要素のSJIS表記
+void cache_query(int unit, const char *path, const char *name, struct smbcmd_querycache *q)
+{
+  uint32_t now = cache_clock();
+
+  q->flags = 0;
+  q->ttl = PCACHE_TTL;
+  q->page_size = PCACHE_PAGESIZE;
+  q->npages = 0;
+
+  scache_t *sc = scache_find(unit, path);
+  if (sc) {
+    q->flags |= QC_STAT | (sc->exists ? 0 : QC_NEGATIVE);
+    q->flags |= now - sc->time <= PCACHE_TTL ? QC_STAT_FRESH : 0;
+    q->stat_atr = sc->atr;
+    q->stat_age = now - sc->time;
+  }
+
+  int dirlen = cache_dirlen(path);
+  uint32_t dirhash = cache_hash(unit, path, dirlen);
+  uint32_t hash = cache_hash(unit, path, -1);
+  for (dcache_t *dc = dc_list; dc != NULL; dc = dc->next) {
+    if (dc->unit != unit) {
+      continue;
+    }
+    if (dc->hash == dirhash && cache_pathmatch(path, dirlen, dc->path) &&
+        dcache_find(dc, name) >= 0) {
+      q->flags |= QC_LISTED;
+    }
+    if (dc->hash == hash && cache_pathmatch(path, -1, dc->path)) {
+      q->flags |= QC_DIRLIST | (dc->complete ? QC_DIRLIST_COMPLETE : 0);
+      q->dir_age = now - dc->time;
+      q->dir_nent = dc->nent;
+    }
+  }
+
+  cfile_t *cf;
+  for (cf = cf_list; cf != NULL; cf = cf->next) {
+    if (cf->unit == unit && cf->hash == hash && cache_pathmatch(path, -1, cf->path)) {
+      break;
+    }
+  }
+  if (cf == NULL) {
+    return;
+  }
+  q->flags |= QC_FILE;
+  q->flags |= now - cf->time <= PCACHE_TTL ? QC_FILE_FRESH : 0;
+  q->flags |= cf->refs > 0 ? QC_PINNED : 0;
+  q->file_age = now - cf->time;
+  q->file_size = cf->size;
+  q->file_refs = cf->refs;
+  for (cpage_t *pg = cf->pages; pg != NULL; pg = pg->next) {
+    if (q->npages < q->pages_len) {
+      struct smbcmd_qcpage *qp = &q->pages[q->npages];
+      qp->pageno = pg->pageno;
+      qp->age = now - pg->time;
+      qp->len = pg->len;
+      qp->flags = (pg->ref ? QCP_REF : 0) | (pg->prefetched ? QCP_PREFETCHED : 0) |
+                  (pg->zlen ? QCP_COMPRESSED : 0);
+      qp->reserved = 0;
+    }
+    q->npages++;
+  }
+}
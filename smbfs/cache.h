@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <humandefs.h>
+#include <smbfscmd.h>
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define PCACHE_PAGESIZE   2048          // ページキャッシュのページサイズ
+#define PCACHE_TTL        (10 * 100)    // ページキャッシュの有効期間 (1/100秒)
+#define PCACHE_ZFAILMAX   2             // 圧縮できないページがこの数続いたファイルは
+#define PCACHE_ZRETRY     8             // この数のページに1つだけ圧縮を試す
+
+#define DCACHE_MAXDIRS    4             // 一覧をキャッシュするディレクトリ数
+#define DCACHE_MAXENT     128           // 1ディレクトリあたりのキャッシュエントリ数
+
+#define SCACHE_MAXENT     16            // ファイル情報キャッシュのエントリ数
+#define SCACHE_PATHLEN    96            // ファイル情報をキャッシュするパス名の長さの上限
+
+//****************************************************************************
+// Data types
+//****************************************************************************
+
+// ディレクトリ一覧キャッシュ
+// FILES/NFILESで得られたディレクトリエントリを一覧の順序で保持する
+typedef struct dcache {
+  struct dcache *next;
+  int unit;
+  uint32_t hash;
+  uint32_t time;                // 一覧を記録した時刻
+  int busy;                     // 一覧を記録中のFILBUFの数
+  bool complete;                // 一覧を最後まで記録済み
+  int nent;                     // 記録済みのエントリ数
+  int lastopen;                 // 直前にopenされたエントリ (-1=なし)
+  int prefetched;               // 先読みを要求済みのエントリの上限
+  char *path;                   // ディレクトリのホストパス名
+  struct dos_filesinfo *ent;    // ディレクトリエントリ (DCACHE_MAXENT個)
+} dcache_t;
+
+struct cfile;
+
+// ページキャッシュのページ
+typedef struct cpage {
+  struct cpage *lru_prev;       // LRUリスト
+  struct cpage *lru_next;
+  struct cpage *next;           // 同じファイルのページ (オフセット順)
+  struct cfile *cf;
+  uint32_t pageno;
+  uint16_t len;                 // 有効なデータ長
+  uint16_t zlen;                // 圧縮されたデータ長 (0=圧縮されていない)
+  volatile uint8_t ref;         // 最近読まれた (追い出し時に一度だけ見逃す)
+  volatile uint8_t prefetched;  // 先読みされてまだ読まれていない
+  uint32_t time;                // ページを確保した時刻
+  uint8_t data[PCACHE_PAGESIZE]; // (圧縮されたページはzlenバイトだけ確保する)
+} cpage_t;
+
+// ページキャッシュのファイル
+typedef struct cfile {
+  struct cfile *next;
+  int unit;
+  uint32_t hash;
+  uint32_t time;                // ファイルサイズを確認した時刻
+  uint32_t size;                // ファイルサイズ
+  int refs;                     // このファイルを参照しているFCBの数
+  int zfail;                    // 続けて圧縮できなかったページ数
+  int writers;                  // 書き込みをライトバックしているFCBの数
+  cpage_t *pages;               // キャッシュされているページ (オフセット順)
+  char *path;                   // ファイルのホストパス名
+} cfile_t;
+
+// ファイル情報キャッシュ
+// ファイルやディレクトリの有無と属性を保持する (存在しないことも記録する)
+typedef struct {
+  int unit;                     // ユニット番号 (-1=未使用)
+  uint32_t hash;
+  uint32_t time;                // 記録した時刻
+  bool exists;                  // ファイルが存在する
+  uint8_t atr;                  // ファイル属性
+  char path[SCACHE_PATHLEN];
+} scache_t;
+
+// キャッシュの統計情報
+struct cache_stats {
+  uint32_t read_hits;           // キャッシュから読めたreadの数
+  uint32_t read_misses;         // サーバから読んだreadの数
+  uint32_t hit_bytes;           // キャッシュから読んだバイト数
+  uint32_t prefetch_issued;     // 先読みしたページ数
+  uint32_t prefetch_used;       // 先読みしたページのうち読まれたページ数
+  uint32_t evicted;             // 追い出されたページ数
+  uint32_t pages;               // 現在のページ数
+  uint32_t budget;              // ページキャッシュの上限ページ数
+  uint32_t fast_hits;           // mutexを確保せずに処理できたDOSコールの数
+  uint32_t fast_retries;        // 処理中にキャッシュが変更されてやり直した数
+  uint32_t zpages;              // 現在の圧縮されたページ数
+  uint32_t zbytes;              // 圧縮されたページが使っているバイト数
+  uint32_t zbudget;             // 圧縮されたページに使うバイト数の上限 (0=圧縮しない)
+  uint32_t zstored;             // 追い出す代わりに圧縮したページ数
+  uint32_t zhits;               // 圧縮されたページを展開して読んだ数
+  uint32_t zskipped;            // 圧縮できなかったか、圧縮を試さなかったページ数
+  uint32_t wb_absorbed;         // サーバに書かずに保持したwriteの数
+  uint32_t wb_flushed;          // 保持していた書き込みをサーバに書いた回数
+  uint32_t stride_records;      // 一定間隔のreadを検出して先読みを要求したレコード数
+  uint32_t stride_backoffs;     // 間隔が変わって先読みするレコード数を減らした回数
+  uint32_t stale_hits;          // 期限切れの一覧やファイル情報をそのまま返した数
+  uint32_t revalidated;         // バックグラウンドで読み直してキャッシュに反映した数
+};
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+extern struct cache_stats cache_stats;
+extern volatile uint32_t pcache_seq;
+extern volatile uint32_t dcache_gen;
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+uint32_t cache_clock(void);
+uint32_t cache_hash(int unit, const char *path, int len);
+int cache_dirlen(const char *path);
+bool cache_pathmatch(const char *p1, int len, const char *p2);
+void cache_init(size_t budget, size_t zbudget);
+
+dcache_t *dcache_lookup(int unit, const char *path, int len);
+dcache_t *dcache_begin(int unit, const char *path);
+void dcache_end(dcache_t *dc);
+void dcache_record(dcache_t *dc, int index, struct dos_filesinfo *fi);
+void dcache_finish(dcache_t *dc, int nent);
+bool dcache_fresh(dcache_t *dc);
+bool dcache_valid(dcache_t *dc, uint32_t maxage);
+int dcache_find(dcache_t *dc, const char *name);
+void dcache_invalidate(int unit, const char *path);
+void dcache_invalidate_unit(int unit);
+
+int scache_lookup(int unit, const char *path, const char *name, uint8_t *atr);
+int scache_lookup_age(int unit, const char *path, const char *name, uint8_t *atr, uint32_t maxage);
+void scache_enter(int unit, const char *path, bool exists, uint8_t atr);
+
+cfile_t *pcache_file(int unit, const char *path, bool create);
+void pcache_ref(cfile_t *cf);
+void pcache_release(cfile_t *cf);
+bool pcache_has_page(cfile_t *cf, uint32_t pageno);
+cpage_t *pcache_alloc_page(cfile_t *cf, uint32_t pageno);
+size_t pcache_read(cfile_t *cf, uint32_t offset, void *buf, size_t len);
+ssize_t pcache_read_nolock(cfile_t *cf, uint32_t offset, void *buf, size_t len);
+void pcache_fill(cfile_t *cf, uint32_t offset, const void *buf, size_t len);
+cpage_t *pcache_store_page(cfile_t *cf, uint32_t pageno, const void *buf, size_t len);
+void pcache_write(cfile_t *cf, uint32_t offset, const void *buf, size_t len, uint32_t size);
+void pcache_validate(cfile_t *cf, uint32_t size);
+void pcache_invalidate(cfile_t *cf);
+void pcache_invalidate_path(int unit, const char *path);
+void pcache_invalidate_unit(int unit);
+
+void cache_query(int unit, const char *path, const char *name, struct smbcmd_querycache *q);
+
+#endif /* _CACHE_H_ */
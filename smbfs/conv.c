@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <humandefs.h>
+
+#include "smbfs.h"
+#include "fileop.h"
+#include "conv.h"
+
+//****************************************************************************
+// Human68k <-> host conversion
+//****************************************************************************
+
+// struct statのファイル情報を変換する
+void conv_statinfo(TYPE_STAT *st, void *v)
+{
+  struct dos_filesinfo *f = (struct dos_filesinfo *)v;
+
+  f->atr = FUNC_FILEMODE_ATTR(st);
+  f->filelen = htobe32(STAT_SIZE(st));
+  time_t mtime = STAT_MTIME(st);
+  struct tm *tm = localtime(&mtime);
+  f->time = htobe16(tm->tm_hour << 11 | tm->tm_min << 5 | tm->tm_sec >> 1);
+  f->date = htobe16((tm->tm_year - 80) << 9 | (tm->tm_mon + 1) << 5 | tm->tm_mday);
+}
+
+// パス名の要素1つをSJISからUTF-8に変換してホストのパスに追加する
+int conv_namebuf_sub(const char *src, size_t src_len, char **dst_buf, size_t *dst_len, char *dst_top)
+{
+  if (*dst_buf > dst_top && (*dst_buf)[-1] != '/') {
+    if (*dst_len == 0)
+      return -1;
+    *(*dst_buf)++ = '/';    //要素の手前の'/'
+    (*dst_len)--;
+  }
+  char *src_buf = (char *)src;
+  return FUNC_ICONV_S2U(&src_buf, &src_len, dst_buf, dst_len);
+}
+
+// namestsの主ファイル名と拡張子からSJISのファイル名を作る (長さを返す)
+// (derived from HFS.java by Makoto Kamada)
+int conv_namests_name(struct dos_namestbuf *ns, uint8_t *bb)
+{
+  int k = 0;
+  memcpy(&bb[k], ns->name1, sizeof(ns->name1));   //主ファイル名1
+  k += sizeof(ns->name1);
+  memcpy(&bb[k], ns->name2, sizeof(ns->name2));   //主ファイル名2
+  k += sizeof(ns->name2);
+  for (; k > 0 && bb[k - 1] == 0x00; k--)   //主ファイル名2の末尾の0x00を切り捨てる
+    ;
+  for (; k > 0 && bb[k - 1] == 0x20; k--)   //主ファイル名1の末尾の0x20を切り捨てる
+    ;
+  bb[k++] = 0x2e;  //拡張子の手前の'.'
+  memcpy(&bb[k], ns->ext, sizeof(ns->ext));   //拡張子
+  k += sizeof(ns->ext);
+  for (; k > 0 && bb[k - 1] == 0x20; k--)   //拡張子の末尾の0x20を切り捨てる
+    ;
+  for (; k > 0 && bb[k - 1] == 0x2e; k--)   //主ファイル名の末尾の0x2eを切り捨てる
+    ;
+  return k;
+}
+
+// namestsのパスをホストのパスに変換する
+// (derived from HFS.java by Makoto Kamada)
+// パス名の要素ごとにSJISからUTF-8に変換して、中間バッファを介さずに直接ホストのパスを作る
+// rootはマウント先のパス名、sizeはpathのバッファサイズ
+int conv_namebuf_root(const char *root, struct dos_namestbuf *ns, bool full, char *path, size_t size)
+{
+  char *dst_top = path;
+  int len = strlen(root);
+  if (len >= size - 1) {
+    return -1;
+  }
+  strcpy(dst_top, root);    //マウント先パス名を前置
+  char *dst_buf = dst_top + len;
+  size_t dst_len = size - 1 - len;  //パス名バッファ残りサイズ
+
+  // パスの区切り 0x09 ごとにディレクトリ名を変換する
+  for (int i = 0; i < 65; ) {
+    for (; i < 65 && ns->path[i] == 0x09; i++)  //0x09の並びを読み飛ばす
+      ;
+    if (i >= 65 || ns->path[i] == 0x00)   //ディレクトリ名がなかった
+      break;
+    int j = i;
+    for (; i < 65 && ns->path[i] != 0x00 && ns->path[i] != 0x09; i++)
+      ;
+    if (conv_namebuf_sub(&ns->path[j], i - j, &dst_buf, &dst_len, dst_top) < 0) {
+      return -1;  //変換できなかった
+    }
+  }
+  // 主ファイル名を展開する
+  if (full) {
+    uint8_t bb[8 + 10 + 1 + 3];   // SJISでのファイル名
+    int k = conv_namests_name(ns, bb);
+    if (conv_namebuf_sub((char *)bb, k, &dst_buf, &dst_len, dst_top) < 0) {
+      return -1;  //変換できなかった
+    }
+  }
+  *dst_buf = '\0';
+  return 0;
+}
+
+// errnoをHuman68kのエラーコードに変換する
+int conv_errno(int err)
+{
+  switch (err) {
+  case 0:
+    return 0;
+  case ENOENT:
+    return _DOSE_NOENT;
+  case ENOTDIR:
+    return _DOSE_NODIR;
+  case EMFILE:
+    return _DOSE_MFILE;
+  case EISDIR:
+    return _DOSE_ISDIR;
+  case EBADF:
+    return _DOSE_BADF;
+  case ENOMEM:
+    return _DOSE_NOMEM;
+  case EFAULT:
+    return _DOSE_ILGMPTR;
+  case ENOEXEC:
+    return _DOSE_ILGFMT;
+  /* case EINVAL:       // open
+    return _DOSE_ILGARG; */
+  case ENAMETOOLONG:
+    return _DOSE_ILGFNAME;
+  case EINVAL:
+    return _DOSE_ILGPARM;
+  case EXDEV:
+    return _DOSE_ILGDRV;
+  /* case EINVAL:       // rmdir
+    return _DOSE_ISCURDIR; */
+  case EACCES:
+  case EPERM:
+  case EROFS:
+    return _DOSE_RDONLY;
+  /* case EEXIST:       // mkdir
+    return _DOSE_EXISTDIR; */
+  case ENOTEMPTY:
+    return _DOSE_NOTEMPTY;
+  /* case ENOTEMPTY:    // rename
+    return _DOSE_CANTREN; */
+  case ENOSPC:
+    return _DOSE_DISKFULL;
+  /* case ENOSPC:       // create, open
+    return _DOSE_DIRFULL; */
+  case EOVERFLOW:
+    return _DOSE_CANTSEEK;
+  case EEXIST:
+    return _DOSE_EXISTFILE;
+  default:
+    return _DOSE_ILGPARM;
+  }
+}
+
+//****************************************************************************
+// Directory search
+//****************************************************************************
+
+// namestsの主ファイル名と拡張子から、ディレクトリ検索に使うファイル名(21バイト)を作る
+// (derived from HFS.java by Makoto Kamada)
+void conv_pattern(struct dos_namestbuf *ns, uint8_t *fname)
+{
+  //検索するファイル名の順序を入れ替える
+  //  主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'のときは主ファイル名2を'?'で充填する
+  memset(fname, 0, 21);
+  memcpy(&fname[0], ns->name1, 8);    //主ファイル名1
+  if (ns->name1[7] == '?' && ns->name2[0] == '\0') {  //主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'
+    memset(&fname[8], '?', 10);           //主ファイル名2
+  } else {
+    memcpy(&fname[8], ns->name2, 10); //主ファイル名2
+  }
+  for (int i = 17; i >= 0 && (fname[i] == '\0' || fname[i] == ' '); i--) {  //主ファイル名1+主ファイル名2の空き
+    fname[i] = '\0';
+  }
+  memcpy(&fname[18], ns->ext, 3);     //拡張子
+  for (int i = 20; i >= 18 && (fname[i] == ' '); i--) { //拡張子の空き
+    fname[i] = '\0';
+  }
+  //検索するファイル名を小文字化する
+  for (int i = 0; i < 21; i++) {
+    int c = fname[i];
+    if ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) {  //SJISの1バイト目
+      i++;
+    } else {
+      fname[i] = tolower(fname[i]);
+    }
+  }
+}
+
+// ファイル名がHuman68kで使える文字だけでできているか
+// (derived from HFS.java by Makoto Kamada)
+bool conv_validname(const char *name)
+{
+  uint8_t c = 0;
+  for (int i = 0; i < sizeof(((struct dos_filesinfo *)0)->name); i++) {
+    if (!(c = name[i]))
+      break;
+    if ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) {  //SJISの1バイト目
+      i++;
+      continue;
+    }
+    if (c <= 0x1f ||  //変換できない文字または制御コード
+        (c == '-' && i == 0) ||  //ファイル名の先頭に使えない文字
+        strchr("/\\,;<=>[]|", c) != NULL) {  //ファイル名に使えない文字
+      break;
+    }
+  }
+  return c == 0;
+}
+
+// ファイル名を主ファイル名と拡張子に分解する (主ファイル名が長すぎる場合は-1を返す)
+// (derived from HFS.java by Makoto Kamada)
+int conv_splitname(const char *b, uint8_t *w2)
+{
+  int k = strlen(b);
+  int m = (b[k - 1] == '.' ? k :  //name.
+           k >= 3 && b[k - 2] == '.' ? k - 2 :  //name.e
+           k >= 4 && b[k - 3] == '.' ? k - 3 :  //name.ex
+           k >= 5 && b[k - 4] == '.' ? k - 4 :  //name.ext
+           k);  //主ファイル名の直後。拡張子があるときは'.'の位置、ないときはk
+  if (m > 18) {  //主ファイル名が長すぎる
+    return -1;
+  }
+  memset(w2, 0, 21);
+  memcpy(&w2[0], &b[0], m);         //主ファイル名
+  if (b[m] == '.')
+    strncpy((char *)&w2[18], &b[m + 1], 3); //拡張子
+
+  for (int i = 0; i < 21; i++)
+    DPRINTF2("%c", w2[i] == 0 ? '_' : w2[i]);
+  DPRINTF2("\r\n");
+  return 0;
+}
+
+// 分解したファイル名を検索するファイル名と比較する
+// (derived from HFS.java by Makoto Kamada)
+bool conv_matchname(const uint8_t *fname, const uint8_t *w2)
+{
+  int f = 0x20;  //0x00=次のバイトはSJISの2バイト目,0x20=次のバイトはSJISの2バイト目ではない
+  for (int i = 0; i < 21; i++) {
+    int c = w2[i];
+    int d = fname[i];
+    if (d != '?' && ('A' <= c && c <= 'Z' ? c | f : c) != d) {  //検索するファイル名の'?'以外の部分がマッチしない。SJISの2バイト目でなければ小文字化してから比較する
+      return false;
+    }
+    f = f != 0x00 && ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) ? 0x00 : 0x20;  //このバイトがSJISの2バイト目ではなくてSJISの1バイト目ならば次のバイトはSJISの2バイト目
+  }
+  return true;
+}
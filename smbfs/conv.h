@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _CONV_H_
+#define _CONV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <humandefs.h>
+#include "fileop.h"
+
+// ホストのパス名やファイル情報とHuman68kの形式との変換を行う
+// (サーバとの通信や常駐部のデータに依存しないので、ホスト上のベンチマークからも使う)
+
+void conv_statinfo(TYPE_STAT *st, void *v);
+int conv_namebuf_sub(const char *src, size_t src_len, char **dst_buf, size_t *dst_len, char *dst_top);
+int conv_namests_name(struct dos_namestbuf *ns, uint8_t *bb);
+int conv_namebuf_root(const char *root, struct dos_namestbuf *ns, bool full, char *path, size_t size);
+int conv_errno(int err);
+
+void conv_pattern(struct dos_namestbuf *ns, uint8_t *fname);
+bool conv_validname(const char *name);
+int conv_splitname(const char *b, uint8_t *w2);
+bool conv_matchname(const uint8_t *fname, const uint8_t *w2);
+
+#endif /* _CONV_H_ */
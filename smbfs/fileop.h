@@ -81,13 +81,60 @@ union smb2fd {
 // SJIS <-> UTF-8 conversion
 //****************************************************************************
 
+// ASCII文字はSJISとUTF-8で同じなので、ASCII以外の区間だけをiconvで変換する
+// (ファイル名のほとんどはASCIIのみなので変換テーブルの参照をほぼ省略できる)
+
 static inline int FUNC_ICONV_S2U(char **src_buf, size_t *src_len, char **dst_buf, size_t *dst_len)
 {
-  return iconv_s2u(src_buf, src_len, dst_buf, dst_len);
+  while (*src_len > 0) {
+    uint8_t c = **src_buf;
+    if (c < 0x80) {                 // ASCII文字はそのままコピー
+      if (*dst_len == 0)
+        return -1;
+      *(*dst_buf)++ = c;
+      (*dst_len)--;
+      (*src_buf)++;
+      (*src_len)--;
+      continue;
+    }
+    // 次のASCII文字までの区間を求める (SJISの2バイト目はASCIIの範囲にもある)
+    size_t n = 0;
+    while (n < *src_len && (uint8_t)(*src_buf)[n] >= 0x80) {
+      c = (*src_buf)[n];
+      n += ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xfc)) ? 2 : 1;
+    }
+    if (n > *src_len)
+      n = *src_len;
+    size_t rest = *src_len - n;
+    if (iconv_s2u(src_buf, &n, dst_buf, dst_len) < 0)
+      return -1;
+    *src_len = rest + n;
+  }
+  return 0;
 }
 static inline int FUNC_ICONV_U2S(char **src_buf, size_t *src_len, char **dst_buf, size_t *dst_len)
 {
-  return iconv_u2s(src_buf, src_len, dst_buf, dst_len);
+  while (*src_len > 0) {
+    uint8_t c = **src_buf;
+    if (c < 0x80) {                 // ASCII文字はそのままコピー
+      if (*dst_len == 0)
+        return -1;
+      *(*dst_buf)++ = c;
+      (*dst_len)--;
+      (*src_buf)++;
+      (*src_len)--;
+      continue;
+    }
+    // UTF-8のマルチバイト文字はすべて0x80以上なので次のASCII文字までを変換する
+    size_t n = 0;
+    while (n < *src_len && (uint8_t)(*src_buf)[n] >= 0x80)
+      n++;
+    size_t rest = *src_len - n;
+    if (iconv_u2s(src_buf, &n, dst_buf, dst_len) < 0)
+      return -1;
+    *src_len = rest + n;
+  }
+  return 0;
 }
 
 //****************************************************************************
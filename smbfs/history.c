@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "smbfs.h"
+#include "cache.h"
+#include "history.h"
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static hprog_t hist_prog[HIST_MAXPROG]; // 実行ファイルごとの起動履歴
+static hprog_t hist_rec;                // 記録中の起動履歴
+static bool hist_recording;             // 起動履歴を記録中
+
+//****************************************************************************
+// Local functions
+//****************************************************************************
+
+static char *hist_strdup(const char *s)
+{
+  char *p = malloc(strlen(s) + 1);
+  if (p) {
+    strcpy(p, s);
+  }
+  return p;
+}
+
+static void hprog_clear(hprog_t *hp)
+{
+  for (int i = 0; i < hp->nent; i++) {
+    free(hp->ent[i].path);
+  }
+  free(hp->path);
+  hp->path = NULL;
+  hp->nent = 0;
+}
+
+static hprog_t *hprog_find(int unit, const char *path)
+{
+  uint32_t hash = cache_hash(unit, path, -1);
+  for (int i = 0; i < HIST_MAXPROG; i++) {
+    hprog_t *hp = &hist_prog[i];
+    if (hp->path && hp->unit == unit && hp->hash == hash && strcasecmp(hp->path, path) == 0) {
+      return hp;
+    }
+  }
+  return NULL;
+}
+
+// 記録した起動履歴を保存する
+static void history_commit(void)
+{
+  if (!hist_recording) {
+    return;
+  }
+  hist_recording = false;
+  if (hist_rec.nent == 0) {
+    hprog_clear(&hist_rec);
+    return;
+  }
+
+  // 同じ実行ファイルの履歴か、最も長く起動されていない履歴を置き換える
+  hprog_t *hp = hprog_find(hist_rec.unit, hist_rec.path);
+  if (hp == NULL) {
+    hp = &hist_prog[0];
+    for (int i = 0; i < HIST_MAXPROG; i++) {
+      if (hist_prog[i].path == NULL) {
+        hp = &hist_prog[i];
+        break;
+      }
+      if ((int32_t)(hist_prog[i].used - hp->used) < 0) {
+        hp = &hist_prog[i];
+      }
+    }
+  }
+  hprog_clear(hp);
+  *hp = hist_rec;
+  hist_rec.path = NULL;
+  hist_rec.nent = 0;
+}
+
+// 記録期間を過ぎていたら記録を終える
+static bool history_active(void)
+{
+  if (hist_recording && cache_clock() - hist_rec.used > HIST_RECTIME) {
+    history_commit();
+  }
+  return hist_recording;
+}
+
+//****************************************************************************
+// Launch history
+//****************************************************************************
+
+// 実行ファイルか (拡張子で判定する)
+bool history_isexec(const char *path)
+{
+  const char *p = strrchr(path, '.');
+  return p && p[1] != '\0' && p[2] == '\0' && strchr("xXrRzZ", p[1]) != NULL;
+}
+
+// 実行ファイルが開かれたので起動履歴の記録を開始する
+// 前回の起動履歴があればそれを返す
+hprog_t *history_launch(int unit, const char *path)
+{
+  if (cache_stats.budget == 0) {
+    return NULL;
+  }
+  history_commit();
+
+  hprog_t *hp = hprog_find(unit, path);
+  if ((hist_rec.path = hist_strdup(path)) != NULL) {
+    hist_rec.unit = unit;
+    hist_rec.hash = cache_hash(unit, path, -1);
+    hist_rec.used = cache_clock();
+    hist_rec.nent = 0;
+    hist_recording = true;
+  }
+  if (hp) {
+    hp->used = hist_rec.used;
+  }
+  return hp;
+}
+
+// 起動履歴を記録中か (記録期間を過ぎていても記録は終えずに調べるだけ)
+bool history_recording(void)
+{
+  return hist_recording;
+}
+
+// 起動後に開かれたファイルを記録する
+void history_open(int unit, const char *path)
+{
+  if (!history_active()) {
+    return;
+  }
+  if (hist_rec.unit == unit && strcmp(hist_rec.path, path) == 0) {
+    return;
+  }
+  for (int i = 0; i < hist_rec.nent; i++) {
+    if (hist_rec.ent[i].unit == unit && strcmp(hist_rec.ent[i].path, path) == 0) {
+      return;
+    }
+  }
+  if (hist_rec.nent < HIST_MAXFILE) {
+    hentry_t *he = &hist_rec.ent[hist_rec.nent];
+    if ((he->path = hist_strdup(path)) != NULL) {
+      he->unit = unit;
+      he->len = 0;
+      hist_rec.nent++;
+    }
+  }
+}
+
+// 起動後に開かれたファイルの読まれた範囲を記録する
+void history_read(int unit, const char *path, uint32_t end)
+{
+  if (!history_active()) {
+    return;
+  }
+  if (end > HIST_MAXLEN) {
+    end = HIST_MAXLEN;
+  }
+  for (int i = 0; i < hist_rec.nent; i++) {
+    hentry_t *he = &hist_rec.ent[i];
+    if (he->unit == unit && strcmp(he->path, path) == 0) {
+      if (he->len < end) {
+        he->len = end;
+      }
+      return;
+    }
+  }
+}
+
+//****************************************************************************
+// Save and load
+//****************************************************************************
+
+// 保存形式:
+//   HIST_MAGIC (8バイト)
+//   実行ファイルごとに { ユニット番号(1) ファイル数(1) パス名(NUL終端)
+//                        ファイルごとに { ユニット番号(1) 長さ(4,BE) パス名(NUL終端) } }
+//   終端 0xff (1)
+
+static void hist_put(uint8_t **p, uint8_t *end, const void *src, size_t len)
+{
+  if (*p + len <= end) {
+    memcpy(*p, src, len);
+  }
+  *p += len;
+}
+
+static void hist_put8(uint8_t **p, uint8_t *end, uint8_t v)
+{
+  hist_put(p, end, &v, 1);
+}
+
+// 起動履歴を保存形式でbufに書き出す (必要なバッファサイズを返す)
+size_t history_save(void *buf, size_t len)
+{
+  history_commit();
+
+  uint8_t *p = buf;
+  uint8_t *end = p + len;
+  hist_put(&p, end, HIST_MAGIC, 8);
+  for (int i = 0; i < HIST_MAXPROG; i++) {
+    hprog_t *hp = &hist_prog[i];
+    if (hp->path == NULL) {
+      continue;
+    }
+    hist_put8(&p, end, hp->unit);
+    hist_put8(&p, end, hp->nent);
+    hist_put(&p, end, hp->path, strlen(hp->path) + 1);
+    for (int j = 0; j < hp->nent; j++) {
+      hentry_t *he = &hp->ent[j];
+      hist_put8(&p, end, he->unit);
+      hist_put8(&p, end, he->len >> 24);
+      hist_put8(&p, end, he->len >> 16);
+      hist_put8(&p, end, he->len >> 8);
+      hist_put8(&p, end, he->len);
+      hist_put(&p, end, he->path, strlen(he->path) + 1);
+    }
+  }
+  hist_put8(&p, end, 0xff);
+  return p - (uint8_t *)buf;
+}
+
+// 保存形式から読み出したパス名をコピーする
+static char *hist_getstr(const uint8_t **p, const uint8_t *end)
+{
+  const uint8_t *s = *p;
+  const uint8_t *e = memchr(s, '\0', end - s);
+  if (e == NULL) {
+    return NULL;
+  }
+  *p = e + 1;
+  return hist_strdup((const char *)s);
+}
+
+// 保存形式の起動履歴を読み込む
+int history_load(const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  const uint8_t *end = p + len;
+
+  if (len < 9 || memcmp(p, HIST_MAGIC, 8) != 0) {
+    return -EINVAL;
+  }
+  p += 8;
+
+  history_commit();
+  for (int i = 0; i < HIST_MAXPROG; i++) {
+    hprog_clear(&hist_prog[i]);
+  }
+
+  uint32_t now = cache_clock();
+  for (int i = 0; p < end && *p != 0xff; i++) {
+    if (end - p < 2) {
+      return -EINVAL;
+    }
+    int unit = *p++;
+    int nent = *p++;
+    char *path = hist_getstr(&p, end);
+    if (path == NULL || nent > HIST_MAXFILE) {
+      free(path);
+      return -EINVAL;
+    }
+    hprog_t dummy = { 0 };
+    hprog_t *hp = i < HIST_MAXPROG ? &hist_prog[i] : &dummy;
+    hp->unit = unit;
+    hp->hash = cache_hash(unit, path, -1);
+    hp->used = now;
+    hp->path = path;
+    for (int j = 0; j < nent; j++) {
+      if (end - p < 5) {
+        hprog_clear(hp);
+        return -EINVAL;
+      }
+      hentry_t *he = &hp->ent[hp->nent];
+      he->unit = *p++;
+      he->len = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+      p += 4;
+      if ((he->path = hist_getstr(&p, end)) == NULL) {
+        hprog_clear(hp);
+        return -EINVAL;
+      }
+      hp->nent++;
+    }
+    if (hp == &dummy) {
+      hprog_clear(hp);          // 保存できる数を超えた履歴は捨てる
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define HIST_MAXPROG      8             // 履歴を記録する実行ファイルの数
+#define HIST_MAXFILE      16            // 1実行ファイルあたりに記録するファイル数
+#define HIST_RECTIME      (10 * 100)    // 起動後に記録する期間 (1/100秒)
+#define HIST_MAXLEN       (16 * 1024)   // 1ファイルあたりに先読みするサイズの上限
+
+#define HIST_MAGIC        "SMBFSHS1"    // 保存形式の識別子
+
+//****************************************************************************
+// Data types
+//****************************************************************************
+
+// 実行ファイルの起動後に開かれたファイル
+typedef struct {
+  uint8_t unit;
+  uint32_t len;                 // 読まれた範囲 (ファイル先頭からのバイト数)
+  char *path;                   // ホストパス名
+} hentry_t;
+
+// 実行ファイルごとの起動履歴
+typedef struct {
+  int unit;                     // 実行ファイルのユニット番号
+  uint32_t hash;
+  uint32_t used;                // 最後に起動された時刻
+  char *path;                   // 実行ファイルのホストパス名 (NULL=未使用)
+  int nent;
+  hentry_t ent[HIST_MAXFILE];   // 開かれた順のファイル
+} hprog_t;
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+bool history_isexec(const char *path);
+hprog_t *history_launch(int unit, const char *path);
+bool history_recording(void);
+void history_open(int unit, const char *path);
+void history_read(int unit, const char *path, uint32_t end);
+size_t history_save(void *buf, size_t len);
+int history_load(const void *buf, size_t len);
+
+#endif /* _HISTORY_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * ページキャッシュのページを圧縮するためのLZ77系の圧縮・展開
+ *
+ * 形式はLZ4のブロック形式と同様で、トークン(上位4bitがリテラル長、下位4bitが一致長-4)、
+ * リテラル、一致位置のオフセット(2バイト)の並びを繰り返す。最後のシーケンスはリテラルだけになる。
+ * 68000でも遅くならないように、乗算や境界をまたぐワードアクセスは使わない。
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "lz.h"
+
+//****************************************************************************
+// Macros and definitions
+//****************************************************************************
+
+#define LZ_HASHBITS     10
+#define LZ_HASHSIZE     (1 << LZ_HASHBITS)
+#define LZ_MAXOFFSET    0xffff
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+// 4バイトのハッシュ値から直前に出現した位置を得る表
+// (前回の圧縮の内容が残っていても、一致を確認してから使うので初期化しない)
+static uint16_t lz_table[LZ_HASHSIZE];
+
+//****************************************************************************
+// Private functions
+//****************************************************************************
+
+static inline unsigned int lz_hash(const uint8_t *p)
+{
+  uint16_t a = (p[0] << 8) | p[1];
+  uint16_t b = (p[2] << 8) | p[3];
+  return (a ^ (a >> 6) ^ (b << 3) ^ (b >> 7)) & (LZ_HASHSIZE - 1);
+}
+
+// トークンの4bitに収まらない長さを追加のバイト列で書き出す
+static inline uint8_t *lz_putlen(uint8_t *op, size_t n)
+{
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+//****************************************************************************
+// Public functions
+//****************************************************************************
+
+// srcのlenバイト(LZ_MAXOFFSETまで)を圧縮してdstに格納し、圧縮後の長さを返す
+// 圧縮後の長さがlimitを超える場合は途中でやめて0を返す
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t limit)
+{
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + limit;
+  unsigned int miss = 0;
+
+  while (len >= LZ_MINMATCH && ip <= iend - LZ_MINMATCH) {
+    unsigned int h = lz_hash(ip);
+    const uint8_t *ref = src + lz_table[h];
+    lz_table[h] = ip - src;
+    if (ref >= ip ||
+        ref[0] != ip[0] || ref[1] != ip[1] || ref[2] != ip[2] || ref[3] != ip[3]) {
+      // 一致しない状態が続いたら間隔を空けて探す (圧縮できないデータを早く諦める)
+      ip += 1 + (miss++ >> 5);
+      continue;
+    }
+    miss = 0;
+
+    const uint8_t *mp = ip + LZ_MINMATCH;
+    const uint8_t *rp = ref + LZ_MINMATCH;
+    while (mp < iend && *mp == *rp) {
+      mp++;
+      rp++;
+    }
+    size_t lit = ip - anchor;
+    size_t mlen = mp - ip - LZ_MINMATCH;
+    if (oend - op < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) {
+      return 0;
+    }
+    uint8_t *token = op++;
+    *token = ((lit >= 15 ? 15 : lit) << 4) | (mlen >= 15 ? 15 : mlen);
+    if (lit >= 15) {
+      op = lz_putlen(op, lit - 15);
+    }
+    while (anchor < ip) {
+      *op++ = *anchor++;
+    }
+    size_t offset = ip - ref;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    if (mlen >= 15) {
+      op = lz_putlen(op, mlen - 15);
+    }
+    ip = anchor = mp;
+  }
+
+  // 残りをリテラルだけのシーケンスとして書き出す
+  size_t lit = iend - anchor;
+  if (oend - op < 1 + lit / 255 + 1 + lit) {
+    return 0;
+  }
+  *op++ = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15) {
+    op = lz_putlen(op, lit - 15);
+  }
+  while (anchor < iend) {
+    *op++ = *anchor++;
+  }
+  return op - dst;
+}
+
+// srcのslenバイトをdstに展開し、展開後の長さを返す
+// 展開後の長さがdlenと一致しない場合や、データが壊れている場合は-1を返す
+int lz_decompress(const uint8_t *src, size_t slen, uint8_t *dst, size_t dlen)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + slen;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dlen;
+
+  while (ip < iend) {
+    unsigned int token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15) {
+      unsigned int b;
+      do {
+        if (ip >= iend) {
+          return -1;
+        }
+        lit += b = *ip++;
+      } while (b == 255);
+    }
+    if (lit > iend - ip || lit > oend - op) {
+      return -1;
+    }
+    while (lit-- > 0) {
+      *op++ = *ip++;
+    }
+    if (ip >= iend) {
+      break;                    // 最後のシーケンス
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t mlen = (token & 15) + LZ_MINMATCH;
+    if ((token & 15) == 15) {
+      unsigned int b;
+      do {
+        if (ip >= iend) {
+          return -1;
+        }
+        mlen += b = *ip++;
+      } while (b == 255);
+    }
+    if (offset == 0 || offset > op - dst || mlen > oend - op) {
+      return -1;
+    }
+    // 一致位置が重なっている場合があるので1バイトずつコピーする
+    const uint8_t *rp = op - offset;
+    while (mlen-- > 0) {
+      *op++ = *rp++;
+    }
+  }
+  return (op == oend) ? (int)dlen : -1;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#ifdef PROF_HOST
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#else
+#include <x68k/iocs.h>
+#endif
+
+#include "smbfs.h"
+#include "profile.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+volatile uint8_t prof_active;           // 計測対象の処理中 (PROF_*)
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+// PCごとのサンプル数 (ハッシュ表)
+static struct {
+  uint32_t pc;
+  uint32_t count;
+} prof_hist[PROF_SLOTS];
+
+static volatile uint8_t prof_enabled __attribute__((used)); // サンプリング中
+static uint32_t prof_samples;           // 記録したサンプル数
+static uint32_t prof_dropped;           // ハッシュ表に入らなかったサンプル数
+
+//****************************************************************************
+// Sampling
+//****************************************************************************
+
+// タイマ割り込みから呼ばれ、割り込まれた時点のPCを記録する
+void prof_sample(uint32_t pc)
+{
+  uint32_t h = (pc * 2654435761u) >> 22;      // PROF_SLOTS = 1 << 10
+  for (int i = 0; i < PROF_PROBE; i++) {
+    int k = (h + i) % PROF_SLOTS;
+    if (prof_hist[k].count == 0) {
+      prof_hist[k].pc = pc;
+    }
+    if (prof_hist[k].pc == pc) {
+      prof_hist[k].count++;
+      prof_samples++;
+      return;
+    }
+  }
+  prof_dropped++;
+}
+
+static void prof_reset(void)
+{
+  memset(prof_hist, 0, sizeof(prof_hist));
+  prof_samples = 0;
+  prof_dropped = 0;
+}
+
+#ifndef PROF_HOST
+
+//****************************************************************************
+// X68000: Timer-C interrupt hook
+//****************************************************************************
+
+#define PROF_VECTOR       0x45          // MFP Timer-C (100Hz)
+#define PROF_HZ           100
+
+static void *prof_oldvec __attribute__((used)); // フック前の割り込みベクタ
+void prof_timer(void);
+
+// Timer-C割り込みの入口
+// 計測対象の処理中なら割り込まれたPCを記録してから、元の割り込み処理に分岐する
+__asm__(
+"    .pushsection .text\n"
+"    .even\n"
+"prof_timer:\n"
+"    tst.b   prof_enabled\n"
+"    beq.s   1f\n"
+"    tst.b   prof_active\n"
+"    beq.s   1f\n"
+"    movem.l %d0-%d1/%a0-%a1,%sp@-\n"
+"    move.l  %sp@(16+2),%sp@-\n"        // 例外スタックフレームのPC
+"    jsr     prof_sample\n"
+"    addq.l  #4,%sp\n"
+"    movem.l %sp@+,%d0-%d1/%a0-%a1\n"
+"1:\n"
+"    move.l  prof_oldvec,%sp@-\n"
+"    rts\n"
+"    .popsection\n"
+);
+
+// 計測を開始する (記録済みのサンプルは消去する)
+int prof_start(void)
+{
+  prof_enabled = false;
+  prof_reset();
+  if (prof_oldvec == NULL) {
+    prof_oldvec = _iocs_b_intvcs(PROF_VECTOR, prof_timer);
+  }
+  prof_enabled = true;
+  return 0;
+}
+
+// 計測を終了する
+// 後から他のプログラムが同じベクタをフックしていたらフックは残し、サンプリングだけを止める
+int prof_stop(void)
+{
+  prof_enabled = false;
+  if (prof_oldvec == NULL) {
+    return 0;
+  }
+  if (*(void **)(PROF_VECTOR * 4) != prof_timer) {
+    return -EBUSY;
+  }
+  _iocs_b_intvcs(PROF_VECTOR, prof_oldvec);
+  prof_oldvec = NULL;
+  return 0;
+}
+
+bool prof_hooked(void)
+{
+  return prof_oldvec != NULL;
+}
+
+#else
+
+//****************************************************************************
+// Host: SIGPROF
+//****************************************************************************
+
+#define PROF_HZ           1000
+
+#if defined(__x86_64__)
+#define PROF_UC_PC(uc)    ((uc)->uc_mcontext.gregs[REG_RIP])
+#elif defined(__i386__)
+#define PROF_UC_PC(uc)    ((uc)->uc_mcontext.gregs[REG_EIP])
+#elif defined(__aarch64__)
+#define PROF_UC_PC(uc)    ((uc)->uc_mcontext.pc)
+#elif defined(__m68k__)
+#define PROF_UC_PC(uc)    ((uc)->uc_mcontext.gregs[R_PC])
+#else
+#define PROF_UC_PC(uc)    0
+#endif
+
+static struct sigaction prof_oldact;
+static bool prof_installed;
+
+static void prof_sigprof(int sig, siginfo_t *si, void *ctx)
+{
+  ucontext_t *uc = (ucontext_t *)ctx;
+  if (prof_enabled && prof_active) {
+    prof_sample((uint32_t)PROF_UC_PC(uc));
+  }
+}
+
+int prof_start(void)
+{
+  prof_enabled = false;
+  prof_reset();
+  if (!prof_installed) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = prof_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &prof_oldact) < 0) {
+      return -errno;
+    }
+    prof_installed = true;
+  }
+  struct itimerval it = {
+    .it_interval = { 0, 1000000 / PROF_HZ },
+    .it_value = { 0, 1000000 / PROF_HZ },
+  };
+  setitimer(ITIMER_PROF, &it, NULL);
+  prof_enabled = true;
+  return 0;
+}
+
+int prof_stop(void)
+{
+  prof_enabled = false;
+  if (prof_installed) {
+    struct itimerval it = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &prof_oldact, NULL);
+    prof_installed = false;
+  }
+  return 0;
+}
+
+bool prof_hooked(void)
+{
+  return prof_installed;
+}
+
+#endif
+
+//****************************************************************************
+// Save
+//****************************************************************************
+
+static void prof_put32(uint8_t **p, uint8_t *end, uint32_t v)
+{
+  for (int i = 24; i >= 0; i -= 8) {
+    if (*p < end) {
+      **p = v >> i;
+    }
+    (*p)++;
+  }
+}
+
+// 記録したサンプルを保存形式で書き出す (必要なバイト数を返す)
+// 形式 (数値はすべてビッグエンディアン):
+//   PROF_MAGIC(8), サンプリング周波数, サンプル数, 記録できなかったサンプル数,
+//   prof_saveのアドレス (.mapのアドレスとの差から再配置量を求める),
+//   エントリ数, { PC, サンプル数 } * エントリ数
+size_t prof_save(void *buf, size_t len)
+{
+  uint8_t *p = buf;
+  uint8_t *end = p + len;
+  if (len >= 8) {
+    memcpy(p, PROF_MAGIC, 8);
+  }
+  p += 8;
+
+  uint32_t nent = 0;
+  for (int i = 0; i < PROF_SLOTS; i++) {
+    if (prof_hist[i].count) {
+      nent++;
+    }
+  }
+  prof_put32(&p, end, PROF_HZ);
+  prof_put32(&p, end, prof_samples);
+  prof_put32(&p, end, prof_dropped);
+  prof_put32(&p, end, (uint32_t)(uintptr_t)prof_save);
+  prof_put32(&p, end, nent);
+  for (int i = 0; i < PROF_SLOTS; i++) {
+    if (prof_hist[i].count) {
+      prof_put32(&p, end, prof_hist[i].pc);
+      prof_put32(&p, end, prof_hist[i].count);
+    }
+  }
+  return p - (uint8_t *)buf;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define PROF_DOSCALL      0x01          // interrupt()の処理中
+#define PROF_BG           0x02          // バックグラウンドスレッドの処理中
+
+#define PROF_SLOTS        1024          // 記録するPCの種類の上限
+#define PROF_PROBE        8             // ハッシュ表の探索回数の上限
+
+#define PROF_MAGIC        "SMBFSPF1"    // 保存形式の識別子
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+// サンプリングプロファイラ (make PROFILE=1 でビルドしたときだけ有効)
+// interrupt()やバックグラウンドスレッドの処理中にタイマ割り込みで実行中のPCを記録する
+// (ホスト上のベンチマークではSIGPROFを使う)
+
+#ifdef PROFILE
+extern volatile uint8_t prof_active;
+#define PROF_ENTER(f)     (prof_active |= (f))
+#define PROF_LEAVE(f)     (prof_active &= ~(f))
+
+int prof_start(void);
+int prof_stop(void);
+bool prof_hooked(void);
+void prof_sample(uint32_t pc);
+size_t prof_save(void *buf, size_t len);
+#else
+#define PROF_ENTER(f)
+#define PROF_LEAVE(f)
+#endif
+
+#endif /* _PROFILE_H_ */
@@ -29,9 +29,11 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <pthread.h>
 #include <malloc.h>
 #include <x68k/dos.h>
@@ -49,6 +51,12 @@
 
 #include "smbfs.h"
 #include "fileop.h"
+#include "conv.h"
+#include "cache.h"
+#include "history.h"
+#include "profile.h"
+#include "trace.h"
+#include "archive.h"
 
 //****************************************************************************
 // Macros and definitions
@@ -57,15 +65,105 @@
 #define PATH_LEN  256
 #define MAXUNIT   8
 
+#define PREFETCH_DEPTH    2             // 先読みするディレクトリエントリの数
+#define PREFETCH_SMALL    (8 * 1024)    // ファイル全体を先読みするサイズの上限
+#define PREFETCH_HEAD     (2 * PCACHE_PAGESIZE) // 大きなファイルの先読みサイズ
+#define BGJOB_MAX         16            // バックグラウンド処理の最大数
+#define KEEPALIVE_INTERVAL  (30 * 100)  // keepaliveの間隔 (1/100秒)
+#define REPLICA_MAX       4             // 1つのマウントで指定できるサーバ数
+#define CONNECT_TIMEOUT   (10 * 100)    // サーバへの接続を待つ時間 (1/100秒)
+#define REPLICA_RETRY     (5 * 100)     // 切り替えに失敗したときに再試行するまでの時間 (1/100秒)
+#define REPLICA_DOWN      0xffffffff    // 接続できなかったサーバの応答時間
+#define PROCSTAT_MAX      16            // 統計情報を記録するプロセス数
+#define WATCH_MAX         8             // 変更を監視できるディレクトリの数
+#define WATCHREG_MAX      16            // WAITCHANGEで登録できる監視の数 (共有している登録も数える)
+#define WATCH_WAITMAX     (60 * 100)    // WAITCHANGEで変更を待つ時間の上限 (1/100秒)
+#define NOTIFY_WATCH_TREE 0x0001        // CHANGE_NOTIFYでサブディレクトリの変更も通知させる
+#define STRIDE_CONFIRM    2             // 同じ間隔のreadがこの回数続いたら先読みする
+#define STRIDE_DEPTH      2             // 先読みするレコード数の初期値
+#define STRIDE_MAXDEPTH   8             // 先読みするレコード数の上限
+#define WB_MAXPAGES       16            // 1つのFCBが書き込みを保持するページ数の上限
+#define WB_TOTALPAGES     32            // 全FCBで書き込みを保持するページ数の上限
+#define WB_DELAY          (2 * 100)     // 書き込みを保持する時間 (1/100秒)
+#define STALE_MAXAGE      (60 * 100)    // 期限切れのキャッシュを返す時間の上限 (1/100秒)
+#define REVAL_MAX         4             // 同時に読み直すディレクトリ一覧とファイル情報の数
+
+// マウント時にURLの引数で指定するsmbfsのオプション
+#define MOUNT_ARCHIVE     0x0001        // ZIP/LZHファイルをディレクトリとして見せる (archive)
+#define MOUNT_STALE       0x0002        // 期限切れのキャッシュを返してから読み直す (stale)
+#define MOUNT_WRITEBACK   0x0004        // 読み書き用に開いたファイルへの書き込みを保持する (writeback)
+
+#define POLLIN      0x0001
+#define POLLOUT     0x0004
+
 typedef char hostpath_t[PATH_LEN];
 
+// 同じ共有を持つ複数のサーバ (URLのホスト名を','で区切って指定する)
+// マウント時に並行して接続して最も早く応答したサーバを使い、接続が切れたら他のサーバに切り替える
+typedef struct {
+  int nhosts;
+  int active;                           // 接続中のサーバ
+  char *host[REPLICA_MAX];              // サーバ名[:ポート番号] (UTF-8)
+  uint32_t latency[REPLICA_MAX];        // 接続にかかった時間 (1/100秒)
+  char *share;
+  char *user;
+  char *password;
+  enum smb2_negotiate_version version;  // URLで指定されたSMBのバージョン
+  volatile bool down;                   // 接続が切れている
+  uint32_t retry;                       // 切り替えに失敗した時刻
+} replica_t;
+
+// SMBCMD_WAITCHANGEで登録されたディレクトリの監視
+// サーバにCHANGE_NOTIFYを送っておき、応答が返るたびにcountを増やして次のCHANGE_NOTIFYを送る
+// (応答はそのユニットの接続を使う処理かバックグラウンドスレッドのsmb2_service()の中で処理される)
+typedef struct {
+  bool used;                            // エントリを使用中
+  bool active;                          // 監視中 (falseなら応答待ちが終わったら解放する)
+  bool pending;                         // CHANGE_NOTIFYの応答待ち
+  bool dirty;                           // キャッシュに反映していない変更がある
+  int unit;
+  int refs;                             // 同じ監視を登録したプログラムの数
+  uint32_t filter;                      // 監視する変更 (WCF_*)
+  bool subtree;                         // サブディレクトリも監視する
+  int error;                            // CHANGE_NOTIFYのエラー (次のWAITで返す)
+  volatile uint32_t count;              // 変更を検出した回数
+  struct smb2_context *smb2;            // CHANGE_NOTIFYを送った接続
+  hostpath_t path;
+} watch_t;
+
+// WAITCHANGEの登録 (WCCMD_REGISTERで返す監視IDはこの添字)
+// 同じ監視を共有していても、前回のWAITから通知された変更は登録ごとに数える
+typedef struct {
+  bool used;                            // エントリを使用中
+  int watch;                            // 共有している監視 (watchesの添字)
+  uint32_t seen;                        // 前回のWAITで返した時点のcount
+} watchreg_t;
+
+// ?staleでマウントしたユニットで、期限切れのまま返したディレクトリ一覧やファイル情報の読み直し
+// バックグラウンドスレッドがサーバから読み直し、結果は次のDOSコールの処理の中でキャッシュに反映する
+typedef struct {
+  bool used;                            // エントリを使用中
+  bool isdir;                           // ディレクトリ一覧を読み直す (falseならファイル情報)
+  bool isroot;                          // ルートディレクトリの一覧
+  volatile bool done;                   // 読み直しが終わった
+  int unit;
+  int err;                              // 読み直しのエラー (errno)
+  int nent;                             // 読み直した一覧のエントリ数
+  uint8_t atr;                          // 読み直したファイル属性
+  uint32_t gen;                         // 読み直しを始めた時点のdcache_gen
+  struct dos_filesinfo *ent;            // 読み直した一覧 (DCACHE_MAXENT個まで)
+  hostpath_t path;
+} reval_t;
+
 struct smbfs_data {
   struct dos_devheader *devheader;      // 常駐部のデバイスヘッダ
   struct dos_dpb *dpbs;                 // DPBテーブルへのポインタ
   int units;                            // ユニット数
   struct smb2_context **rootsmb2;       // 各ユニットのsmb2_contextへのポインタ
-  pthread_t keepalive_thread;           // keepaliveスレッド
-  pthread_mutex_t keepalive_mutex;      // keepalive処理用mutex
+  pthread_t bg_thread;                  // バックグラウンド処理(keepalive,先読み)スレッド
+  pthread_mutex_t unit_mutex[MAXUNIT];  // 各ユニットのサーバとの接続の排他用mutex
+  pthread_mutex_t cache_mutex;          // 全ユニットで共有するデータ(キャッシュ等)の排他用mutex
+  bool prof_hooked;                     // プロファイラがタイマ割り込みをフックしている
 };
 
 //****************************************************************************
@@ -77,11 +175,20 @@ struct dos_req_header *reqheader;       // Human68kからのリクエストヘ
 
 char *rootpath[MAXUNIT];                // 各ユニットのホストパス
 struct smb2_context *rootsmb2[MAXUNIT]; // 各ユニットのsmb2_context
+replica_t *replica[MAXUNIT];            // 各ユニットの複製サーバ (サーバが1つならNULL)
+struct smbcmd_conntime conntime[MAXUNIT]; // 各ユニットの接続時の所要時間
+uint32_t mountflags[MAXUNIT];           // 各ユニットのマウントオプション (MOUNT_*)
+watch_t watches[WATCH_MAX];             // 変更を監視しているディレクトリ
+watchreg_t watchregs[WATCHREG_MAX];     // WAITCHANGEの登録
+volatile bool watch_dirty;              // キャッシュに反映していない変更がある
+reval_t revals[REVAL_MAX];              // バックグラウンドで読み直す一覧とファイル情報
+volatile bool reval_ready;              // キャッシュに反映していない読み直しの結果がある
 
 struct smbfs_data smbfs_data = {        // 常駐部との共有データ(常駐解除用)
   .devheader = &devheader,
   .rootsmb2 = rootsmb2,
-  .keepalive_mutex = PTHREAD_MUTEX_INITIALIZER
+  .unit_mutex = { [0 ... MAXUNIT - 1] = PTHREAD_MUTEX_INITIALIZER },
+  .cache_mutex = PTHREAD_MUTEX_INITIALIZER
 };
 
 #ifdef DEBUG
@@ -92,6 +199,8 @@ char ** const environ_none = { NULL };  // 空の環境変数リスト
 char **environ;
 uint32_t _heap_size = 1024 * 128;
 uint32_t _stack_size = 1024 * 32;
+uint32_t cache_size = 1024 * 32;        // ページキャッシュのサイズ
+uint32_t zcache_size = 0;               // 圧縮したページを保持するメモリのサイズ
 
 //****************************************************************************
 // for debugging
@@ -142,140 +251,23 @@ struct smb2_context *getsmb2(int unit)
 
 //----------------------------------------------------------------------------
 
-// struct statのファイル情報を変換する
-static void conv_statinfo(TYPE_STAT *st, void *v)
-{
-  struct dos_filesinfo *f = (struct dos_filesinfo *)v;
-
-  f->atr = FUNC_FILEMODE_ATTR(st);
-  f->filelen = htobe32(STAT_SIZE(st));
-  time_t mtime = STAT_MTIME(st);
-  struct tm *tm = localtime(&mtime);
-  f->time = htobe16(tm->tm_hour << 11 | tm->tm_min << 5 | tm->tm_sec >> 1);
-  f->date = htobe16((tm->tm_year - 80) << 9 | (tm->tm_mon + 1) << 5 | tm->tm_mday);
-}
-
 // namestsのパスをホストのパスに変換する
-// (derived from HFS.java by Makoto Kamada)
 static int conv_namebuf(int unit, struct dos_namestbuf *ns, bool full, hostpath_t *path)
 {
-  uint8_t bb[88];   // SJISでのパス名
-  int k = 0;
-
   if (rootpath[unit] == NULL) { // ホストパスが割り当てられていない
     return -1;
   }
-
-  // パスの区切りを 0x09 -> '/' に変更
-  for (int i = 0; i < 65; ) {
-    for (; i < 65 && ns->path[i] == 0x09; i++)  //0x09の並びを読み飛ばす
-      ;
-    if (i >= 65 || ns->path[i] == 0x00)   //ディレクトリ名がなかった
-      break;
-    bb[k++] = 0x2f;  //ディレクトリ名の手前の'/'
-    for (; i < 65 && ns->path[i] != 0x00 && ns->path[i] != 0x09; i++)
-      bb[k++] = ns->path[i];  //ディレクトリ名
-  }
-  // 主ファイル名を展開する
-  if (full) {
-    bb[k++] = 0x2f;  //主ファイル名の手前の'/'
-    memcpy(&bb[k], ns->name1, sizeof(ns->name1));   //主ファイル名1
-    k += sizeof(ns->name1);
-    memcpy(&bb[k], ns->name2, sizeof(ns->name2));   //主ファイル名2
-    k += sizeof(ns->name2);
-    for (; k > 0 && bb[k - 1] == 0x00; k--)   //主ファイル名2の末尾の0x00を切り捨てる
-      ;
-    for (; k > 0 && bb[k - 1] == 0x20; k--)   //主ファイル名1の末尾の0x20を切り捨てる
-      ;
-    bb[k++] = 0x2e;  //拡張子の手前の'.'
-    memcpy(&bb[k], ns->ext, sizeof(ns->ext));   //拡張子
-    k += sizeof(ns->ext);
-    for (; k > 0 && bb[k - 1] == 0x20; k--)   //拡張子の末尾の0x20を切り捨てる
-      ;
-    for (; k > 0 && bb[k - 1] == 0x2e; k--)   //主ファイル名の末尾の0x2eを切り捨てる
-      ;
-  }
-
-  char *dst_buf = (char *)path;
-  strncpy(dst_buf, rootpath[unit], sizeof(*path) - 1);
-  int len = strlen(rootpath[unit]);
-  if (len >= 1) {
-    if (rootpath[unit][len - 1] == '/' && bb[0] == '/') {
-      len--;                  //rootpathの末尾から'/'が連続しないようにする
-    } else if (rootpath[unit][len - 1] != '/' && bb[0] != '/') {
-      dst_buf[len++] = '/';   //rootpathの末尾に'/'を追加する
-    }
-  }
-  dst_buf += len;   //マウント先パス名を前置
-
-  // SJIS -> UTF-8に変換
-  size_t dst_len = sizeof(*path) - 1 - len;  //パス名バッファ残りサイズ
-  char *src_buf = (char *)bb;
-  size_t src_len = k;
-  if (len == 0 && bb[0] == '/') {
-    src_buf++;      //変換後のパス名の先頭に'/'が来ないようにする
-    src_len--;
-  }
-  if (FUNC_ICONV_S2U(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
-    return -1;  //変換できなかった
-  }
-  *dst_buf = '\0';
-  return 0;
+  return conv_namebuf_root(rootpath[unit], ns, full, (char *)path, sizeof(*path));
 }
 
-// errnoをHuman68kのエラーコードに変換する
-static int conv_errno(int err)
+// アーカイブ内のパス名なら索引を得て、アーカイブ内のパス名(SJIS)をmemberに返す
+// (アーカイブ自身ならmemberは空文字列になる)
+static arc_t *arc_path(int unit, const char *path, char *member)
 {
-  switch (err) {
-  case 0:
-    return 0;
-  case ENOENT:
-    return _DOSE_NOENT;
-  case ENOTDIR:
-    return _DOSE_NODIR;
-  case EMFILE:
-    return _DOSE_MFILE;
-  case EISDIR:
-    return _DOSE_ISDIR;
-  case EBADF:
-    return _DOSE_BADF;
-  case ENOMEM:
-    return _DOSE_NOMEM;
-  case EFAULT:
-    return _DOSE_ILGMPTR;
-  case ENOEXEC:
-    return _DOSE_ILGFMT;
-  /* case EINVAL:       // open
-    return _DOSE_ILGARG; */
-  case ENAMETOOLONG:
-    return _DOSE_ILGFNAME;
-  case EINVAL:
-    return _DOSE_ILGPARM;
-  case EXDEV:
-    return _DOSE_ILGDRV;
-  /* case EINVAL:       // rmdir
-    return _DOSE_ISCURDIR; */
-  case EACCES:
-  case EPERM:
-  case EROFS:
-    return _DOSE_RDONLY;
-  /* case EEXIST:       // mkdir
-    return _DOSE_EXISTDIR; */
-  case ENOTEMPTY:
-    return _DOSE_NOTEMPTY;
-  /* case ENOTEMPTY:    // rename
-    return _DOSE_CANTREN; */
-  case ENOSPC:
-    return _DOSE_DISKFULL;
-  /* case ENOSPC:       // create, open
-    return _DOSE_DIRFULL; */
-  case EOVERFLOW:
-    return _DOSE_CANTSEEK;
-  case EEXIST:
-    return _DOSE_EXISTFILE;
-  default:
-    return _DOSE_ILGPARM;
+  if (!(mountflags[unit] & MOUNT_ARCHIVE)) {
+    return NULL;
   }
+  return arc_lookup(unit, path, member, ARC_PATHLEN);
 }
 
 //----------------------------------------------------------------------------
@@ -386,6 +378,11 @@ static int my_atoi(char **p)
 // Filesystem operations
 //****************************************************************************
 
+static void wb_flush_unit(int unit, const char *path);
+static void wb_flush_dir(int unit, const char *dir);
+static void reval_queue(int unit, const char *path, bool isdir, bool isroot);
+static bool files_cached(struct dos_req_header *req, uint32_t maxage);
+
 int op_chdir(struct dos_req_header *req)
 {
   hostpath_t path;
@@ -403,8 +400,38 @@ int op_chdir(struct dos_req_header *req)
     return _DOSE_NODIR;
   }
 
+  char member[ARC_PATHLEN];
+  arc_t *arc = arc_path(req->unit, path, member);
+  if (arc != NULL) {          // アーカイブ内のディレクトリ
+    int err = (arc_stat(arc, member) & 0x10) ? 0 : _DOSE_NODIR;
+    DPRINTF1("-> %d (archive)\r\n", err);
+    return err;
+  }
+
+  uint8_t atr;
+  if ((mountflags[req->unit] & MOUNT_STALE) &&
+      scache_lookup_age(req->unit, path, NULL, &atr, STALE_MAXAGE) >= 0) {
+    // 期限切れの情報ならそのまま使い、バックグラウンドで読み直す
+    if (scache_lookup(req->unit, path, NULL, NULL) < 0) {
+      reval_queue(req->unit, path, false, false);
+      cache_stats.stale_hits++;
+    }
+    int err = (atr & 0x10) ? 0 : _DOSE_NODIR;
+    DPRINTF1("-> %d (stale)\r\n", err);
+    return err;
+  }
+
   TYPE_STAT st;
-  if (FUNC_STAT(req->unit, NULL, path, &st) != 0 || !STAT_ISDIR(&st)) {
+  int err;
+  if (FUNC_STAT(req->unit, &err, path, &st) != 0) {
+    if (err == ENOENT) {
+      scache_enter(req->unit, path, false, 0);
+    }
+    DPRINTF1("-> NODIR\r\n");
+    return _DOSE_NODIR;
+  }
+  scache_enter(req->unit, path, true, FUNC_FILEMODE_ATTR(&st));
+  if (!STAT_ISDIR(&st)) {
     DPRINTF1("-> NODIR\r\n");
     return _DOSE_NODIR;
   } else {
@@ -428,6 +455,7 @@ int op_mkdir(struct dos_req_header *req)
 
   int err;
   FUNC_MKDIR(req->unit, &err, path);
+  dcache_invalidate(req->unit, path);
   switch (err) {
   case EEXIST:
     DPRINTF1("-> EXISTDIR\r\n");
@@ -454,6 +482,7 @@ int op_rmdir(struct dos_req_header *req)
 
   int err;
   FUNC_RMDIR(req->unit, &err, path);
+  dcache_invalidate(req->unit, path);
   switch (err) {
   case EINVAL:
     DPRINTF1("-> ISCURDIR\r\n");
@@ -483,8 +512,14 @@ int op_rename(struct dos_req_header *req)
     return _DOSE_NODIR;
   }
 
+  wb_flush_unit(req->unit, NULL);
+
   int err;
   FUNC_RENAME(req->unit, &err, pathold, pathnew);
+  // ディレクトリの移動で配下のパス名も変わるため、ユニットのキャッシュをすべて捨てる
+  dcache_invalidate_unit(req->unit);
+  pcache_invalidate_unit(req->unit);
+  arc_invalidate_unit(req->unit);
 
   DPRINTF1("RENAME: %s to %s  -> %d\r\n", pathold, pathnew, err);
 
@@ -511,8 +546,13 @@ int op_delete(struct dos_req_header *req)
     return _DOSE_NODIR;
   }
 
+  wb_flush_unit(req->unit, path);
+
   int err;
   FUNC_UNLINK(req->unit, &err, path);
+  dcache_invalidate(req->unit, path);
+  pcache_invalidate_path(req->unit, path);
+  arc_invalidate(req->unit, path);
   err = conv_errno(err);
   DPRINTF1("-> %d\r\n", err);
   return err;
@@ -533,19 +573,56 @@ int op_chmod(struct dos_req_header *req)
 
   DPRINTF1(" 0x%02x ", req->attr);
 
+  char member[ARC_PATHLEN];
+  arc_t *arc = arc_path(req->unit, path, member);
+  if (arc != NULL) {          // アーカイブ内のファイルの属性は変更できない
+    int err = arc_stat(arc, member);
+    if (err < 0) {
+      err = _DOSE_NOENT;
+    } else if (req->attr != 0xff) {
+      err = _DOSE_RDONLY;
+    }
+    DPRINTF1("-> %d (archive)\r\n", err);
+    return err;
+  }
+
+  wb_flush_unit(req->unit, path);
+
+  if (req->attr == 0xff && (mountflags[req->unit] & MOUNT_STALE)) {
+    char name[8 + 10 + 1 + 3 + 1];
+    uint8_t atr;
+    name[conv_namests_name(req->addr, (uint8_t *)name)] = '\0';
+    int res = scache_lookup_age(req->unit, path, name, &atr, STALE_MAXAGE);
+    if (res >= 0) {
+      // 期限切れの情報ならそのまま使い、バックグラウンドで読み直す
+      if (scache_lookup(req->unit, path, name, NULL) < 0) {
+        reval_queue(req->unit, path, false, false);
+        cache_stats.stale_hits++;
+      }
+      int err = res ? atr : conv_errno(ENOENT);
+      DPRINTF1("-> %d (stale)\r\n", err);
+      return err;
+    }
+  }
+
   TYPE_STAT st;
   int err;
   if (FUNC_STAT(req->unit, &err, path, &st) < 0) {
+    if (err == ENOENT) {
+      scache_enter(req->unit, path, false, 0);
+    }
     err = conv_errno(err);
     DPRINTF1("-> %d\r\n", err);
     return err;
   } else {
     err = FUNC_FILEMODE_ATTR(&st);
+    scache_enter(req->unit, path, true, err);
   }
 
   if (req->attr != 0xff) {
     FUNC_CHMOD(req->unit, &err, path, FUNC_ATTR_FILEMODE(req->attr, &st));
     err = conv_errno(err);
+    dcache_invalidate(req->unit, path);
   }
 
   DPRINTF1("-> %d\r\n", err);
@@ -566,7 +643,13 @@ typedef struct {
   uint8_t attr;         // 検索するファイル属性
   uint8_t fname[21];    // 検索するファイル名(ワイルドカード付き)
   TYPE_DIR dir;         // ディレクトリディスクリプタ
-  hostpath_t hostpath;  // ホスト側検索パス名
+  bool cached;          // ディレクトリ一覧キャッシュから読み出す
+  bool literal;         // ワイルドカードのないファイル名を直接調べた (次は一覧の終わり)
+  dcache_t *dc;         // 一覧を記録するディレクトリ一覧キャッシュ
+  int dcpos;            // 次に記録(読み出し)するエントリの位置
+  arc_t *arc;           // アーカイブ内のディレクトリならその索引
+  int arcpos;           // 次に読み出すアーカイブのエントリの位置
+  hostpath_t hostpath;  // ホスト側検索パス名 (アーカイブ内ならアーカイブ内のパス名)
 } dirlist_t;
 
 static dirlist_t *dl_store;
@@ -580,11 +663,18 @@ static void dl_free(dirlist_t *dl)
     FUNC_CLOSEDIR(dl->unit, NULL, dl->dir);
   }
   dl->dir = DIR_BADDIR;
+  dl->cached = false;
+  dl->literal = false;
+  dcache_end(dl->dc);
+  dl->dc = NULL;
+  arc_release(dl->arc);
+  dl->arc = NULL;
   dl->filep = 0;
 }
 
 // FILBUFに対応するバッファを探す
-static dirlist_t *dl_alloc(uint32_t filep, bool create)
+// (growがfalseならバッファの拡張は行わない)
+static dirlist_t *dl_alloc(uint32_t filep, bool create, bool grow)
 {
   for (int i = 0; i < dl_size; i++) {
     dirlist_t *dl = &dl_store[i];
@@ -604,9 +694,13 @@ static dirlist_t *dl_alloc(uint32_t filep, bool create)
     if (dl->filep == 0) {   // 新規作成で未使用のバッファを見つけた
       dl->filep = filep;
       dl->dir = DIR_BADDIR;
+      dl->dc = NULL;
+      dl->arc = NULL;
       return dl;
     }
   }
+  if (!grow)
+    return NULL;
   dl_size++;                // バッファが不足しているので拡張する
   dirlist_t *dl_new = realloc(dl_store, sizeof(dirlist_t) * dl_size);
   if (dl_new == NULL) {
@@ -617,6 +711,8 @@ static dirlist_t *dl_alloc(uint32_t filep, bool create)
   dirlist_t *dl = &dl_store[dl_size - 1];
   dl->filep = filep;
   dl->dir = DIR_BADDIR;
+  dl->dc = NULL;
+  dl->arc = NULL;
   return dl;
 }
 
@@ -630,13 +726,31 @@ static void dl_freeall(int unit)
   }
 }
 
+// 検索条件を設定する
+static void dl_init(dirlist_t *dl, struct dos_req_header *req)
+{
+  struct dos_namestbuf *ns = req->addr;
+
+  dl->unit = req->unit;
+  dl->isroot = strcmp(ns->path, "\t") == 0;
+  dl->isfirst = true;
+  dl->literal = false;
+  dl->attr = req->attr;
+
+  conv_pattern(ns, dl->fname);
+
+  DPRINTF2("dl_opendir: %02x ", dl->attr);
+  for (int i = 0; i < 21; i++)
+    DPRINTF2("%c", dl->fname[i] == 0 ? '_' : dl->fname[i]);
+  DPRINTF2("\r\n");
+}
+
 static int dl_opendir(dirlist_t **dlp, struct dos_req_header *req)
 {
   dirlist_t *dl;
   *dlp = NULL;
-  struct dos_namestbuf *ns = req->addr;
 
-  if ((dl = dl_alloc(req->status, true)) == NULL) {
+  if ((dl = dl_alloc(req->status, true, true)) == NULL) {
     return ENOMEM;
   }
 
@@ -644,57 +758,138 @@ static int dl_opendir(dirlist_t **dlp, struct dos_req_header *req)
     dl_free(dl);
     return ENOENT;
   }
-  dl->unit = req->unit;
-  dl->isroot = strcmp(ns->path, "\t") == 0;
-  dl->isfirst = true;
-  dl->attr = req->attr;
-
-  // (derived from HFS.java by Makoto Kamada)
-  //検索するファイル名の順序を入れ替える
-  //  主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'のときは主ファイル名2を'?'で充填する
-  memset(dl->fname, 0, sizeof(dl->fname));
-  memcpy(&dl->fname[0], ns->name1, 8);    //主ファイル名1
-  if (ns->name1[7] == '?' && ns->name2[0] == '\0') {  //主ファイル名1の末尾が'?'で主ファイル名2の先頭が'\0'
-    memset(&dl->fname[8], '?', 10);           //主ファイル名2
-  } else {
-    memcpy(&dl->fname[8], ns->name2, 10); //主ファイル名2
-  }
-  for (int i = 17; i >= 0 && (dl->fname[i] == '\0' || dl->fname[i] == ' '); i--) {  //主ファイル名1+主ファイル名2の空き
-    dl->fname[i] = '\0';
-  }
-  memcpy(&dl->fname[18], ns->ext, 3);     //拡張子
-  for (int i = 20; i >= 18 && (dl->fname[i] == ' '); i--) { //拡張子の空き
-    dl->fname[i] = '\0';
-  }
-  //検索するファイル名を小文字化する
-  for (int i = 0; i < 21; i++) {
-    int c = dl->fname[i];
-    if ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) {  //SJISの1バイト目
-      i++;
-    } else {
-      dl->fname[i] = tolower(dl->fname[i]);
+  dl_init(dl, req);
+  dl->cached = false;
+
+  char member[ARC_PATHLEN];
+  arc_t *arc = arc_path(req->unit, dl->hostpath, member);
+  if (arc != NULL) {
+    //アーカイブ内のディレクトリは索引から一覧を作る
+    if (!(arc_stat(arc, member) & 0x10)) {
+      dl_free(dl);
+      return ENOENT;
     }
+    arc_ref(arc);
+    dl->arc = arc;
+    strcpy(dl->hostpath, member);
+    dl->arcpos = -2;          // 最初に.と..を返す
+    *dlp = dl;
+    return 0;
   }
 
-  DPRINTF2("dl_opendir: %02x ", dl->attr);
-  for (int i = 0; i < 21; i++)
-    DPRINTF2("%c", dl->fname[i] == 0 ? '_' : dl->fname[i]);
-  DPRINTF2("\r\n");
-
   //ディレクトリを開いてディスクリプタを得る
   int err;
   if ((dl->dir = FUNC_OPENDIR(req->unit, &err, dl->hostpath)) == DIR_BADDIR) {
     return err;
   }
+  //ディレクトリの一覧をキャッシュに記録する
+  dl->dc = dcache_begin(req->unit, dl->hostpath);
+  dl->dcpos = 0;
 
   *dlp = dl;
   return 0;
 }
 
+// 属性、時刻、日付、ファイルサイズを得る
+// (アーカイブをディレクトリとして見せる場合はZIP/LZHファイルをディレクトリにする)
+static void dl_statinfo(int unit, TYPE_STAT *st, struct dos_filesinfo *fi)
+{
+  conv_statinfo(st, fi);
+  if ((mountflags[unit] & MOUNT_ARCHIVE) && !(fi->atr & 0x10) &&
+      arc_isarchive(fi->name, strlen(fi->name))) {
+    fi->atr = 0x10;
+    fi->filelen = 0;
+  }
+}
+
+// アーカイブの索引から属性とファイル名の条件に合うものを選ぶ
+static int dl_readarc(dirlist_t *dl, struct dos_filesinfo *fi)
+{
+  uint8_t w2[21];
+
+  while (dl->arcpos < 0) {
+    const char *dot = dl->arcpos++ == -2 ? "." : "..";
+    if (!(dl->attr & 0x10) || conv_splitname(dot, w2) < 0 || !conv_matchname(dl->fname, w2)) {
+      continue;
+    }
+    fi->atr = 0x10;
+    fi->time = fi->date = 0;
+    fi->filelen = 0;
+    strcpy(fi->name, dot);
+    if (dl->arcpos == 0) {
+      dl->arcpos = arc_first(dl->arc, dl->hostpath);
+    }
+    return 1;
+  }
+
+  const char *name;
+  arcent_t *e;
+  while ((e = arc_next(dl->arc, dl->hostpath, &dl->arcpos, &name)) != NULL) {
+    if (strlen(name) >= sizeof(fi->name) || !conv_validname(name) ||
+        conv_splitname(name, w2) < 0 || !conv_matchname(dl->fname, w2) ||
+        (e->atr & dl->attr) == 0) {
+      continue;
+    }
+    fi->atr = e->atr;
+    fi->time = htobe16(e->time);
+    fi->date = htobe16(e->date);
+    fi->filelen = htobe32(e->usize);
+    strcpy(fi->name, name);
+    return 1;
+  }
+  dl_free(dl);
+  return 0;   // もうファイルがない
+}
+
+// サーバのディレクトリエントリをHuman68kのエントリに変換する
+// (ファイル名をSJISに変換できないなど、Human68kで扱えないエントリならfalseを返す)
+static bool dl_convent(int unit, bool isroot, TYPE_DIRENT *d, struct dos_filesinfo *fi, uint8_t *w2)
+{
+  char *childName = DIRENT_NAME(d);
+
+  if (isroot) {  //ルートディレクトリのとき
+    if (strcmp(childName, ".") == 0 || strcmp(childName, "..") == 0) {  //.と..を除く
+      return false;
+    }
+  }
+
+  // ファイル名をSJISに変換する
+  char *dst_buf = fi->name;
+  size_t dst_len = sizeof(fi->name) - 1;
+  char *src_buf = childName;
+  size_t src_len = strlen(childName);
+  if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
+    return false;
+  }
+  *dst_buf = '\0';
+  if (!conv_validname(fi->name)) {  //ファイル名に使えない文字がある
+    return false;
+  }
+
+  //ファイル名を分解する
+  if (conv_splitname(fi->name, w2) < 0) {
+    return false;
+  }
+
+  if (0xffffffffL < STAT_SIZE(DIRENT_STAT(d))) {  //4GB以上のファイルは検索できないことにする
+    return false;
+  }
+
+  //属性、時刻、日付、ファイルサイズを取得する
+  dl_statinfo(unit, DIRENT_STAT(d), fi);
+  return true;
+}
+
 int dl_readdir(dirlist_t *dl, void *v)
 {
   TYPE_DIRENT *d;
   struct dos_filesinfo *fi = (struct dos_filesinfo *)v;
+  uint8_t w2[21];
+
+  if (dl->literal) {
+    dl_free(dl);
+    return 0;   // 直接調べたファイルの次はない
+  }
 
   if (dl->isfirst && dl->isroot && (dl->attr & 0x08) != 0 &&
       dl->fname[0] == '?' && dl->fname[18] == '?') {    //検索するファイル名が*.*のとき
@@ -714,94 +909,180 @@ int dl_readdir(dirlist_t *dl, void *v)
   }
 
   dl->isfirst = false;
-  //ディレクトリの一覧から属性とファイル名の条件に合うものを選ぶ
-  while ((d = FUNC_READDIR(dl->unit, NULL, dl->dir))) {
-    char *childName = DIRENT_NAME(d);
 
-    if (dl->isroot) {  //ルートディレクトリのとき
-      if (strcmp(childName, ".") == 0 || strcmp(childName, "..") == 0) {  //.と..を除く
+  if (dl->arc) {
+    return dl_readarc(dl, fi);
+  }
+
+  if (dl->cached) {
+    //ディレクトリ一覧キャッシュから属性とファイル名の条件に合うものを選ぶ
+    while (dl->dcpos < dl->dc->nent) {
+      struct dos_filesinfo *e = &dl->dc->ent[dl->dcpos++];
+      if ((e->atr & dl->attr) == 0 || conv_splitname(e->name, w2) < 0 || !conv_matchname(dl->fname, w2)) {
         continue;
       }
+      memcpy(fi, e, sizeof(*fi));
+      return 1;
     }
+    dl_free(dl);
+    return 0;   // もうファイルがない
+  }
 
-    // ファイル名をSJISに変換する
-    char *dst_buf = fi->name;
-    size_t dst_len = sizeof(fi->name) - 1;
-    char *src_buf = childName;
-    size_t src_len = strlen(childName);
-    if (FUNC_ICONV_U2S(&src_buf, &src_len, &dst_buf, &dst_len) < 0) {
+  //ディレクトリの一覧から属性とファイル名の条件に合うものを選ぶ
+  while ((d = FUNC_READDIR(dl->unit, NULL, dl->dir))) {
+    if (!dl_convent(dl->unit, dl->isroot, d, fi, w2)) {
       continue;
     }
-    *dst_buf = '\0';
-    uint8_t c;
-    for (int i = 0; i < sizeof(fi->name); i++) {
-      if (!(c = fi->name[i]))
-        break;
-      if ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) {  //SJISの1バイト目
-        i++;
-        continue;
-      }
-      if (c <= 0x1f ||  //変換できない文字または制御コード
-          (c == '-' && i == 0) ||  //ファイル名の先頭に使えない文字
-          strchr("/\\,;<=>[]|", c) != NULL) {  //ファイル名に使えない文字
-        break;
-      }
+    //検索条件に関係なく、すべてのエントリを一覧の順序でキャッシュに記録する
+    if (dl->dc) {
+      dcache_record(dl->dc, dl->dcpos++, fi);
     }
-    if (c) {  //ファイル名に使えない文字がある
+
+    //ファイル名を比較する
+    if (!conv_matchname(dl->fname, w2)) { //ファイル名がマッチしなかった
       continue;
     }
 
-    //ファイル名を分解する
-    char *b = fi->name;
-    int k = strlen(b);
-    int m = (b[k - 1] == '.' ? k :  //name.
-             k >= 3 && b[k - 2] == '.' ? k - 2 :  //name.e
-             k >= 4 && b[k - 3] == '.' ? k - 3 :  //name.ex
-             k >= 5 && b[k - 4] == '.' ? k - 4 :  //name.ext
-             k);  //主ファイル名の直後。拡張子があるときは'.'の位置、ないときはk
-    if (m > 18) {  //主ファイル名が長すぎる
+    if ((fi->atr & dl->attr) == 0) {  //属性がマッチしない
       continue;
     }
-    uint8_t w2[21] = { 0 };
-    memcpy(&w2[0], &b[0], m);         //主ファイル名
-    if (b[m] == '.')
-      strncpy((char *)&w2[18], &b[m + 1], 3); //拡張子
 
-    for (int i = 0; i < 21; i++)
-      DPRINTF2("%c", w2[i] == 0 ? '_' : w2[i]);
-    DPRINTF2("\r\n");
+    return 1;
+  }
+
+  dcache_finish(dl->dc, dl->dcpos);
+  dl_free(dl);
+  return 0;   // もうファイルがない
+}
 
-    //ファイル名を比較する
-    {
-      int f = 0x20;  //0x00=次のバイトはSJISの2バイト目,0x20=次のバイトはSJISの2バイト目ではない
-      int i;
-      for (i = 0; i < 21; i++) {
-        int c = w2[i];
-        int d = dl->fname[i];
-        if (d != '?' && ('A' <= c && c <= 'Z' ? c | f : c) != d) {  //検索するファイル名の'?'以外の部分がマッチしない。SJISの2バイト目でなければ小文字化してから比較する
-          break;
+// 検索するファイル名にワイルドカードがなければ、ディレクトリを読まずにファイル情報を調べる
+// (Human68kやシェルはファイルの存在や属性を調べるのにワイルドカードのないFILESを使う)
+// サーバへの問い合わせはFUNC_STAT(CREATE+QUERY_INFO+CLOSEの1往復)だけで、ディレクトリの大きさによらない
+// 処理できなければfalseを返し、通常通りディレクトリの一覧から探す
+static bool files_literal(struct dos_req_header *req)
+{
+  struct dos_namestbuf *ns = (struct dos_namestbuf *)req->addr;
+  struct dos_filbuf *fb = (struct dos_filbuf *)req->status;
+  struct dos_filesinfo *fi = (struct dos_filesinfo *)&fb->ext[2];
+  hostpath_t dirpath;
+  hostpath_t path;
+  char name[8 + 10 + 1 + 3 + 1];
+  char member[ARC_PATHLEN];
+  uint8_t fname[21];
+  dirlist_t *dl;
+
+  conv_pattern(ns, fname);
+  if (memchr(fname, '?', sizeof(fname)) != NULL) {
+    return false;
+  }
+  name[conv_namests_name(ns, (uint8_t *)name)] = '\0';
+  if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return false;
+  }
+  if (conv_namebuf(req->unit, ns, false, &dirpath) < 0 ||
+      conv_namebuf(req->unit, ns, true, &path) < 0 ||
+      arc_path(req->unit, dirpath, member) != NULL) {
+    return false;
+  }
+  if ((dl = dl_alloc(req->status, true, true)) == NULL) {
+    return false;
+  }
+  dl_init(dl, req);
+
+  TYPE_STAT st;
+  uint8_t atr;
+  int err;
+  if (scache_lookup(req->unit, path, name, &atr) == 0) {
+    DPRINTF1("-> NOMORE (literal, cached)\r\n");
+    dl_free(dl);
+    req->status = _DOSE_NOMORE;
+    return true;              // 存在しないことが分かっている
+  }
+
+  // 有効期間内の一覧にあれば、サーバ上の大文字小文字のファイル名と情報をそのまま返す
+  dcache_t *dc = dcache_lookup(req->unit, dirpath, -1);
+  int index = -1;
+  if (dc != NULL && dcache_fresh(dc)) {
+    index = dcache_find(dc, name);
+  }
+  if (index >= 0) {
+    memcpy(fi, &dc->ent[index], sizeof(*fi));
+  } else if (FUNC_STAT(req->unit, &err, path, &st) != 0) {
+    if (err != ENOENT) {
+      dl_free(dl);
+      return false;
+    }
+    // 見つからなかった場合はディレクトリが存在するかで返すエラーが変わる
+    if (!dl->isroot) {
+      int res = scache_lookup(req->unit, dirpath, NULL, &atr);
+      if (res < 0) {
+        if (FUNC_STAT(req->unit, &err, dirpath, &st) != 0) {
+          if (err != ENOENT) {
+            dl_free(dl);
+            return false;
+          }
+          scache_enter(req->unit, dirpath, false, 0);
+          res = 0;
+        } else {
+          atr = FUNC_FILEMODE_ATTR(&st);
+          scache_enter(req->unit, dirpath, true, atr);
+          res = 1;
         }
-        f = f != 0x00 && ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) ? 0x00 : 0x20;  //このバイトがSJISの2バイト目ではなくてSJISの1バイト目ならば次のバイトはSJISの2バイト目
       }
-      if (i < 21) { //ファイル名がマッチしなかった
-        continue;
+      if (res == 0 || !(atr & 0x10)) {
+        DPRINTF1("-> NODIR (literal)\r\n");
+        dl_free(dl);
+        req->status = _DOSE_NODIR;
+        return true;
       }
     }
+    scache_enter(req->unit, path, false, 0);
+    DPRINTF1("-> NOMORE (literal)\r\n");
+    dl_free(dl);
+    req->status = _DOSE_NOMORE;
+    return true;
+  } else {
+    scache_enter(req->unit, path, true, FUNC_FILEMODE_ATTR(&st));
 
-    //属性、時刻、日付、ファイルサイズを取得する
-    if (0xffffffffL < STAT_SIZE(DIRENT_STAT(d))) {  //4GB以上のファイルは検索できないことにする
-      continue;
-    }
-    conv_statinfo(DIRENT_STAT(d), fi);
-    if ((fi->atr & dl->attr) == 0) {  //属性がマッチしない
-      continue;
+    // FUNC_STATではサーバ上のファイル名が得られないので、検索したときの大文字小文字のまま返す
+    // (ワイルドカードでの検索とはファイル名の大文字小文字が異なることがある)
+    strcpy(fi->name, name);
+    if (0xffffffffL < STAT_SIZE(&st)) {  //4GB以上のファイルは検索できないことにする
+      fi->atr = 0;
+    } else {
+      dl_statinfo(req->unit, &st, fi);
     }
-
-    return 1;
   }
+  if ((fi->atr & dl->attr) == 0) {  //属性がマッチしない
+    DPRINTF1("-> NOMORE (literal)\r\n");
+    dl_free(dl);
+    req->status = _DOSE_NOMORE;
+    return true;
+  }
+  dl->literal = true;
+  DPRINTF1("FILES: attr=0x%02x filep=0x%08x -> %s (literal)\r\n", req->attr, (uint32_t)fb, fi->name);
+  req->status = 0;
+  return true;
+}
 
-  dl_free(dl);
-  return 0;   // もうファイルがない
+// 検索するファイルが保持している書き込みをサーバに書き込む
+// (ワイルドカードを含まなければそのファイルだけ、含んでいればディレクトリ内のファイルすべて)
+static void files_flush(struct dos_req_header *req)
+{
+  struct dos_namestbuf *ns = (struct dos_namestbuf *)req->addr;
+  hostpath_t path;
+  uint8_t fname[21];
+
+  conv_pattern(ns, fname);
+  bool wild = memchr(fname, '?', sizeof(fname)) != NULL;
+  if (conv_namebuf(req->unit, ns, !wild, &path) < 0) {
+    return;
+  }
+  if (wild) {
+    wb_flush_dir(req->unit, path);
+  } else {
+    wb_flush_unit(req->unit, path);
+  }
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -814,6 +1095,15 @@ int op_files(struct dos_req_header *req)
   DNAMEPRINT(req->addr, true, "FILES: ");
   DPRINTF1("\r\n");
 
+  files_flush(req);             // 一覧のファイルサイズが古くならないようにする
+
+  if ((mountflags[req->unit] & MOUNT_STALE) && files_cached(req, STALE_MAXAGE)) {
+    return req->status;       // 期限切れの一覧を返し、バックグラウンドで読み直す
+  }
+  if (files_literal(req)) {
+    return req->status;
+  }
+
   int err = dl_opendir(&dl, req);
   if (err) {
     switch (err) {
@@ -845,7 +1135,7 @@ int op_nfiles(struct dos_req_header *req)
 
   DPRINTF1("NFILES: ");
 
-  if ((dl = dl_alloc(req->status, false)) == NULL) {
+  if ((dl = dl_alloc(req->status, false, false)) == NULL) {
     DPRINTF1("-> ILGARG\r\n");
     return _DOSE_ILGARG;
   }
@@ -863,42 +1153,411 @@ int op_nfiles(struct dos_req_header *req)
 // File operations
 //****************************************************************************
 
+// ライトバックキャッシュのページ
+// サーバに書き込んでいないデータをページ単位で保持する (ページ内で書き込まれた範囲は連続している)
+typedef struct wbpage {
+  struct wbpage *next;  // 同じFCBのページ (オフセット順)
+  uint32_t pageno;
+  uint16_t lo;          // 書き込まれた範囲 (ページ内のオフセット)
+  uint16_t hi;
+  uint8_t data[PCACHE_PAGESIZE];
+} wbpage_t;
+
 // file descriptor management structure
 // Human68kから渡されるFCBのアドレスをキーとしてfdを管理する
 typedef struct {
   uint32_t fcb;
-  TYPE_FD fd;
+  TYPE_FD fd;           // FD_BADFDならまだサーバ側でオープンしていない
   off_t pos;
   int unit;
+  cfile_t *cf;          // ページキャッシュ
+  arcfile_t *af;        // アーカイブ内のファイル
+  bool wb;              // 書き込みをライトバックする (他からの書き込みを拒否してオープンした)
+  int ndirty;           // 書き込みを保持しているページ数
+  uint32_t dirtytime;   // 最も古い書き込みを保持した時刻
+  wbpage_t *dirty;      // 書き込みを保持しているページ (オフセット順)
+  bool modified;        // 書き込みやファイル長の変更を行った (クローズ時に一覧を無効にする)
+  uint32_t rpos;        // 前回のreadの位置
+  uint32_t rend;        // 前回のreadの終了位置
+  int32_t stride;       // 前回と前々回のreadの間隔 (0=連続しているか近い)
+  int sconf;            // 同じ間隔のreadが続いた回数
+  int sdepth;           // 先読みするレコード数
+  int sahead;           // 先読みを要求済みのレコード数
 } fdinfo_t;
 
 static fdinfo_t *fi_store;
 static int fi_size = 0;
+static volatile int wb_total;           // 全FCBで書き込みを保持しているページ数
 
-// FCBに対応するバッファを探す
-static fdinfo_t *fi_alloc(int unit, uint32_t fcb, bool alloc)
+//----------------------------------------------------------------------------
+
+// 保持している書き込みを捨てる
+static void wb_discard(fdinfo_t *fi)
 {
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fcb == fcb) {
-      if (alloc) {              // 新規作成で同じFCBを見つけたらバッファを再利用
-        FUNC_CLOSE(unit, NULL, fi_store[i].fd);
-        fi_store[i].fd = FD_BADFD;
-        fi_store[i].unit = unit;
+  while (fi->dirty) {
+    wbpage_t *wp = fi->dirty;
+    fi->dirty = wp->next;
+    free(wp);
+  }
+  wb_total -= fi->ndirty;
+  fi->ndirty = 0;
+  if (fi->wb && fi->cf) {
+    fi->cf->writers--;
+  }
+  fi->wb = false;
+}
+
+// 保持している書き込みをオフセット順にサーバに書き込み、書き込んだページを解放する
+// 連続するページはまとめて1回で書き込み、書き込んだ回数をwritesに加える
+// (全FCBで共有するwb_totalと統計情報は、呼び出し元がcache_mutexを確保した状態で更新する)
+static int wb_send(fdinfo_t *fi, int *writes)
+{
+  int err;
+  while (fi->dirty) {
+    wbpage_t *first = fi->dirty;
+    wbpage_t *last = first;
+    int n = 1;
+    while (last->hi == PCACHE_PAGESIZE && last->next &&
+           last->next->pageno == last->pageno + 1 && last->next->lo == 0) {
+      last = last->next;
+      n++;
+    }
+    wbpage_t *stop;
+    off_t offset = (off_t)first->pageno * PCACHE_PAGESIZE + first->lo;
+    size_t len = (n - 1) * PCACHE_PAGESIZE + last->hi - first->lo;
+
+    // 複数ページにまたがる書き込みは連続したバッファにまとめる (確保できなければページごとに書く)
+    uint8_t *buf = NULL;
+    if (n > 1 && (buf = malloc(len)) != NULL) {
+      uint8_t *p = buf;
+      for (wbpage_t *wp = first; ; wp = wp->next) {
+        memcpy(p, &wp->data[wp->lo], wp->hi - wp->lo);
+        p += wp->hi - wp->lo;
+        if (wp == last) {
+          break;
+        }
       }
-      return &fi_store[i];
+    } else {
+      last = first;
+      len = first->hi - first->lo;
     }
-  }
-  if (!alloc)
-    return NULL;
+    stop = last->next;
 
-  for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fcb == 0) { // 新規作成で未使用のバッファを見つけた
-      fi_store[i].fcb = fcb;
-      fi_store[i].unit = unit;
-      return &fi_store[i];
+    ssize_t bytes = -1;
+    if (fi->pos == offset || FUNC_LSEEK(fi->unit, &err, fi->fd, offset, SEEK_SET) >= 0) {
+      fi->pos = offset;
+      bytes = FUNC_WRITE(fi->unit, &err, fi->fd, buf ? buf : &first->data[first->lo], len);
     }
-  }
-  fi_size++;                    // バッファが不足しているので拡張する
+    free(buf);
+    if (bytes < 0) {
+      DPRINTF1("wb_flush: write error %d\r\n", err);
+      return conv_errno(err);
+    }
+    fi->pos += bytes;
+    (*writes)++;
+
+    while (fi->dirty != stop) {
+      wbpage_t *wp = fi->dirty;
+      fi->dirty = wp->next;
+      free(wp);
+      fi->ndirty--;
+    }
+  }
+  return 0;
+}
+
+// 保持している書き込みをサーバに書き込む (DOSコールの処理から呼ばれる)
+static int wb_flush(fdinfo_t *fi)
+{
+  if (fi->fd == FD_BADFD && fi->dirty) {
+    // 複製サーバに切り替わって閉じられたファイルは、読み書き用に開き直して書き込む
+    int err;
+    if ((fi->fd = FUNC_OPEN(fi->unit, &err, fi->cf->path, O_RDWR|O_BINARY)) == FD_BADFD) {
+      DPRINTF1("wb_flush: reopen error %d\r\n", err);
+      return conv_errno(err);
+    }
+    fi->pos = 0;
+  }
+  int ndirty = fi->ndirty;
+  int writes = 0;
+  int err = wb_send(fi, &writes);
+  wb_total -= ndirty - fi->ndirty;
+  cache_stats.wb_flushed += writes;
+  return err;
+}
+
+// ユニットのFCBが保持している書き込みをすべてサーバに書き込む
+// (pathを指定したらそのファイルだけ)
+static void wb_flush_unit(int unit, const char *path)
+{
+  if (wb_total == 0) {
+    return;
+  }
+  for (int i = 0; i < fi_size; i++) {
+    fdinfo_t *fi = &fi_store[i];
+    if (fi->fcb == 0 || fi->unit != unit || fi->dirty == NULL) {
+      continue;
+    }
+    if (path && !cache_pathmatch(fi->cf->path, -1, path)) {
+      continue;
+    }
+    wb_flush(fi);
+  }
+}
+
+// ディレクトリ内のファイルのFCBが保持している書き込みをサーバに書き込む
+static void wb_flush_dir(int unit, const char *dir)
+{
+  if (wb_total == 0) {
+    return;
+  }
+  for (int i = 0; i < fi_size; i++) {
+    fdinfo_t *fi = &fi_store[i];
+    if (fi->fcb == 0 || fi->unit != unit || fi->dirty == NULL) {
+      continue;
+    }
+    if (!cache_pathmatch(fi->cf->path, cache_dirlen(fi->cf->path), dir)) {
+      continue;
+    }
+    wb_flush(fi);
+  }
+}
+
+// 保持してから時間の経った書き込みをサーバに書き込む (バックグラウンドスレッドから呼ばれる)
+// サーバとの通信中はユニットのmutexだけを確保し、他のユニットへのDOSコールを待たせない
+// (fi_storeは他のユニットへのDOSコールで再確保されることがあるので、FCBの状態を写して書き込む)
+static void wb_flush_bg(int unit)
+{
+  static fdinfo_t tmp;                  // スレッドのスタックが小さいのでstaticに置く
+
+  if (pthread_mutex_trylock(&smbfs_data.unit_mutex[unit]) != 0) {
+    return;                     // 使用中のユニットは次の機会に書き込む
+  }
+  while (wb_total > 0 && rootsmb2[unit]) {
+    pthread_mutex_lock(&smbfs_data.cache_mutex);
+    int i;
+    for (i = 0; i < fi_size; i++) {
+      fdinfo_t *fi = &fi_store[i];
+      if (fi->fcb != 0 && fi->unit == unit && fi->dirty != NULL && fi->fd != FD_BADFD &&
+          cache_clock() - fi->dirtytime >= WB_DELAY) {
+        break;
+      }
+    }
+    if (i == fi_size) {
+      pthread_mutex_unlock(&smbfs_data.cache_mutex);
+      break;
+    }
+    tmp = fi_store[i];
+    pthread_mutex_unlock(&smbfs_data.cache_mutex);
+
+    // このユニットのmutexを確保しているので、このFCBの書き込みやクローズは行われない
+    int writes = 0;
+    int err = wb_send(&tmp, &writes);
+
+    pthread_mutex_lock(&smbfs_data.cache_mutex);
+    for (i = 0; i < fi_size; i++) {
+      fdinfo_t *fi = &fi_store[i];
+      if (fi->fcb == tmp.fcb && fi->unit == unit) {
+        wb_total -= fi->ndirty - tmp.ndirty;
+        fi->dirty = tmp.dirty;
+        fi->ndirty = tmp.ndirty;
+        fi->pos = tmp.pos;
+        break;
+      }
+    }
+    cache_stats.wb_flushed += writes;
+    pthread_mutex_unlock(&smbfs_data.cache_mutex);
+    if (err != 0) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+}
+
+// 書き込みを保持する (保持できなければ、保持していた書き込みをサーバに書いてから0を返す)
+static ssize_t wb_write(fdinfo_t *fi, uint32_t pos, const void *buf, size_t len, uint32_t size)
+{
+  uint32_t first = pos / PCACHE_PAGESIZE;
+  uint32_t last = (pos + len - 1) / PCACHE_PAGESIZE;
+  int err;
+
+  // 保持している範囲と離れた書き込みは、間のデータがないので先に保持していた分を書き込む
+  int need = 0;
+  bool conflict = false;
+  for (uint32_t pageno = first; pageno <= last; pageno++) {
+    wbpage_t *wp;
+    for (wp = fi->dirty; wp != NULL && wp->pageno < pageno; wp = wp->next)
+      ;
+    if (wp == NULL || wp->pageno != pageno) {
+      need++;
+      continue;
+    }
+    uint32_t lo = pageno == first ? pos % PCACHE_PAGESIZE : 0;
+    uint32_t hi = pageno == last ? (pos + len - 1) % PCACHE_PAGESIZE + 1 : PCACHE_PAGESIZE;
+    if (hi < wp->lo || lo > wp->hi) {
+      conflict = true;
+    }
+  }
+  if (conflict) {
+    if ((err = wb_flush(fi)) != 0) {
+      return err;
+    }
+    need = last - first + 1;
+  }
+  if (need > 0 && (fi->ndirty + need > WB_MAXPAGES || wb_total + need > WB_TOTALPAGES)) {
+    if ((err = wb_flush(fi)) != 0) {
+      return err;
+    }
+    wb_flush_unit(fi->unit, NULL);
+    need = last - first + 1;
+    if (need > WB_MAXPAGES || wb_total + need > WB_TOTALPAGES) {
+      return 0;                 // 大きな書き込みはそのままサーバに書く
+    }
+  }
+
+  // 必要なページを先に確保しておき、確保できなければ保持しない
+  wbpage_t *newpages = NULL;
+  for (int i = 0; i < need; i++) {
+    wbpage_t *wp = malloc(sizeof(wbpage_t));
+    if (wp == NULL) {
+      while (newpages) {
+        wp = newpages;
+        newpages = wp->next;
+        free(wp);
+      }
+      return (err = wb_flush(fi)) != 0 ? err : 0;
+    }
+    wp->next = newpages;
+    newpages = wp;
+  }
+
+  if (fi->dirty == NULL) {
+    fi->dirtytime = cache_clock();
+  }
+  const uint8_t *src = buf;
+  wbpage_t **pwp = &fi->dirty;
+  for (uint32_t pageno = first; pageno <= last; pageno++) {
+    while (*pwp != NULL && (*pwp)->pageno < pageno) {
+      pwp = &(*pwp)->next;
+    }
+    wbpage_t *wp = *pwp;
+    if (wp == NULL || wp->pageno != pageno) {
+      wp = newpages;
+      newpages = wp->next;
+      wp->pageno = pageno;
+      wp->lo = PCACHE_PAGESIZE;
+      wp->hi = 0;
+      wp->next = *pwp;
+      *pwp = wp;
+      fi->ndirty++;
+      wb_total++;
+    }
+    uint32_t lo = pageno == first ? pos % PCACHE_PAGESIZE : 0;
+    uint32_t hi = pageno == last ? (pos + len - 1) % PCACHE_PAGESIZE + 1 : PCACHE_PAGESIZE;
+    memcpy(&wp->data[lo], src, hi - lo);
+    src += hi - lo;
+    if (lo < wp->lo) {
+      wp->lo = lo;
+    }
+    if (hi > wp->hi) {
+      wp->hi = hi;
+    }
+  }
+
+  pcache_write(fi->cf, pos, buf, len, size);
+  cache_stats.wb_absorbed++;
+  return len;
+}
+
+// サーバから読んだデータに保持している書き込みを重ねる (重ねた後の有効なデータ長を返す)
+// (書き込みでファイルが伸びていれば、サーバから読めたデータより長くなる)
+static size_t wb_overlay(fdinfo_t *fi, uint32_t pos, uint8_t *buf, size_t len, size_t bytes)
+{
+  for (wbpage_t *wp = fi->dirty; wp != NULL; wp = wp->next) {
+    uint32_t start = wp->pageno * PCACHE_PAGESIZE + wp->lo;
+    uint32_t end = wp->pageno * PCACHE_PAGESIZE + wp->hi;
+    if (end <= pos || start >= pos + len) {
+      continue;
+    }
+    if (start < pos) {
+      start = pos;
+    }
+    if (end > pos + len) {
+      end = pos + len;
+    }
+    memcpy(&buf[start - pos], &wp->data[start - wp->pageno * PCACHE_PAGESIZE], end - start);
+    if (start - pos <= bytes && end - pos > bytes) {
+      bytes = end - pos;
+    }
+  }
+  return bytes;
+}
+
+// 同じファイルを開いているすべてのFCBが保持している書き込みを重ねる
+// (サーバから読んだデータが、まだサーバに書いていない書き込みより古くてもキャッシュに入れられる)
+static size_t wb_overlay_cf(cfile_t *cf, uint32_t pos, uint8_t *buf, size_t len, size_t bytes)
+{
+  if (cf == NULL || wb_total == 0) {
+    return bytes;
+  }
+  for (int i = 0; i < fi_size; i++) {
+    fdinfo_t *fi = &fi_store[i];
+    if (fi->fcb != 0 && fi->cf == cf && fi->dirty != NULL) {
+      bytes = wb_overlay(fi, pos, buf, len, bytes);
+    }
+  }
+  return bytes;
+}
+
+// 間隔をあけたreadの検出状態を初期化する
+static void fi_resetstride(fdinfo_t *fi)
+{
+  fi->rpos = fi->rend = 0;
+  fi->stride = 0;
+  fi->sconf = fi->sahead = 0;
+  fi->sdepth = STRIDE_DEPTH;
+}
+
+// FCBに対応するバッファを探す
+static fdinfo_t *fi_alloc(int unit, uint32_t fcb, bool alloc)
+{
+  for (int i = 0; i < fi_size; i++) {
+    if (fi_store[i].fcb == fcb) {
+      if (alloc) {              // 新規作成で同じFCBを見つけたらバッファを再利用
+        if (fi_store[i].dirty) {
+          wb_flush(&fi_store[i]);
+        }
+        if (fi_store[i].fd != FD_BADFD) {
+          FUNC_CLOSE(fi_store[i].unit, NULL, fi_store[i].fd);
+        }
+        wb_discard(&fi_store[i]);
+        pcache_release(fi_store[i].cf);
+        arc_fclose(fi_store[i].af, true);
+        fi_store[i].fd = FD_BADFD;
+        fi_store[i].unit = unit;
+        fi_store[i].cf = NULL;
+        fi_store[i].af = NULL;
+        fi_store[i].modified = false;
+        fi_resetstride(&fi_store[i]);
+      }
+      return &fi_store[i];
+    }
+  }
+  if (!alloc)
+    return NULL;
+
+  for (int i = 0; i < fi_size; i++) {
+    if (fi_store[i].fcb == 0) { // 新規作成で未使用のバッファを見つけた
+      fi_store[i].fcb = fcb;
+      fi_store[i].unit = unit;
+      fi_store[i].cf = NULL;
+      fi_store[i].af = NULL;
+      fi_store[i].modified = false;
+      fi_resetstride(&fi_store[i]);
+      return &fi_store[i];
+    }
+  }
+  fi_size++;                    // バッファが不足しているので拡張する
   fdinfo_t *fi_new = realloc(fi_store, sizeof(fdinfo_t) * fi_size);
   if (fi_new == NULL) {
     fi_size--;
@@ -908,6 +1567,13 @@ static fdinfo_t *fi_alloc(int unit, uint32_t fcb, bool alloc)
   fi_store[fi_size - 1].fcb = fcb;
   fi_store[fi_size - 1].fd = FD_BADFD;
   fi_store[fi_size - 1].unit = unit;
+  fi_store[fi_size - 1].cf = NULL;
+  fi_store[fi_size - 1].af = NULL;
+  fi_store[fi_size - 1].wb = false;
+  fi_store[fi_size - 1].ndirty = 0;
+  fi_store[fi_size - 1].dirty = NULL;
+  fi_store[fi_size - 1].modified = false;
+  fi_resetstride(&fi_store[fi_size - 1]);
   return &fi_store[fi_size - 1];
 }
 
@@ -916,21 +1582,517 @@ static void fi_free(uint32_t fcb)
 {
   for (int i = 0; i < fi_size; i++) {
     if (fi_store[i].fcb == fcb) {
+      wb_discard(&fi_store[i]);
+      pcache_release(fi_store[i].cf);
+      arc_fclose(fi_store[i].af, true);
+      fi_resetstride(&fi_store[i]);
       fi_store[i].fcb = 0;
       fi_store[i].fd = FD_BADFD;
+      fi_store[i].cf = NULL;
+      fi_store[i].af = NULL;
       return;
     }
   }
 }
 
-static void fi_freeall(int unit)
+// (closeがfalseならサーバ側のファイルは閉じずに捨てる。ただし書き込みを保持しているFCBは、
+//  新しい接続で開き直して書き込めるように、ファイルを閉じた状態にして残す)
+static void fi_freeall(int unit, bool close)
 {
   for (int i = 0; i < fi_size; i++) {
-    if (fi_store[i].fd != FD_BADFD && fi_store[i].unit == unit) {
-      FUNC_CLOSE(unit, NULL, fi_store[i].fd);
+    if (fi_store[i].fcb != 0 && fi_store[i].unit == unit) {
+      if (!close && fi_store[i].dirty) {
+        if (fi_store[i].wb) {   // 開き直したファイルは他からの書き込みを拒否しない
+          fi_store[i].cf->writers--;
+          fi_store[i].wb = false;
+        }
+        fi_store[i].fd = FD_BADFD;
+        continue;
+      }
+      if (close && fi_store[i].dirty) {
+        wb_flush(&fi_store[i]);
+      }
+      if (close && fi_store[i].fd != FD_BADFD) {
+        FUNC_CLOSE(unit, NULL, fi_store[i].fd);
+      }
+      wb_discard(&fi_store[i]);
+      pcache_release(fi_store[i].cf);
+      arc_fclose(fi_store[i].af, close);
+      fi_resetstride(&fi_store[i]);
       fi_store[i].fd = FD_BADFD;
       fi_store[i].fcb = 0;
+      fi_store[i].cf = NULL;
+      fi_store[i].af = NULL;
+    }
+  }
+}
+
+// オープンを遅延したファイルをサーバ側でオープンする
+static int fi_open(fdinfo_t *fi)
+{
+  if (fi->fd != FD_BADFD) {
+    return 0;
+  }
+  if (fi->dirty) {              // 切り替え前の接続で保持していた書き込みがあれば先に書き込む
+    return wb_flush(fi);
+  }
+  int err;
+  if ((fi->fd = FUNC_OPEN(fi->unit, &err, fi->cf->path, O_RDONLY|O_BINARY)) == FD_BADFD) {
+    return conv_errno(err);
+  }
+  fi->pos = 0;
+  return 0;
+}
+
+// 書き込みでファイルサイズや更新日時が変わったので、ファイルを含む一覧とファイル情報を無効にする
+// (キャッシュの一覧はmutexを確保せずに返されるので、変更した時点で無効にしておく)
+static void fi_modified(fdinfo_t *fi)
+{
+  fi->modified = true;
+  if (fi->cf) {
+    dcache_invalidate(fi->unit, fi->cf->path);
+  }
+}
+
+// このマシンの他のFCBが同じファイルを開いているか
+static bool fi_isopen(int unit, uint32_t fcb, cfile_t *cf)
+{
+  for (int i = 0; i < fi_size; i++) {
+    if (fi_store[i].fcb != 0 && fi_store[i].fcb != fcb &&
+        fi_store[i].unit == unit && fi_store[i].cf == cf) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 同じファイルをライトバックしているFCBを通常のオープンに戻す
+// (他からの書き込みを拒否して開いたままだと、このマシン自身も書き込み用に開けない)
+static void wb_release(int unit, cfile_t *cf)
+{
+  for (int i = 0; i < fi_size; i++) {
+    fdinfo_t *fi = &fi_store[i];
+    if (fi->fcb == 0 || fi->unit != unit || fi->cf != cf || !fi->wb) {
+      continue;
+    }
+    if (wb_flush(fi) != 0) {
+      continue;                 // 書き込めなかったデータは保持したままにする
+    }
+    FUNC_CLOSE(unit, NULL, fi->fd);
+    fi->fd = FUNC_OPEN(unit, NULL, cf->path, O_RDWR|O_BINARY);
+    fi->pos = 0;
+    wb_discard(fi);
+    DPRINTF1("wb_release: fcb=0x%08x fd=%d\r\n", fi->fcb, fi->fd != FD_BADFD);
+  }
+}
+
+// 他のクライアントからの書き込みを拒否してファイルを読み書き用にオープンする
+// (smb2_open()は共有モードを指定できないので、CREATEを直接送って応答を待つ)
+// 書き込みはこのFCBだけが行えるので、サーバに書き込む前のデータを保持しておける
+struct excl_open {
+  volatile bool done;
+  int status;
+  uint64_t size;
+  smb2_file_id id;
+};
+static struct excl_open excl_open;     // (DOSコールの処理中にしか使わない)
+
+static void excl_open_cb(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+  struct excl_open *eo = private_data;
+  eo->status = status;
+  if (status == SMB2_STATUS_SUCCESS) {
+    struct smb2_create_reply *rep = command_data;
+    memcpy(eo->id, rep->file_id, sizeof(eo->id));
+    eo->size = rep->end_of_file;
+  }
+  eo->done = true;
+}
+
+static int watch_poll(int unit, uint32_t timeout);
+
+static TYPE_FD fi_open_excl(int unit, const char *path, int *err)
+{
+  struct smb2_context *smb2 = getsmb2(unit);
+  struct smb2_create_request req;
+  memset(&req, 0, sizeof(req));
+  req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+  req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+  req.desired_access = SMB2_FILE_READ_DATA | SMB2_FILE_READ_EA | SMB2_FILE_READ_ATTRIBUTES |
+                       SMB2_FILE_WRITE_DATA | SMB2_FILE_APPEND_DATA | SMB2_FILE_WRITE_EA |
+                       SMB2_FILE_WRITE_ATTRIBUTES | SMB2_READ_CONTROL | SMB2_SYNCHRONIZE;
+  req.share_access = SMB2_FILE_SHARE_READ;
+  req.create_disposition = SMB2_FILE_OPEN;
+  req.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+  req.name = path;
+
+  struct excl_open *eo = &excl_open;
+  eo->done = false;
+  struct smb2_pdu *pdu = smb2_cmd_create_async(smb2, &req, excl_open_cb, eo);
+  if (pdu == NULL) {
+    *err = ENOMEM;
+    return FD_BADFD;
+  }
+  smb2_queue_pdu(smb2, pdu);
+  while (!eo->done) {
+    if (watch_poll(unit, 100) < 0) {
+      *err = EIO;
+      return FD_BADFD;
+    }
+  }
+  if (eo->status != SMB2_STATUS_SUCCESS) {
+    *err = nterror_to_errno(eo->status);
+    return FD_BADFD;
+  }
+
+  union smb2fd fd = { .fd = FD_BADFD };
+  if ((fd.sfh = smb2_fh_from_file_id(smb2, &eo->id)) == NULL) {
+    *err = ENOMEM;
+    return FD_BADFD;
+  }
+  fd.sfh->end_of_file = eo->size;       // SEEK_ENDでファイルサイズを得られるようにする
+  fd.smb2 = smb2;
+  return fd.fd;
+}
+
+// ページ1つ分のデータをサーバから読み込む
+static ssize_t fi_readbuf(int unit, TYPE_FD fd, off_t *pos, uint32_t pageno, void *buf, int *err)
+{
+  off_t offset = (off_t)pageno * PCACHE_PAGESIZE;
+  if (*pos != offset) {
+    if (FUNC_LSEEK(unit, err, fd, offset, SEEK_SET) < 0) {
+      return -1;
+    }
+    *pos = offset;
+  }
+  ssize_t bytes = FUNC_READ(unit, err, fd, buf, PCACHE_PAGESIZE);
+  if (bytes < 0) {
+    return -1;
+  }
+  *pos += bytes;
+  return bytes;
+}
+
+static ssize_t fi_readpage(int unit, TYPE_FD fd, off_t *pos, cpage_t *pg, int *err)
+{
+  ssize_t bytes = fi_readbuf(unit, fd, pos, pg->pageno, pg->data, err);
+  if (bytes >= 0) {
+    pg->len = bytes;
+  }
+  return bytes;
+}
+
+//----------------------------------------------------------------------------
+
+// バックグラウンドスレッドでの先読み処理
+typedef struct {
+  int unit;             // ドライブのユニット番号 (-1=未使用)
+  uint32_t len;         // 先読みする範囲の末尾 (先頭から読む場合はバイト数)
+  uint32_t next;        // 次に先読みするページ
+  uint32_t start;       // 先読みしている範囲の先頭
+  int32_t stride;       // 続けて先読みするレコードの間隔
+  int count;            // 続けて先読みするレコード数
+  TYPE_FD fd;
+  off_t pos;
+  cfile_t *cf;
+  char *path;           // 先読みするファイルのホストパス名
+} bgjob_t;
+
+static bgjob_t bg_jobs[BGJOB_MAX];
+static int bg_head;                     // 次に処理する先読み処理
+static int bg_count;                    // 先読み処理の数
+
+// 先読み処理をキューに追加する
+// ([start, start+len) を先読みした後、strideずつ離れた同じ長さの範囲をcount回先読みする)
+static int bg_queue_range(int unit, const char *path, uint32_t start, uint32_t len,
+                          int32_t stride, int count)
+{
+  if (bg_count >= BGJOB_MAX) {
+    return -1;
+  }
+  bgjob_t *job = &bg_jobs[(bg_head + bg_count) % BGJOB_MAX];
+  if ((job->path = malloc(strlen(path) + 1)) == NULL) {
+    return -1;
+  }
+  strcpy(job->path, path);
+  job->unit = unit;
+  job->len = start + len;
+  job->next = start / PCACHE_PAGESIZE;
+  job->start = start;
+  job->stride = stride;
+  job->count = count;
+  job->fd = FD_BADFD;
+  job->pos = 0;
+  job->cf = NULL;
+  bg_count++;
+  return 0;
+}
+
+static int bg_queue(int unit, const char *path, uint32_t len)
+{
+  return bg_queue_range(unit, path, 0, len, 0, 0);
+}
+
+// 先頭の先読み処理を終了する
+// (開いていたファイルを返すので、呼び出し側でcache_mutexを解放してから閉じる)
+static TYPE_FD bg_done(void)
+{
+  bgjob_t *job = &bg_jobs[bg_head];
+  TYPE_FD fd = job->fd;
+  pcache_release(job->cf);
+  free(job->path);
+  job->unit = -1;
+  bg_head = (bg_head + 1) % BGJOB_MAX;
+  bg_count--;
+  return fd;
+}
+
+// アンマウントするユニットの先読み処理を取り消す
+static void bg_cancel_unit(int unit)
+{
+  for (int i = 0; i < bg_count; i++) {
+    bgjob_t *job = &bg_jobs[(bg_head + i) % BGJOB_MAX];
+    if (job->unit == unit) {
+      if (job->fd != FD_BADFD) {
+        FUNC_CLOSE(job->unit, NULL, job->fd);
+        job->fd = FD_BADFD;
+      }
+      pcache_release(job->cf);
+      job->cf = NULL;
+      job->len = 0;             // 次の処理で終了させる
+    }
+  }
+}
+
+// 先頭の先読み処理を1ページ分進める
+// サーバとの通信中はそのユニットのmutexだけを確保して、他のユニットへのDOSコールを待たせない
+// (cache_mutexはキャッシュや先読みキューを扱う間だけ確保する)
+// ユニットが使用中で進められなければfalseを返す
+static bool bg_prefetch(void)
+{
+  static uint8_t buf[PCACHE_PAGESIZE];    // スレッドのスタックが小さいのでstaticに置く
+  TYPE_FD closefd = FD_BADFD;
+  int err;
+
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+  bgjob_t *job = &bg_jobs[bg_head];
+  int unit = job->unit;
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+  if (unit < 0) {
+    return true;
+  }
+
+  // 先読みキューの先頭を変更するのはこのスレッドだけなので、jobはこの間も先頭のまま
+  // (アンマウントによる取り消しはユニットのmutexを確保して行われる)
+  if (pthread_mutex_trylock(&smbfs_data.unit_mutex[unit]) != 0) {
+    return false;
+  }
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+
+  if (job->len == 0 || rootsmb2[unit] == NULL) {
+    closefd = bg_done();
+    goto out;
+  }
+  if (job->cf == NULL) {
+    if ((job->cf = pcache_file(unit, job->path, true)) == NULL) {
+      closefd = bg_done();
+      goto out;
+    }
+    pcache_ref(job->cf);
+  }
+  if (job->cf->writers > 0) {   // サーバ上のデータはライトバック中の書き込みより古い
+    closefd = bg_done();
+    goto out;
+  }
+  // 先読みの必要なページを探す (範囲を読み終えたら次のレコードに進む)
+  while (1) {
+    while (job->next * PCACHE_PAGESIZE < job->len &&
+           pcache_has_page(job->cf, job->next)) {
+      job->next++;
+    }
+    if (job->next * PCACHE_PAGESIZE < job->len || job->count == 0) {
+      break;
+    }
+    int64_t start = (int64_t)job->start + job->stride;
+    if (start < 0 || start >= job->cf->size) {
+      break;
+    }
+    job->len = start + (job->len - job->start);
+    job->start = start;
+    job->next = start / PCACHE_PAGESIZE;
+    job->count--;
+  }
+  if (job->next * PCACHE_PAGESIZE >= job->len) {
+    closefd = bg_done();
+    goto out;
+  }
+
+  if (job->fd == FD_BADFD) {
+    pthread_mutex_unlock(&smbfs_data.cache_mutex);
+    TYPE_FD fd = FUNC_OPEN(unit, &err, job->path, O_RDONLY|O_BINARY);
+    uint32_t size = 0;
+    if (fd != FD_BADFD) {
+      size = FUNC_LSEEK(unit, NULL, fd, 0, SEEK_END);
+    }
+    pthread_mutex_lock(&smbfs_data.cache_mutex);
+    if ((job->fd = fd) == FD_BADFD) {
+      closefd = bg_done();
+      goto out;
+    }
+    job->pos = size;
+    pcache_validate(job->cf, size);
+    if (job->len > size) {
+      job->len = size;
+    }
+    goto out;
+  }
+
+  uint32_t pageno = job->next;
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+  ssize_t bytes = fi_readbuf(unit, job->fd, &job->pos, pageno, buf, &err);
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+
+  cpage_t *pg;
+  if (bytes < 0 || (pg = pcache_store_page(job->cf, pageno, buf, bytes)) == NULL) {
+    closefd = bg_done();
+    goto out;
+  }
+  pg->prefetched = 1;
+  cache_stats.prefetch_issued++;
+  DPRINTF1("Prefetch %s page=%d\r\n", job->path, pageno);
+  job->next++;
+
+out:
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+  if (closefd != FD_BADFD) {
+    FUNC_CLOSE(unit, NULL, closefd);
+  }
+  pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+  return true;
+}
+
+// ファイル名の拡張子を得る
+static const char *file_ext(const char *name)
+{
+  const char *p = strrchr(name, '.');
+  return p ? p : "";
+}
+
+// ディレクトリ一覧の順にファイルが開かれていたら、続くファイルの先読みを要求する
+static void prefetch_next(int unit, struct dos_namestbuf *ns, const char *path)
+{
+  int dirlen = cache_dirlen(path);
+  dcache_t *dc = dcache_lookup(unit, path, dirlen);
+  if (dc == NULL) {
+    return;
+  }
+
+  char name[8 + 10 + 1 + 3 + 1];
+  name[conv_namests_name(ns, (uint8_t *)name)] = '\0';
+  int index = dcache_find(dc, name);
+  if (index < 0) {
+    return;
+  }
+  bool inorder = dc->lastopen >= 0 && index > dc->lastopen;
+  dc->lastopen = index;
+  if (!inorder) {
+    return;
+  }
+
+  // 同じ拡張子を持つ続くファイルを先読みの候補にする
+  const char *ext = file_ext(name);
+  int n = 0;
+  for (int i = index + 1; i < dc->nent && n < PREFETCH_DEPTH; i++) {
+    struct dos_filesinfo *e = &dc->ent[i];
+    if ((e->atr & 0x18) != 0 || e->filelen == 0 ||
+        strcasecmp(file_ext(e->name), ext) != 0) {
+      continue;
+    }
+    n++;
+    if (i < dc->prefetched) {
+      continue;                 // 先読みを要求済み
+    }
+    hostpath_t epath;
+    memcpy(epath, path, dirlen);
+    char *dst_buf = epath + dirlen;
+    size_t dst_len = sizeof(epath) - 1 - dirlen;
+    if (conv_namebuf_sub(e->name, strlen(e->name), &dst_buf, &dst_len, epath) < 0) {
+      continue;
     }
+    *dst_buf = '\0';
+    uint32_t len = be32toh(e->filelen);
+    if (bg_queue(unit, epath, len <= PREFETCH_SMALL ? len : PREFETCH_HEAD) < 0) {
+      break;
+    }
+    dc->prefetched = i + 1;
+  }
+}
+
+// 前回の起動時に開かれたファイルの先読みを要求する
+static void prefetch_history(hprog_t *hp)
+{
+  if (hp == NULL) {
+    return;
+  }
+  for (int i = 0; i < hp->nent; i++) {
+    hentry_t *he = &hp->ent[i];
+    if (he->len == 0 || he->unit >= MAXUNIT || rootsmb2[he->unit] == NULL) {
+      continue;
+    }
+    if (bg_queue(he->unit, he->path, he->len) < 0) {
+      break;
+    }
+  }
+}
+
+// 一定の間隔で離れたレコードを読んでいたら、続くレコードを先読みする
+// 先読みしたレコードが読まれないまま間隔が変わったら先読みするレコード数を減らし、
+// 先読みが間に合っていれば増やす
+static void prefetch_stride(fdinfo_t *fi, uint32_t pos, size_t len)
+{
+  int32_t delta = pos - fi->rpos;
+  fi->rpos = pos;
+  fi->rend = pos + len;
+  if (fi->cf == NULL || len == 0) {
+    return;
+  }
+
+  if (delta != fi->stride || delta == 0) {
+    if (fi->sahead > 0 && fi->sdepth > 1) {
+      fi->sdepth /= 2;          // 予測が外れて先読みしたレコードが無駄になった
+      cache_stats.stride_backoffs++;
+    }
+    // 連続したreadや同じページ内の移動はページ単位の読み込みで足りる
+    uint32_t dist = delta < 0 ? -delta : delta;
+    fi->stride = dist >= len + PCACHE_PAGESIZE ? delta : 0;
+    fi->sconf = 0;
+    fi->sahead = 0;
+    return;
+  }
+  if (fi->stride == 0) {
+    return;
+  }
+  if (fi->sconf < STRIDE_CONFIRM) {
+    fi->sconf++;
+  } else if (fi->sahead > 0) {
+    fi->sahead--;               // 先読みしたレコードが読まれた
+    if (pcache_has_page(fi->cf, pos / PCACHE_PAGESIZE) && fi->sdepth < STRIDE_MAXDEPTH) {
+      fi->sdepth++;
+    }
+  }
+  if (fi->sconf < STRIDE_CONFIRM || fi->sahead >= fi->sdepth) {
+    return;
+  }
+
+  int64_t start = (int64_t)pos + (int64_t)(fi->sahead + 1) * fi->stride;
+  if (start < 0 || start >= fi->cf->size) {
+    return;
+  }
+  int count = fi->sdepth - fi->sahead;
+  if (bg_queue_range(fi->unit, fi->cf->path, start, len, fi->stride, count - 1) == 0) {
+    DPRINTF1(" stride=%d depth=%d start=%d", fi->stride, fi->sdepth, (uint32_t)start);
+    fi->sahead = fi->sdepth;
+    cache_stats.stride_records += count;
   }
 }
 
@@ -948,9 +2110,17 @@ int op_create(struct dos_req_header *req)
     return _DOSE_NODIR;
   }
 
+  char member[ARC_PATHLEN];
+  if (arc_path(req->unit, path, member) != NULL && member[0] != '\0') {
+    DPRINTF1("-> RDONLY (archive)\r\n");
+    return _DOSE_RDONLY;      // アーカイブ内にはファイルを作れない
+  }
+
   int mode = O_CREAT|O_RDWR|O_TRUNC|O_BINARY;
   mode |= req->status ? 0 : O_EXCL;
 
+  wb_flush_unit(req->unit, path);
+
   int err;
   if ((filefd = FUNC_OPEN(req->unit, &err, path, mode)) == FD_BADFD) {
     switch (err) {
@@ -975,12 +2145,56 @@ int op_create(struct dos_req_header *req)
   fi->pos = 0;
   dos_fcb_size(req->fcb) = 0;
 
+  dcache_invalidate(req->unit, path);
+  arc_invalidate(req->unit, path);
+  if ((fi->cf = pcache_file(req->unit, path, true)) != NULL) {
+    pcache_ref(fi->cf);
+    pcache_invalidate(fi->cf);
+    pcache_validate(fi->cf, 0);
+  }
+
   DPRINTF1(" fcb=0x%08x attr=0x%02x mode=%d\r\n", (uint32_t)req->fcb, req->attr, req->status);
   return 0;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// アーカイブ内のファイルを読み出し専用でオープンする
+static int op_open_archive(struct dos_req_header *req, arc_t *arc, const char *member)
+{
+  arcent_t *e = arc_find(arc, member);
+  if (e == NULL) {
+    DPRINTF1("-> NOENT (archive)\r\n");
+    return _DOSE_NOENT;
+  }
+  if (e->atr & 0x10) {
+    DPRINTF1("-> ISDIR (archive)\r\n");
+    return _DOSE_ISDIR;
+  }
+  if (dos_fcb_mode(req->fcb) != 0) {
+    DPRINTF1("-> RDONLY (archive)\r\n");
+    return _DOSE_RDONLY;
+  }
+
+  fdinfo_t *fi = fi_alloc(req->unit, (uint32_t)req->fcb, true);
+  if (fi == NULL) {
+    DPRINTF1("-> NOMEM\r\n");
+    return _DOSE_NOMEM;
+  }
+  int err;
+  if ((fi->af = arc_fopen(req->unit, arc, e, &err)) == NULL) {
+    fi_free((uint32_t)req->fcb);
+    err = conv_errno(err);
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
+  fi->pos = 0;
+  dos_fcb_size(req->fcb) = e->usize;
+
+  DPRINTF1(" fcb=0x%08x mode=0 -> %d (archive)\r\n", (uint32_t)req->fcb, e->usize);
+  return 0;
+}
+
 int op_open(struct dos_req_header *req)
 {
   hostpath_t path;
@@ -1009,9 +2223,40 @@ int op_open(struct dos_req_header *req)
     return _DOSE_ILGARG;
   }
 
+  char member[ARC_PATHLEN];
+  arc_t *arc = arc_path(req->unit, path, member);
+  if (arc != NULL && member[0] != '\0') {
+    return op_open_archive(req, arc, member);
+  }
+
+  wb_flush_unit(req->unit, path);
+
+  // 読み出し専用で有効なキャッシュがあれば、サーバ側のオープンは最初のキャッシュミスまで遅らせる
+  cfile_t *cf = pcache_file(req->unit, path, true);
+  bool lazy = (dos_fcb_mode(req->fcb) == 0 && cf != NULL && cf->pages != NULL);
+
+  // ?writebackでマウントしたユニットでは、読み書き用のオープンは他からの書き込みを拒否できれば
+  // 書き込みをライトバックする (閉じるまで他のクライアントはそのファイルを書き込み用に開けない)
+  // (すでに他で書き込み用に開かれていればSHARING_VIOLATIONになるので、通常のオープンをする)
+  // このマシンの他のFCBが開いているファイルは、書き込みを拒否せずに通常のオープンをする
   int err;
-  if ((filefd = FUNC_OPEN(req->unit, &err, path, mode)) == FD_BADFD) {
+  filefd = FD_BADFD;
+  bool wb = false;
+  if (dos_fcb_mode(req->fcb) != 0 && cf != NULL) {
+    wb_release(req->unit, cf);
+  }
+  if (dos_fcb_mode(req->fcb) == 2 && cf != NULL && (mountflags[req->unit] & MOUNT_WRITEBACK) &&
+      !fi_isopen(req->unit, (uint32_t)req->fcb, cf)) {
+    wb = (filefd = fi_open_excl(req->unit, path, &err)) != FD_BADFD;
+    DPRINTF1(" wb=%d", wb);
+  }
+  if (!lazy && !wb && (filefd = FUNC_OPEN(req->unit, &err, path, mode)) == FD_BADFD) {
     switch (err) {
+    case ENOENT:
+      scache_enter(req->unit, path, false, 0);
+      err = conv_errno(err);
+      DPRINTF1("-> %d\r\n", err);
+      return err;
     case EINVAL:
       DPRINTF1("-> ILGARG\r\n");
       return _DOSE_ILGARG;
@@ -1024,16 +2269,40 @@ int op_open(struct dos_req_header *req)
   
   fdinfo_t *fi = fi_alloc(req->unit, (uint32_t)req->fcb, true);
   if (fi == NULL) {
-    FUNC_CLOSE(req->unit, NULL, filefd);
+    if (filefd != FD_BADFD) {
+      FUNC_CLOSE(req->unit, NULL, filefd);
+    }
     DPRINTF1("-> NOMEM\r\n");
     return _DOSE_NOMEM;
   }
 
   fi->fd = filefd;
   fi->pos = 0;
-  uint32_t len = FUNC_LSEEK(req->unit, NULL, filefd, 0, SEEK_END);
+  fi->cf = cf;
+  pcache_ref(cf);
+  if ((fi->wb = wb)) {
+    cf->writers++;
+  }
+  uint32_t len;
+  if (lazy) {
+    len = cf->size;
+  } else {
+    len = FUNC_LSEEK(req->unit, NULL, filefd, 0, SEEK_END);
+    FUNC_LSEEK(req->unit, NULL, filefd, 0, SEEK_SET);
+    if (cf) {
+      pcache_validate(cf, len);
+    }
+  }
   dos_fcb_size(req->fcb) = len;
-  FUNC_LSEEK(req->unit, NULL, filefd, 0, SEEK_SET);
+
+  if (dos_fcb_mode(req->fcb) == 0) {
+    if (history_isexec(path)) {   // 実行ファイルなら前回の起動時に開かれたファイルを先読みする
+      prefetch_history(history_launch(req->unit, path));
+    } else {
+      history_open(req->unit, path);
+      prefetch_next(req->unit, req->addr, path);
+    }
+  }
 
   DPRINTF1(" fcb=0x%08x mode=%d -> %d\r\n", (uint32_t)req->fcb, dos_fcb_mode(req->fcb), len);
   return 0;
@@ -1051,10 +2320,19 @@ int op_close(struct dos_req_header *req)
     return _DOSE_BADF;
   }
 
-  int err;
-  if (FUNC_CLOSE(req->unit, &err, fi->fd) < 0) {
+  int err = 0;
+  if (fi->dirty && (err = wb_flush(fi)) != 0) {
+    // 保持していた書き込みをサーバに書けなければ、FCBを閉じずにデータを残してエラーを返す
+    // (もう一度クローズするか、アンマウントするときに再び書き込む)
+    DPRINTF1("fcb=0x%08x -> %d (write-back)\r\n", req->fcb, err);
+    return err;
+  }
+  if (fi->fd != FD_BADFD && FUNC_CLOSE(req->unit, &err, fi->fd) < 0) {
     err = conv_errno(err);
   }
+  if (fi->modified && fi->cf) {   // クローズ時にサーバ側の更新日時が変わることがある
+    dcache_invalidate(req->unit, fi->cf->path);
+  }
 
   fi_free((uint32_t)req->fcb);
   DPRINTF1("fcb=0x%08x err=%d\r\n", req->fcb, err);
@@ -1074,25 +2352,93 @@ int op_read(struct dos_req_header *req)
   }
 
   uint32_t *pp = &dos_fcb_fpos(req->fcb);
+  uint32_t pos = *pp;
+  uint8_t *addr = req->addr;
+  size_t len = req->status;
+  size_t hit = 0;
   ssize_t bytes = 0;
   int err;
-  if (fi->pos != *pp) {
-    if (FUNC_LSEEK(req->unit, &err, fi->fd, *pp, SEEK_SET) < 0) {
+
+  if (fi->af) {
+    // アーカイブ内のファイルは展開しながら読む
+    if ((bytes = arc_fread(fi->af, pos, addr, len, &err)) < 0) {
+      err = conv_errno(err);
+      DPRINTF1("-> %d\r\n", err);
+      return err;
+    }
+    *pp = pos + bytes;
+    DPRINTF1(" fcb=0x%08x addr=0x%08x len=%d -> pos=%d len=%d (archive)\r\n",
+             (uint32_t)req->fcb, (uint32_t)req->addr, req->status, *pp, bytes);
+    return bytes;
+  }
+
+  prefetch_stride(fi, pos, len);
+
+  if (fi->cf) {
+    // ページキャッシュから読めるだけ読む
+    hit = pcache_read(fi->cf, *pp, addr, len);
+    if (hit == len || (hit > 0 && *pp + hit >= fi->cf->size)) {
+      cache_stats.read_hits++;
+      *pp += hit;
+      history_read(req->unit, fi->cf->path, *pp);
+      DPRINTF1(" fcb=0x%08x addr=0x%08x len=%d -> pos=%d len=%d (cached)\r\n",
+               (uint32_t)req->fcb, (uint32_t)req->addr, req->status, *pp, hit);
+      return hit;
+    }
+    cache_stats.read_misses++;
+    pos += hit;
+    addr += hit;
+    len -= hit;
+  }
+
+  if ((err = fi_open(fi)) != 0) {
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
+
+  cpage_t *pg;
+  if (fi->cf && pos % PCACHE_PAGESIZE + len <= PCACHE_PAGESIZE &&
+      (pg = pcache_alloc_page(fi->cf, pos / PCACHE_PAGESIZE)) != NULL) {
+    // 1ページに収まる小さなreadはページ単位で読み込んでキャッシュから返す
+    // (ページ境界をまたぐreadは1ページ分だけでは足りないので直接読む)
+    if (fi_readpage(req->unit, fi->fd, &fi->pos, pg, &err) < 0) {
       err = conv_errno(err);
       DPRINTF1("-> %d\r\n", err);
       return err;
     }
-    fi->pos = *pp;
-  }
-  bytes = FUNC_READ(req->unit, &err, fi->fd, req->addr, req->status);
-  if (bytes < 0) {
-    err = conv_errno(err);
-    DPRINTF1("-> %d\r\n", err);
-    return err;
+    // サーバに書き込んでいないデータを重ねる
+    pg->len = wb_overlay_cf(fi->cf, pg->pageno * PCACHE_PAGESIZE, pg->data, PCACHE_PAGESIZE, pg->len);
+    bytes = pcache_read(fi->cf, pos, addr, len);
+    cache_stats.hit_bytes -= bytes;
+  } else {
+    if (fi->pos != pos) {
+      if (FUNC_LSEEK(req->unit, &err, fi->fd, pos, SEEK_SET) < 0) {
+        err = conv_errno(err);
+        DPRINTF1("-> %d\r\n", err);
+        return err;
+      }
+      fi->pos = pos;
+    }
+    bytes = FUNC_READ(req->unit, &err, fi->fd, addr, len);
+    if (bytes < 0) {
+      err = conv_errno(err);
+      DPRINTF1("-> %d\r\n", err);
+      return err;
+    }
+    fi->pos += bytes;
+    if (fi->cf) {
+      bytes = wb_overlay_cf(fi->cf, pos, addr, len, bytes);
+      pcache_fill(fi->cf, pos, addr, bytes);
+    } else if (fi->dirty) {
+      bytes = wb_overlay(fi, pos, addr, len, bytes);
+    }
   }
 
-  fi->pos += bytes;
-  *pp = fi->pos;
+  *pp = pos + bytes;
+  bytes += hit;
+  if (fi->cf) {
+    history_read(req->unit, fi->cf->path, *pp);
+  }
 
   DPRINTF1(" fcb=0x%08x addr=0x%08x len=%d -> pos=%d len=%d\r\n",
            (uint32_t)req->fcb, (uint32_t)req->addr, req->status, *pp, bytes);
@@ -1115,6 +2461,18 @@ int op_write(struct dos_req_header *req)
   uint32_t *sp = &dos_fcb_size(req->fcb);
   ssize_t bytes = 0;
   int err;
+  if (fi->af) {
+    DPRINTF1("-> RDONLY (archive)\r\n");
+    return _DOSE_RDONLY;
+  }
+  if ((err = fi_open(fi)) != 0) {
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
+  if (req->status == 0 && fi->dirty && (err = wb_flush(fi)) != 0) {
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
   if (req->status == 0) {     // 0バイトのwriteはファイル長を切り詰める
     if (FUNC_FTRUNCATE(req->unit, &err, fi->fd, *pp) < 0) {
       err = conv_errno(err);
@@ -1123,6 +2481,23 @@ int op_write(struct dos_req_header *req)
     } else {
       *sp = *pp;      //0バイト書き込み=truncateなのでFCBのファイルサイズをポインタ位置にする
     }
+    fi_modified(fi);
+  } else if (fi->wb &&
+             (bytes = wb_write(fi, *pp, req->addr, req->status,
+                               *pp + req->status > *sp ? *pp + req->status : *sp)) != 0) {
+    // 書き込みをライトバックキャッシュに保持した (キャッシュされているページは書き換え済み)
+    if (bytes < 0) {
+      DPRINTF1("-> %d\r\n", (int)bytes);
+      return bytes;
+    }
+    *pp += bytes;
+    if (*pp > *sp) {
+      *sp = *pp;
+    }
+    fi_modified(fi);
+    DPRINTF1(" fcb=0x%08x addr=0x%08x len=%d -> pos=%d size=%d len=%d (write-back)\r\n",
+             (uint32_t)req->fcb, (uint32_t)req->addr, req->status, *pp, *sp, bytes);
+    return bytes;
   } else {
     if (fi->pos != *pp) {
       if (FUNC_LSEEK(req->unit, &err, fi->fd, *pp, SEEK_SET) < 0) {
@@ -1144,6 +2519,11 @@ int op_write(struct dos_req_header *req)
     if (*pp > *sp) {
       *sp = *pp;    //FCBのファイルサイズを増やす
     }
+    fi_modified(fi);
+  }
+  if (fi->cf) {     //書き込んだファイルのキャッシュを捨てる
+    pcache_invalidate(fi->cf);
+    pcache_validate(fi->cf, *sp);
   }
 
   DPRINTF1(" fcb=0x%08x addr=0x%08x len=%d -> pos=%d size=%d len=%d\r\n",
@@ -1183,6 +2563,24 @@ int op_filedate(struct dos_req_header *req)
 
   int res;
   int err;
+  if (fi->af) {             // アーカイブ内のファイルは索引の日時を返す
+    if (req->status != 0) {
+      DPRINTF1("-> RDONLY (archive)\r\n");
+      return _DOSE_RDONLY;
+    }
+    arcent_t *e = arc_fentry(fi->af);
+    res = htobe16(e->time) + (htobe16(e->date) << 16);
+    DPRINTF1("fcb=0x%08x 0x%08x -> 0x%08x (archive)\r\n", (uint32_t)req->fcb, req->status, res);
+    return res;
+  }
+  if ((err = fi_open(fi)) != 0) {
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
+  if (fi->dirty && (err = wb_flush(fi)) != 0) {  // 書き込みで更新日時が変わるので先に書き込む
+    DPRINTF1("-> %d\r\n", err);
+    return err;
+  }
   if (req->status == 0) {   // 更新日時取得
     TYPE_STAT st;
     if (FUNC_FSTAT(req->unit, &err, fi->fd, &st) < 0) {
@@ -1199,6 +2597,7 @@ int op_filedate(struct dos_req_header *req)
       DPRINTF1("-> %d\r\n", err);
       return err;
     }
+    fi_modified(fi);
     res = 0;
   }
 
@@ -1234,80 +2633,754 @@ int op_dskfre(struct dos_req_header *req)
     res->sectsize = htobe16(1024);
     resfree = free;
   }
-
-  DPRINTF1("DSKFRE: free=%u total=%u clusect=%u sectsz=%u res=%d\r\n", res->freeclu, res->totalclu, res->clusect, res->sectsize, resfree);
-  return resfree;
+
+  DPRINTF1("DSKFRE: free=%u total=%u clusect=%u sectsz=%u res=%d\r\n", res->freeclu, res->totalclu, res->clusect, res->sectsize, resfree);
+  return resfree;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_drvctrl(struct dos_req_header *req)
+{
+  DPRINTF1("DRVCTRL:\r\n");
+  req->attr = 2;
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_getdpb(struct dos_req_header *req)
+{
+  DPRINTF1("GETDPB:\r\n");
+  uint8_t *p = (uint8_t *)req->addr;
+  memset(p, 0, 16);
+  *(uint16_t *)&p[0] = 512;   // 一部のアプリがエラーになるので仮のセクタ長を設定しておく
+  p[2] = 1;
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_diskred(struct dos_req_header *req)
+{
+  DPRINTF1("DISKRED:\r\n");
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_diskwrt(struct dos_req_header *req)
+{
+  DPRINTF1("DISKWRT:\r\n");
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_abort(struct dos_req_header *req)
+{
+  DPRINTF1("ABORT:\r\n");
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_mediacheck(struct dos_req_header *req)
+{
+  DPRINTF1("MEDIACHECK:\r\n");
+  return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int op_lock(struct dos_req_header *req)
+{
+  DPRINTF1("LOCK:\r\n");
+  return 0;
+}
+
+//****************************************************************************
+// Process accounting
+//****************************************************************************
+
+// DOSコールを発行したプロセスごとの統計情報
+// (mutexを確保しない高速パスからも更新するので、競合した場合の数え落としは許容する)
+static struct smbcmd_procstat procstat[PROCSTAT_MAX];
+static uint32_t procstat_last[PROCSTAT_MAX];      // 最後のDOSコールの時刻
+
+// 現在のプロセスの統計情報を得る (表が一杯なら最も長く使われていないものを再利用する)
+static struct smbcmd_procstat *procstat_get(uint32_t now)
+{
+  uint32_t psp = *(uint32_t *)0x1c28;     // 実行中のプロセスのメモリ管理ポインタ
+  int victim = 0;
+  for (int i = 0; i < PROCSTAT_MAX; i++) {
+    if (procstat[i].psp == psp) {
+      procstat_last[i] = now;
+      return &procstat[i];
+    }
+    if (procstat[i].psp == 0 ||
+        (procstat[victim].psp != 0 && now - procstat_last[i] > now - procstat_last[victim])) {
+      victim = i;
+    }
+  }
+
+  struct smbcmd_procstat *ps = &procstat[victim];
+  memset(ps, 0, sizeof(*ps));
+  if (psp != 0) {
+    memcpy(ps->name, (char *)psp + 0xc4, sizeof(ps->name));   // プロセス管理領域の実行ファイル名
+    ps->name[sizeof(ps->name) - 1] = '\0';
+  }
+  ps->psp = psp;
+  procstat_last[victim] = now;
+  return ps;
+}
+
+// DOSコールの処理結果を現在のプロセスの統計情報に加える
+static void procstat_account(struct dos_req_header *req, uint32_t start)
+{
+  uint32_t now = cache_clock();
+  struct smbcmd_procstat *ps = procstat_get(now);
+  ps->requests++;
+  ps->time += now - start;
+  uint8_t cmd = req->command & 0x7f;
+  if ((cmd == 0x4c || cmd == 0x4d) && (int32_t)req->status > 0) {   // read/write
+    ps->bytes += req->status;
+  }
+}
+
+//****************************************************************************
+// Connection setup
+//****************************************************************************
+
+// サーバへの接続処理
+// smb2_connect_share_async()で接続して段階ごとの所要時間とlibsmb2内の処理時間を記録する
+// (NTLM認証やSMB 3.1.1のpre-auth integrityのハッシュ計算は68000では重いため、その分を把握できるようにする)
+typedef struct {
+  struct smb2_context *smb2;
+  int status;                           // 1=接続中 0=接続できた 負=エラー
+  int phase;                            // 現在の段階 (CONNPHASE_*)
+  uint32_t start;                       // 接続を開始した時刻
+  uint32_t phase_start;                 // 現在の段階を開始した時刻
+  struct smbcmd_conntime ct;
+} connprobe_t;
+
+static void connect_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data)
+{
+  connprobe_t *pr = private_data;
+  if (pr->status == 1) {
+    pr->status = status < 0 ? status : 0;
+  }
+}
+
+// 接続の段階を進める
+static void connect_phase(connprobe_t *pr, int phase, uint32_t now)
+{
+  while (pr->phase < phase) {
+    pr->ct.time[pr->phase] = now - pr->phase_start;
+    pr->phase_start = now;
+    pr->phase++;
+  }
+}
+
+// 処理の終わったlibsmb2の呼び出しに応じて接続の段階を進める
+static void connect_update(connprobe_t *pr, uint32_t t0)
+{
+  uint32_t now = cache_clock();
+  pr->ct.cpu[pr->phase] += now - t0;
+  pr->ct.cpu[CONNPHASE_TOTAL] += now - t0;
+  if (pr->status < 0) {
+    return;
+  }
+  if (pr->status == 0) {
+    connect_phase(pr, CONNPHASE_TOTAL, now);
+    pr->ct.time[CONNPHASE_TOTAL] = now - pr->start;
+    pr->ct.dialect = pr->smb2->dialect;
+  } else if (pr->smb2->dialect != 0) {
+    connect_phase(pr, CONNPHASE_SESSION, now);    // negotiateの応答を受け取った
+  } else if (smb2_get_fd(pr->smb2) >= 0 && !(smb2_which_events(pr->smb2) & POLLOUT)) {
+    connect_phase(pr, CONNPHASE_NEGOTIATE, now);  // TCP接続後にnegotiateを送り終えた
+  }
+}
+
+static void connect_start(connprobe_t *pr, const char *server, const char *share)
+{
+  memset(&pr->ct, 0, sizeof(pr->ct));
+  pr->status = 1;
+  pr->phase = CONNPHASE_TCP;
+  pr->start = pr->phase_start = cache_clock();
+  if (smb2_connect_share_async(pr->smb2, server, share, NULL, connect_cb, pr) < 0) {
+    DPRINTF1("smb2_connect_share_async failed. %s\r\n", smb2_get_error(pr->smb2));
+    pr->status = -EIO;
+  }
+  connect_update(pr, pr->start);
+}
+
+// 接続処理中のいずれかが接続できるまで待ち、最初に接続できたもののインデックスを返す
+static int connect_wait(connprobe_t *pr, int n)
+{
+  uint32_t start = cache_clock();
+  int winner = -1;
+  while (winner < 0 && cache_clock() - start < CONNECT_TIMEOUT) {
+    fd_set rfds, wfds;
+    int maxfd = -1;
+    int pending = 0;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (int i = 0; i < n; i++) {
+      if (pr[i].status != 1) {
+        continue;
+      }
+      pending++;
+      int fd = smb2_get_fd(pr[i].smb2);
+      if (fd < 0) {
+        continue;
+      }
+      int events = smb2_which_events(pr[i].smb2);
+      if (events & POLLIN) {
+        FD_SET(fd, &rfds);
+      }
+      if (events & POLLOUT) {
+        FD_SET(fd, &wfds);
+      }
+      if (fd > maxfd) {
+        maxfd = fd;
+      }
+    }
+    if (pending == 0) {
+      break;                    // どこにも接続できなかった
+    }
+
+    struct timeval tv = { 0, 100 * 1000 };
+    int nfds = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+
+    for (int i = 0; i < n; i++) {
+      if (pr[i].status != 1) {
+        continue;
+      }
+      int fd = smb2_get_fd(pr[i].smb2);
+      int revents = 0;
+      if (nfds > 0 && fd >= 0) {
+        revents |= FD_ISSET(fd, &rfds) ? POLLIN : 0;
+        revents |= FD_ISSET(fd, &wfds) ? POLLOUT : 0;
+      }
+      uint32_t t0 = cache_clock();
+      if (smb2_service(pr[i].smb2, revents) < 0) {
+        DPRINTF1("smb2_service failed. %s\r\n", smb2_get_error(pr[i].smb2));
+        pr[i].status = -EIO;
+      }
+      connect_update(&pr[i], t0);
+      if (pr[i].status == 0) {
+        DPRINTF1("connect %d: tcp=%d negotiate=%d session=%d cpu=%d/%d/%d\r\n", i,
+                 pr[i].ct.time[0], pr[i].ct.time[1], pr[i].ct.time[2],
+                 pr[i].ct.cpu[0], pr[i].ct.cpu[1], pr[i].ct.cpu[2]);
+        if (winner < 0) {
+          winner = i;
+        }
+      }
+    }
+  }
+  return winner;
+}
+
+//****************************************************************************
+// Stale-while-revalidate
+//****************************************************************************
+
+// 読み直しを依頼する (DOSコールの処理から、mutexを確保した状態で呼ばれる)
+// 同じ読み直しが依頼済みか、空きがなければ何もしない (次に期限切れのまま返すときに再び依頼される)
+static void reval_queue(int unit, const char *path, bool isdir, bool isroot)
+{
+  reval_t *r = NULL;
+
+  for (int i = 0; i < REVAL_MAX; i++) {
+    if (revals[i].used) {
+      if (revals[i].unit == unit && revals[i].isdir == isdir &&
+          strcmp(revals[i].path, path) == 0) {
+        r = NULL;
+        break;
+      }
+    } else if (r == NULL) {
+      r = &revals[i];
+    }
+  }
+  if (r != NULL &&
+      (!isdir || (r->ent = malloc(sizeof(struct dos_filesinfo) * DCACHE_MAXENT)) != NULL)) {
+    r->unit = unit;
+    r->isdir = isdir;
+    r->isroot = isroot;
+    r->done = false;
+    strcpy(r->path, path);
+    r->used = true;
+    DPRINTF1("REVAL: unit=%d %s %s\r\n", unit, isdir ? "dir" : "stat", path);
+  }
+}
+
+static void reval_free(reval_t *r)
+{
+  free(r->ent);
+  r->ent = NULL;
+  r->used = false;
+}
+
+// アンマウントするユニットの読み直しを取り消す
+static void reval_cancel(int unit)
+{
+  for (int i = 0; i < REVAL_MAX; i++) {
+    if (revals[i].used && revals[i].unit == unit) {
+      reval_free(&revals[i]);
+    }
+  }
+}
+
+// 依頼された読み直しを1つ行う (バックグラウンドスレッドから呼ばれる)
+static void reval_run(void)
+{
+  static hostpath_t path;               // スレッドのスタックが小さいのでstaticに置く
+  static struct dos_filesinfo fi;
+  uint8_t w2[21];
+  reval_t *r = NULL;
+
+  for (int i = 0; i < REVAL_MAX; i++) {
+    if (revals[i].used && !revals[i].done) {
+      r = &revals[i];
+      break;
+    }
+  }
+  if (r == NULL) {
+    return;
+  }
+  int unit = r->unit;
+
+  // 取り消しや再利用はmutexを確保して行われるので、確保してから依頼がそのままか確かめる
+  // (ユニットが使用中なら次の機会に行う)
+  if (pthread_mutex_trylock(&smbfs_data.unit_mutex[unit]) != 0) {
+    return;
+  }
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+  if (!r->used || r->done || r->unit != unit) {
+    pthread_mutex_unlock(&smbfs_data.cache_mutex);
+    pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+    return;
+  }
+  strcpy(path, r->path);
+  r->gen = dcache_gen;
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+
+  // ユニットのmutexを確保している間は、このユニットへの取り消しは行われない
+  int err = 0;
+  if (rootsmb2[unit] == NULL) {
+    err = EIO;
+  } else if (r->isdir) {
+    TYPE_DIR dir;
+    TYPE_DIRENT *d;
+    int n = 0;
+    if ((dir = FUNC_OPENDIR(unit, &err, path)) != DIR_BADDIR) {
+      while ((d = FUNC_READDIR(unit, NULL, dir))) {
+        if (dl_convent(unit, r->isroot, d, &fi, w2)) {
+          if (n < DCACHE_MAXENT) {
+            r->ent[n] = fi;
+          }
+          n++;
+        }
+      }
+      FUNC_CLOSEDIR(unit, NULL, dir);
+      r->nent = n;
+      err = 0;
+    }
+  } else {
+    TYPE_STAT st;
+    if (FUNC_STAT(unit, &err, path, &st) == 0) {
+      r->atr = FUNC_FILEMODE_ATTR(&st);
+      err = 0;
+    }
+  }
+  DPRINTF1("REVAL: unit=%d %s -> %d\r\n", unit, path, err);
+
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+  r->err = err;
+  r->done = true;
+  reval_ready = true;
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+  pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+}
+
+// 読み直した結果をキャッシュに反映する (DOSコールの処理の最初に、mutexを確保した状態で呼ばれる)
+// 読み直しを始めてからキャッシュが無効にされていれば、結果が古い可能性があるので捨てる
+static void reval_apply(void)
+{
+  reval_ready = false;
+  for (int i = 0; i < REVAL_MAX; i++) {
+    reval_t *r = &revals[i];
+    if (!r->used || !r->done) {
+      continue;
+    }
+    if (r->gen == dcache_gen) {
+      if (r->isdir) {
+        dcache_t *dc = dcache_lookup(r->unit, r->path, -1);
+        if (dc != NULL && dc->busy) {
+          reval_ready = true;     // 一覧を読み出し中なので、次のDOSコールで反映する
+          continue;
+        }
+        if (r->err == ENOENT) {
+          dcache_invalidate(r->unit, r->path);
+        } else if (r->err == 0 && (dc = dcache_begin(r->unit, r->path)) != NULL) {
+          for (int j = 0; j < r->nent && j < DCACHE_MAXENT; j++) {
+            dcache_record(dc, j, &r->ent[j]);
+          }
+          dcache_finish(dc, r->nent);
+          dcache_end(dc);
+        }
+      } else {
+        if (r->err == ENOENT) {
+          scache_enter(r->unit, r->path, false, 0);
+        } else if (r->err == 0) {
+          scache_enter(r->unit, r->path, true, r->atr);
+        }
+      }
+      if (r->err == 0 || r->err == ENOENT) {
+        cache_stats.revalidated++;
+      }
+    }
+    reval_free(r);
+  }
+}
+
+//****************************************************************************
+// Directory change notification
+//****************************************************************************
+
+static void watch_arm(watch_t *w);
+
+static void watch_cb(struct smb2_context *smb2, int status,
+                     void *command_data, void *private_data)
+{
+  watch_t *w = private_data;
+  if (smb2 != w->smb2) {
+    return;                     // 切り替える前の接続からの応答
+  }
+  w->pending = false;
+  if (!w->active) {
+    w->used = false;            // 監視が終了していたのでここで解放する
+    return;
+  }
+  DPRINTF1("WATCH: unit=%d %s status=%d\r\n", w->unit, w->path, status);
+  if (status < 0) {
+    w->error = status;
+  } else {
+    w->dirty = true;
+    watch_dirty = true;
+    watch_arm(w);
+  }
+  w->count++;
+}
+
+// CHANGE_NOTIFYを送る
+static void watch_arm(watch_t *w)
+{
+  struct smb2_context *smb2 = rootsmb2[w->unit];
+  if (smb2 == NULL) {
+    return;
+  }
+  w->smb2 = smb2;
+  w->pending = true;
+  if (smb2_notify_change_async(smb2, w->path, w->subtree ? NOTIFY_WATCH_TREE : 0,
+                               w->filter, 0, watch_cb, w) < 0) {
+    w->pending = false;
+    w->error = -EIO;
+    w->count++;
+  }
+}
+
+// 監視中でCHANGE_NOTIFYを送っていないエントリがあれば送る
+static bool watch_rearm(int unit)
+{
+  bool any = false;
+  for (int i = 0; i < WATCH_MAX; i++) {
+    watch_t *w = &watches[i];
+    if (w->used && w->unit == unit) {
+      if (w->active && !w->pending && w->error == 0) {
+        watch_arm(w);
+      }
+      any = true;
+    }
+  }
+  return any;
+}
+
+// ユニットの接続に届いた応答を処理する (timeoutは1/100秒単位の待ち時間)
+// (接続が切れていれば-1を返す)
+static int watch_poll(int unit, uint32_t timeout)
+{
+  struct smb2_context *smb2 = rootsmb2[unit];
+  int fd = smb2_get_fd(smb2);
+  if (fd < 0) {
+    return -1;
+  }
+  fd_set rfds, wfds;
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  int events = smb2_which_events(smb2);
+  if (events & POLLIN) {
+    FD_SET(fd, &rfds);
+  }
+  if (events & POLLOUT) {
+    FD_SET(fd, &wfds);
+  }
+  struct timeval tv = { timeout / 100, (timeout % 100) * 10000 };
+  int revents = 0;
+  if (select(fd + 1, &rfds, &wfds, NULL, &tv) > 0) {
+    revents |= FD_ISSET(fd, &rfds) ? POLLIN : 0;
+    revents |= FD_ISSET(fd, &wfds) ? POLLOUT : 0;
+  }
+  if (smb2_service(smb2, revents) < 0) {
+    if (replica[unit]) {
+      replica[unit]->down = true;       // 切り替えは次のDOSコールで行う
+    }
+    return -1;
+  }
+  return 0;
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-int op_drvctrl(struct dos_req_header *req)
+// 変更が通知されたユニットのキャッシュを捨てる (DOSコールの処理中に呼ぶ)
+static void watch_flush(void)
 {
-  DPRINTF1("DRVCTRL:\r\n");
-  req->attr = 2;
-  return 0;
+  watch_dirty = false;
+  for (int i = 0; i < WATCH_MAX; i++) {
+    watch_t *w = &watches[i];
+    if (w->used && w->dirty) {
+      w->dirty = false;
+      pcache_invalidate_unit(w->unit);
+      dcache_invalidate_unit(w->unit);
+    }
+  }
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-int op_getdpb(struct dos_req_header *req)
+// 接続を破棄する前に、その接続に送ったCHANGE_NOTIFYの応答を待たないようにする
+// (unmountがtrueなら監視も終了する)
+static void watch_detach(int unit, bool unmount)
 {
-  DPRINTF1("GETDPB:\r\n");
-  uint8_t *p = (uint8_t *)req->addr;
-  memset(p, 0, 16);
-  *(uint16_t *)&p[0] = 512;   // 一部のアプリがエラーになるので仮のセクタ長を設定しておく
-  p[2] = 1;
-  return 0;
+  for (int i = 0; i < WATCH_MAX; i++) {
+    watch_t *w = &watches[i];
+    if (w->used && w->unit == unit) {
+      w->smb2 = NULL;
+      w->pending = false;
+      if (!w->active) {
+        w->used = false;
+      } else if (unmount) {
+        w->used = w->active = false;
+        w->error = -ENODEV;
+        w->count++;
+        for (int j = 0; j < WATCHREG_MAX; j++) {
+          if (watchregs[j].used && watchregs[j].watch == i) {
+            watchregs[j].used = false;
+          }
+        }
+      }
+    }
+  }
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+//****************************************************************************
+// Replica servers
+//****************************************************************************
 
-int op_diskred(struct dos_req_header *req)
+// URLのホスト名部分を','で区切ってrpに格納し、URLには最初のホスト名だけを残す
+static int replica_parse(char *url, replica_t *rp)
 {
-  DPRINTF1("DISKRED:\r\n");
-  return 0;
-}
+  char *p = strstr(url, "://");
+  p = p ? p + 3 : url;
+  char *end = strchr(p, '/');
+  if (end == NULL) {
+    end = p + strlen(p);
+  }
+  for (char *q = p; q < end; q++) {       // ユーザ名の後ろからがホスト名
+    if (*q == '@') {
+      p = q + 1;
+    }
+  }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+  rp->nhosts = 0;
+  char *h = p;
+  while (h <= end) {
+    char *e = memchr(h, ',', end - h);
+    if (e == NULL) {
+      e = end;
+    }
+    if (e > h) {
+      if (rp->nhosts >= REPLICA_MAX || (rp->host[rp->nhosts] = malloc(e - h + 1)) == NULL) {
+        return -1;
+      }
+      memcpy(rp->host[rp->nhosts], h, e - h);
+      rp->host[rp->nhosts][e - h] = '\0';
+      rp->nhosts++;
+    }
+    h = e + 1;
+  }
+  if (rp->nhosts == 0) {
+    return -1;
+  }
+  // URLから2番目以降のホスト名を取り除く
+  char *first = p + strlen(rp->host[0]);
+  memmove(first, end, strlen(end) + 1);
+  return rp->nhosts;
+}
 
-int op_diskwrt(struct dos_req_header *req)
+static void replica_free(replica_t *rp)
 {
-  DPRINTF1("DISKWRT:\r\n");
-  return 0;
+  if (rp == NULL) {
+    return;
+  }
+  for (int i = 0; i < rp->nhosts; i++) {
+    free(rp->host[i]);
+  }
+  free(rp->share);
+  free(rp->user);
+  free(rp->password);
+  free(rp);
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-int op_abort(struct dos_req_header *req)
+// skip以外のサーバに並行して接続し、最初に接続できた(最も応答の速い)サーバを返す
+static struct smb2_context *replica_connect(replica_t *rp, int skip, struct smbcmd_conntime *ct)
 {
-  DPRINTF1("ABORT:\r\n");
-  return 0;
-}
+  connprobe_t pr[REPLICA_MAX];
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+  for (int i = 0; i < rp->nhosts; i++) {
+    pr[i].smb2 = NULL;
+    pr[i].status = -EIO;
+    if (i == skip || (pr[i].smb2 = smb2_init_context()) == NULL) {
+      continue;
+    }
+    smb2_set_user(pr[i].smb2, rp->user);
+    if (rp->password) {
+      smb2_set_password(pr[i].smb2, rp->password);
+    }
+    smb2_set_version(pr[i].smb2, rp->version);
+    smb2_set_security_mode(pr[i].smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+    DPRINTF1("replica %d: connecting %s\r\n", i, rp->host[i]);
+    connect_start(&pr[i], rp->host[i], rp->share);
+  }
 
-int op_mediacheck(struct dos_req_header *req)
+  int winner = connect_wait(pr, rp->nhosts);
+
+  // 選ばれなかったサーバへの接続は破棄する
+  for (int i = 0; i < rp->nhosts; i++) {
+    if (i != skip) {
+      rp->latency[i] = pr[i].status == 0 ? pr[i].ct.time[CONNPHASE_TOTAL] : REPLICA_DOWN;
+    }
+    if (i == winner || pr[i].smb2 == NULL) {
+      continue;
+    }
+    if (pr[i].status == 0) {
+      smb2_disconnect_share(pr[i].smb2);
+    }
+    smb2_destroy_context(pr[i].smb2);
+  }
+  if (winner < 0) {
+    return NULL;
+  }
+  rp->active = winner;
+  *ct = pr[winner].ct;
+  return pr[winner].smb2;
+}
+
+// 接続が切れたユニットを他のサーバに切り替える
+// (切れた接続で開いていたファイルやディレクトリ、キャッシュは破棄する。
+//  保持していた書き込みは新しいサーバでファイルを開き直して書き込む)
+static int replica_failover(int unit)
 {
-  DPRINTF1("MEDIACHECK:\r\n");
+  replica_t *rp = replica[unit];
+  if (rp->retry != 0 && cache_clock() - rp->retry < REPLICA_RETRY) {
+    return -1;
+  }
+  DPRINTF1("replica failover unit=%d from %s\r\n", unit, rp->host[rp->active]);
+  int old = rp->active;
+  struct smbcmd_conntime ct;
+  struct smb2_context *smb2 = replica_connect(rp, old, &ct);
+  if (smb2 == NULL) {
+    smb2 = replica_connect(rp, -1, &ct);  // 元のサーバが戻っていればそれでもよい
+  }
+  if (smb2 == NULL) {
+    rp->retry = cache_clock() | 1;
+    return -1;
+  }
+
+  bg_cancel_unit(unit);
+  fi_freeall(unit, false);
+  dl_freeall(unit);
+  pcache_invalidate_unit(unit);
+  dcache_invalidate_unit(unit);
+  watch_detach(unit, false);            // 新しい接続で送り直す
+  smb2_destroy_context(rootsmb2[unit]);
+  rootsmb2[unit] = smb2;
+  conntime[unit] = ct;
+  rp->down = false;
+  rp->retry = 0;
+  DPRINTF1("replica failover unit=%d to %s\r\n", unit, rp->host[rp->active]);
+  wb_flush_unit(unit, NULL);
   return 0;
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-int op_lock(struct dos_req_header *req)
+// サーバからエラーが返ったら接続が切れていないかを確認する
+static void replica_check(int unit)
 {
-  DPRINTF1("LOCK:\r\n");
-  return 0;
+  if (unit < MAXUNIT && replica[unit] && rootsmb2[unit] &&
+      smb2_echo(rootsmb2[unit]) < 0) {
+    replica[unit]->down = true;
+  }
 }
 
 //****************************************************************************
 // IOCTRL operations
 //****************************************************************************
 
+// URLの引数からsmbfs自身のオプションを取り除いてMOUNT_*を返す
+// (残りの引数はそのままlibsmb2に渡す)
+static uint32_t mount_options(char *url)
+{
+  static const struct {
+    const char *name;
+    uint32_t flag;
+  } opts[] = {
+    { "archive", MOUNT_ARCHIVE },
+    { "stale", MOUNT_STALE },
+    { "writeback", MOUNT_WRITEBACK },
+  };
+  uint32_t flags = 0;
+  char *q = strchr(url, '?');
+  if (q == NULL) {
+    return 0;
+  }
+  char *src = q + 1;
+  char *dst = q;
+  while (*src) {
+    char *e = strchr(src, '&');
+    int len = e ? e - src : strlen(src);
+    int i;
+    for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+      if (strlen(opts[i].name) == len && strncasecmp(src, opts[i].name, len) == 0) {
+        flags |= opts[i].flag;
+        break;
+      }
+    }
+    if (i == sizeof(opts) / sizeof(opts[0]) && len > 0) {   // libsmb2の引数はそのまま残す
+      *dst = (dst == q) ? '?' : '&';
+      dst++;
+      memmove(dst, src, len);
+      dst += len;
+    }
+    src += len + (e ? 1 : 0);
+  }
+  *dst = '\0';
+  return flags;
+}
+
 static int op_do_mount(int unit, struct smbcmd_mount *mnt)
 {
   int mnt_err = 0;
   struct smb2_url *url = NULL;
+  replica_t *rp = NULL;
+  char urlbuf[PATH_LEN];
 
   DPRINTF1(" MOUNT url=%s user=%s pass=%s\r\n",
            mnt->url, mnt->username, mnt->password);
@@ -1327,7 +3400,26 @@ static int op_do_mount(int unit, struct smbcmd_mount *mnt)
   environ = mnt->environ;
 
   // 与えられたURLをパースする(UTF-8に変換後)
-  if ((url = smb2_parse_url(smb2, sjis_to_utf8(mnt->url))) == NULL) {
+  // サーバ名が','で区切られていれば複製サーバの一覧として扱う
+  char *utf8url = sjis_to_utf8(mnt->url);
+  if (utf8url == NULL) {
+    DPRINTF1("  -> INVAL\r\n");
+    mnt_err = -EINVAL;
+    goto mnt_errout;
+  }
+  strcpy(urlbuf, utf8url);
+  mountflags[unit] = mount_options(urlbuf);
+  if ((rp = calloc(1, sizeof(replica_t))) == NULL) {
+    DPRINTF1("  -> NOMEM\r\n");
+    mnt_err = -ENOMEM;
+    goto mnt_errout;
+  }
+  if (replica_parse(urlbuf, rp) < 0) {
+    DPRINTF1("  -> INVAL\r\n");
+    mnt_err = -EINVAL;
+    goto mnt_errout;
+  }
+  if ((url = smb2_parse_url(smb2, urlbuf)) == NULL) {
     DPRINTF1("  -> INVAL\r\n");
     mnt_err = -EINVAL;
     goto mnt_errout;
@@ -1360,13 +3452,40 @@ static int op_do_mount(int unit, struct smbcmd_mount *mnt)
   }
 
   // サーバに接続する
-  smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
-  DPRINTF1("smb2_connect_share\r\n");
-  if (smb2_connect_share(smb2, url->server, url->share, NULL) < 0) {
-    DPRINTF1("smb2_connect_share failed. %s\r\n", smb2_get_error(smb2));
-    mnt_err = -EIO;
-    goto mnt_errout;
+  if (rp->nhosts > 1) {
+    // 複製サーバのすべてに接続を試みて最も早く応答したサーバを使う
+    rp->share = strdup(url->share);
+    rp->user = strdup(smb2_get_user(smb2));
+    rp->password = strdup(smb2->password);
+    rp->version = smb2->version;
+    if (rp->share == NULL || rp->user == NULL || rp->password == NULL) {
+      DPRINTF1("  -> NOMEM\r\n");
+      mnt_err = -ENOMEM;
+      goto mnt_errout;
+    }
+    smb2_destroy_context(smb2);
+    DPRINTF1("replica_connect %d hosts\r\n", rp->nhosts);
+    if ((smb2 = replica_connect(rp, -1, &conntime[unit])) == NULL) {
+      DPRINTF1("replica_connect failed.\r\n");
+      mnt_err = -EIO;
+      goto mnt_errout;
+    }
+    replica[unit] = rp;
+  } else {
+    replica_free(rp);
+    rp = NULL;
+    smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+    DPRINTF1("smb2_connect_share\r\n");
+    connprobe_t pr = { .smb2 = smb2 };
+    connect_start(&pr, url->server, url->share);
+    if (connect_wait(&pr, 1) < 0) {
+      DPRINTF1("smb2_connect_share failed. %s\r\n", smb2_get_error(smb2));
+      mnt_err = -EIO;
+      goto mnt_errout;
+    }
+    conntime[unit] = pr.ct;
   }
+  rp = NULL;
   rootsmb2[unit] = smb2;
   DPRINTF1("smb2_connect_share succeeded.\r\n");
 
@@ -1403,99 +3522,427 @@ mnt_errout:
   if (url) {
     smb2_destroy_url(url);
   }
-  smb2_disconnect_share(smb2);
-  smb2_destroy_context(smb2);
-  rootsmb2[unit] = NULL;
-  return mnt_err;
+  if (smb2) {
+    smb2_disconnect_share(smb2);
+    smb2_destroy_context(smb2);
+  }
+  replica_free(rp);
+  replica_free(replica[unit]);
+  replica[unit] = NULL;
+  rootsmb2[unit] = NULL;
+  return mnt_err;
+}
+
+static void op_do_unmount_one(int unit)
+{
+  bg_cancel_unit(unit);
+  fi_freeall(unit, true);
+  dl_freeall(unit);
+  pcache_invalidate_unit(unit);
+  dcache_invalidate_unit(unit);
+  arc_invalidate_unit(unit);
+  watch_detach(unit, true);
+  reval_cancel(unit);
+  mountflags[unit] = 0;
+  smb2_disconnect_share(rootsmb2[unit]);
+  smb2_destroy_context(rootsmb2[unit]);
+  rootsmb2[unit] = NULL;
+  free(rootpath[unit]);
+  rootpath[unit] = NULL;
+  replica_free(replica[unit]);
+  replica[unit] = NULL;
+}
+
+static int op_do_unmount(int unit)
+{
+  DPRINTF1(" UNMOUNT\r\n");
+  if (rootsmb2[unit] == NULL) {
+    DPRINTF1(" not mounted\r\n");
+    return -ENOENT;
+  }
+
+  if (check_dpb_busy(&smbfs_data.dpbs[unit])) {
+    DPRINTF1(" busy\r\n");
+    return -EBUSY;
+  }
+
+  op_do_unmount_one(unit);
+
+  DPRINTF1(" unmounted\r\n");
+  return 0;
+}
+
+static int op_do_unmountall(void)
+{
+  DPRINTF1(" UNMOUNTALL\r\n");
+
+  // 使用中のマウントがあるか確認する
+  for (int unit = 0; unit < MAXUNIT; unit++) {
+    if (rootsmb2[unit] != NULL && check_dpb_busy(&smbfs_data.dpbs[unit])) {
+      DPRINTF1(" busy\r\n");
+      return -EBUSY;
+    }
+  }
+
+  for (int unit = 0; unit < MAXUNIT; unit++) {
+    if (rootsmb2[unit] != NULL) {
+      op_do_unmount_one(unit);
+    }
+  }
+
+  DPRINTF1(" unmounted\r\n");
+  return 0;
+}
+
+static int op_do_getmount_sub(char *dst, const char *src, size_t dst_len)
+{
+  char *sjis_src = utf8_to_sjis(src);
+  if (sjis_src == NULL) {
+    dst[0] = '\0';
+    return 0;
+  } else {
+    strncpy(dst, sjis_src, dst_len - 1);
+    dst[dst_len - 1] = '\0';
+    return strlen(sjis_src) + 1;
+  }
+}
+
+static int op_do_getmount(int unit, struct smbcmd_getmount *mnt)
+{
+  DPRINTF1(" GETMOUNT\r\n");
+  if (rootsmb2[unit] == NULL) {
+    DPRINTF1(" not mounted\r\n");
+    return -ENOENT;
+  }
+  mnt->server_len = op_do_getmount_sub(mnt->server, rootsmb2[unit]->server, mnt->server_len);
+  mnt->share_len = op_do_getmount_sub(mnt->share, rootsmb2[unit]->share, mnt->share_len);
+  mnt->rootpath_len = op_do_getmount_sub(mnt->rootpath, rootpath[unit], mnt->rootpath_len);
+  mnt->username_len = op_do_getmount_sub(mnt->username, rootsmb2[unit]->user, mnt->username_len);
+  return 0;
+}
+
+static int op_do_getmeminfo(struct smbcmd_getmeminfo *meminfo)
+{
+  DPRINTF1(" GETMEMINFO\r\n");
+  struct mallinfo mi = mallinfo();
+
+  meminfo->total_heap_size = _heap_size;
+  meminfo->used_heap_size = mi.uordblks;
+  return 0;
+}
+
+static int op_do_gethistory(struct smbcmd_history *hist)
+{
+  DPRINTF1(" GETHISTORY\r\n");
+  hist->buf_len = history_save(hist->buf, hist->buf_len);
+  return 0;
+}
+
+static int op_do_sethistory(struct smbcmd_history *hist)
+{
+  DPRINTF1(" SETHISTORY\r\n");
+  return history_load(hist->buf, hist->buf_len);
+}
+
+static int op_do_getstats(struct smbcmd_getstats *req)
+{
+  static struct smbcmd_getstats st;
+  struct smbcmd_getstats *stats = &st;
+
+  DPRINTF1(" GETSTATS size=%d\r\n", (int)req->size);
+  if (req->size < sizeof(req->size)) {
+    return -EINVAL;
+  }
+  stats->read_hits = cache_stats.read_hits;
+  stats->read_misses = cache_stats.read_misses;
+  stats->hit_bytes = cache_stats.hit_bytes;
+  stats->prefetch_issued = cache_stats.prefetch_issued;
+  stats->prefetch_used = cache_stats.prefetch_used;
+  stats->evicted = cache_stats.evicted;
+  stats->cache_pages = cache_stats.pages;
+  stats->cache_budget = cache_stats.budget;
+  stats->page_size = PCACHE_PAGESIZE;
+  stats->fast_hits = cache_stats.fast_hits;
+  stats->fast_retries = cache_stats.fast_retries;
+  stats->zcache_pages = cache_stats.zpages;
+  stats->zcache_bytes = cache_stats.zbytes;
+  stats->zcache_budget = cache_stats.zbudget;
+  stats->zstored = cache_stats.zstored;
+  stats->zhits = cache_stats.zhits;
+  stats->zskipped = cache_stats.zskipped;
+  stats->wb_absorbed = cache_stats.wb_absorbed;
+  stats->wb_flushed = cache_stats.wb_flushed;
+  stats->wb_pages = wb_total;
+  stats->stride_records = cache_stats.stride_records;
+  stats->stride_backoffs = cache_stats.stride_backoffs;
+  stats->stale_hits = cache_stats.stale_hits;
+  stats->revalidated = cache_stats.revalidated;
+
+  // 呼び出し側が知っている項目までを返す (新しい項目を追加しても古いsmbmountのバッファを越えない)
+  stats->size = req->size < sizeof(st) ? req->size : sizeof(st);
+  memcpy(req, stats, stats->size);
+  return 0;
+}
+
+static int op_do_getconntime(int unit, struct smbcmd_conntime *ct)
+{
+  DPRINTF1(" GETCONNTIME\r\n");
+  if (rootsmb2[unit] == NULL) {
+    DPRINTF1(" not mounted\r\n");
+    return -ENOENT;
+  }
+  *ct = conntime[unit];
+  return 0;
+}
+
+static int op_do_getprocstats(struct smbcmd_getprocstats *st)
+{
+  DPRINTF1(" GETPROCSTATS\r\n");
+  uint32_t now = cache_clock();
+  int n = 0;
+  for (int i = 0; i < PROCSTAT_MAX; i++) {
+    if (procstat[i].requests == 0) {
+      continue;
+    }
+    if (n < st->procs_len) {
+      st->procs[n] = procstat[i];
+      st->procs[n].age = now - procstat_last[i];
+    }
+    n++;
+  }
+  st->nprocs = n;
+  return 0;
+}
+
+static int op_do_trace(struct smbcmd_trace *trace)
+{
+  DPRINTF1(" TRACE %d\r\n", trace->cmd);
+  switch (trace->cmd) {
+  case TRACECMD_START:
+    return trace_start(trace->nrec);
+  case TRACECMD_STOP:
+    trace_stop();
+    return 0;
+  case TRACECMD_GET:
+    trace->buf_len = trace_save(trace->buf, trace->buf ? trace->buf_len : 0);
+    return 0;
+  case TRACECMD_CLEAR:
+    trace_clear();
+    return 0;
+  default:
+    return -EINVAL;
+  }
+}
+
+#ifdef PROFILE
+static int op_do_profile(struct smbcmd_profile *prof)
+{
+  DPRINTF1(" PROFILE %d\r\n", prof->cmd);
+  int res;
+  switch (prof->cmd) {
+  case PROFCMD_START:
+    res = prof_start();
+    break;
+  case PROFCMD_STOP:
+    res = prof_stop();
+    break;
+  case PROFCMD_GET:
+    prof->buf_len = prof_save(prof->buf, prof->buf_len);
+    return 0;
+  default:
+    return -EINVAL;
+  }
+  smbfs_data.prof_hooked = prof_hooked();
+  return res;
 }
+#endif
 
-static void op_do_unmount_one(int unit)
+// IOCTRLで渡されたSJISのパス名を要素ごとにホストのパスに変換する ('\\'と'/'のどちらも区切りとして扱う)
+// nameにはパス名の最後の要素を返す
+static int op_do_hostpath(int unit, const char *sjispath, hostpath_t path, const char **name)
 {
-  fi_freeall(unit);
-  dl_freeall(unit);
-  smb2_disconnect_share(rootsmb2[unit]);
-  smb2_destroy_context(rootsmb2[unit]);
-  rootsmb2[unit] = NULL;
-  free(rootpath[unit]);
-  rootpath[unit] = NULL;
+  int len = strlen(rootpath[unit]);
+  if (len >= sizeof(hostpath_t) - 1) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(path, rootpath[unit]);
+  char *dst_buf = path + len;
+  size_t dst_len = sizeof(hostpath_t) - 1 - len;
+  const char *p = sjispath;
+  *name = p;
+  while (*p) {
+    if (*p == '\\' || *p == '/') {
+      p++;
+      continue;
+    }
+    const char *s = p;
+    while (*p && *p != '\\' && *p != '/') {
+      uint8_t c = *p;
+      p += ((0x81 <= c && c <= 0x9f) || (0xe0 <= c && c <= 0xef)) && p[1] ? 2 : 1;
+    }
+    if (conv_namebuf_sub(s, p - s, &dst_buf, &dst_len, path) < 0) {
+      return -ENAMETOOLONG;
+    }
+    *name = s;
+  }
+  *dst_buf = '\0';
+  return 0;
 }
 
-static int op_do_unmount(int unit)
+static int op_do_querycache(int unit, struct smbcmd_querycache *q)
 {
-  DPRINTF1(" UNMOUNT\r\n");
-  if (rootsmb2[unit] == NULL) {
-    DPRINTF1(" not mounted\r\n");
+  DPRINTF1(" QUERYCACHE %s\r\n", q->path);
+  if (rootpath[unit] == NULL) {
     return -ENOENT;
   }
 
-  if (check_dpb_busy(&smbfs_data.dpbs[unit])) {
-    DPRINTF1(" busy\r\n");
-    return -EBUSY;
+  hostpath_t path;
+  const char *name;
+  int err = op_do_hostpath(unit, q->path, path, &name);
+  if (err < 0) {
+    return err;
   }
 
-  op_do_unmount_one(unit);
+  char sjisname[8 + 10 + 1 + 3 + 1];
+  int len = strlen(name);
+  if (len >= sizeof(sjisname)) {
+    len = sizeof(sjisname) - 1;
+  }
+  memcpy(sjisname, name, len);
+  sjisname[len] = '\0';
 
-  DPRINTF1(" unmounted\r\n");
+  cache_query(unit, path, sjisname, q);
   return 0;
 }
 
-static int op_do_unmountall(void)
+static int op_do_waitchange(int unit, struct smbcmd_waitchange *wc)
 {
-  DPRINTF1(" UNMOUNTALL\r\n");
-
-  // 使用中のマウントがあるか確認する
-  for (int unit = 0; unit < MAXUNIT; unit++) {
-    if (rootsmb2[unit] != NULL && check_dpb_busy(&smbfs_data.dpbs[unit])) {
-      DPRINTF1(" busy\r\n");
-      return -EBUSY;
-    }
+  DPRINTF1(" WAITCHANGE cmd=%d id=%d\r\n", wc->cmd, wc->id);
+  if (rootsmb2[unit] == NULL) {
+    return -ENOENT;
   }
 
-  for (int unit = 0; unit < MAXUNIT; unit++) {
-    if (rootsmb2[unit] != NULL) {
-      op_do_unmount_one(unit);
+  if (wc->cmd == WCCMD_REGISTER) {
+    hostpath_t path;
+    const char *name;
+    TYPE_STAT st;
+    int err = op_do_hostpath(unit, wc->path, path, &name);
+    if (err < 0) {
+      return err;
     }
-  }
+    if (FUNC_STAT(unit, &err, path, &st) != 0) {
+      return -err;
+    }
+    if (!STAT_ISDIR(&st)) {
+      return -ENOTDIR;
+    }
+    uint32_t filter = wc->filter ? wc->filter : WCF_DEFAULT;
+    bool subtree = wc->subtree != 0;
 
-  DPRINTF1(" unmounted\r\n");
-  return 0;
-}
+    int reg;
+    for (reg = 0; reg < WATCHREG_MAX; reg++) {
+      if (!watchregs[reg].used) {
+        break;
+      }
+    }
+    if (reg == WATCHREG_MAX) {
+      return -EMFILE;
+    }
 
-static int op_do_getmount_sub(char *dst, const char *src, size_t dst_len)
-{
-  char *sjis_src = utf8_to_sjis(src);
-  if (sjis_src == NULL) {
-    dst[0] = '\0';
+    // 同じ監視がすでにあれば共有する
+    int id;
+    watch_t *w;
+    for (id = 0; id < WATCH_MAX; id++) {
+      w = &watches[id];
+      if (w->used && w->active && w->unit == unit && w->filter == filter &&
+          w->subtree == subtree && strcmp(w->path, path) == 0) {
+        break;
+      }
+    }
+    if (id == WATCH_MAX) {
+      for (id = 0; id < WATCH_MAX; id++) {
+        if (!watches[id].used) {
+          break;
+        }
+      }
+      if (id == WATCH_MAX) {
+        return -EMFILE;
+      }
+      w = &watches[id];
+      w->used = w->active = true;
+      w->pending = w->dirty = false;
+      w->unit = unit;
+      w->refs = 0;
+      w->filter = filter;
+      w->subtree = subtree;
+      w->error = 0;
+      strcpy(w->path, path);
+      watch_arm(w);
+    }
+    w->refs++;
+    watchregs[reg].used = true;
+    watchregs[reg].watch = id;
+    watchregs[reg].seen = w->count;
+    DPRINTF1("  -> id=%d watch=%d refs=%d %s\r\n", reg, id, w->refs, path);
+    wc->id = reg;
     return 0;
-  } else {
-    strncpy(dst, sjis_src, dst_len - 1);
-    dst[dst_len - 1] = '\0';
-    return strlen(sjis_src) + 1;
   }
-}
 
-static int op_do_getmount(int unit, struct smbcmd_getmount *mnt)
-{
-  DPRINTF1(" GETMOUNT\r\n");
-  if (rootsmb2[unit] == NULL) {
-    DPRINTF1(" not mounted\r\n");
-    return -ENOENT;
+  if (wc->id < 0 || wc->id >= WATCHREG_MAX || !watchregs[wc->id].used) {
+    return -EINVAL;
+  }
+  watchreg_t *wr = &watchregs[wc->id];
+  watch_t *w = &watches[wr->watch];
+  if (!w->used || !w->active || w->unit != unit) {
+    return -EINVAL;
   }
-  mnt->server_len = op_do_getmount_sub(mnt->server, rootsmb2[unit]->server, mnt->server_len);
-  mnt->share_len = op_do_getmount_sub(mnt->share, rootsmb2[unit]->share, mnt->share_len);
-  mnt->rootpath_len = op_do_getmount_sub(mnt->rootpath, rootpath[unit], mnt->rootpath_len);
-  mnt->username_len = op_do_getmount_sub(mnt->username, rootsmb2[unit]->user, mnt->username_len);
-  return 0;
-}
 
-static int op_do_getmeminfo(struct smbcmd_getmeminfo *meminfo)
-{
-  DPRINTF1(" GETMEMINFO\r\n");
-  struct mallinfo mi = mallinfo();
+  switch (wc->cmd) {
+  case WCCMD_WAIT:
+  {
+    // 変更が通知されるまで接続に届く応答を処理しながら待つ
+    // (待っている間もcache_mutexは解放して、他のユニットの先読みやkeepaliveを止めない。
+    //  このユニットのmutexは確保したままなので、バックグラウンドスレッドはこのユニットを飛ばす)
+    uint32_t timeout = wc->timeout < WATCH_WAITMAX ? wc->timeout : WATCH_WAITMAX;
+    uint32_t start = cache_clock();
+    do {
+      if (w->active && (!w->pending || w->smb2 != rootsmb2[unit]) && w->error == 0) {
+        watch_arm(w);
+      }
+      uint32_t elapsed = cache_clock() - start;
+      uint32_t wait = timeout - elapsed < 10 ? timeout - elapsed : 10;
+      pthread_mutex_unlock(&smbfs_data.cache_mutex);
+      watch_poll(unit, elapsed < timeout ? wait : 0);
+      pthread_mutex_lock(&smbfs_data.cache_mutex);
+    } while (w->count == wr->seen && w->error == 0 && cache_clock() - start < timeout);
+
+    if (w->dirty) {
+      watch_flush();
+    }
+    wc->changes = w->count - wr->seen;
+    wr->seen = w->count;
+    if (w->error) {
+      int err = w->error;
+      w->error = 0;             // 次のWAITでCHANGE_NOTIFYを送り直す
+      return err;
+    }
+    return 0;
+  }
 
-  meminfo->total_heap_size = _heap_size;
-  meminfo->used_heap_size = mi.uordblks;
-  return 0;
+  case WCCMD_CANCEL:
+    wr->used = false;
+    if (--w->refs > 0) {
+      return 0;
+    }
+    w->active = false;
+    if (!w->pending) {
+      w->used = false;
+    }
+    return 0;
+
+  default:
+    return -EINVAL;
+  }
 }
 
   /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -1522,29 +3969,272 @@ int op_ioctl(struct dos_req_header *req)
     return op_do_getmount(unit, (struct smbcmd_getmount *)req->addr);
   case SMBCMD_GETMEMINFO:
     return op_do_getmeminfo((struct smbcmd_getmeminfo *)req->addr);
+  case SMBCMD_GETSTATS:
+    return op_do_getstats((struct smbcmd_getstats *)req->addr);
+  case SMBCMD_GETPROCSTATS:
+    return op_do_getprocstats((struct smbcmd_getprocstats *)req->addr);
+  case SMBCMD_GETCONNTIME:
+    return op_do_getconntime(unit, (struct smbcmd_conntime *)req->addr);
+  case SMBCMD_TRACE:
+    return op_do_trace((struct smbcmd_trace *)req->addr);
+  case SMBCMD_GETHISTORY:
+    return op_do_gethistory((struct smbcmd_history *)req->addr);
+  case SMBCMD_SETHISTORY:
+    return op_do_sethistory((struct smbcmd_history *)req->addr);
+  case SMBCMD_QUERYCACHE:
+    return op_do_querycache(unit, (struct smbcmd_querycache *)req->addr);
+  case SMBCMD_WAITCHANGE:
+    return op_do_waitchange(unit, (struct smbcmd_waitchange *)req->addr);
+#ifdef PROFILE
+  case SMBCMD_PROFILE:
+    return op_do_profile((struct smbcmd_profile *)req->addr);
+#endif
   default:
     return -EINVAL;
   }
 }
 
 //****************************************************************************
-// Keepalive thread
+// Cache fast path
+//****************************************************************************
+
+// キャッシュだけで処理できるDOSコールはmutexを確保せずに処理する
+// ディレクトリ一覧とファイル情報のキャッシュはDOSコールの処理からしか変更されないのでそのまま参照し、
+// バックグラウンドスレッドも変更するページキャッシュはpcache_read_nolock()で読み出す
+// (ここではサーバとの通信や新たなメモリの確保を行わず、処理できなければfalseを返す
+//  ただしFILESでは、同じFILBUFの使い終わった検索バッファを再利用するために解放することがある)
+// 起動履歴はmutexを確保して記録するので、記録中のreadはここでは処理しない
+// 変更の通知や読み直しの結果をキャッシュに反映していなければ、先にmutexを確保して反映させる
+
+static bool fast_chdir(struct dos_req_header *req)
+{
+  hostpath_t path;
+  uint8_t atr;
+
+  if (conv_namebuf(req->unit, req->addr, false, &path) < 0) {
+    return false;
+  }
+  switch (scache_lookup(req->unit, path, NULL, &atr)) {
+  case 1:
+    req->status = (atr & 0x10) ? 0 : _DOSE_NODIR;
+    break;
+  case 0:
+    req->status = _DOSE_NODIR;
+    break;
+  default:
+    return false;
+  }
+  DNAMEPRINT(req->addr, false, "CHDIR: ");
+  DPRINTF1("-> %d (cached)\r\n", req->status);
+  return true;
+}
+
+static bool fast_chmod(struct dos_req_header *req)
+{
+  hostpath_t path;
+  char name[8 + 10 + 1 + 3 + 1];
+  uint8_t atr;
+
+  if (req->attr != 0xff ||    // 属性の変更はサーバで行う
+      conv_namebuf(req->unit, req->addr, true, &path) < 0) {
+    return false;
+  }
+  name[conv_namests_name(req->addr, (uint8_t *)name)] = '\0';
+  switch (scache_lookup(req->unit, path, name, &atr)) {
+  case 1:
+    req->status = atr;
+    break;
+  case 0:
+    req->status = conv_errno(ENOENT);
+    break;
+  default:
+    return false;
+  }
+  DNAMEPRINT(req->addr, true, "CHMOD: ");
+  DPRINTF1("-> %d (cached)\r\n", req->status);
+  return true;
+}
+
+static bool fast_open(struct dos_req_header *req)
+{
+  hostpath_t path;
+  char name[8 + 10 + 1 + 3 + 1];
+
+  if (conv_namebuf(req->unit, req->addr, true, &path) < 0) {
+    return false;
+  }
+  name[conv_namests_name(req->addr, (uint8_t *)name)] = '\0';
+  if (scache_lookup(req->unit, path, name, NULL) != 0) {
+    return false;             // 存在しないことが分かっている場合だけ処理する
+  }
+  req->status = conv_errno(ENOENT);
+  DNAMEPRINT(req->addr, true, "OPEN: ");
+  DPRINTF1("-> %d (cached)\r\n", req->status);
+  return true;
+}
+
+// キャッシュの一覧から検索する (maxageより古い一覧は使わない)
+// 有効期間を過ぎた一覧を使ったときはバックグラウンドでの読み直しを依頼する
+static bool files_cached(struct dos_req_header *req, uint32_t maxage)
+{
+  hostpath_t path;
+  dirlist_t *dl;
+  dcache_t *dc;
+  struct dos_filbuf *fb = (struct dos_filbuf *)req->status;
+
+  if (conv_namebuf(req->unit, req->addr, false, &path) < 0 ||
+      (dc = dcache_lookup(req->unit, path, -1)) == NULL || !dcache_valid(dc, maxage)) {
+    return false;
+  }
+  if ((dl = dl_alloc(req->status, false, false)) != NULL && dl->dir != DIR_BADDIR) {
+    return false;             // 使用中のバッファを閉じるにはサーバとの通信が必要
+  }
+  if ((dl = dl_alloc(req->status, true, false)) == NULL) {
+    return false;
+  }
+  strcpy(dl->hostpath, path);
+  dl_init(dl, req);
+  dl->cached = true;
+  dl->dc = dc;
+  dl->dcpos = 0;
+  dc->busy++;
+  if (maxage > PCACHE_TTL && !dcache_fresh(dc)) {  // mutexを確保して呼ばれた場合だけ
+    reval_queue(req->unit, path, true, dl->isroot);
+    cache_stats.stale_hits++;
+  }
+
+  DNAMEPRINT(req->addr, true, "FILES: ");
+  if (dl_readdir(dl, &fb->ext[2]) == 0) {
+    DPRINTF1("-> NOMORE (cached)\r\n");
+    req->status = _DOSE_NOMORE;
+  } else {
+    DPRINTF1("-> %s (cached)\r\n", fb->name);
+    req->status = 0;
+  }
+  return true;
+}
+
+static bool fast_files(struct dos_req_header *req)
+{
+  return files_cached(req, PCACHE_TTL);
+}
+
+static bool fast_nfiles(struct dos_req_header *req)
+{
+  dirlist_t *dl;
+  struct dos_filbuf *fb = (struct dos_filbuf *)req->status;
+
+  if ((dl = dl_alloc(req->status, false, false)) == NULL || !(dl->cached || dl->literal)) {
+    return false;
+  }
+  if (dl_readdir(dl, &fb->ext[2]) == 0) {
+    DPRINTF1("NFILES: -> NOMORE (cached)\r\n");
+    req->status = _DOSE_NOMORE;
+  } else {
+    DPRINTF1("NFILES: -> %s (cached)\r\n", fb->name);
+    req->status = 0;
+  }
+  return true;
+}
+
+static bool fast_read(struct dos_req_header *req)
+{
+  fdinfo_t *fi = fi_alloc(req->unit, (uint32_t)req->fcb, false);
+  if (fi == NULL || fi->cf == NULL) {
+    return false;
+  }
+
+  // 前回のreadから続いていない位置のreadは、一定間隔のreadを検出するためにmutexを確保して処理する
+  uint32_t *pp = &dos_fcb_fpos(req->fcb);
+  if (*pp != fi->rend || history_recording()) {
+    return false;
+  }
+  ssize_t hit = pcache_read_nolock(fi->cf, *pp, req->addr, req->status);
+  if (hit < 0 || !(hit == req->status || (hit > 0 && *pp + hit >= fi->cf->size))) {
+    return false;
+  }
+  cache_stats.read_hits++;
+  fi->rpos = *pp;
+  fi->rend = *pp + req->status;
+  *pp += hit;
+  req->status = hit;
+  DPRINTF1("READ: fcb=0x%08x len=%d -> pos=%d (cached)\r\n", (uint32_t)req->fcb, hit, *pp);
+  return true;
+}
+
+static bool op_fast(struct dos_req_header *req)
+{
+  switch (req->command & 0x7f) {
+  case 0x41: /* chdir */
+    return fast_chdir(req);
+  case 0x46: /* chmod */
+    return fast_chmod(req);
+  case 0x47: /* files */
+    return fast_files(req);
+  case 0x48: /* nfiles */
+    return fast_nfiles(req);
+  case 0x4a: /* open */
+    return fast_open(req);
+  case 0x4c: /* read */
+    return fast_read(req);
+  case 0x4e: /* seek */
+    req->status = op_seek(req);
+    return true;
+  default:
+    return false;
+  }
+}
+
+//****************************************************************************
+// Background thread
 //****************************************************************************
 
+// keepaliveと先読み、ディレクトリの変更の通知の受け取り、ライトバック、キャッシュの読み直しを行うスレッド
+// 先読みは1ページずつ行い、その間だけmutexを確保するのでDOSコールの処理を長く待たせない
+// (サーバとの通信中はそのユニットのmutexだけを確保するので、他のユニットへのDOSコールは待たされない)
 __attribute__((noreturn))
-static void *keepalive_thread_func(void *arg)
+static void *bg_thread_func(void *arg)
 {
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
   int unit = 0;
+  uint32_t keepalive = cache_clock();
+  bool busy = false;
   while (1) {
-    sleep(30);
-    pthread_mutex_lock(&smbfs_data.keepalive_mutex);
-    DPRINTF1("Keepalive check unit=%d\r\n", unit);
-    if (rootsmb2[unit]) {
-      smb2_echo(rootsmb2[unit]);
+    if (bg_count == 0 || busy) {
+      usleep(100 * 1000);
+    }
+    PROF_ENTER(PROF_BG);
+    busy = bg_count > 0 && !bg_prefetch();
+    reval_run();                // 期限切れのまま返した一覧とファイル情報を読み直す
+    // 保持してから時間の経った書き込みをサーバに書き込む
+    for (int u = 0; u < smbfs_data.units && wb_total > 0; u++) {
+      wb_flush_bg(u);
+    }
+    // 監視しているディレクトリの変更の通知を受け取る
+    // (WCCMD_WAITなどでユニットのmutexを確保しているDOSコールは自分で応答を処理するので、
+    //  空くのを待たずに次のユニットに進む)
+    for (int u = 0; u < smbfs_data.units; u++) {
+      if (pthread_mutex_trylock(&smbfs_data.unit_mutex[u]) != 0) {
+        continue;
+      }
+      if (rootsmb2[u] && watch_rearm(u)) {
+        watch_poll(u, 0);
+      }
+      pthread_mutex_unlock(&smbfs_data.unit_mutex[u]);
+    }
+    if (cache_clock() - keepalive >= KEEPALIVE_INTERVAL) {
+      // 使用中のユニットは接続が生きているので、確認せずに次のユニットに進む
+      DPRINTF1("Keepalive check unit=%d\r\n", unit);
+      if (pthread_mutex_trylock(&smbfs_data.unit_mutex[unit]) == 0) {
+        if (rootsmb2[unit] && smb2_echo(rootsmb2[unit]) < 0 && replica[unit]) {
+          replica[unit]->down = true;   // 切り替えは次のDOSコールで行う
+        }
+        pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+      }
+      unit = (unit + 1) % smbfs_data.units;
+      keepalive = cache_clock();
     }
-    unit = (unit + 1) % smbfs_data.units;
-    pthread_mutex_unlock(&smbfs_data.keepalive_mutex);
+    PROF_LEAVE(PROF_BG);
   }
 }
 
@@ -1552,6 +4242,37 @@ static void *keepalive_thread_func(void *arg)
 // Device driver interrupt rountine
 //****************************************************************************
 
+// DOSコールが使うユニットのビットマスクを得る (全ドライブのアンマウントは全ユニットを使う)
+static uint32_t lock_units_for(struct dos_req_header *req)
+{
+  if ((req->command & 0x7f) == 0x55 && ((int)req->status >> 16) == SMBCMD_UNMOUNTALL) {
+    return (1 << MAXUNIT) - 1;
+  }
+  return req->unit < MAXUNIT ? 1 << req->unit : 0;
+}
+
+// ユニットのmutexを番号の小さい順に確保してからcache_mutexを確保する
+// (バックグラウンドスレッドも同じ順に確保するのでデッドロックしない)
+static void lock_units(uint32_t mask)
+{
+  for (int unit = 0; unit < MAXUNIT; unit++) {
+    if (mask & (1 << unit)) {
+      pthread_mutex_lock(&smbfs_data.unit_mutex[unit]);
+    }
+  }
+  pthread_mutex_lock(&smbfs_data.cache_mutex);
+}
+
+static void unlock_units(uint32_t mask)
+{
+  pthread_mutex_unlock(&smbfs_data.cache_mutex);
+  for (int unit = MAXUNIT - 1; unit >= 0; unit--) {
+    if (mask & (1 << unit)) {
+      pthread_mutex_unlock(&smbfs_data.unit_mutex[unit]);
+    }
+  }
+}
+
 int interrupt(void)
 {
   uint16_t err = 0;
@@ -1559,7 +4280,36 @@ int interrupt(void)
 
   DPRINTF2("----Command: 0x%02x\r\n", req->command);
 
-  pthread_mutex_lock(&smbfs_data.keepalive_mutex);
+  PROF_ENTER(PROF_DOSCALL);
+  uint32_t start = cache_clock();
+  trace_t tr;
+  bool tracing = trace_enabled;
+  if (tracing) {
+    trace_begin(req, &tr);
+  }
+  if (!watch_dirty && !reval_ready && op_fast(req)) {
+    cache_stats.fast_hits++;
+    procstat_account(req, start);
+    if (tracing) {
+      trace_end(req, &tr, true);
+    }
+    PROF_LEAVE(PROF_DOSCALL);
+    return 0;
+  }
+
+  uint32_t units = lock_units_for(req);
+  lock_units(units);
+  if (watch_dirty) {
+    watch_flush();              // 変更が通知されたディレクトリのキャッシュを捨てる
+  }
+  if (reval_ready) {
+    reval_apply();              // バックグラウンドで読み直した一覧とファイル情報を反映する
+  }
+
+  // 複製サーバへの接続が切れていたら他のサーバに切り替える
+  if (req->unit < MAXUNIT && replica[req->unit] && replica[req->unit]->down) {
+    replica_failover(req->unit);
+  }
 
   switch (req->command & 0x7f) {
   case 0x40: /* init */
@@ -1651,7 +4401,16 @@ int interrupt(void)
     err = 0x1003;  // 不正なコマンドコード
   }
 
-  pthread_mutex_unlock(&smbfs_data.keepalive_mutex);
+  if ((int32_t)req->status == _DOSE_ILGPARM) {
+    replica_check(req->unit);
+  }
+  procstat_account(req, start);
+  if (tracing) {
+    trace_end(req, &tr, false);
+  }
+
+  unlock_units(units);
+  PROF_LEAVE(PROF_DOSCALL);
 
   return err;
 }
@@ -1663,9 +4422,11 @@ int interrupt(void)
 void usage(void)
 {
   _dos_print(
-     "使用法: smbfs [/u<ドライブ数>] [/r]\r\n"
+     "使用法: smbfs [/u<ドライブ数>] [/c<キャッシュサイズ>] [/z<圧縮キャッシュサイズ>] [/r]\r\n"
      "オプション:\r\n"
      "    /u<ドライブ数>  - smbfsで利用するドライブ数を指定します (1-8)\r\n"
+     "    /c<キャッシュサイズ> - ファイルキャッシュのサイズをKB単位で指定します (0で無効)\r\n"
+     "    /z<圧縮キャッシュサイズ> - 追い出すページを圧縮して残すメモリをKB単位で指定します\r\n"
      "    /r              - 常駐しているsmbfsを常駐解除します\r\n"
     );
   _dos_exit2(1);
@@ -1680,6 +4441,7 @@ void start(struct dos_comline *cmdline)
 
   int units = 1;
   int release = 0;
+  int heapspec = 0;
   int arg;
 
   char *p = (char *)cmdline->buffer;
@@ -1712,11 +4474,26 @@ void start(struct dos_comline *cmdline)
           extern char *_HSTA, *_HEND;
           _heap_size = arg * 1024;
           _HEND =  _HSTA + _heap_size;
+          heapspec = 1;
           DPRINTF1("heap:%d\r\n", _heap_size);
         } else {
           usage();
         }
         break;
+      case 'c':
+        if (*p < '0' || *p > '9') {
+          usage();
+        }
+        cache_size = my_atoi(&p) * 1024;
+        DPRINTF1("cache:%d\r\n", cache_size);
+        break;
+      case 'z':
+        if (*p < '0' || *p > '9') {
+          usage();
+        }
+        zcache_size = my_atoi(&p) * 1024;
+        DPRINTF1("zcache:%d\r\n", zcache_size);
+        break;
       case 'r':
         release = 1;
         DPRINTF1("release\r\n");
@@ -1775,11 +4552,18 @@ void start(struct dos_comline *cmdline)
         _dos_exit();
       }
     }
+    if (r_smbfs_data->prof_hooked) {
+      _dos_print("プロファイラが割り込みをフックしているため常駐解除できません\r\n");
+      _dos_exit();
+    }
 
-    // Keepaliveスレッドを終了する
-    pthread_mutex_lock(&r_smbfs_data->keepalive_mutex);
-    pthread_cancel(r_smbfs_data->keepalive_thread);
-    pthread_join(r_smbfs_data->keepalive_thread, NULL);
+    // バックグラウンドスレッドを終了する
+    for (int i = 0; i < MAXUNIT; i++) {
+      pthread_mutex_lock(&r_smbfs_data->unit_mutex[i]);
+    }
+    pthread_mutex_lock(&r_smbfs_data->cache_mutex);
+    pthread_cancel(r_smbfs_data->bg_thread);
+    pthread_join(r_smbfs_data->bg_thread, NULL);
 
     // デバイスドライバのリンクリストからsmbfsを外す
     struct dos_devheader *prev = find_devheader(r_devheader);
@@ -1854,14 +4638,23 @@ void start(struct dos_comline *cmdline)
       _dos_exit();
     }
 
-    // Keepaliveスレッドを作成する
+    // ファイルキャッシュを初期化する
+    // (ヒープサイズの指定がなければキャッシュの分だけヒープを増やす)
+    if (!heapspec && cache_size > 0) {
+      extern char *_HSTA, *_HEND;
+      _heap_size += cache_size + zcache_size;
+      _HEND =  _HSTA + _heap_size;
+    }
+    cache_init(cache_size, zcache_size);
+
+    // バックグラウンドスレッドを作成する
     pthread_attr_t attr;
     pthread_attr_init(&attr);
-    pthread_attr_setname_np(&attr, "smbfs_keepalive");
+    pthread_attr_setname_np(&attr, "smbfs_bg");
     pthread_attr_setstacksize(&attr, 4 * 1024);
     pthread_attr_setsystemstacksize_np(&attr, 2 * 1024);
-    if (pthread_create(&smbfs_data.keepalive_thread, &attr, keepalive_thread_func, NULL) != 0) {
-      _dos_print("Keepaliveスレッドを作成できません\r\n");
+    if (pthread_create(&smbfs_data.bg_thread, &attr, bg_thread_func, NULL) != 0) {
+      _dos_print("バックグラウンドスレッドを作成できません\r\n");
       _dos_exit();
     }
 
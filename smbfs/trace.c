@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <x68k/dos.h>
+
+#include <humandefs.h>
+
+#include "smbfs.h"
+#include "cache.h"
+#include "trace.h"
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+volatile bool trace_enabled;            // 記録中
+
+//****************************************************************************
+// Local variables
+//****************************************************************************
+
+static trace_t *trace_ring;             // 記録用のリングバッファ
+static uint32_t trace_size;             // リングバッファの要素数
+static uint32_t trace_count;            // 記録したDOSコールの数 (上書きされたものを含む)
+
+//****************************************************************************
+// Recording
+//****************************************************************************
+
+// FNV-1aハッシュ
+static uint32_t trace_hash(uint32_t h, const char *s, int len)
+{
+  for (int i = 0; i < len && s[i] != '\0'; i++) {
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+// namestsのディレクトリ名とパス名のハッシュ値を得る
+static void trace_namests(int unit, struct dos_namestbuf *ns, trace_t *tr)
+{
+  uint32_t h = trace_hash(2166136261u ^ unit, (char *)ns->path, sizeof(ns->path));
+  tr->dir = h;
+  h = trace_hash(h, (char *)ns->name1, sizeof(ns->name1));
+  h = trace_hash(h, (char *)ns->name2, sizeof(ns->name2));
+  tr->path = trace_hash(h, (char *)ns->ext, sizeof(ns->ext));
+  if (memchr(ns->name1, '?', sizeof(ns->name1)) || memchr(ns->ext, '?', sizeof(ns->ext))) {
+    tr->flags |= TRF_WILD;
+  }
+}
+
+// DOSコールの処理前の状態を記録する
+void trace_begin(struct dos_req_header *req, trace_t *tr)
+{
+  memset(tr, 0, sizeof(*tr));
+  tr->time = cache_clock();
+  tr->unit = req->unit;
+  tr->cmd = req->command & 0x7f;
+  tr->atr = req->attr;
+
+  switch (tr->cmd) {
+  case 0x44: /* rename */
+  {
+    trace_t tn;
+    trace_namests(req->unit, (struct dos_namestbuf *)req->status, &tn);
+    tr->arg = tn.path;
+  }
+    /* fall through */
+  case 0x41: /* chdir */
+  case 0x42: /* mkdir */
+  case 0x43: /* rmdir */
+  case 0x45: /* remove */
+  case 0x46: /* chmod */
+    trace_namests(req->unit, req->addr, tr);
+    break;
+  case 0x47: /* files */
+    trace_namests(req->unit, req->addr, tr);
+    tr->arg = req->status;
+    break;
+  case 0x48: /* nfiles */
+    tr->arg = req->status;
+    break;
+  case 0x49: /* create */
+  case 0x4a: /* open */
+    trace_namests(req->unit, req->addr, tr);
+    tr->arg = (uint32_t)req->fcb;
+    break;
+  case 0x4c: /* read */
+  case 0x4d: /* write */
+    tr->len = req->status;
+    /* fall through */
+  case 0x4b: /* close */
+  case 0x4f: /* filedate */
+    tr->arg = (uint32_t)req->fcb;
+    tr->offset = dos_fcb_fpos(req->fcb);
+    break;
+  }
+}
+
+// DOSコールの処理結果を記録する
+void trace_end(struct dos_req_header *req, trace_t *tr, bool fast)
+{
+  if (trace_ring == NULL) {
+    return;
+  }
+  tr->result = req->status;
+  if (fast) {
+    tr->flags |= TRF_FAST;
+  }
+  if (tr->arg != 0 && tr->cmd >= 0x49 && tr->cmd != 0x4e) {
+    tr->size = dos_fcb_size(req->fcb);
+  }
+  trace_ring[trace_count % trace_size] = *tr;
+  trace_count++;
+}
+
+// 記録を開始する (記録済みのトレースは消去する)
+int trace_start(uint32_t nrec)
+{
+  trace_enabled = false;
+  trace_clear();
+  if (nrec == 0 || nrec > TRACE_MAX) {
+    return -EINVAL;
+  }
+  if ((trace_ring = malloc(nrec * sizeof(trace_t))) == NULL) {
+    return -ENOMEM;
+  }
+  trace_size = nrec;
+  trace_enabled = true;
+  return 0;
+}
+
+// 記録を終了する (記録したトレースは保存するまで残す)
+void trace_stop(void)
+{
+  trace_enabled = false;
+}
+
+// 記録したトレースを消去してメモリを解放する
+void trace_clear(void)
+{
+  trace_enabled = false;
+  free(trace_ring);
+  trace_ring = NULL;
+  trace_size = 0;
+  trace_count = 0;
+}
+
+//****************************************************************************
+// Save
+//****************************************************************************
+
+static void trace_put32(uint8_t **p, uint8_t *end, uint32_t v)
+{
+  for (int i = 24; i >= 0; i -= 8) {
+    if (*p < end) {
+      **p = v >> i;
+    }
+    (*p)++;
+  }
+}
+
+// 記録したトレースを古い順に保存形式で書き出す (必要なバイト数を返す)
+// 形式 (数値はすべてビッグエンディアン):
+//   TRACE_MAGIC(8), 時刻の単位(Hz), 記録数, 上書きされて失われた記録数,
+//   { 時刻, unit<<24|cmd<<16|flags<<8|atr, path, dir, arg, offset, len, size, result } * 記録数
+size_t trace_save(void *buf, size_t len)
+{
+  uint8_t *p = buf;
+  uint8_t *end = p + len;
+  if (len >= 8) {
+    memcpy(p, TRACE_MAGIC, 8);
+  }
+  p += 8;
+
+  uint32_t n = trace_count < trace_size ? trace_count : trace_size;
+  trace_put32(&p, end, 100);
+  trace_put32(&p, end, n);
+  trace_put32(&p, end, trace_count - n);
+  for (uint32_t i = trace_count - n; i < trace_count; i++) {
+    trace_t *tr = &trace_ring[i % trace_size];
+    trace_put32(&p, end, tr->time);
+    trace_put32(&p, end, (tr->unit << 24) | (tr->cmd << 16) | (tr->flags << 8) | tr->atr);
+    trace_put32(&p, end, tr->path);
+    trace_put32(&p, end, tr->dir);
+    trace_put32(&p, end, tr->arg);
+    trace_put32(&p, end, tr->offset);
+    trace_put32(&p, end, tr->len);
+    trace_put32(&p, end, tr->size);
+    trace_put32(&p, end, tr->result);
+  }
+  return p - (uint8_t *)buf;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <humandefs.h>
+
+//****************************************************************************
+// Definitions
+//****************************************************************************
+
+#define TRACE_MAGIC       "SMBFSTR1"    // 保存形式の識別子
+#define TRACE_MAX         16384         // 記録できるDOSコール数の上限
+
+#define TRF_FAST          0x01          // mutexを確保せずキャッシュだけで処理した
+#define TRF_WILD          0x02          // ファイル名にワイルドカードを含む
+
+// 記録する1回のDOSコール
+typedef struct {
+  uint32_t time;                // 時刻 (1/100秒)
+  uint8_t unit;
+  uint8_t cmd;                  // コマンドコード (0x41-0x58)
+  uint8_t flags;                // TRF_*
+  uint8_t atr;                  // 検索属性/ファイル属性
+  uint32_t path;                // パス名のハッシュ値
+  uint32_t dir;                 // ディレクトリ名のハッシュ値
+  uint32_t arg;                 // FCB/FILBUFのアドレス (renameでは変更後のパス名のハッシュ値)
+  uint32_t offset;              // read/writeの開始位置
+  uint32_t len;                 // read/writeの要求バイト数
+  uint32_t size;                // ファイルサイズ
+  int32_t result;               // 処理結果
+} trace_t;
+
+//****************************************************************************
+// Global variables
+//****************************************************************************
+
+extern volatile bool trace_enabled;
+
+//****************************************************************************
+// Function prototypes
+//****************************************************************************
+
+// DOSコールのトレース記録 (キャッシュシミュレータ smbsim.py の入力にする)
+// trace_begin()で処理前の状態を、trace_end()で処理結果を記録する
+
+void trace_begin(struct dos_req_header *req, trace_t *tr);
+void trace_end(struct dos_req_header *req, trace_t *tr, bool fast);
+int trace_start(uint32_t nrec);
+void trace_stop(void);
+void trace_clear(void);
+size_t trace_save(void *buf, size_t len);
+
+#endif /* _TRACE_H_ */
@@ -46,6 +46,9 @@
 
 #define PATH_LEN 256
 
+// 1/100秒単位の時間を"%u.%02u"で表示するための引数
+#define AGE_SEC(t)  (unsigned int)((t) / 100), (unsigned int)((t) % 100)
+
 //****************************************************************************
 // Global variables
 //****************************************************************************
@@ -230,26 +233,110 @@ static void usage(void)
     "使用法: smbmount <smb2-url> [drive:] [options]\n"
     "        smbmount -D [-a] [drive:]\n"
     "        smbumount [-a] [drive:]\n"
+    "        smbmount -S [-p] [drive:]\n"
+    "        smbmount -T [drive:]\n"
+    "        smbmount -H save|load <file> [drive:]\n"
+    "        smbmount -Q <path>\n"
+    "        smbmount -W <dir> [<sec>]\n"
+    "        smbmount -P start|stop|save <file> [drive:]\n"
+    "        smbmount -R start [<count>]|stop|save <file>|clear [drive:]\n"
     "オプション:\n"
     "    -U <username[%password]>   - 接続時のユーザ名とパスワードを指定\n"
     "    -N                         - パスワードをユーザに問い合わせない\n"
+    "    -V <version>               - 使用するSMBのバージョンを指定 (2, 2.02, 2.1, 3, 3.0, 3.02, 3.1.1)\n"
+    "    -A                         - ZIP/LZHファイルを読み出し専用のディレクトリとして見せる\n"
+    "    -s                         - 期限切れのディレクトリ一覧とファイル情報を返してから読み直す\n"
+    "    -w                         - 読み書き用に開いたファイルへの書き込みをメモリに保持する\n"
+    "    -T                         - 接続にかかった時間の内訳を表示\n"
     "    -D                         - マウントを解除\n"
-    "    -a                         - 全ドライブのマウントを解除\n\n"
+    "    -a                         - 全ドライブのマウントを解除\n"
+    "    -S                         - ファイルキャッシュの統計情報を表示\n"
+    "    -p                         - (-Sと共に指定) プロセスごとの統計情報を表示\n"
+    "    -H save|load <file>        - 起動履歴をファイルに保存/ファイルから読み込み\n"
+    "    -Q <path>                  - パス名についてキャッシュされている情報を表示\n"
+    "    -W <dir> [<sec>]           - ディレクトリの内容が変更されるまで待つ (秒数省略時はキー入力まで)\n"
+    "    -P start|stop|save <file>  - プロファイラの開始/終了/結果のファイルへの保存\n"
+    "    -R start [<count>]|stop|save <file>|clear\n"
+    "                               - DOSコールのトレース記録の開始/終了/ファイルへの保存/消去\n\n"
     "URL フォーマット:\n"
-    "    [smb://][<domain>;][<username>@]<host>[:<port>]/<share>[/<path>]\n\n"
+    "    [smb://][<domain>;][<username>@]<host>[:<port>][,<host>[:<port>]...]/<share>[/<path>]\n\n"
     "環境変数 NTLM_USER_FILE で指定したファイルがユーザ情報に使用されます\n"
   );
 }
 
+// 接続処理の所要時間を表示する
+static int show_conntime(int drive)
+{
+  static const char *phase[] = {
+    "TCP connect:    ",
+    "Negotiate:      ",
+    "Session/Tree:   ",
+    "Total:          ",
+  };
+  struct smbcmd_conntime ct;
+  if (_dos_ioctrlfdctl(drive, SMBCMD_GETCONNTIME, (void *)&ct) < 0) {
+    printf("ドライブ %c: の接続時間の情報が得られません\n", 'A' + drive - 1);
+    return -1;
+  }
+  printf("Dialect:        %x.%02x\n", ct.dialect >> 8, ct.dialect & 0xff);
+  for (int i = 0; i <= CONNPHASE_TOTAL; i++) {
+    printf("%s%u.%02u sec (CPU %u.%02u sec)\n",
+           phase[i], AGE_SEC(ct.time[i]), AGE_SEC(ct.cpu[i]));
+  }
+  return 0;
+}
+
+// -Vで指定するSMBのバージョン (libsmb2のURLの"vers="に渡す)
+static const char *smb_version(const char *ver)
+{
+  static const char *versions[] = {
+    "2", "2.02", "2.10", "3", "3.0", "3.02", "3.1.1", NULL
+  };
+  if (strcmp(ver, "2.1") == 0) {
+    return "2.10";
+  }
+  for (int i = 0; versions[i] != NULL; i++) {
+    if (strcmp(ver, versions[i]) == 0) {
+      return versions[i];
+    }
+  }
+  return NULL;
+}
+
 //****************************************************************************
 // Main program
 //****************************************************************************
 
+// URLに引数を追加する
+static void url_addarg(char *url, const char *name, const char *value)
+{
+  strncat(url, strchr(url, '?') ? "&" : "?", PATH_LEN - strlen(url) - 1);
+  strncat(url, name, PATH_LEN - strlen(url) - 1);
+  strncat(url, value, PATH_LEN - strlen(url) - 1);
+}
+
 int main(int argc, char **argv)
 {
   int unmount_mode = 0;
   int nopass_mode = 0;
   int meminfo_mode = 0;
+  int stats_mode = 0;
+  int procs_mode = 0;
+  int conntime_mode = 0;
+  const char *version = NULL;
+  int archive_mode = 0;
+  int stale_mode = 0;
+  int writeback_mode = 0;
+  char *history_cmd = NULL;
+  char *history_file = NULL;
+  char *query_path = NULL;
+  char *watch_path = NULL;
+  int watch_sec = -1;
+  char *profile_cmd = NULL;
+  char *profile_file = NULL;
+  char *trace_cmd = NULL;
+  char *trace_file = NULL;
+  uint32_t trace_count = 4096;
   int all_mode = 0;
   int url_index = 0;
   int drvarg = 0;         // 0=最初のSMBFSドライブ 1=A: 2=B: ...
@@ -270,6 +357,76 @@ int main(int argc, char **argv)
       nopass_mode = 1;
     } else if (strcmp(argv[i], "-M") == 0) {
       meminfo_mode = 1;
+    } else if (strcmp(argv[i], "-S") == 0) {
+      stats_mode = 1;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      procs_mode = 1;
+    } else if (strcmp(argv[i], "-T") == 0) {
+      conntime_mode = 1;
+    } else if (strcmp(argv[i], "-A") == 0) {
+      archive_mode = 1;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      stale_mode = 1;
+    } else if (strcmp(argv[i], "-w") == 0) {
+      writeback_mode = 1;
+    } else if (strcmp(argv[i], "-V") == 0) {
+      if (i + 1 >= argc || (version = smb_version(argv[++i])) == NULL) {
+        usage();
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "-H") == 0) {
+      if (i + 2 < argc &&
+          (strcmp(argv[i + 1], "save") == 0 || strcmp(argv[i + 1], "load") == 0)) {
+        history_cmd = argv[++i];
+        history_file = argv[++i];
+      } else {
+        usage();
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "-P") == 0) {
+      if (i + 1 < argc &&
+          (strcmp(argv[i + 1], "start") == 0 || strcmp(argv[i + 1], "stop") == 0)) {
+        profile_cmd = argv[++i];
+      } else if (i + 2 < argc && strcmp(argv[i + 1], "save") == 0) {
+        profile_cmd = argv[++i];
+        profile_file = argv[++i];
+      } else {
+        usage();
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "-R") == 0) {
+      if (i + 1 < argc && strcmp(argv[i + 1], "start") == 0) {
+        trace_cmd = argv[++i];
+        if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+          trace_count = atoi(argv[++i]);
+        }
+      } else if (i + 1 < argc &&
+                 (strcmp(argv[i + 1], "stop") == 0 || strcmp(argv[i + 1], "clear") == 0)) {
+        trace_cmd = argv[++i];
+      } else if (i + 2 < argc && strcmp(argv[i + 1], "save") == 0) {
+        trace_cmd = argv[++i];
+        trace_file = argv[++i];
+      } else {
+        usage();
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "-Q") == 0) {
+      if (i + 1 < argc) {
+        query_path = argv[++i];
+      } else {
+        usage();
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "-W") == 0) {
+      if (i + 1 < argc) {
+        watch_path = argv[++i];
+        if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+          watch_sec = atoi(argv[++i]);
+        }
+      } else {
+        usage();
+        exit(1);
+      }
     } else if (strcmp(argv[i], "-U") == 0) {
       if (i + 1 < argc) {
         username = argv[++i];
@@ -295,6 +452,17 @@ int main(int argc, char **argv)
     }
   }
 
+  // -Q,-Wではパス名のドライブを対象にする
+  struct dos_nameckbuf nameck;
+  if (query_path || watch_path) {
+    const char *p = query_path ? query_path : watch_path;
+    if (_dos_nameck(p, &nameck) < 0) {
+      printf("%s はパス名として正しくありません\n", p);
+      exit(1);
+    }
+    drvarg = toupper((unsigned char)nameck.drive[0]) - 'A' + 1;
+  }
+
   // ドライブ指定をチェック (指定がなければ drive=最初のSMBFSドライブ)
   int drive = get_smbfs_drive(drvarg);
   if (drive < 0) {
@@ -316,6 +484,369 @@ int main(int argc, char **argv)
     exit(0);
   }
 
+  ////////////////////////////////////////////////////////////////////////////
+  // ファイルキャッシュの統計情報表示
+
+  if (stats_mode && procs_mode) {
+    struct smbcmd_procstat procs[32];
+    struct smbcmd_getprocstats st = {
+      .procs_len = sizeof(procs) / sizeof(procs[0]),
+      .procs = procs,
+    };
+    if (_dos_ioctrlfdctl(drive, SMBCMD_GETPROCSTATS, (void *)&st) < 0) {
+      printf("常駐しているSMBFSはプロセスごとの統計情報に対応していません\n");
+      exit(1);
+    }
+    int n = st.nprocs < st.procs_len ? st.nprocs : st.procs_len;
+    printf("PSP       Name                     Requests      Bytes     Time      Idle\n");
+    for (int i = 0; i < n; i++) {
+      printf("%08x  %-23s %9u %10u %5u.%02u %6u.%02u\n",
+             (unsigned int)procs[i].psp, procs[i].name,
+             (unsigned int)procs[i].requests, (unsigned int)procs[i].bytes,
+             AGE_SEC(procs[i].time), AGE_SEC(procs[i].age));
+    }
+    exit(0);
+  }
+
+  if (stats_mode) {
+    struct smbcmd_getstats stats = { .size = sizeof(stats) };  // ドライバが返さない項目は0のまま
+    if (_dos_ioctrlfdctl(drive, SMBCMD_GETSTATS, (void *)&stats) < 0) {
+      printf("常駐しているSMBFSは統計情報に対応していません\n");
+      exit(1);
+    }
+    unsigned int reads = stats.read_hits + stats.read_misses;
+    printf("Cache size:      %u/%u pages (%u bytes/page)\n",
+           (unsigned int)stats.cache_pages, (unsigned int)stats.cache_budget,
+           (unsigned int)stats.page_size);
+    printf("Read hits:       %u/%u (%u%%)\n",
+           (unsigned int)stats.read_hits, reads,
+           reads ? (unsigned int)(stats.read_hits * 100ULL / reads) : 0);
+    printf("Hit bytes:       %u bytes\n", (unsigned int)stats.hit_bytes);
+    printf("Prefetch used:   %u/%u pages (%u%%)\n",
+           (unsigned int)stats.prefetch_used, (unsigned int)stats.prefetch_issued,
+           stats.prefetch_issued ?
+             (unsigned int)(stats.prefetch_used * 100ULL / stats.prefetch_issued) : 0);
+    printf("Evicted:         %u pages\n", (unsigned int)stats.evicted);
+    printf("Lock-free hits:  %u (retried %u)\n",
+           (unsigned int)stats.fast_hits, (unsigned int)stats.fast_retries);
+    if (stats.zcache_budget > 0) {
+      printf("Compressed:      %u pages, %u/%u bytes\n",
+             (unsigned int)stats.zcache_pages, (unsigned int)stats.zcache_bytes,
+             (unsigned int)stats.zcache_budget);
+      printf("Compressed hits: %u (stored %u, skipped %u)\n",
+             (unsigned int)stats.zhits, (unsigned int)stats.zstored,
+             (unsigned int)stats.zskipped);
+    }
+    if (stats.stride_records > 0) {
+      printf("Stride prefetch: %u records (backed off %u times)\n",
+             (unsigned int)stats.stride_records, (unsigned int)stats.stride_backoffs);
+    }
+    if (stats.wb_absorbed > 0) {
+      printf("Write-back:      %u writes held, %u flushes, %u pages pending\n",
+             (unsigned int)stats.wb_absorbed, (unsigned int)stats.wb_flushed,
+             (unsigned int)stats.wb_pages);
+    }
+    if (stats.stale_hits > 0) {
+      printf("Stale hits:      %u (revalidated %u)\n",
+             (unsigned int)stats.stale_hits, (unsigned int)stats.revalidated);
+    }
+    exit(0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // パス名のキャッシュ情報表示
+
+  if (query_path) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s%s", nameck.path, nameck.name, nameck.ext);
+    struct smbcmd_querycache q = {
+      .path = path,
+      .pages_len = 0,
+      .pages = NULL,
+    };
+    if (_dos_ioctrlfdctl(drive, SMBCMD_QUERYCACHE, (void *)&q) < 0) {
+      printf("ドライブ %c: のキャッシュ情報が得られません\n", 'A' + drive - 1);
+      exit(1);
+    }
+    if (q.npages > 0) {
+      q.pages_len = q.npages;
+      if ((q.pages = malloc(q.pages_len * sizeof(*q.pages))) == NULL) {
+        printf("メモリが不足しています\n");
+        exit(1);
+      }
+      _dos_ioctrlfdctl(drive, SMBCMD_QUERYCACHE, (void *)&q);
+      if (q.npages > q.pages_len) {
+        q.npages = q.pages_len;   // 2回の呼び出しの間にページが増えた
+      }
+    }
+
+    printf("Path:            %c:%s\n", 'A' + drive - 1, path);
+    if (!(q.flags & QC_STAT)) {
+      printf("Stat cache:      none\n");
+    } else if (q.flags & QC_NEGATIVE) {
+      printf("Stat cache:      not found (negative), age %u.%02us%s\n",
+             AGE_SEC(q.stat_age), (q.flags & QC_STAT_FRESH) ? "" : " (expired)");
+    } else {
+      printf("Stat cache:      atr 0x%02x, age %u.%02us%s\n",
+             q.stat_atr, AGE_SEC(q.stat_age), (q.flags & QC_STAT_FRESH) ? "" : " (expired)");
+    }
+    printf("Parent listing:  %s\n", (q.flags & QC_LISTED) ? "listed" : "none");
+    if (q.flags & QC_DIRLIST) {
+      printf("Dir listing:     %u entries%s, age %u.%02us\n",
+             (unsigned int)q.dir_nent,
+             (q.flags & QC_DIRLIST_COMPLETE) ? "" : " (partial)", AGE_SEC(q.dir_age));
+    } else {
+      printf("Dir listing:     none\n");
+    }
+    if (q.flags & QC_FILE) {
+      unsigned int total = (q.file_size + q.page_size - 1) / q.page_size;
+      printf("Page cache:      %u/%u pages resident (%u%%), size %u bytes, checked %u.%02us ago%s\n",
+             (unsigned int)q.npages, total,
+             total ? (unsigned int)(q.npages * 100ULL / total) : 0,
+             (unsigned int)q.file_size, AGE_SEC(q.file_age), (q.flags & QC_FILE_FRESH) ? "" : " (expired)");
+      printf("Pinned:          %s (%u open)\n",
+             (q.flags & QC_PINNED) ? "yes" : "no", (unsigned int)q.file_refs);
+    } else {
+      printf("Page cache:      none\n");
+    }
+    printf("Lease:           none (cached data is trusted for %u.%02us)\n", AGE_SEC(q.ttl));
+    if (q.npages > 0) {
+      printf("\n    page     offset   len      age  flags\n");
+      for (int i = 0; i < q.npages; i++) {
+        struct smbcmd_qcpage *qp = &q.pages[i];
+        printf("%8u %10u %5u %5u.%02us  %s%s%s\n",
+               (unsigned int)qp->pageno, (unsigned int)(qp->pageno * q.page_size),
+               qp->len, AGE_SEC(qp->age),
+               (qp->flags & QCP_REF) ? "R" : "-",
+               (qp->flags & QCP_PREFETCHED) ? "P" : "-",
+               (qp->flags & QCP_COMPRESSED) ? "Z" : "-");
+      }
+    }
+    free(q.pages);
+    exit(0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // ディレクトリの変更待ち
+
+  if (watch_path) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s%s%s", nameck.path, nameck.name, nameck.ext);
+    struct smbcmd_waitchange wc = {
+      .cmd = WCCMD_REGISTER,
+      .path = path,
+      .filter = WCF_DEFAULT,
+      .subtree = 0,
+    };
+    int res = _dos_ioctrlfdctl(drive, SMBCMD_WAITCHANGE, (void *)&wc);
+    if (res < 0) {
+      printf("%c:%s の変更を監視できません (%d)\n", 'A' + drive - 1, path, res);
+      exit(1);
+    }
+
+    // キー入力があれば中断できるよう、1回のWAITは1秒までにする
+    uint32_t left = watch_sec < 0 ? UINT32_MAX : watch_sec * 100;
+    wc.cmd = WCCMD_WAIT;
+    wc.changes = 0;
+    while (left > 0 && wc.changes == 0) {
+      if (_dos_keysns()) {
+        _dos_inkey();
+        break;
+      }
+      wc.timeout = left < 100 ? left : 100;
+      if ((res = _dos_ioctrlfdctl(drive, SMBCMD_WAITCHANGE, (void *)&wc)) < 0) {
+        break;
+      }
+      if (watch_sec >= 0) {
+        left -= wc.timeout;
+      }
+    }
+
+    wc.cmd = WCCMD_CANCEL;
+    _dos_ioctrlfdctl(drive, SMBCMD_WAITCHANGE, (void *)&wc);
+    if (res < 0) {
+      printf("%c:%s の変更の通知を受けられません (%d)\n", 'A' + drive - 1, path, res);
+      exit(1);
+    } else if (wc.changes == 0) {
+      printf("%c:%s は変更されませんでした\n", 'A' + drive - 1, path);
+      exit(1);
+    }
+    printf("%c:%s が変更されました (%u)\n", 'A' + drive - 1, path, (unsigned int)wc.changes);
+    exit(0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // プロファイラの制御
+
+  if (profile_cmd) {
+    struct smbcmd_profile prof = {
+      .buf_len = 0,
+      .buf = NULL,
+    };
+    int res;
+    if (strcmp(profile_cmd, "start") == 0) {
+      prof.cmd = PROFCMD_START;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_PROFILE, (void *)&prof);
+      if (res == 0) {
+        printf("プロファイラを開始しました\n");
+      }
+    } else if (strcmp(profile_cmd, "stop") == 0) {
+      prof.cmd = PROFCMD_STOP;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_PROFILE, (void *)&prof);
+      if (res == -EBUSY) {
+        printf("他のプログラムが割り込みをフックしているため、フックを残してプロファイラを終了しました\n");
+        exit(0);
+      } else if (res == 0) {
+        printf("プロファイラを終了しました\n");
+      }
+    } else {
+      FILE *fp;
+      prof.cmd = PROFCMD_GET;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_PROFILE, (void *)&prof);
+      if (res == 0) {
+        // 計測中ならサンプルが増えるので余裕を持たせる
+        size_t len = prof.buf_len + 256 * 8;
+        if ((prof.buf = malloc(len)) == NULL) {
+          printf("メモリが不足しています\n");
+          exit(1);
+        }
+        prof.buf_len = len;
+        _dos_ioctrlfdctl(drive, SMBCMD_PROFILE, (void *)&prof);
+        if (prof.buf_len > len) {
+          printf("プロファイラを終了してから保存してください\n");
+          exit(1);
+        }
+        if ((fp = fopen(profile_file, "wb")) == NULL ||
+            fwrite(prof.buf, 1, prof.buf_len, fp) != prof.buf_len) {
+          printf("%s に書き込めません\n", profile_file);
+          exit(1);
+        }
+        fclose(fp);
+        printf("プロファイル結果を %s に保存しました\n", profile_file);
+      }
+    }
+    if (res < 0) {
+      printf("常駐しているSMBFSはプロファイラ付きでビルドされていません\n");
+      exit(1);
+    }
+    exit(0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // トレース記録の制御
+
+  if (trace_cmd) {
+    struct smbcmd_trace trace = {
+      .nrec = trace_count,
+      .buf_len = 0,
+      .buf = NULL,
+    };
+    int res;
+    if (strcmp(trace_cmd, "start") == 0) {
+      trace.cmd = TRACECMD_START;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_TRACE, (void *)&trace);
+      if (res == -ENOMEM) {
+        printf("常駐部のメモリが不足しています\n");
+        exit(1);
+      } else if (res == -EINVAL) {
+        printf("記録数の指定が正しくありません\n");
+        exit(1);
+      } else if (res == 0) {
+        printf("トレースの記録を開始しました (%u 回分)\n", (unsigned int)trace_count);
+      }
+    } else if (strcmp(trace_cmd, "stop") == 0) {
+      trace.cmd = TRACECMD_STOP;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_TRACE, (void *)&trace);
+      if (res == 0) {
+        printf("トレースの記録を終了しました\n");
+      }
+    } else if (strcmp(trace_cmd, "clear") == 0) {
+      trace.cmd = TRACECMD_CLEAR;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_TRACE, (void *)&trace);
+      if (res == 0) {
+        printf("トレースを消去しました\n");
+      }
+    } else {
+      FILE *fp;
+      trace.cmd = TRACECMD_GET;
+      res = _dos_ioctrlfdctl(drive, SMBCMD_TRACE, (void *)&trace);
+      if (res == 0) {
+        // 記録中ならDOSコールが増えるので余裕を持たせる (1回分は36バイト)
+        size_t len = trace.buf_len + 64 * 36;
+        if ((trace.buf = malloc(len)) == NULL) {
+          printf("メモリが不足しています\n");
+          exit(1);
+        }
+        trace.buf_len = len;
+        _dos_ioctrlfdctl(drive, SMBCMD_TRACE, (void *)&trace);
+        if (trace.buf_len > len) {
+          printf("トレースの記録を終了してから保存してください\n");
+          exit(1);
+        }
+        if ((fp = fopen(trace_file, "wb")) == NULL ||
+            fwrite(trace.buf, 1, trace.buf_len, fp) != trace.buf_len) {
+          printf("%s に書き込めません\n", trace_file);
+          exit(1);
+        }
+        fclose(fp);
+        printf("トレースを %s に保存しました\n", trace_file);
+      }
+    }
+    if (res < 0) {
+      printf("常駐しているSMBFSはトレースの記録に対応していません\n");
+      exit(1);
+    }
+    exit(0);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////
+  // 起動履歴の保存/読み込み
+
+  if (history_cmd) {
+    struct smbcmd_history hist;
+    FILE *fp;
+    if (strcmp(history_cmd, "save") == 0) {
+      hist.buf_len = 0;
+      hist.buf = NULL;
+      if (_dos_ioctrlfdctl(drive, SMBCMD_GETHISTORY, (void *)&hist) < 0) {
+        printf("常駐しているSMBFSは起動履歴に対応していません\n");
+        exit(1);
+      }
+      if ((hist.buf = malloc(hist.buf_len)) == NULL) {
+        printf("メモリが不足しています\n");
+        exit(1);
+      }
+      _dos_ioctrlfdctl(drive, SMBCMD_GETHISTORY, (void *)&hist);
+      if ((fp = fopen(history_file, "wb")) == NULL ||
+          fwrite(hist.buf, 1, hist.buf_len, fp) != hist.buf_len) {
+        printf("%s に書き込めません\n", history_file);
+        exit(1);
+      }
+      fclose(fp);
+      printf("起動履歴を %s に保存しました\n", history_file);
+    } else {
+      if ((fp = fopen(history_file, "rb")) == NULL) {
+        printf("%s が開けません\n", history_file);
+        exit(1);
+      }
+      fseek(fp, 0, SEEK_END);
+      hist.buf_len = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+      if ((hist.buf = malloc(hist.buf_len)) == NULL) {
+        printf("メモリが不足しています\n");
+        exit(1);
+      }
+      if (fread(hist.buf, 1, hist.buf_len, fp) != hist.buf_len ||
+          _dos_ioctrlfdctl(drive, SMBCMD_SETHISTORY, (void *)&hist) < 0) {
+        printf("%s は起動履歴ファイルではありません\n", history_file);
+        exit(1);
+      }
+      fclose(fp);
+      printf("起動履歴を %s から読み込みました\n", history_file);
+    }
+    exit(0);
+  }
+
   ////////////////////////////////////////////////////////////////////////////
   // アンマウント処理
 
@@ -362,6 +893,20 @@ int main(int argc, char **argv)
   if (url_index != 0) {
     convert_path_separator(argv[url_index]);
     char *normalized_url = normalize_smb_url(argv[url_index]);
+    if (version) {
+      // SMBのバージョンはURLの引数としてlibsmb2に渡す
+      url_addarg(normalized_url, "vers=", version);
+    }
+    if (archive_mode) {
+      // smbfsのオプションもURLの引数として渡す (smbfsが取り除いてからlibsmb2に渡す)
+      url_addarg(normalized_url, "archive", "");
+    }
+    if (stale_mode) {
+      url_addarg(normalized_url, "stale", "");
+    }
+    if (writeback_mode) {
+      url_addarg(normalized_url, "writeback", "");
+    }
 
     char username_buf[64];
     username_buf[0] = '\0';
@@ -417,9 +962,19 @@ int main(int argc, char **argv)
     }
 
     printf("ドライブ %c: にSMBFSをマウントしました\n", 'A' + drive - 1);
+    if (conntime_mode) {
+      show_conntime(drive);
+    }
     exit(0);
   }
 
+  ////////////////////////////////////////////////////////////////////////////
+  // 接続時間の表示
+
+  if (conntime_mode) {
+    exit(show_conntime(drive) < 0 ? 1 : 0);
+  }
+
   ////////////////////////////////////////////////////////////////////////////
   // マウント状態の表示
 
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+#
+# smbprof.py - Symbolize smbfs sampling profiler output
+# 
+# Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+#
+# The MIT License (MIT)
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+#
+# smbmount -P save (または bench -p) で保存したプロファイル結果を
+# リンク時の .map ファイルで関数ごとに集計してフラットプロファイルを表示する
+#
+# 使用法: smbprof.py <profile> <mapfile> [-n <行数>] [-a]
+#   -n <行数>  表示する関数の数 (省略時は 30)
+#   -a         関数の中のアドレスごとのサンプル数も表示する
+#
+
+import sys
+import re
+import struct
+import bisect
+import argparse
+
+MAGIC = b'SMBFSPF1'
+ANCHOR = 'prof_save'
+
+def load_profile(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+    if data[:8] != MAGIC:
+        sys.exit(f'{filename}: not a smbfs profile')
+    hz, samples, dropped, anchor, nent = struct.unpack_from('>5I', data, 8)
+    pcs = {}
+    for i in range(nent):
+        pc, count = struct.unpack_from('>2I', data, 28 + i * 8)
+        pcs[pc] = pcs.get(pc, 0) + count
+    return hz, samples, dropped, anchor, pcs
+
+# .map ファイルから関数のアドレスを得る
+# -ffunction-sections でビルドしていれば static 関数も .text.<関数名> の入力セクションとして現れる
+def load_map(filename):
+    sections = []       # (開始アドレス, サイズ, 名前, オブジェクト)
+    symbols = {}        # アドレス -> 名前
+    re_sec = re.compile(r'^ (\.text(?:\.\S+)?)(?:\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(.*))?$')
+    re_cont = re.compile(r'^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(.*)$')
+    re_sym = re.compile(r'^\s+0x([0-9a-fA-F]+)\s+([A-Za-z_.$][\w.$]*)\s*$')
+    pending = None
+    with open(filename, errors='replace') as f:
+        for line in f:
+            line = line.rstrip('\n')
+            if pending:
+                m = re_cont.match(line)
+                if m:
+                    sections.append((int(m.group(1), 16), int(m.group(2), 16), pending, m.group(3)))
+                pending = None
+                continue
+            m = re_sec.match(line)
+            if m:
+                if m.group(2) is None:
+                    pending = m.group(1)        # 名前が長いと次の行に続く
+                else:
+                    sections.append((int(m.group(2), 16), int(m.group(3), 16), m.group(1), m.group(4)))
+                continue
+            m = re_sym.match(line)
+            if m:
+                symbols[int(m.group(1), 16)] = m.group(2)
+
+    funcs = {}
+    for addr, size, name, obj in sections:
+        if size == 0:
+            continue
+        obj = re.sub(r'^.*/', '', obj)
+        if name.startswith('.text.'):
+            funcs.setdefault(addr, (name[6:], size, obj))
+        # 入力セクションの中の大域シンボル
+        for a, s in symbols.items():
+            if addr <= a < addr + size:
+                funcs[a] = (s, addr + size - a, obj)
+    anchor = next((a for a, s in symbols.items() if s == ANCHOR), None)
+    if anchor is None:
+        anchor = next((a for a, (s, _, _) in funcs.items() if s == ANCHOR), None)
+    return sorted((a, s, sz, o) for a, (s, sz, o) in funcs.items()), anchor
+
+def main():
+    ap = argparse.ArgumentParser(description='Symbolize smbfs sampling profile')
+    ap.add_argument('profile')
+    ap.add_argument('mapfile')
+    ap.add_argument('-n', type=int, default=30, help='number of functions to show')
+    ap.add_argument('-a', action='store_true', help='show samples per address')
+    args = ap.parse_args()
+
+    hz, samples, dropped, anchor_rt, pcs = load_profile(args.profile)
+    funcs, anchor_map = load_map(args.mapfile)
+    if anchor_map is None:
+        sys.exit(f'{args.mapfile}: symbol {ANCHOR} not found (build with PROFILE=1)')
+    reloc = anchor_rt - anchor_map      # 実行時のアドレスとリンク時のアドレスの差
+
+    starts = [f[0] for f in funcs]
+    total = {}
+    detail = {}
+    for pc, count in pcs.items():
+        addr = (pc - reloc) & 0xffffffff
+        i = bisect.bisect_right(starts, addr) - 1
+        if i >= 0 and addr < funcs[i][0] + funcs[i][2]:
+            key = f'{funcs[i][1]} ({funcs[i][3]})'
+            off = addr - funcs[i][0]
+        else:
+            key = '(outside smbfs)'
+            off = pc
+        total[key] = total.get(key, 0) + count
+        detail.setdefault(key, {})
+        detail[key][off] = detail[key].get(off, 0) + count
+
+    print(f'{samples} samples at {hz} Hz ({samples / hz:.2f} s), {dropped} dropped')
+    print(f'{"%":>6} {"samples":>8} {"cum%":>6}  function')
+    cum = 0
+    for key, count in sorted(total.items(), key=lambda kv: -kv[1])[:args.n]:
+        cum += count
+        print(f'{count * 100 / samples:6.2f} {count:8d} {cum * 100 / samples:6.2f}  {key}')
+        if args.a:
+            for off, c in sorted(detail[key].items(), key=lambda kv: -kv[1])[:8]:
+                print(f'{"":22}  {"+" if key[0] != "(" else ""}0x{off:x}: {c}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,441 @@
+#!/usr/bin/env python3
+#
+# smbsim.py - Trace-driven cache simulator for smbfs
+#
+# Copyright (c) 2026 Yuichi Nakamura (@yunkya2)
+#
+# The MIT License (MIT)
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+#
+# smbmount -R save で保存したDOSコールのトレースを再生して、
+# smbfs のキャッシュ (ページ/ファイル情報/存在しないファイル/ディレクトリ一覧) の
+# 大きさ・有効期間・追い出し方式を変えたときのヒット率と削減できるサーバとの往復回数を求める
+#
+# 使用法: smbsim.py <trace> [オプション]
+#   --data <KB,...>     ページキャッシュの大きさ (smbfs の /c オプション、KB単位)
+#   --stat <N,...>      ファイル情報キャッシュのエントリ数
+#   --neg <N,...>       存在しないファイルのキャッシュのエントリ数 (0 ならファイル情報キャッシュと共用)
+#   --list <N,...>      一覧をキャッシュするディレクトリ数
+#   --ttl <秒,...>      キャッシュの有効期間
+#   --policy <名前,...> 追い出し方式 (lru, clock, 2q)
+#   --knee <割合>       最大の削減効果のうちこの割合を得られる最小の大きさを推奨する (省略時は 0.9)
+#
+# 複数の値を指定したキャッシュについてはそれぞれの値で再生し、
+# 他のキャッシュは最初の値 (省略時は smbfs の既定値) に固定する
+#
+
+import sys
+import struct
+import argparse
+from collections import OrderedDict
+
+MAGIC = b'SMBFSTR1'
+
+PAGESIZE = 2048         # PCACHE_PAGESIZE
+PAGE_BYTES = 2048 + 32  # sizeof(cpage_t)
+STAT_BYTES = 112        # sizeof(scache_t)
+LIST_BYTES = 128 * 32   # DCACHE_MAXENT * sizeof(struct dos_filesinfo)
+
+# smbfs の既定値
+DEFAULT_DATA = 32       # KB
+DEFAULT_STAT = 16       # SCACHE_MAXENT
+DEFAULT_NEG = 0
+DEFAULT_LIST = 4        # DCACHE_MAXDIRS
+DEFAULT_TTL = 10        # PCACHE_TTL (秒)
+
+# DOSコールのコマンドコード
+CMD_CHDIR, CMD_MKDIR, CMD_RMDIR, CMD_RENAME, CMD_DELETE, CMD_CHMOD = range(0x41, 0x47)
+CMD_FILES, CMD_NFILES, CMD_CREATE, CMD_OPEN, CMD_CLOSE, CMD_READ, CMD_WRITE = range(0x47, 0x4e)
+
+TRF_FAST = 0x01
+DOSE_NOENT = -2
+DOSE_NODIR = -3
+
+def load_trace(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+    if data[:8] != MAGIC:
+        sys.exit(f'{filename}: not a smbfs trace')
+    hz, nrec, lost = struct.unpack_from('>3I', data, 8)
+    recs = []
+    for i in range(nrec):
+        (time, ucfa, path, dir, arg, offset, length, size,
+         result) = struct.unpack_from('>8Ii', data, 20 + i * 36)
+        recs.append((time / hz, (ucfa >> 24) & 0xff, (ucfa >> 16) & 0xff,
+                     (ucfa >> 8) & 0xff, ucfa & 0xff,
+                     path, dir, arg, offset, length, size, result))
+    return recs, lost
+
+#****************************************************************************
+# Eviction policies
+#****************************************************************************
+
+class LRU:
+    def __init__(self, cap):
+        self.cap = cap
+        self.d = OrderedDict()
+
+    def get(self, key):
+        if key in self.d:
+            self.d.move_to_end(key)
+            return self.d[key]
+        return None
+
+    def put(self, key, value):
+        if self.cap <= 0:
+            return
+        self.d[key] = value
+        self.d.move_to_end(key)
+        while len(self.d) > self.cap:
+            self.d.popitem(last=False)
+
+    def remove(self, key):
+        self.d.pop(key, None)
+
+    def __contains__(self, key):
+        return key in self.d
+
+# 参照ビット付きの循環リスト (smbfs のページキャッシュの追い出し方式に近い)
+class CLOCK:
+    def __init__(self, cap):
+        self.cap = cap
+        self.keys = []
+        self.ref = []
+        self.d = {}             # key -> (slot, value)
+        self.hand = 0
+
+    def get(self, key):
+        e = self.d.get(key)
+        if e is None:
+            return None
+        self.ref[e[0]] = 1
+        return e[1]
+
+    def put(self, key, value):
+        if self.cap <= 0:
+            return
+        e = self.d.get(key)
+        if e is not None:
+            self.d[key] = (e[0], value)
+            self.ref[e[0]] = 1
+            return
+        if len(self.keys) < self.cap:
+            self.keys.append(key)
+            self.ref.append(0)
+            self.d[key] = (len(self.keys) - 1, value)
+            return
+        while True:
+            slot = self.hand
+            self.hand = (self.hand + 1) % self.cap
+            k = self.keys[slot]
+            if k is not None and self.ref[slot]:
+                self.ref[slot] = 0
+                continue
+            if k is not None:
+                del self.d[k]
+            self.keys[slot] = key
+            self.ref[slot] = 0
+            self.d[key] = (slot, value)
+            return
+
+    def remove(self, key):
+        e = self.d.pop(key, None)
+        if e is not None:
+            self.keys[e[0]] = None
+            self.ref[e[0]] = 0
+
+    def __contains__(self, key):
+        return key in self.d
+
+# 2Q: 初回の参照はFIFO (A1in) に入れ、A1inから追い出された後に再び参照されたものだけをLRU (Am) に入れる
+class TwoQ:
+    def __init__(self, cap):
+        self.cap = cap
+        self.kin = max(1, cap // 4)
+        self.kout = max(1, cap // 2)
+        self.a1in = OrderedDict()
+        self.a1out = OrderedDict()
+        self.am = OrderedDict()
+
+    def get(self, key):
+        if key in self.am:
+            self.am.move_to_end(key)
+            return self.am[key]
+        if key in self.a1in:
+            return self.a1in[key]
+        return None
+
+    def put(self, key, value):
+        if self.cap <= 0:
+            return
+        if key in self.am:
+            self.am[key] = value
+            self.am.move_to_end(key)
+            return
+        if key in self.a1in:
+            self.a1in[key] = value
+            return
+        if key in self.a1out:
+            del self.a1out[key]
+            self.am[key] = value
+        else:
+            self.a1in[key] = value
+        while len(self.a1in) + len(self.am) > self.cap:
+            if len(self.a1in) > self.kin or not self.am:
+                k, _ = self.a1in.popitem(last=False)
+                self.a1out[k] = None
+                while len(self.a1out) > self.kout:
+                    self.a1out.popitem(last=False)
+            else:
+                self.am.popitem(last=False)
+
+    def remove(self, key):
+        self.a1in.pop(key, None)
+        self.am.pop(key, None)
+
+    def __contains__(self, key):
+        return key in self.a1in or key in self.am
+
+POLICIES = { 'lru': LRU, 'clock': CLOCK, '2q': TwoQ }
+
+#****************************************************************************
+# Simulator
+#****************************************************************************
+
+class Stats:
+    def __init__(self):
+        self.lookups = 0
+        self.hits = 0
+        self.saved = 0          # 削減できたサーバとの往復回数
+
+    def hit(self, saved=1):
+        self.lookups += 1
+        self.hits += 1
+        self.saved += saved
+
+    def miss(self):
+        self.lookups += 1
+
+class Sim:
+    def __init__(self, data_kb, nstat, nneg, nlist, ttl, policy):
+        cls = POLICIES[policy]
+        self.pages = cls(data_kb * 1024 // PAGE_BYTES)
+        self.stat = cls(nstat)
+        self.neg = cls(nneg) if nneg > 0 else self.stat
+        self.list = cls(nlist)
+        self.ttl = ttl
+        self.fcb = {}           # FCB -> パス名のハッシュ値
+        self.fpages = {}        # パス名のハッシュ値 -> キャッシュされているページ番号
+        self.fsize = {}         # パス名のハッシュ値 -> (ファイルサイズ, 確認した時刻)
+        self.dirof = {}         # パス名のハッシュ値 -> ディレクトリ名のハッシュ値
+        self.st = { k: Stats() for k in ('data', 'stat', 'neg', 'list') }
+        self.rt = 0             # キャッシュがない場合のサーバとの往復回数
+
+    def fresh(self, t, now):
+        return now - t <= self.ttl
+
+    # ディレクトリ一覧にあればファイルの有無も分かる
+    def listed(self, dir, now):
+        t = self.list.get(dir)
+        return t is not None and self.fresh(t, now)
+
+    def lookup(self, path, dir, now):
+        e = self.stat.get(path)
+        if e is None and self.neg is not self.stat:
+            e = self.neg.get(path)
+        if e is not None and self.fresh(e[1], now):
+            return e[0]
+        if self.listed(dir, now):
+            return 'listed'
+        return None
+
+    def enter(self, path, exists, now):
+        if exists:
+            self.neg.remove(path)
+            self.stat.put(path, (True, now))
+        else:
+            self.stat.remove(path)
+            self.neg.put(path, (False, now))
+
+    def drop_file(self, path):
+        for pg in self.fpages.pop(path, ()):
+            self.pages.remove((path, pg))
+        self.fsize.pop(path, None)
+
+    def modify(self, path, dir):
+        self.stat.remove(path)
+        if self.neg is not self.stat:
+            self.neg.remove(path)
+        self.list.remove(dir)
+        self.drop_file(path)
+
+    def run(self, recs, list_rt):
+        for (now, unit, cmd, flags, atr, path, dir, arg, offset, length, size, result) in recs:
+            if cmd in (CMD_CHDIR, CMD_CHMOD) and (cmd == CMD_CHDIR or atr == 0xff):
+                key = dir if cmd == CMD_CHDIR else path
+                self.rt += 1
+                r = self.lookup(key, dir, now)
+                kind = 'stat' if result >= 0 else 'neg'
+                if r is not None:
+                    self.st[kind].hit()
+                else:
+                    self.st[kind].miss()
+                    if result >= 0 or result in (DOSE_NOENT, DOSE_NODIR):
+                        self.enter(key, result >= 0, now)
+            elif cmd == CMD_OPEN:
+                self.rt += 1
+                if result < 0:
+                    # 存在しないことが分かっていればサーバに問い合わせない
+                    if self.lookup(path, dir, now) is not None:
+                        self.st['neg'].hit()
+                    else:
+                        self.st['neg'].miss()
+                        if result == DOSE_NOENT:
+                            self.enter(path, False, now)
+                    continue
+                self.enter(path, True, now)
+                self.fcb[arg] = path
+                self.dirof[path] = dir
+                s = self.fsize.get(path)
+                if s is None or s[0] != size:
+                    self.drop_file(path)
+                self.fsize[path] = (size, now)
+            elif cmd == CMD_READ:
+                path = self.fcb.get(arg)
+                if path is None or result <= 0:
+                    continue
+                self.rt += 1
+                s = self.fsize.get(path)
+                if s is not None and not self.fresh(s[1], now):
+                    self.drop_file(path)        # 有効期間を過ぎたら読み直す
+                    self.fsize[path] = (size, now)
+                first = offset // PAGESIZE
+                last = (offset + result - 1) // PAGESIZE
+                pages = self.fpages.setdefault(path, set())
+                if all(self.pages.get((path, pg)) is not None for pg in range(first, last + 1)):
+                    self.st['data'].hit()
+                    continue
+                self.st['data'].miss()
+                for pg in range(first, last + 1):
+                    self.pages.put((path, pg), True)
+                    pages.add(pg)
+            elif cmd == CMD_FILES:
+                self.rt += list_rt
+                if self.listed(dir, now):
+                    self.st['list'].hit(list_rt)
+                else:
+                    self.st['list'].miss()
+                    self.list.put(dir, now)
+            elif cmd in (CMD_CREATE, CMD_WRITE, CMD_MKDIR, CMD_RMDIR, CMD_DELETE, CMD_RENAME) or \
+                 (cmd == CMD_CHMOD and atr != 0xff):
+                self.rt += 1
+                if cmd == CMD_WRITE:
+                    path = self.fcb.get(arg)
+                    if path is None:
+                        continue
+                    dir = self.dirof.get(path, dir)
+                if cmd == CMD_CREATE:
+                    self.fcb[arg] = path
+                    self.dirof[path] = dir
+                self.modify(path, dir)
+                if cmd == CMD_RENAME:
+                    self.modify(arg, dir)
+            elif cmd == CMD_CLOSE:
+                self.rt += 1
+
+    def saved(self):
+        return sum(s.saved for s in self.st.values())
+
+#****************************************************************************
+# Main
+#****************************************************************************
+
+def intlist(s):
+    return [int(x) for x in s.split(',')]
+
+def floatlist(s):
+    return [float(x) for x in s.split(',')]
+
+def main():
+    ap = argparse.ArgumentParser(description='Trace-driven cache simulator for smbfs')
+    ap.add_argument('trace')
+    ap.add_argument('--data', type=intlist, default=[DEFAULT_DATA])
+    ap.add_argument('--stat', type=intlist, default=[DEFAULT_STAT])
+    ap.add_argument('--neg', type=intlist, default=[DEFAULT_NEG])
+    ap.add_argument('--list', type=intlist, default=[DEFAULT_LIST])
+    ap.add_argument('--ttl', type=floatlist, default=[DEFAULT_TTL])
+    ap.add_argument('--policy', type=lambda s: s.split(','), default=['clock'])
+    ap.add_argument('--list-rt', type=int, default=3,
+                    help='round trips per directory listing (create + query + close)')
+    ap.add_argument('--knee', type=float, default=0.9)
+    args = ap.parse_args()
+
+    for p in args.policy:
+        if p not in POLICIES:
+            sys.exit(f'unknown policy: {p}')
+
+    recs, lost = load_trace(args.trace)
+    span = recs[-1][0] - recs[0][0] if recs else 0
+    fast = sum(1 for r in recs if r[3] & TRF_FAST)
+    print(f'{len(recs)} DOS calls in {span:.1f} sec ({fast} answered lock-free by smbfs)'
+          + (f', {lost} lost' if lost else ''))
+
+    base = dict(data=args.data[0], nstat=args.stat[0], nneg=args.neg[0],
+                nlist=args.list[0], ttl=args.ttl[0])
+    sweeps = [
+        ('data', 'data', args.data, lambda v: f'{v}KB', lambda v: v * 1024),
+        ('stat', 'nstat', args.stat, str, lambda v: v * STAT_BYTES),
+        ('neg', 'nneg', args.neg, lambda v: str(v) if v else 'shared', lambda v: v * STAT_BYTES),
+        ('list', 'nlist', args.list, str, lambda v: v * LIST_BYTES),
+        ('ttl', 'ttl', args.ttl, lambda v: f'{v:g}s', lambda v: 0),
+    ]
+
+    for policy in args.policy:
+        print(f'\npolicy: {policy}')
+        print(f'  {"cache":<6} {"size":>8} {"memory":>8}  {"data":>6} {"stat":>6} {"neg":>6} {"list":>6}'
+              f'  {"round trips":>17} {"saved":>6}')
+        for name, key, values, fmt, mem in sweeps:
+            if len(values) <= 1 and name != 'data':
+                continue
+            results = []
+            for v in values:
+                cfg = dict(base)
+                cfg[key] = v
+                sim = Sim(cfg['data'], cfg['nstat'], cfg['nneg'], cfg['nlist'], cfg['ttl'], policy)
+                sim.run(recs, args.list_rt)
+                results.append((v, sim))
+                rates = []
+                for k in ('data', 'stat', 'neg', 'list'):
+                    s = sim.st[k]
+                    rates.append(f'{100 * s.hits / s.lookups:5.1f}%' if s.lookups else '    --')
+                saved = sim.saved()
+                print(f'  {name:<6} {fmt(v):>8} {mem(v):>8}  {" ".join(rates)}'
+                      f'  {sim.rt - saved:>8}/{sim.rt:<8} {100 * saved / sim.rt if sim.rt else 0:5.1f}%')
+            if len(results) > 1 and name != 'ttl':
+                # そのキャッシュ自身による削減効果で判定する
+                best = max(sim.st[name].saved for _, sim in results)
+                for v, sim in sorted(results, key=lambda r: r[0]):
+                    if best and sim.st[name].saved >= best * args.knee:
+                        print(f'  -> {name}: {fmt(v)} gives {100 * sim.st[name].saved / best:.0f}% of the best saving')
+                        break
+
+if __name__ == '__main__':
+    main()